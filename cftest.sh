@@ -0,0 +1,338 @@
+#!/bin/bash
+#
+# partclone-utils' change file tools test script
+#
+# Writes to a raw image through imagemount and src/nbdtest, then checks
+# that the change file tools keep what was written.  What an image and its
+# change file hold is compared by copying the export out with nbdtest -c,
+# so the image itself must come through unchanged.
+#
+# Usage: ./cftest.sh [debug]
+
+set -eu
+
+if [ "$#" -ge 1 ] && [ "$1" == "debug" ]; then
+    set -x
+    shift
+fi
+
+IMAGEMOUNT=src/imagemount
+NBDTEST=src/nbdtest
+CFCOMPACT=src/cfcompact
+CFSEND=src/cfsend
+CFRECEIVE=src/cfreceive
+CFMERGE=src/cfmerge
+CFCOMMIT=src/cfcommit
+WORK_DIR=`mktemp -d /tmp/cftest.XXXXXX`
+SOCKET=$WORK_DIR/sock
+IMAGE=$WORK_DIR/raw-image
+LOG=$WORK_DIR/log
+SEED=$$
+SERVER_PID=""
+ERR=0
+
+dd if=/dev/urandom bs=1M count=64 of=$IMAGE 2> /dev/null
+IMAGE_MD5SUM=`md5sum $IMAGE | cut -d\  -f1`
+
+stop_server() {
+    if [ -n "$SERVER_PID" ]; then
+        kill $SERVER_PID 2> /dev/null || true
+        wait $SERVER_PID 2> /dev/null || true
+        SERVER_PID=""
+    fi
+}
+
+on_exit() {
+    stop_server
+    rm -rf $WORK_DIR
+    exit $ERR
+}
+
+trap on_exit EXIT
+
+# Serve an image with a change file: start_server image change-file [options]
+start_server() {
+    local SERVED=$1
+    local CHANGES=$2
+    shift 2
+
+    rm -f $SOCKET
+    $IMAGEMOUNT -D -w -R -l $SOCKET -f $SERVED -c $CHANGES "$@" > $LOG 2>&1 &
+    SERVER_PID=$!
+    for i in `seq 50`; do
+        grep -q "being served" $LOG && break
+        sleep 0.1
+    done
+    if ! grep -q "being served" $LOG; then
+        ERROR_MESSAGE="imagemount did not start: `cat $LOG`"
+        return 1
+    fi
+}
+
+# Write the test pattern through a change file: write change-file [options]
+write() {
+    local CHANGES=$1
+    shift
+
+    start_server $IMAGE $CHANGES "$@" || return 1
+    if ! $NBDTEST -s $SEED $SOCKET > $LOG 2>&1; then
+        ERROR_MESSAGE=`grep "^$NBDTEST: " $LOG | tail -1`
+        return 1
+    fi
+    stop_server
+}
+
+# Write a file through a change file: load change-file file [options]
+load() {
+    local CHANGES=$1
+    local FILE=$2
+    shift 2
+
+    start_server $IMAGE $CHANGES "$@" || return 1
+    if ! $NBDTEST -w $FILE $SOCKET > $LOG 2>&1; then
+        ERROR_MESSAGE=`grep "^$NBDTEST: " $LOG | tail -1`
+        return 1
+    fi
+    stop_server
+}
+
+# Copy out what an image holds with a change file: copy image change-file out
+copy() {
+    start_server $1 $2 || return 1
+    if ! $NBDTEST -c $3 $SOCKET > $LOG 2>&1; then
+        ERROR_MESSAGE=`grep "^$NBDTEST: " $LOG | tail -1`
+        return 1
+    fi
+    stop_server
+}
+
+# Check that two files hold the same: same file file what
+same() {
+    if ! cmp -s $1 $2; then
+        ERROR_MESSAGE="$3 differs."
+        return 1
+    fi
+}
+
+# Compacting offline keeps the data.
+test_compact() {
+    write $WORK_DIR/a.cf "$@" &&
+    copy $IMAGE $WORK_DIR/a.cf $WORK_DIR/before &&
+    $CFCOMPACT $IMAGE $WORK_DIR/a.cf > $LOG 2>&1 &&
+    copy $IMAGE $WORK_DIR/a.cf $WORK_DIR/after &&
+    same $WORK_DIR/before $WORK_DIR/after "The compacted change file"
+}
+
+# Compacting while the export is written keeps the data, and the writes
+# go on meanwhile.
+test_compact_live() {
+    local NBDTEST_PID
+
+    write $WORK_DIR/a.cf "$@" || return 1
+    start_server $IMAGE $WORK_DIR/a.cf "$@" || return 1
+    $NBDTEST -s $[ SEED + 1 ] $SOCKET > $WORK_DIR/nbdtest.log 2>&1 &
+    NBDTEST_PID=$!
+    while kill -0 $NBDTEST_PID 2> /dev/null; do
+        kill -USR1 $SERVER_PID
+        sleep 0.05
+    done
+    if ! wait $NBDTEST_PID; then
+        ERROR_MESSAGE=`grep "^$NBDTEST: " $WORK_DIR/nbdtest.log | tail -1`
+        return 1
+    fi
+    if ! $NBDTEST -c $WORK_DIR/before $SOCKET > $LOG 2>&1; then
+        ERROR_MESSAGE=`grep "^$NBDTEST: " $LOG | tail -1`
+        return 1
+    fi
+    stop_server
+    if [ -e $WORK_DIR/a.cf.compact ]; then
+        ERROR_MESSAGE="A compaction was left behind."
+        return 1
+    fi
+    copy $IMAGE $WORK_DIR/a.cf $WORK_DIR/after &&
+    same $WORK_DIR/before $WORK_DIR/after "The compacted change file"
+}
+
+# Streaming the changes to another change file, and then the ones made
+# since, gives the same data.
+test_send() {
+    write $WORK_DIR/a.cf "$@" &&
+    $CFSEND $IMAGE $WORK_DIR/a.cf > $WORK_DIR/stream 2> $LOG &&
+    $CFRECEIVE $WORK_DIR/b.cf < $WORK_DIR/stream 2> $LOG &&
+    SEED=$[ SEED + 1 ] write $WORK_DIR/a.cf "$@" &&
+    $CFSEND $IMAGE $WORK_DIR/a.cf 1 > $WORK_DIR/stream 2> $LOG &&
+    $CFRECEIVE $WORK_DIR/b.cf < $WORK_DIR/stream 2> $LOG &&
+    copy $IMAGE $WORK_DIR/a.cf $WORK_DIR/before &&
+    copy $IMAGE $WORK_DIR/b.cf $WORK_DIR/after &&
+    same $WORK_DIR/before $WORK_DIR/after "The received change file" || {
+        [ -n "$ERROR_MESSAGE" ] || ERROR_MESSAGE=`tail -1 $LOG`
+        return 1
+    }
+}
+
+# A change file that is being served cannot be sent, as that starts a new
+# generation.
+test_send_busy() {
+    write $WORK_DIR/a.cf "$@" || return 1
+    start_server $IMAGE $WORK_DIR/a.cf "$@" || return 1
+    if $CFSEND $IMAGE $WORK_DIR/a.cf > $WORK_DIR/stream 2> $WORK_DIR/err ||
+       ! grep -q "in use" $WORK_DIR/err; then
+        ERROR_MESSAGE="A served change file was sent."
+        return 1
+    fi
+    stop_server
+    if ! $CFSEND $IMAGE $WORK_DIR/a.cf > $WORK_DIR/stream 2> $LOG; then
+        ERROR_MESSAGE=`cat $LOG`
+        return 1
+    fi
+}
+
+# Merging the change file into a new image gives the same data, and
+# leaves the change file as it was.
+test_merge() {
+    local CF_MD5SUM
+
+    write $WORK_DIR/a.cf "$@" || return 1
+    CF_MD5SUM=`md5sum $WORK_DIR/a.cf | cut -d\  -f1`
+    if ! $CFMERGE $IMAGE $WORK_DIR/a.cf $WORK_DIR/merged > $LOG 2>&1; then
+        ERROR_MESSAGE=`tail -1 $LOG`
+        return 1
+    fi
+    if [ x`md5sum $WORK_DIR/a.cf | cut -d\  -f1` != x$CF_MD5SUM ]; then
+        ERROR_MESSAGE="The change file was written to."
+        return 1
+    fi
+    if $CFMERGE $IMAGE $WORK_DIR/none.cf $WORK_DIR/none > $LOG 2>&1 ||
+       [ -e $WORK_DIR/none ]; then
+        ERROR_MESSAGE="A missing change file was merged."
+        return 1
+    fi
+    copy $IMAGE $WORK_DIR/a.cf $WORK_DIR/before &&
+    copy $WORK_DIR/merged $WORK_DIR/b.cf $WORK_DIR/after &&
+    same $WORK_DIR/before $WORK_DIR/after "The merged image"
+}
+
+# Committing the change file into a copy of the image writes what the
+# image with the change file held, and empties the change file.  A change
+# file that is being served is not committed.
+test_commit() {
+    cp $IMAGE $WORK_DIR/committed
+    write $WORK_DIR/a.cf "$@" || return 1
+    copy $IMAGE $WORK_DIR/a.cf $WORK_DIR/before || return 1
+    start_server $WORK_DIR/committed $WORK_DIR/a.cf "$@" || return 1
+    if $CFCOMMIT $WORK_DIR/committed $WORK_DIR/a.cf > $LOG 2>&1 ||
+       ! grep -q "in use" $LOG; then
+        ERROR_MESSAGE="A served change file was committed."
+        return 1
+    fi
+    stop_server
+    if ! $CFCOMMIT $WORK_DIR/committed $WORK_DIR/a.cf > $LOG 2>&1; then
+        ERROR_MESSAGE=`tail -1 $LOG`
+        return 1
+    fi
+    same $WORK_DIR/before $WORK_DIR/committed "The committed image" &&
+    copy $WORK_DIR/committed $WORK_DIR/a.cf $WORK_DIR/after &&
+    same $WORK_DIR/before $WORK_DIR/after "The emptied change file"
+}
+
+# Writing through a chain of change files leaves the lower layer as it
+# was, and gives what writing both times to one change file does.  The
+# lower layer's name has a colon in it, escaped in the chain.
+test_chain() {
+    local CF_MD5SUM
+    local LOWER=$WORK_DIR/lo\\:w.cf
+
+    write $LOWER "$@" || return 1
+    CF_MD5SUM=`md5sum $WORK_DIR/lo:w.cf | cut -d\  -f1`
+    SEED=$[ SEED + 1 ] write $LOWER:$WORK_DIR/b.cf "$@" || return 1
+    if [ x`md5sum $WORK_DIR/lo:w.cf | cut -d\  -f1` != x$CF_MD5SUM ]; then
+        ERROR_MESSAGE="The lower layer was written to."
+        return 1
+    fi
+    write $WORK_DIR/c.cf "$@" &&
+    SEED=$[ SEED + 1 ] write $WORK_DIR/c.cf "$@" &&
+    copy $IMAGE $LOWER:$WORK_DIR/b.cf $WORK_DIR/before &&
+    copy $IMAGE $WORK_DIR/c.cf $WORK_DIR/after &&
+    same $WORK_DIR/before $WORK_DIR/after "The chain"
+}
+
+# Data made of one chunk over and over is stored about once with dedup,
+# and reads back whole, also after random writes over the shared blocks.
+# The same writes without dedup give the same data.
+test_dedup() {
+    local SIZE
+
+    dd if=/dev/urandom bs=64k count=1 of=$WORK_DIR/chunk 2> /dev/null
+    for i in `seq 1024`; do
+        cat $WORK_DIR/chunk
+    done > $WORK_DIR/pattern
+    load $WORK_DIR/a.cf $WORK_DIR/pattern -o "$@" &&
+    copy $IMAGE $WORK_DIR/a.cf $WORK_DIR/after &&
+    same $WORK_DIR/pattern $WORK_DIR/after "The deduplicated data" ||
+        return 1
+    SIZE=`stat -c %s $WORK_DIR/a.cf`
+    if [ $SIZE -gt $[ 8 * 1024 * 1024 ] ]; then
+        ERROR_MESSAGE="The deduplicated change file takes $SIZE bytes."
+        return 1
+    fi
+    write $WORK_DIR/a.cf -o "$@" &&
+    load $WORK_DIR/b.cf $WORK_DIR/pattern &&
+    write $WORK_DIR/b.cf &&
+    copy $IMAGE $WORK_DIR/a.cf $WORK_DIR/before &&
+    copy $IMAGE $WORK_DIR/b.cf $WORK_DIR/after &&
+    same $WORK_DIR/before $WORK_DIR/after "The rewritten deduplicated data"
+}
+
+go() {
+    local TEST=$1
+    shift
+    local OPTIONS="$*"
+
+    __go() {
+        ERROR_MESSAGE=""
+        rm -f $WORK_DIR/*.cf* $WORK_DIR/before $WORK_DIR/after \
+            $WORK_DIR/stream $WORK_DIR/merged $WORK_DIR/committed \
+            $WORK_DIR/chunk $WORK_DIR/pattern
+        $TEST $OPTIONS || return 1
+        stop_server
+        if [ x`md5sum $IMAGE | cut -d\  -f1` != x$IMAGE_MD5SUM ]; then
+            ERROR_MESSAGE="The image was written to."
+            return 1
+        fi
+    }
+
+    GREEN='\033[0;32m'
+    RED='\033[0;31m'
+    NC='\033[0m' # No Color
+    if __go; then
+        echo -e "${GREEN}[OK  ]${NC}"
+    else
+        echo -e "${RED}[FAIL]${NC}"
+        ERR=1
+    fi
+    stop_server
+    echo " test=$TEST options=$OPTIONS seed=$$"
+    echo " $ERROR_MESSAGE"
+}
+
+go test_compact
+go test_compact -o compress
+go test_compact -o dedup
+go test_compact_live
+go test_compact_live -o compress
+go test_compact_live -o dedup -W 16
+go test_send
+go test_send -o compress
+go test_send -o dedup
+go test_send_busy
+go test_merge
+go test_merge -o compress
+go test_merge -o dedup
+go test_commit
+go test_commit -o compress
+go test_commit -o dedup
+go test_chain
+go test_chain -o compress
+go test_chain -o dedup
+go test_dedup dedup
+go test_dedup dedup,compress
@@ -0,0 +1,113 @@
+#!/bin/bash
+#
+# partclone-utils' imagemount network export test script
+#
+# Serves an image over a Unix or TCP socket in several configurations and
+# runs src/nbdtest against each: the handshake, pipelined overlapping
+# writes, flush and FUA, trim and write zeroes, and block status.  Writes
+# go to a change file, so the image itself must come through unchanged.
+#
+# Usage: ./nbdtest.sh [debug] [image]
+#
+# Without an image, a raw one of random data is made.  Partclone and
+# ntfsclone images also report where their holes are.
+
+set -eu
+
+if [ "$#" -ge 1 ] && [ "$1" == "debug" ]; then
+    set -x
+    shift
+fi
+
+IMAGEMOUNT=src/imagemount
+NBDTEST=src/nbdtest
+WORK_DIR=`mktemp -d /tmp/nbdtest.XXXXXX`
+SOCKET=$WORK_DIR/sock
+CHANGE_FILE=$WORK_DIR/image.cf
+LOG=$WORK_DIR/log
+TCP_ADDRESS=127.0.0.1:$[ 20000 + $$ % 20000 ]
+SERVER_PID=""
+ERR=0
+
+if [ "$#" -ge 1 ]; then
+    IMAGE=$1
+    RAW=""
+else
+    IMAGE=$WORK_DIR/raw-image
+    RAW="-R"
+    dd if=/dev/urandom bs=1M count=64 of=$IMAGE 2> /dev/null
+fi
+IMAGE_MD5SUM=`md5sum $IMAGE | cut -d\  -f1`
+
+stop_server() {
+    if [ -n "$SERVER_PID" ]; then
+        kill $SERVER_PID 2> /dev/null || true
+        wait $SERVER_PID 2> /dev/null || true
+        SERVER_PID=""
+    fi
+}
+
+on_exit() {
+    stop_server
+    rm -rf $WORK_DIR
+    exit $ERR
+}
+
+trap on_exit EXIT
+
+go() {
+    local ADDRESS=$1
+    shift
+    local OPTIONS="$*"
+
+    __go() {
+        ERROR_MESSAGE=""
+        rm -f $CHANGE_FILE $SOCKET
+
+        $IMAGEMOUNT -D -w $RAW -l $ADDRESS -f $IMAGE -c $CHANGE_FILE \
+            $OPTIONS > $LOG 2>&1 &
+        SERVER_PID=$!
+        for i in `seq 50`; do
+            grep -q "being served" $LOG && break
+            sleep 0.1
+        done
+        if ! grep -q "being served" $LOG; then
+            ERROR_MESSAGE="imagemount did not start: `cat $LOG`"
+            return 1
+        fi
+
+        if ! $NBDTEST -s $$ $ADDRESS > $LOG 2>&1; then
+            ERROR_MESSAGE=`grep "^$NBDTEST: " $LOG | tail -1`
+            return 1
+        fi
+
+        stop_server
+        if [ x`md5sum $IMAGE | cut -d\  -f1` != x$IMAGE_MD5SUM ]; then
+            ERROR_MESSAGE="The image was written to."
+            return 1
+        fi
+    }
+
+    GREEN='\033[0;32m'
+    RED='\033[0;31m'
+    NC='\033[0m' # No Color
+    if __go; then
+        echo -e "${GREEN}[OK  ]${NC}"
+    else
+        echo -e "${RED}[FAIL]${NC}"
+        ERR=1
+    fi
+    stop_server
+    echo " address=$ADDRESS options=$OPTIONS seed=$$"
+    echo " $ERROR_MESSAGE"
+}
+
+go $SOCKET
+go $SOCKET -j 1
+go $SOCKET -j 16
+go $SOCKET -W 16
+go $SOCKET -W 16 -j 1
+go $SOCKET -o compress
+go $SOCKET -o volatile -W 16
+go $SOCKET -o dedup -W 16
+go $TCP_ADDRESS
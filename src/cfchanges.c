@@ -1,4 +1,5 @@
 #include "changefileint.h"
+#include "libcompress.h"
 #include "libimage.h"
 #include "sysdep_int.h"
 #include "sysdep_posix.h"
@@ -11,6 +12,10 @@
 #include <unistd.h>
 
 const sysdep_dispatch_t *sysdep = &posix_dispatch;
+/* Records of dedup change files name only the first block they back. */
+static int shared_blocks = 0;
+/* Records of compressed change files lead with their trailer. */
+static int compressed_blocks = 0;
 
 void
 dump_header(char *n, cf_header_t *h) {
@@ -55,13 +60,44 @@ verify_block(void *cf, uint64_t offs, uint64_t index, void *rbuffer,
     int      error = 1;
     if (!(error = (*sysdep->sys_seek)(cf, offs, SYSDEP_SEEK_ABSOLUTE,
                                       (uint64_t *)NULL))) {
-        if (!(error = (*sysdep->sys_read)(cf, rbuffer, bsize, &nread)) &&
-            (nread == bsize)) {
+        if (compressed_blocks) {
+            cf_zblock_trailer_t ztrail;
+            void *              zbuffer;
+            if (!(error = (*sysdep->sys_read)(cf, &ztrail, sizeof(ztrail),
+                                              &nread)) &&
+                (nread == sizeof(ztrail)) &&
+                (ztrail.cfb_magic == CF_MAGIC_4) &&
+                (ztrail.cfb_length <= bsize) &&
+                !(error = (*sysdep->sys_malloc)(&zbuffer, bsize))) {
+                error = 1;
+                if (!(*sysdep->sys_read)(cf, zbuffer, ztrail.cfb_length,
+                                         &nread) &&
+                    (nread == ztrail.cfb_length)) {
+                    if (ztrail.cfb_length == bsize) {
+                        memcpy(rbuffer, zbuffer, bsize);
+                        error = 0;
+                    } else {
+                        error = lz_decompress(zbuffer, ztrail.cfb_length,
+                                              rbuffer, bsize);
+                    }
+                    if (!error &&
+                        !((shared_blocks || (ztrail.cfb_curblock == index)) &&
+                          (ztrail.cfb_crc == xcrc32(0L, rbuffer, bsize)))) {
+                        error = 1;
+                    }
+                }
+                (void)(*sysdep->sys_free)(zbuffer);
+            } else {
+                error = 1;
+            }
+        } else if (!(error = (*sysdep->sys_read)(cf, rbuffer, bsize,
+                                                 &nread)) &&
+                   (nread == bsize)) {
             cf_block_trailer_t btrail;
             if (!(error = (*sysdep->sys_read)(cf, &btrail, sizeof(btrail),
                                               &nread)) &&
                 (nread == sizeof(btrail))) {
-                if ((btrail.cfb_curblock == index) &&
+                if ((shared_blocks || (btrail.cfb_curblock == index)) &&
                     (btrail.cfb_magic == CF_MAGIC_3) &&
                     (btrail.cfb_crc == xcrc32(0L, rbuffer, bsize))) {
                     error = 0;
@@ -87,12 +123,16 @@ dump_blocks(cf_header_t *h, uint64_t *bm, void *cf, void *rw, void *ro) {
     for (bi = 0; bi < h->cf_total_blocks; bi++) {
         if (bm[bi]) {
             int good = 0;
-            printf("%lu: offset 0x%016lx: ", bi, bm[bi]);
             nfound++;
-            if (!verify_block(cf, bm[bi], bi, rbuffer, bsize)) {
-                good = 1;
+            if (CF_ENTRY_ZERO(bm[bi])) {
+                printf("%lu: zero\n", bi);
+            } else {
+                printf("%lu: offset 0x%016lx: ", bi, bm[bi]);
+                if (!verify_block(cf, bm[bi], bi, rbuffer, bsize)) {
+                    good = 1;
+                }
+                printf("%s\n", (good) ? "ok" : "INVALID");
             }
-            printf("%s\n", (good) ? "ok" : "INVALID");
             (void)image_seek(rw, bi);
             (void)image_seek(ro, bi);
             if (((error = image_readblocks(rw, wbuffer, 1)) == 0) &&
@@ -165,7 +205,7 @@ main(int argc, char *argv[]) {
         if (((error = image_open(basefile, (char *)NULL, SYSDEP_OPEN_RO, sysdep,
                                  1, &roctx)) == 0) &&
             ((error = image_verify(roctx)) == 0) &&
-            ((error = image_open(basefile, changefile, SYSDEP_OPEN_RW, sysdep,
+            ((error = image_open(basefile, changefile, SYSDEP_OPEN_RO, sysdep,
                                  1, &rwctx)) == 0) &&
             ((error = image_verify(rwctx)) == 0) &&
             ((error = (*sysdep->sys_open)(&cfp, changefile, SYSDEP_OPEN_RO)) ==
@@ -183,6 +223,12 @@ main(int argc, char *argv[]) {
                     uint64_t bmsize = header.cf_total_blocks * sizeof(uint64_t);
                     uint64_t *blockmap;
 
+                    shared_blocks = (header.cf_version >= CF_VERSION_2) &&
+                                    (header.cf_features & CF_FEATURE_DEDUP);
+                    compressed_blocks =
+                        (header.cf_version >= CF_VERSION_2) &&
+                        (header.cf_features & CF_FEATURE_COMPRESS);
+
                     if ((error = (*sysdep->sys_malloc)(&blockmap, bmsize)) ==
                         0) {
 
@@ -0,0 +1,57 @@
+/*
+ * cfcompact.c - Compact the change file of an image.
+ */
+/*
+ * Copyright (c) 2013, Ideal World, Inc.  All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ */
+#ifdef HAVE_CONFIG_H
+#    include "config.h"
+#endif /* HAVE_CONFIG_H */
+#include "libimage.h"
+#include "sysdep_posix.h"
+#include <stdio.h>
+#include <string.h>
+
+const sysdep_dispatch_t *sysdep = &posix_dispatch;
+
+/*
+ * Rewrite the live blocks of the change file in block order, dropping
+ * superseded records, and swap the result in place of the original.
+ */
+int
+main(int argc, char *argv[]) {
+    int error = 1;
+
+    if (argc == 3) {
+        void *rwctx = (void *)NULL;
+
+        char *basefile   = argv[1];
+        char *changefile = argv[2];
+
+        if (((error = image_open(basefile, changefile, SYSDEP_OPEN_RW, sysdep,
+                                 1, &rwctx)) == 0) &&
+            ((error = image_verify(rwctx)) == 0)) {
+            if ((error = image_compact(rwctx)) != 0) {
+                fprintf(stderr, "%s: cannot compact %s: %s\n", argv[0],
+                        changefile, strerror(error));
+            }
+        } else {
+            fprintf(stderr, "%s: cannot open %s with %s\n", argv[0], basefile,
+                    changefile);
+        }
+        if (rwctx) {
+            (void)image_close(rwctx);
+        }
+    } else {
+        fprintf(stderr, "%s: usage %s image-file change-file\n", argv[0],
+                argv[0]);
+    }
+
+    return error;
+}
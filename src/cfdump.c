@@ -1,8 +1,13 @@
 #include "changefileint.h"
+#include "libchecksum.h"
+#include "libcompress.h"
 #include "sysdep_int.h"
 #include "sysdep_posix.h"
 #include <ctype.h>
+#include <errno.h>
+#include <getopt.h>
 #include <inttypes.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -10,6 +15,10 @@
 #include <unistd.h>
 
 const sysdep_dispatch_t *sysdep = &posix_dispatch;
+/* Records of dedup change files name only the first block they back. */
+static int shared_blocks = 0;
+/* Records of compressed change files lead with their trailer. */
+static int compressed_blocks = 0;
 
 void
 dump_header(char *n, cf_header_t *h) {
@@ -17,34 +26,17 @@ dump_header(char *n, cf_header_t *h) {
            "total\n",
            n, h->cf_version, h->cf_flags, h->cf_used_blocks,
            h->cf_total_blocks);
-}
-
-static int      crcinitdone = 0;
-static uint32_t xcrc_tab32[CRC_TABLE_LEN];
-static inline uint32_t
-xcrc32(uint32_t crc, unsigned char *buf, uint64_t size) {
-    int      i;
-    uint64_t s;
-    uint32_t tmp;
-
-    if (!crcinitdone) {
-        for (i = 0; i < CRC_TABLE_LEN; i++) {
-            int      j;
-            uint32_t init_crc = (uint32_t)i;
-            for (j = 0; j < CRC_UNIT_BITS; j++) {
-                init_crc = (init_crc & 0x00000001L)
-                               ? (init_crc >> 1) ^ 0xEDB88320L
-                               : (init_crc >> 1);
-            }
-            xcrc_tab32[i] = init_crc;
-        }
-    }
-    for (s = 0; s < size; s++) {
-        tmp = crc ^ (((uint32_t)buf[s]) & 0x000000ffL);
-        crc = (crc >> 8) ^ xcrc_tab32[tmp & 0xff];
-    }
-
-    return crc;
+    if ((h->cf_version >= CF_VERSION_2) && (h->cf_features & CF_FEATURE_DEDUP))
+        printf("%s: dedup, %u records, table at 0x%016" PRIx64 "\n", n,
+               h->cf_dedup_count, h->cf_dedup_offset);
+    if ((h->cf_version >= CF_VERSION_2) &&
+        (h->cf_features & CF_FEATURE_COMPRESS))
+        printf("%s: compressed\n", n);
+    if ((h->cf_version >= CF_VERSION_2) &&
+        (h->cf_features & CF_FEATURE_GENERATIONS))
+        printf("%s: generation %u\n", n, h->cf_generation);
+    if ((h->cf_version >= CF_VERSION_2) && (h->cf_features & CF_FEATURE_ZERO))
+        printf("%s: zero blocks marked\n", n);
 }
 
 int
@@ -54,20 +46,56 @@ verify_block(void *cf, uint64_t offs, uint64_t index, void *rbuffer,
     int      error = 1;
     if (!(error = (*sysdep->sys_seek)(cf, offs, SYSDEP_SEEK_ABSOLUTE,
                                       (uint64_t *)NULL))) {
-        if (!(error = (*sysdep->sys_read)(cf, rbuffer, bsize, &nread)) &&
-            (nread == bsize)) {
+        if (compressed_blocks) {
+            cf_zblock_trailer_t ztrail;
+            void *              zbuffer;
+            if (!(error = (*sysdep->sys_read)(cf, &ztrail, sizeof(ztrail),
+                                              &nread)) &&
+                (nread == sizeof(ztrail)) &&
+                (ztrail.cfb_magic == CF_MAGIC_4) &&
+                (ztrail.cfb_length <= bsize) &&
+                !(error = (*sysdep->sys_malloc)(&zbuffer, bsize))) {
+                error = 1;
+                if (!(*sysdep->sys_read)(cf, zbuffer, ztrail.cfb_length,
+                                         &nread) &&
+                    (nread == ztrail.cfb_length)) {
+                    if (ztrail.cfb_length == bsize) {
+                        memcpy(rbuffer, zbuffer, bsize);
+                        error = 0;
+                    } else {
+                        error = lz_decompress(zbuffer, ztrail.cfb_length,
+                                              rbuffer, bsize);
+                    }
+                    if (!error &&
+                        !((shared_blocks || (ztrail.cfb_curblock == index)) &&
+                          (ztrail.cfb_crc ==
+                           update_crc32(0L, rbuffer, bsize)))) {
+                        error = 1;
+                    }
+                }
+                (void)(*sysdep->sys_free)(zbuffer);
+            } else {
+                error = 1;
+            }
+        } else if (!(error = (*sysdep->sys_read)(cf, rbuffer, bsize,
+                                                 &nread)) &&
+                   (nread == bsize)) {
             cf_block_trailer_t btrail;
             if (!(error = (*sysdep->sys_read)(cf, &btrail, sizeof(btrail),
                                               &nread)) &&
                 (nread == sizeof(btrail))) {
-                if ((btrail.cfb_curblock == index) &&
+                if ((shared_blocks || (btrail.cfb_curblock == index)) &&
                     (btrail.cfb_magic == CF_MAGIC_3) &&
-                    (btrail.cfb_crc == xcrc32(0L, rbuffer, bsize))) {
+                    (btrail.cfb_crc == update_crc32(0L, rbuffer, bsize))) {
                     error = 0;
                 } else {
                     error = 1;
                 }
+            } else {
+                error = 1;
             }
+        } else {
+            error = 1;
         }
     }
 
@@ -81,7 +109,10 @@ dump_blocks(cf_header_t *h, uint64_t *bm, void *cf) {
     uint64_t bsize   = 0;
     void *   rbuffer = (void *)NULL;
     for (bi = 0; bi < h->cf_total_blocks; bi++) {
-        if (bm[bi]) {
+        if (CF_ENTRY_ZERO(bm[bi])) {
+            printf("%lu: zero\n", bi);
+            nfound++;
+        } else if (bm[bi]) {
             int good = 0;
             printf("%lu: offset 0x%016lx: ", bi, bm[bi]);
             nfound++;
@@ -132,13 +163,488 @@ dump_blocks(cf_header_t *h, uint64_t *bm, void *cf) {
     }
 }
 
+/*
+ * Verification mode reads the records in file order in large chunks and
+ * leaves checking them to a pool of workers.  Chunks are handed out in
+ * the order they are read and come back in any order.
+ */
+#define VERIFY_CHUNK_BYTES (8 * 1024 * 1024)
+#define VERIFY_MAX_WORKERS 64
+#define VERIFY_PROBES      16
+
+typedef struct verify_record {
+    uint64_t vr_offset;
+    uint64_t vr_block;
+    uint64_t vr_size; /* on disk, filled in by the workers */
+    int      vr_bad;
+} verify_record_t;
+
+typedef struct verify_chunk {
+    unsigned char *vk_data;
+    uint64_t       vk_offset; /* of vk_data in the change file */
+    uint64_t       vk_length;
+    uint64_t       vk_first; /* records covered */
+    uint64_t       vk_count;
+} verify_chunk_t;
+
+typedef struct verify_context {
+    void *           vc_cf;
+    verify_record_t *vc_records; /* by offset */
+    uint64_t         vc_nrecords;
+    uint64_t         vc_bsize;
+    uint64_t         vc_recmax; /* largest possible record */
+    uint64_t         vc_chunk_bytes;
+    verify_chunk_t * vc_chunks;
+    uint32_t *       vc_free;  /* idle chunks */
+    uint32_t *       vc_queue; /* read chunks, in order */
+    uint32_t         vc_nchunks;
+    uint32_t         vc_nfree;
+    uint64_t         vc_nqueued;
+    uint64_t         vc_ntaken;
+    int              vc_done; /* nothing more will be queued */
+    pthread_mutex_t  vc_lock;
+    pthread_cond_t   vc_cv;
+} verify_context_t;
+
+static int
+verify_record_cmp(const void *a, const void *b) {
+    const verify_record_t *ra = (const verify_record_t *)a;
+    const verify_record_t *rb = (const verify_record_t *)b;
+
+    if (ra->vr_offset != rb->vr_offset)
+        return (ra->vr_offset < rb->vr_offset) ? -1 : 1;
+    return (ra->vr_block < rb->vr_block) ? -1 : (ra->vr_block > rb->vr_block);
+}
+
+/*
+ * Check one record in a chunk, noting its size on disk.  Returns nonzero
+ * if it is bad.
+ */
+static int
+verify_chunk_record(verify_context_t *vcp, verify_chunk_t *vkp,
+                    verify_record_t *vrp, unsigned char *zbuffer) {
+    unsigned char *rp    = vkp->vk_data + (vrp->vr_offset - vkp->vk_offset);
+    uint64_t       avail = vkp->vk_length - (vrp->vr_offset - vkp->vk_offset);
+    uint64_t       bsize = vcp->vc_bsize;
+
+    if (vrp->vr_offset < vkp->vk_offset)
+        return 1;
+    if (compressed_blocks) {
+        cf_zblock_trailer_t ztrail;
+        unsigned char *     data = rp + sizeof(ztrail);
+
+        if (avail < sizeof(ztrail))
+            return 1;
+        memcpy(&ztrail, rp, sizeof(ztrail));
+        vrp->vr_size = sizeof(ztrail) + ztrail.cfb_space;
+        if ((ztrail.cfb_magic != CF_MAGIC_4) || (ztrail.cfb_length > bsize) ||
+            (ztrail.cfb_length > ztrail.cfb_space) ||
+            (avail < (sizeof(ztrail) + ztrail.cfb_length)))
+            return 1;
+        if (ztrail.cfb_length < bsize) {
+            if (!zbuffer ||
+                lz_decompress(data, ztrail.cfb_length, zbuffer, bsize))
+                return 1;
+            data = zbuffer;
+        }
+        return !((shared_blocks || (ztrail.cfb_curblock == vrp->vr_block)) &&
+                 (ztrail.cfb_crc == update_crc32(0L, data, bsize)));
+    } else {
+        cf_block_trailer_t btrail;
+
+        vrp->vr_size = bsize + sizeof(btrail);
+        if (avail < vrp->vr_size)
+            return 1;
+        memcpy(&btrail, rp + bsize, sizeof(btrail));
+        return !((shared_blocks || (btrail.cfb_curblock == vrp->vr_block)) &&
+                 (btrail.cfb_magic == CF_MAGIC_3) &&
+                 (btrail.cfb_crc == update_crc32(0L, rp, bsize)));
+    }
+}
+
+/*
+ * Verify whole chunks until there are no more.  Blocks sharing a record
+ * share its verdict.
+ */
+static void *
+verify_worker(void *arg) {
+    verify_context_t *vcp     = (verify_context_t *)arg;
+    unsigned char *   zbuffer = (unsigned char *)NULL;
+
+    /*
+     * Without a buffer, compressed records are simply reported bad.
+     */
+    if (compressed_blocks)
+        (void)(*sysdep->sys_malloc)(&zbuffer, vcp->vc_bsize);
+    for (;;) {
+        verify_chunk_t *vkp;
+        uint32_t        ci;
+        uint64_t        ri;
+
+        pthread_mutex_lock(&vcp->vc_lock);
+        while ((vcp->vc_ntaken == vcp->vc_nqueued) && !vcp->vc_done)
+            pthread_cond_wait(&vcp->vc_cv, &vcp->vc_lock);
+        if (vcp->vc_ntaken == vcp->vc_nqueued) {
+            pthread_mutex_unlock(&vcp->vc_lock);
+            break;
+        }
+        ci = vcp->vc_queue[vcp->vc_ntaken++ % vcp->vc_nchunks];
+        pthread_mutex_unlock(&vcp->vc_lock);
+
+        vkp = &vcp->vc_chunks[ci];
+        for (ri = vkp->vk_first; ri < (vkp->vk_first + vkp->vk_count); ri++) {
+            verify_record_t *vrp = &vcp->vc_records[ri];
+
+            if ((ri > vkp->vk_first) &&
+                (vrp->vr_offset == vrp[-1].vr_offset)) {
+                vrp->vr_bad  = vrp[-1].vr_bad;
+                vrp->vr_size = vrp[-1].vr_size;
+            } else {
+                vrp->vr_bad = verify_chunk_record(vcp, vkp, vrp, zbuffer);
+            }
+        }
+
+        pthread_mutex_lock(&vcp->vc_lock);
+        vcp->vc_free[vcp->vc_nfree++] = ci;
+        pthread_cond_broadcast(&vcp->vc_cv);
+        pthread_mutex_unlock(&vcp->vc_lock);
+    }
+    if (zbuffer)
+        (void)(*sysdep->sys_free)(zbuffer);
+
+    return NULL;
+}
+
+/*
+ * Read the records into chunks and queue them for the workers.  A chunk
+ * starts at a record and takes in every record that surely fits; those
+ * sharing an offset are never split up.
+ */
+static int
+verify_reader(verify_context_t *vcp, uint64_t file_end) {
+    int      error = 0;
+    uint64_t ri    = 0;
+
+    while (!error && (ri < vcp->vc_nrecords)) {
+        verify_chunk_t *vkp;
+        uint64_t        start = vcp->vc_records[ri].vr_offset;
+        uint64_t        end;
+        uint64_t        rj;
+        uint64_t        nread;
+
+        /*
+         * Records past the end of the file have nothing to read.
+         */
+        if (start >= file_end) {
+            for (; ri < vcp->vc_nrecords; ri++)
+                vcp->vc_records[ri].vr_bad = 1;
+            break;
+        }
+        end = start + vcp->vc_chunk_bytes;
+        if (end > file_end)
+            end = file_end;
+        for (rj = ri + 1; rj < vcp->vc_nrecords; rj++) {
+            uint64_t roff = vcp->vc_records[rj].vr_offset;
+
+            if ((roff != vcp->vc_records[rj - 1].vr_offset) &&
+                ((roff >= end) ||
+                 ((end != file_end) && ((roff + vcp->vc_recmax) > end))))
+                break;
+        }
+        if ((vcp->vc_records[rj - 1].vr_offset + vcp->vc_recmax) < end)
+            end = vcp->vc_records[rj - 1].vr_offset + vcp->vc_recmax;
+
+        pthread_mutex_lock(&vcp->vc_lock);
+        while (!vcp->vc_nfree)
+            pthread_cond_wait(&vcp->vc_cv, &vcp->vc_lock);
+        vkp = &vcp->vc_chunks[vcp->vc_free[--vcp->vc_nfree]];
+        pthread_mutex_unlock(&vcp->vc_lock);
+
+        vkp->vk_offset = start;
+        vkp->vk_length = end - start;
+        vkp->vk_first  = ri;
+        vkp->vk_count  = rj - ri;
+        if (((error = (*sysdep->sys_seek)(vcp->vc_cf, start,
+                                          SYSDEP_SEEK_ABSOLUTE,
+                                          (uint64_t *)NULL)) == 0) &&
+            ((error = (*sysdep->sys_read)(vcp->vc_cf, vkp->vk_data,
+                                          vkp->vk_length, &nread)) == 0) &&
+            (nread != vkp->vk_length))
+            error = EIO;
+
+        pthread_mutex_lock(&vcp->vc_lock);
+        if (error)
+            vcp->vc_free[vcp->vc_nfree++] = vkp - vcp->vc_chunks;
+        else
+            vcp->vc_queue[vcp->vc_nqueued++ % vcp->vc_nchunks] =
+                vkp - vcp->vc_chunks;
+        pthread_cond_broadcast(&vcp->vc_cv);
+        pthread_mutex_unlock(&vcp->vc_lock);
+        ri = rj;
+    }
+    pthread_mutex_lock(&vcp->vc_lock);
+    vcp->vc_done = 1;
+    pthread_cond_broadcast(&vcp->vc_cv);
+    pthread_mutex_unlock(&vcp->vc_lock);
+
+    return error;
+}
+
+/*
+ * Find the block size by trying the first few records until one checks
+ * out at some size.
+ */
+static uint64_t
+verify_blocksize(void *cf, verify_record_t *records, uint64_t nrecords) {
+    void *   rbuffer;
+    uint64_t ri;
+    uint64_t bsize;
+
+    for (ri = 0; (ri < nrecords) && (ri < VERIFY_PROBES); ri++) {
+        for (bsize = 512; bsize < (128 * 1024 * 1024); bsize *= 2) {
+            if ((*sysdep->sys_malloc)(&rbuffer, bsize) == 0) {
+                int bad = verify_block(cf, records[ri].vr_offset,
+                                       records[ri].vr_block, rbuffer, bsize);
+
+                (void)(*sysdep->sys_free)(rbuffer);
+                if (!bad)
+                    return bsize;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Verify every record and report corrupt blocks, space not taken by live
+ * records and how fragmented the records are.  Returns nonzero if
+ * anything is corrupt.
+ */
+int
+verify_blocks(char *n, cf_header_t *h, uint64_t *bm, void *cf,
+              uint32_t nworkers) {
+    verify_context_t vc;
+    pthread_t        workers[VERIFY_MAX_WORKERS];
+    uint32_t         nstarted = 0;
+    uint64_t         file_end;
+    uint64_t         data_start;
+    uint64_t         data_end;
+    uint64_t         live    = 0;
+    uint64_t         nbad    = 0;
+    uint64_t         extents = 0;
+    uint64_t         nzero   = 0;
+    uint64_t         nkept   = 0;
+    uint64_t         bi;
+    uint64_t         ri;
+    uint32_t         ci;
+    int              error;
+
+    memset(&vc, 0, sizeof(vc));
+    vc.vc_cf = cf;
+    if ((error = (*sysdep->sys_file_size)(cf, &file_end)) != 0) {
+        fprintf(stderr, "%s: cannot get size\n", n);
+        return error;
+    }
+    data_start = h->cf_blockmap_offset + h->cf_total_blocks * sizeof(uint64_t);
+    data_end   = file_end;
+    if (h->cf_version >= CF_VERSION_2) {
+        if (h->cf_features & CF_FEATURE_GENERATIONS)
+            data_start += h->cf_total_blocks * sizeof(uint32_t);
+        data_end = h->cf_data_end;
+    }
+    for (bi = 0; bi < h->cf_total_blocks; bi++) {
+        if (CF_ENTRY_ZERO(bm[bi]))
+            nzero++;
+        /*
+         * A zeroed block's kept record still takes space and is checked.
+         */
+        if (CF_ENTRY_RECORD(bm[bi])) {
+            vc.vc_nrecords++;
+            if (CF_ENTRY_ZERO(bm[bi]))
+                nkept++;
+        }
+    }
+    if (vc.vc_nrecords &&
+        ((error = (*sysdep->sys_malloc)(
+              &vc.vc_records, vc.vc_nrecords * sizeof(verify_record_t))) !=
+         0)) {
+        fprintf(stderr, "%s: cannot allocate records\n", n);
+        return error;
+    }
+    for (bi = 0, ri = 0; bi < h->cf_total_blocks; bi++) {
+        if (CF_ENTRY_RECORD(bm[bi])) {
+            vc.vc_records[ri].vr_offset = CF_ENTRY_RECORD(bm[bi]);
+            vc.vc_records[ri].vr_block  = bi;
+            vc.vc_records[ri].vr_size   = 0;
+            vc.vc_records[ri].vr_bad    = 0;
+            ri++;
+        }
+    }
+    if (vc.vc_nrecords)
+        qsort(vc.vc_records, vc.vc_nrecords, sizeof(verify_record_t),
+              verify_record_cmp);
+
+    /*
+     * Set up and run the pool.
+     */
+    if (vc.vc_nrecords &&
+        !(vc.vc_bsize = verify_blocksize(cf, vc.vc_records, vc.vc_nrecords))) {
+        fprintf(stderr, "%s: cannot determine block size\n", n);
+        error = ENODEV;
+    }
+    vc.vc_recmax = vc.vc_bsize + (compressed_blocks
+                                      ? sizeof(cf_zblock_trailer_t)
+                                      : sizeof(cf_block_trailer_t));
+    vc.vc_chunk_bytes = (vc.vc_recmax > VERIFY_CHUNK_BYTES)
+                            ? vc.vc_recmax
+                            : VERIFY_CHUNK_BYTES;
+    vc.vc_nchunks     = 2 * nworkers;
+    if (!error && vc.vc_nrecords &&
+        ((error = (*sysdep->sys_malloc)(
+              &vc.vc_chunks, vc.vc_nchunks * sizeof(verify_chunk_t))) == 0) &&
+        ((error = (*sysdep->sys_malloc)(
+              &vc.vc_free, vc.vc_nchunks * sizeof(uint32_t))) == 0) &&
+        ((error = (*sysdep->sys_malloc)(
+              &vc.vc_queue, vc.vc_nchunks * sizeof(uint32_t))) == 0)) {
+        memset(vc.vc_chunks, 0, vc.vc_nchunks * sizeof(verify_chunk_t));
+        for (ci = 0; !error && (ci < vc.vc_nchunks); ci++) {
+            if ((error = (*sysdep->sys_malloc)(&vc.vc_chunks[ci].vk_data,
+                                               vc.vc_chunk_bytes)) == 0)
+                vc.vc_free[vc.vc_nfree++] = ci;
+        }
+        if (!error) {
+            pthread_mutex_init(&vc.vc_lock, NULL);
+            pthread_cond_init(&vc.vc_cv, NULL);
+            for (nstarted = 0; nstarted < nworkers; nstarted++) {
+                if (pthread_create(&workers[nstarted], NULL, verify_worker,
+                                   &vc))
+                    break;
+            }
+            if (nstarted) {
+                error = verify_reader(&vc, file_end);
+            } else {
+                error = EAGAIN;
+            }
+            /*
+             * The reader is done one way or another; let the workers drain.
+             */
+            pthread_mutex_lock(&vc.vc_lock);
+            vc.vc_done = 1;
+            pthread_cond_broadcast(&vc.vc_cv);
+            pthread_mutex_unlock(&vc.vc_lock);
+            while (nstarted)
+                pthread_join(workers[--nstarted], NULL);
+            pthread_cond_destroy(&vc.vc_cv);
+            pthread_mutex_destroy(&vc.vc_lock);
+        }
+        if (error)
+            fprintf(stderr, "%s: cannot verify: %s\n", n, strerror(error));
+    }
+    if (vc.vc_chunks) {
+        for (ci = 0; ci < vc.vc_nchunks; ci++) {
+            if (vc.vc_chunks[ci].vk_data)
+                (void)(*sysdep->sys_free)(vc.vc_chunks[ci].vk_data);
+        }
+        (void)(*sysdep->sys_free)(vc.vc_chunks);
+    }
+    if (vc.vc_free)
+        (void)(*sysdep->sys_free)(vc.vc_free);
+    if (vc.vc_queue)
+        (void)(*sysdep->sys_free)(vc.vc_queue);
+
+    /*
+     * Report.  A record continues an extent if it follows the one before
+     * it both in the file and in block order.
+     */
+    if (!error) {
+        for (ri = 0; ri < vc.vc_nrecords; ri++) {
+            verify_record_t *vrp = &vc.vc_records[ri];
+
+            if (vrp->vr_bad) {
+                printf("%" PRIu64 ": offset 0x%016" PRIx64 ": INVALID\n",
+                       vrp->vr_block, vrp->vr_offset);
+                nbad++;
+            }
+            if (!ri || (vrp->vr_offset != vrp[-1].vr_offset)) {
+                live += vrp->vr_size;
+                if (!ri ||
+                    (vrp->vr_offset != (vrp[-1].vr_offset + vrp[-1].vr_size)) ||
+                    (vrp->vr_block != (vrp[-1].vr_block + 1)))
+                    extents++;
+            } else {
+                extents++;
+            }
+        }
+        if ((h->cf_version >= CF_VERSION_2) &&
+            (h->cf_features & CF_FEATURE_DEDUP) && h->cf_dedup_offset)
+            live += CF_DEDUP_CAPACITY(h->cf_dedup_count) *
+                    sizeof(cf_dedup_entry_t);
+        if (live > (data_end - data_start))
+            live = data_end - data_start;
+        printf("%s: %" PRIu64 " blocks verified by %u workers, %" PRIu64
+               " corrupt\n",
+               n, vc.vc_nrecords, nworkers, nbad);
+        if (nzero)
+            printf("%s: %" PRIu64 " zero blocks, %" PRIu64
+                   " keeping their records\n",
+                   n, nzero, nkept);
+        printf("%s: %" PRIu64 " data bytes, %" PRIu64
+               " orphaned (%.1f%%)\n",
+               n, data_end - data_start, data_end - data_start - live,
+               (data_end > data_start)
+                   ? (100.0 * (data_end - data_start - live)) /
+                         (data_end - data_start)
+                   : 0.0);
+        printf("%s: fragmentation %.4f (%" PRIu64 " extents/%" PRIu64
+               " blocks)\n",
+               n, vc.vc_nrecords ? ((double)extents / vc.vc_nrecords) : 0.0,
+               extents, vc.vc_nrecords);
+        if (h->cf_used_blocks != vc.vc_nrecords - nkept + nzero) {
+            printf("WARNING: %" PRIu64 " found, %" PRIu64 " used blocks\n",
+                   vc.vc_nrecords - nkept + nzero, h->cf_used_blocks);
+        }
+        error = (nbad) ? 1 : 0;
+    }
+    if (vc.vc_records)
+        (void)(*sysdep->sys_free)(vc.vc_records);
+
+    return error;
+}
+
 int
 main(int argc, char *argv[]) {
     void *cfp;
     int   i;
-    int   error = 1;
+    int   option;
+    int   verify   = 0;
+    long  nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+    int   error    = 1;
 
-    for (i = 1; i < argc; i++) {
+    /*
+     * -v verifies and summarizes instead of dumping, with -j workers.
+     */
+    while ((option = getopt(argc, argv, "vj:")) != -1) {
+        switch (option) {
+        case 'v':
+            verify = 1;
+            break;
+        case 'j':
+            nworkers = strtol(optarg, (char **)NULL, 10);
+            break;
+        default:
+            fprintf(stderr, "%s: usage %s [-v [-j workers]] change-file ...\n",
+                    argv[0], argv[0]);
+            return 1;
+        }
+    }
+    (void)init_crc32();
+    if (nworkers < 1)
+        nworkers = 1;
+    if (nworkers > VERIFY_MAX_WORKERS)
+        nworkers = VERIFY_MAX_WORKERS;
+
+    for (i = optind; i < argc; i++) {
         if ((error = (*sysdep->sys_open)(&cfp, argv[i], SYSDEP_OPEN_RO)) == 0) {
             cf_header_t header;
             uint64_t    nread;
@@ -151,6 +657,12 @@ main(int argc, char *argv[]) {
                     uint64_t bmsize = header.cf_total_blocks * sizeof(uint64_t);
                     uint64_t *blockmap;
 
+                    shared_blocks = (header.cf_version >= CF_VERSION_2) &&
+                                    (header.cf_features & CF_FEATURE_DEDUP);
+                    compressed_blocks =
+                        (header.cf_version >= CF_VERSION_2) &&
+                        (header.cf_features & CF_FEATURE_COMPRESS);
+
                     if ((error = (*sysdep->sys_malloc)(&blockmap, bmsize)) ==
                         0) {
                         dump_header(argv[i], &header);
@@ -159,7 +671,11 @@ main(int argc, char *argv[]) {
                             SYSDEP_SEEK_ABSOLUTE, (uint64_t *)NULL);
                         if ((error = (*sysdep->sys_read)(cfp, blockmap, bmsize,
                                                          &nread)) == 0) {
-                            dump_blocks(&header, blockmap, cfp);
+                            if (verify)
+                                error = verify_blocks(argv[i], &header,
+                                                      blockmap, cfp, nworkers);
+                            else
+                                dump_blocks(&header, blockmap, cfp);
                         } else {
                             fprintf(stderr, "%s: cannot read blockmap\n",
                                     argv[i]);
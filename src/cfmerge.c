@@ -0,0 +1,454 @@
+/*
+ * cfmerge.c - Merge an image and its change file into a new partclone image.
+ */
+/*
+ * Copyright (c) 2013, Ideal World, Inc.  All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ */
+#ifdef HAVE_CONFIG_H
+#    include "config.h"
+#endif /* HAVE_CONFIG_H */
+#include "changefile.h"
+#include "libchecksum.h"
+#include "libimage.h"
+#include "partclone.h"
+#include "sysdep_posix.h"
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+const sysdep_dispatch_t *sysdep = &posix_dispatch;
+
+/*
+ * Blocks go from the reader to the checksummer to the writer in batches of
+ * about MERGE_BATCH_BYTES.  Each batch holds whole checksum groups but the
+ * last.
+ */
+#define MERGE_BATCHES             8
+#define MERGE_BATCH_BYTES         (1024 * 1024)
+#define MERGE_BLOCKS_PER_CHECKSUM 64
+
+typedef struct merge_batch {
+    unsigned char *mb_data;
+    uint32_t *     mb_crcs;    /* one per checksum group */
+    uint64_t       mb_nblocks; /* used blocks in the batch */
+} merge_batch_t;
+
+typedef struct merge_context {
+    void *          mc_image;
+    void *          mc_out;
+    unsigned char * mc_bitmap; /* byte per block, filled by the reader */
+    uint64_t        mc_blocksize;
+    uint64_t        mc_totalblocks;
+    uint64_t        mc_usedblocks;
+    uint64_t        mc_data_offset;
+    uint64_t        mc_batch_blocks;
+    merge_batch_t   mc_batch[MERGE_BATCHES];
+    uint64_t        mc_nread;    /* batches read */
+    uint64_t        mc_ncrc;     /* batches checksummed */
+    uint64_t        mc_nwritten; /* batches written */
+    int             mc_done;     /* the reader is done */
+    int             mc_error;
+    pthread_mutex_t mc_lock;
+    pthread_cond_t  mc_cv;
+} merge_context_t;
+
+/*
+ * Finish a stage on a batch and wake up whoever waits for it.
+ */
+static void
+merge_advance(merge_context_t *mcp, uint64_t *countp, int error) {
+    pthread_mutex_lock(&mcp->mc_lock);
+    if (error && !mcp->mc_error)
+        mcp->mc_error = error;
+    else if (countp)
+        (*countp)++;
+    pthread_cond_broadcast(&mcp->mc_cv);
+    pthread_mutex_unlock(&mcp->mc_lock);
+}
+
+/*
+ * Read the used blocks, in block order, noting them in the bitmap.  Runs
+ * of blocks in one state are found with image_extent_at, and each run of
+ * used ones is read into the batch with as few image_readblocks_at calls
+ * as the batches allow.
+ */
+static void *
+merge_reader(void *arg) {
+    merge_context_t *mcp   = (merge_context_t *)arg;
+    uint64_t         bi    = 0;
+    uint64_t         count = 0; /* left of the run at bi */
+    int              state = 0;
+    int              error = 0;
+
+    while (!error && (bi < mcp->mc_totalblocks)) {
+        merge_batch_t *mbp;
+
+        pthread_mutex_lock(&mcp->mc_lock);
+        while (!mcp->mc_error &&
+               ((mcp->mc_nread - mcp->mc_nwritten) >= MERGE_BATCHES))
+            pthread_cond_wait(&mcp->mc_cv, &mcp->mc_lock);
+        error = mcp->mc_error;
+        pthread_mutex_unlock(&mcp->mc_lock);
+        if (error)
+            break;
+
+        mbp             = &mcp->mc_batch[mcp->mc_nread % MERGE_BATCHES];
+        mbp->mb_nblocks = 0;
+        while (!error && (bi < mcp->mc_totalblocks) &&
+               (mbp->mb_nblocks < mcp->mc_batch_blocks)) {
+            uint64_t n;
+
+            if (!count &&
+                (((state = image_extent_at(mcp->mc_image, bi,
+                                           mcp->mc_totalblocks - bi,
+                                           &count)) == BLOCK_ERROR) ||
+                 !count)) {
+                error = EIO;
+            } else if (state & IMAGE_EXTENT_HOLE) {
+                memset(&mcp->mc_bitmap[bi], 0, count);
+                bi += count;
+                count = 0;
+            } else {
+                n = mcp->mc_batch_blocks - mbp->mb_nblocks;
+                if (n > count)
+                    n = count;
+                if ((error = image_readblocks_at(
+                         mcp->mc_image, bi,
+                         mbp->mb_data + (mbp->mb_nblocks * mcp->mc_blocksize),
+                         n)) == 0) {
+                    memset(&mcp->mc_bitmap[bi], 1, n);
+                    bi += n;
+                    count -= n;
+                    mbp->mb_nblocks += n;
+                }
+            }
+        }
+        mcp->mc_usedblocks += mbp->mb_nblocks;
+        merge_advance(mcp, (mbp->mb_nblocks) ? &mcp->mc_nread : NULL, error);
+    }
+    pthread_mutex_lock(&mcp->mc_lock);
+    mcp->mc_done = 1;
+    pthread_cond_broadcast(&mcp->mc_cv);
+    pthread_mutex_unlock(&mcp->mc_lock);
+
+    return NULL;
+}
+
+/*
+ * Wait for a batch that the previous stage is done with.  Returns zero
+ * when there will be no more.
+ */
+static int
+merge_wait(merge_context_t *mcp, uint64_t *prevp, uint64_t *ourp) {
+    int more;
+
+    pthread_mutex_lock(&mcp->mc_lock);
+    while (!mcp->mc_error && (*ourp == *prevp) &&
+           !(mcp->mc_done && (*prevp == mcp->mc_nread)))
+        pthread_cond_wait(&mcp->mc_cv, &mcp->mc_lock);
+    more = !mcp->mc_error && (*ourp != *prevp);
+    pthread_mutex_unlock(&mcp->mc_lock);
+
+    return more;
+}
+
+/*
+ * Checksum each group of blocks, starting each afresh.
+ */
+static void *
+merge_checksummer(void *arg) {
+    merge_context_t *mcp = (merge_context_t *)arg;
+
+    while (merge_wait(mcp, &mcp->mc_nread, &mcp->mc_ncrc)) {
+        merge_batch_t *mbp = &mcp->mc_batch[mcp->mc_ncrc % MERGE_BATCHES];
+        uint64_t       gi;
+
+        for (gi = 0; (gi * MERGE_BLOCKS_PER_CHECKSUM) < mbp->mb_nblocks;
+             gi++) {
+            uint64_t gblocks =
+                mbp->mb_nblocks - (gi * MERGE_BLOCKS_PER_CHECKSUM);
+
+            if (gblocks > MERGE_BLOCKS_PER_CHECKSUM)
+                gblocks = MERGE_BLOCKS_PER_CHECKSUM;
+            mbp->mb_crcs[gi] = update_crc32(
+                init_crc32(),
+                mbp->mb_data +
+                    (gi * MERGE_BLOCKS_PER_CHECKSUM * mcp->mc_blocksize),
+                gblocks * mcp->mc_blocksize);
+        }
+        merge_advance(mcp, &mcp->mc_ncrc, 0);
+    }
+
+    return NULL;
+}
+
+/*
+ * Write each group of blocks followed by its checksum.
+ */
+static void *
+merge_writer(void *arg) {
+    merge_context_t *mcp = (merge_context_t *)arg;
+    int              error;
+
+    if ((error = (*sysdep->sys_seek)(mcp->mc_out, mcp->mc_data_offset,
+                                     SYSDEP_SEEK_ABSOLUTE, (uint64_t *)NULL)) !=
+        0)
+        merge_advance(mcp, (uint64_t *)NULL, error);
+    while (merge_wait(mcp, &mcp->mc_ncrc, &mcp->mc_nwritten)) {
+        merge_batch_t *mbp = &mcp->mc_batch[mcp->mc_nwritten % MERGE_BATCHES];
+        uint64_t       gi;
+        uint64_t       nwritten;
+
+        for (gi = 0;
+             !error && ((gi * MERGE_BLOCKS_PER_CHECKSUM) < mbp->mb_nblocks);
+             gi++) {
+            uint64_t gblocks =
+                mbp->mb_nblocks - (gi * MERGE_BLOCKS_PER_CHECKSUM);
+            uint64_t gsize;
+
+            if (gblocks > MERGE_BLOCKS_PER_CHECKSUM)
+                gblocks = MERGE_BLOCKS_PER_CHECKSUM;
+            gsize = gblocks * mcp->mc_blocksize;
+            if (((error = (*sysdep->sys_write)(
+                      mcp->mc_out,
+                      mbp->mb_data +
+                          (gi * MERGE_BLOCKS_PER_CHECKSUM * mcp->mc_blocksize),
+                      gsize, &nwritten)) == 0) &&
+                (nwritten != gsize))
+                error = EIO;
+            if (!error &&
+                ((error = (*sysdep->sys_write)(mcp->mc_out, &mbp->mb_crcs[gi],
+                                               CRC_SIZE, &nwritten)) == 0) &&
+                (nwritten != CRC_SIZE))
+                error = EIO;
+        }
+        merge_advance(mcp, &mcp->mc_nwritten, error);
+    }
+
+    return NULL;
+}
+
+/*
+ * Write the image header and the bitmap.
+ */
+static int
+merge_write_head(merge_context_t *mcp, const char *fstype) {
+    int           error;
+    image_head_v2 head;
+    uint64_t      bitmap_size = (mcp->mc_totalblocks + 7) / 8;
+    uint8_t *     bitmap;
+    uint64_t      bi;
+    uint64_t      nwritten;
+
+    memset(&head, 0, sizeof(head));
+    memcpy(head.magic, IMAGE_MAGIC, IMAGE_MAGIC_SIZE);
+    strncpy(head.ptc_version, PACKAGE_VERSION, sizeof(head.ptc_version));
+    memcpy(head.version, IMAGE_VERSION_2, VERSION_SIZE);
+    head.endianess = ENDIAN_MAGIC;
+    memcpy(head.fs, fstype, sizeof(head.fs));
+    head.device_size         = mcp->mc_totalblocks * mcp->mc_blocksize;
+    head.totalblock          = mcp->mc_totalblocks;
+    head.usedblocks          = mcp->mc_usedblocks;
+    head.used_bitmap         = mcp->mc_usedblocks;
+    head.block_size          = mcp->mc_blocksize;
+    head.feature_size        = offsetof(image_head_v2, crc) -
+                               offsetof(image_head_v2, feature_size);
+    head.image_version       = 2;
+    head.cpu_bits            = sizeof(long) * 8;
+    head.checksum_mode       = CSM_CRC32;
+    head.checksum_size       = CRC_SIZE;
+    head.blocks_per_checksum = MERGE_BLOCKS_PER_CHECKSUM;
+    head.reseed_checksum     = 1;
+    head.bitmap_mode         = BM_BIT;
+    head.crc = update_crc32(init_crc32(), &head, offsetof(image_head_v2, crc));
+
+    if ((error = (*sysdep->sys_malloc)(&bitmap, bitmap_size + CRC_SIZE)) ==
+        0) {
+        crc32_t crc;
+
+        memset(bitmap, 0, bitmap_size);
+        for (bi = 0; bi < mcp->mc_totalblocks; bi++)
+            if (mcp->mc_bitmap[bi])
+                bitmap[bi >> 3] |= 1 << (bi & 7);
+        crc = update_crc32(init_crc32(), bitmap, bitmap_size);
+        memcpy(&bitmap[bitmap_size], &crc, CRC_SIZE);
+        if (((error = (*sysdep->sys_seek)(mcp->mc_out, 0, SYSDEP_SEEK_ABSOLUTE,
+                                          (uint64_t *)NULL)) == 0) &&
+            ((error = (*sysdep->sys_write)(mcp->mc_out, &head, sizeof(head),
+                                           &nwritten)) == 0) &&
+            (nwritten != sizeof(head)))
+            error = EIO;
+        if (!error &&
+            ((error = (*sysdep->sys_write)(mcp->mc_out, bitmap,
+                                           bitmap_size + CRC_SIZE,
+                                           &nwritten)) == 0) &&
+            (nwritten != (bitmap_size + CRC_SIZE)))
+            error = EIO;
+        (void)(*sysdep->sys_free)(bitmap);
+    }
+
+    return error;
+}
+
+/*
+ * Keep the file system type of partclone images.
+ */
+static void
+merge_fstype(const char *path, char *fstype) {
+    void *  fd;
+    uint8_t head[sizeof(image_head_v2)];
+
+    memset(fstype, 0, FS_MAGIC_SIZE + 1);
+    strcpy(fstype, raw_MAGIC);
+    if ((*sysdep->sys_open)(&fd, path, SYSDEP_OPEN_RO) == 0) {
+        uint64_t nread;
+
+        if (((*sysdep->sys_read)(fd, head, sizeof(head), &nread) == 0) &&
+            (nread == sizeof(head)) &&
+            (memcmp(head, IMAGE_MAGIC, IMAGE_MAGIC_SIZE) == 0)) {
+            image_head_v1 *h1p = (image_head_v1 *)head;
+            image_head_v2 *h2p = (image_head_v2 *)head;
+
+            if (memcmp(h1p->version, IMAGE_VERSION, VERSION_SIZE) == 0) {
+                memcpy(fstype, h1p->fs, FS_MAGIC_SIZE);
+            } else if (memcmp(h2p->version, IMAGE_VERSION_2, VERSION_SIZE) ==
+                       0) {
+                memcpy(fstype, h2p->fs, FS_MAGIC_SIZE);
+            }
+            fstype[FS_MAGIC_SIZE] = '\0';
+        }
+        (void)(*sysdep->sys_close)(fd);
+    }
+}
+
+/*
+ * Merge the image and the change file.
+ */
+static int
+merge_image(merge_context_t *mcp, const char *fstype) {
+    int       error;
+    int       i;
+    pthread_t reader, checksummer, writer;
+
+    mcp->mc_batch_blocks = MERGE_BATCH_BYTES / mcp->mc_blocksize;
+    mcp->mc_batch_blocks -= mcp->mc_batch_blocks % MERGE_BLOCKS_PER_CHECKSUM;
+    if (!mcp->mc_batch_blocks)
+        mcp->mc_batch_blocks = MERGE_BLOCKS_PER_CHECKSUM;
+    mcp->mc_data_offset = sizeof(image_head_v2) +
+                          ((mcp->mc_totalblocks + 7) / 8) + CRC_SIZE;
+    if ((error = (*sysdep->sys_malloc)(&mcp->mc_bitmap,
+                                       mcp->mc_totalblocks)) != 0)
+        return error;
+    for (i = 0; !error && (i < MERGE_BATCHES); i++) {
+        if ((error = (*sysdep->sys_malloc)(
+                 &mcp->mc_batch[i].mb_data,
+                 mcp->mc_batch_blocks * mcp->mc_blocksize)) == 0)
+            error = (*sysdep->sys_malloc)(
+                &mcp->mc_batch[i].mb_crcs,
+                (mcp->mc_batch_blocks / MERGE_BLOCKS_PER_CHECKSUM) *
+                    sizeof(uint32_t));
+    }
+    if (!error) {
+        pthread_mutex_init(&mcp->mc_lock, NULL);
+        pthread_cond_init(&mcp->mc_cv, NULL);
+        if ((error = pthread_create(&reader, NULL, merge_reader, mcp)) == 0) {
+            if ((error = pthread_create(&checksummer, NULL, merge_checksummer,
+                                        mcp)) == 0) {
+                if ((error = pthread_create(&writer, NULL, merge_writer,
+                                            mcp)) == 0) {
+                    pthread_join(writer, NULL);
+                } else {
+                    merge_advance(mcp, (uint64_t *)NULL, error);
+                }
+                pthread_join(checksummer, NULL);
+            } else {
+                merge_advance(mcp, (uint64_t *)NULL, error);
+            }
+            pthread_join(reader, NULL);
+        }
+        if (!error)
+            error = mcp->mc_error;
+        if (!error)
+            error = merge_write_head(mcp, fstype);
+        if (!error)
+            error = (*sysdep->sys_flush)(mcp->mc_out);
+        pthread_cond_destroy(&mcp->mc_cv);
+        pthread_mutex_destroy(&mcp->mc_lock);
+    }
+    for (i = 0; i < MERGE_BATCHES; i++) {
+        if (mcp->mc_batch[i].mb_data)
+            (void)(*sysdep->sys_free)(mcp->mc_batch[i].mb_data);
+        if (mcp->mc_batch[i].mb_crcs)
+            (void)(*sysdep->sys_free)(mcp->mc_batch[i].mb_crcs);
+    }
+    (void)(*sysdep->sys_free)(mcp->mc_bitmap);
+
+    return error;
+}
+
+/*
+ * Write the image as modified by the change file to a new partclone image
+ * that stands on its own.  Reading, checksumming and writing each run in
+ * their own thread.  The image and the change file are only read.
+ */
+int
+main(int argc, char *argv[]) {
+    int error = 1;
+
+    if (argc == 4) {
+        merge_context_t merge;
+        void *          fd;
+        char            fstype[FS_MAGIC_SIZE + 1];
+
+        char *basefile   = argv[1];
+        char *changefile = argv[2];
+        char *newfile    = argv[3];
+
+        memset(&merge, 0, sizeof(merge));
+        merge_fstype(basefile, fstype);
+        if ((*sysdep->sys_open)(&fd, newfile, SYSDEP_OPEN_RO) == 0) {
+            (void)(*sysdep->sys_close)(fd);
+            fprintf(stderr, "%s: %s exists\n", argv[0], newfile);
+            error = EEXIST;
+        } else if ((error = cf_exists(changefile, sysdep)) != 0) {
+            fprintf(stderr, "%s: cannot open %s: %s\n", argv[0], changefile,
+                    strerror(error));
+        } else if (((error = image_open(basefile, changefile, SYSDEP_OPEN_RO,
+                                        sysdep, 1, &merge.mc_image)) == 0) &&
+                   ((error = image_verify(merge.mc_image)) == 0) &&
+                   ((error = (*sysdep->sys_open)(&merge.mc_out, newfile,
+                                                 SYSDEP_CREATE)) == 0)) {
+            merge.mc_blocksize   = image_blocksize(merge.mc_image);
+            merge.mc_totalblocks = image_blockcount(merge.mc_image);
+            if ((error = merge_image(&merge, fstype)) == 0) {
+                printf("%s: %" PRIu64 " of %" PRIu64 " blocks used\n", newfile,
+                       merge.mc_usedblocks, merge.mc_totalblocks);
+            } else {
+                fprintf(stderr, "%s: cannot merge into %s: %s\n", argv[0],
+                        newfile, strerror(error));
+            }
+            (void)(*sysdep->sys_close)(merge.mc_out);
+            if (error)
+                (void)(*sysdep->sys_unlink)(newfile);
+        } else {
+            fprintf(stderr, "%s: cannot open %s with %s\n", argv[0], basefile,
+                    changefile);
+        }
+        if (merge.mc_image)
+            (void)image_close(merge.mc_image);
+    } else {
+        fprintf(stderr, "%s: usage %s image-file change-file new-image-file\n",
+                argv[0], argv[0]);
+    }
+
+    return error;
+}
@@ -0,0 +1,239 @@
+/*
+ * cfreceive.c - Apply the changes sent by cfsend to a change file.
+ */
+/*
+ * Copyright (c) 2013, Ideal World, Inc.  All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ */
+#ifdef HAVE_CONFIG_H
+#    include "config.h"
+#endif /* HAVE_CONFIG_H */
+#include "changefileint.h"
+#include "libchecksum.h"
+#include "libcompress.h"
+#include "sysdep_posix.h"
+#include <errno.h>
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+const sysdep_dispatch_t *sysdep = &posix_dispatch;
+
+/*
+ * Read from the stream, keeping its checksum.
+ */
+static int
+stream_read(FILE *sfp, crc32_t *crcp, void *buf, uint64_t size) {
+    if (fread(buf, 1, size, sfp) != size)
+        return EIO;
+    *crcp = update_crc32(*crcp, buf, size);
+    return 0;
+}
+
+/*
+ * Read the blocks of the stream and check them, keeping the blocks in the
+ * staging file.  Nothing reaches the change file until the checksum of the
+ * whole stream is known to be good.
+ */
+static int
+stage_changes(FILE *sfp, cf_stream_header_t *shp, crc32_t crc, void *stage,
+              uint64_t *nrecvp) {
+    int                error;
+    void *             buffer  = (void *)NULL;
+    void *             zbuffer = (void *)NULL;
+    cf_stream_record_t srec;
+    uint64_t           nwritten;
+
+    if (((error = (*sysdep->sys_malloc)(&buffer, shp->css_blocksize)) == 0) &&
+        ((error = (*sysdep->sys_malloc)(&zbuffer, shp->css_blocksize)) ==
+         0)) {
+        while (!error) {
+            if (fread(&srec, 1, sizeof(srec), sfp) != sizeof(srec)) {
+                error = EIO;
+                break;
+            }
+            /*
+             * The end record carries the checksum of all that preceded it.
+             */
+            if (srec.csr_block == CF_STREAM_END) {
+                if (srec.csr_crc != crc)
+                    error = EILSEQ;
+                break;
+            }
+            crc = update_crc32(crc, &srec, sizeof(srec));
+            if ((srec.csr_block >= shp->css_total_blocks) ||
+                (srec.csr_length > shp->css_blocksize)) {
+                error = EINVAL;
+            } else if (srec.csr_length == shp->css_blocksize) {
+                error = stream_read(sfp, &crc, buffer, srec.csr_length);
+            } else if ((error = stream_read(sfp, &crc, zbuffer,
+                                            srec.csr_length)) == 0) {
+                error = lz_decompress(zbuffer, srec.csr_length, buffer,
+                                      shp->css_blocksize);
+            }
+            if (!error &&
+                (update_crc32(init_crc32(), buffer, shp->css_blocksize) !=
+                 srec.csr_crc))
+                error = EILSEQ;
+            /*
+             * Staged records always hold the whole block.
+             */
+            srec.csr_length = shp->css_blocksize;
+            if (!error &&
+                ((error = (*sysdep->sys_write)(stage, &srec, sizeof(srec),
+                                               &nwritten)) == 0) &&
+                (nwritten == sizeof(srec)) &&
+                ((error = (*sysdep->sys_write)(stage, buffer,
+                                               shp->css_blocksize,
+                                               &nwritten)) == 0) &&
+                (nwritten == shp->css_blocksize))
+                (*nrecvp)++;
+            else if (!error)
+                error = EIO;
+        }
+    }
+    if (zbuffer)
+        (void)(*sysdep->sys_free)(zbuffer);
+    if (buffer)
+        (void)(*sysdep->sys_free)(buffer);
+
+    return error;
+}
+
+/*
+ * Write the staged blocks to the change file.
+ */
+static int
+apply_changes(void *cfp, void *stage, cf_stream_header_t *shp,
+              uint64_t nrecv) {
+    int                error;
+    void *             buffer = (void *)NULL;
+    cf_stream_record_t srec;
+    uint64_t           nread;
+    uint64_t           ri;
+
+    if (((error = (*sysdep->sys_malloc)(&buffer, shp->css_blocksize)) == 0) &&
+        ((error = (*sysdep->sys_seek)(stage, 0, SYSDEP_SEEK_ABSOLUTE,
+                                      (uint64_t *)NULL)) == 0)) {
+        for (ri = 0; !error && (ri < nrecv); ri++) {
+            if (((error = (*sysdep->sys_read)(stage, &srec, sizeof(srec),
+                                              &nread)) == 0) &&
+                (nread == sizeof(srec)) &&
+                ((error = (*sysdep->sys_read)(stage, buffer,
+                                              shp->css_blocksize, &nread)) ==
+                 0) &&
+                (nread == shp->css_blocksize)) {
+                if ((error = cf_seek(cfp, srec.csr_block)) == 0)
+                    error = cf_writeblock(cfp, buffer);
+            } else if (!error) {
+                error = EIO;
+            }
+        }
+    }
+    if (buffer)
+        (void)(*sysdep->sys_free)(buffer);
+
+    return error;
+}
+
+/*
+ * Apply a stream read from standard input to the change file, creating it
+ * if needed.  A stream applies to a change file that has received all
+ * generations up to the one the stream starts from, so streams must be
+ * applied in the order they were sent.  An interrupted stream may be sent
+ * again.
+ */
+int
+main(int argc, char *argv[]) {
+    int error = 1;
+
+    if (argc == 2) {
+        void *             cfp        = (void *)NULL;
+        char *             changefile = argv[1];
+        cf_stream_header_t sheader;
+        crc32_t            crc = init_crc32();
+
+        if ((error = stream_read(stdin, &crc, &sheader, sizeof(sheader))) ==
+            0) {
+            if ((sheader.css_magic == CF_STREAM_MAGIC) &&
+                (sheader.css_version == CF_STREAM_VERSION) &&
+                (sheader.css_crc ==
+                 update_crc32(init_crc32(), &sheader,
+                              offsetof(cf_stream_header_t, css_crc))) &&
+                sheader.css_blocksize &&
+                (sheader.css_generation > sheader.css_base)) {
+                uint32_t rgen;
+
+                if (((error = cf_create(
+                          changefile, sysdep, sheader.css_blocksize,
+                          sheader.css_total_blocks,
+                          sheader.css_features &
+                              (CF_FEATURE_DEDUP | CF_FEATURE_COMPRESS),
+                          &cfp)) == 0) &&
+                    ((error = cf_exclusive(cfp)) == 0) &&
+                    ((error = cf_generation(cfp, &rgen)) == 0)) {
+                    uint64_t nrecv = 0;
+                    void *   stage = (void *)NULL;
+
+                    /*
+                     * The copy is at the generation after the last one it
+                     * received.  Blocks take the generation of the stream.
+                     */
+                    if (sheader.css_base != (rgen - 1)) {
+                        fprintf(stderr,
+                                "%s: %s has generations up to %u, stream "
+                                "follows %u\n",
+                                argv[0], changefile, rgen - 1,
+                                sheader.css_base);
+                        error = EINVAL;
+                    } else if (((error = (*sysdep->sys_open)(
+                                     &stage, changefile, SYSDEP_TEMPORARY)) ==
+                                0) &&
+                               ((error = stage_changes(stdin, &sheader, crc,
+                                                       stage, &nrecv)) == 0) &&
+                               ((error = cf_set_generation(
+                                     cfp, sheader.css_generation)) == 0) &&
+                               ((error = apply_changes(cfp, stage, &sheader,
+                                                       nrecv)) == 0) &&
+                               ((error = cf_set_generation(
+                                     cfp, sheader.css_generation + 1)) == 0) &&
+                               ((error = cf_sync(cfp)) == 0)) {
+                        fprintf(stderr,
+                                "%s: received %" PRIu64
+                                " blocks, generations %u to %u\n",
+                                argv[0], nrecv, sheader.css_base + 1,
+                                sheader.css_generation);
+                    } else {
+                        (void)cf_set_generation(cfp, rgen);
+                        fprintf(stderr, "%s: cannot receive into %s: %s\n",
+                                argv[0], changefile, strerror(error));
+                    }
+                    if (stage)
+                        (void)(*sysdep->sys_close)(stage);
+                } else {
+                    fprintf(stderr, "%s: cannot open %s: %s\n", argv[0],
+                            changefile, strerror(error));
+                }
+                if (cfp)
+                    (void)cf_finish(cfp);
+            } else {
+                fprintf(stderr, "%s: not a change stream\n", argv[0]);
+                error = EINVAL;
+            }
+        } else {
+            fprintf(stderr, "%s: cannot read stream\n", argv[0]);
+        }
+    } else {
+        fprintf(stderr, "%s: usage %s change-file < stream\n", argv[0],
+                argv[0]);
+    }
+
+    return error;
+}
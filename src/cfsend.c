@@ -0,0 +1,201 @@
+/*
+ * cfsend.c - Send the changes made to a change file since a generation.
+ */
+/*
+ * Copyright (c) 2013, Ideal World, Inc.  All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ */
+#ifdef HAVE_CONFIG_H
+#    include "config.h"
+#endif /* HAVE_CONFIG_H */
+#include "changefileint.h"
+#include "libchecksum.h"
+#include "libcompress.h"
+#include "libimage.h"
+#include "sysdep_posix.h"
+#include <errno.h>
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+const sysdep_dispatch_t *sysdep = &posix_dispatch;
+
+/*
+ * Write to the stream, keeping its checksum.
+ */
+static int
+stream_write(FILE *sfp, crc32_t *crcp, void *buf, uint64_t size) {
+    *crcp = update_crc32(*crcp, buf, size);
+    return (fwrite(buf, 1, size, sfp) == size) ? 0 : EIO;
+}
+
+/*
+ * Write the blocks written after generation since.
+ */
+static int
+send_changes(void *cfp, FILE *sfp, cf_stream_header_t *shp, uint64_t *nsentp) {
+    int                error;
+    void *             buffer  = (void *)NULL;
+    void *             zbuffer = (void *)NULL;
+    crc32_t            crc     = init_crc32();
+    cf_stream_record_t srec;
+    uint64_t           bi;
+
+    if (((error = (*sysdep->sys_malloc)(&buffer, shp->css_blocksize)) == 0) &&
+        ((error = (*sysdep->sys_malloc)(&zbuffer, shp->css_blocksize)) ==
+         0) &&
+        ((error = stream_write(sfp, &crc, shp, sizeof(*shp))) == 0)) {
+        for (bi = 0; !error && (bi < shp->css_total_blocks); bi++) {
+            uint32_t bgen;
+
+            if (((error = cf_seek(cfp, bi)) == 0) &&
+                ((error = cf_blockgen(cfp, &bgen)) == 0) &&
+                (bgen > shp->css_base) &&
+                ((error = cf_readblock(cfp, buffer)) == 0)) {
+                void *payload = buffer;
+
+                srec.csr_block = bi;
+                srec.csr_crc =
+                    update_crc32(init_crc32(), buffer, shp->css_blocksize);
+                /*
+                 * Send it compressed if that saves anything.
+                 */
+                srec.csr_length = lz_compress(buffer, shp->css_blocksize,
+                                              zbuffer, shp->css_blocksize - 1);
+                if (srec.csr_length) {
+                    payload = zbuffer;
+                } else {
+                    srec.csr_length = shp->css_blocksize;
+                }
+                if (((error = stream_write(sfp, &crc, &srec, sizeof(srec))) ==
+                     0) &&
+                    ((error = stream_write(sfp, &crc, payload,
+                                           srec.csr_length)) == 0)) {
+                    (*nsentp)++;
+                }
+            }
+        }
+        if (!error) {
+            srec.csr_block  = CF_STREAM_END;
+            srec.csr_length = 0;
+            srec.csr_crc    = crc;
+            if ((fwrite(&srec, 1, sizeof(srec), sfp) != sizeof(srec)) ||
+                fflush(sfp))
+                error = EIO;
+        }
+    }
+    if (zbuffer)
+        (void)(*sysdep->sys_free)(zbuffer);
+    if (buffer)
+        (void)(*sysdep->sys_free)(buffer);
+
+    return error;
+}
+
+/*
+ * Write a stream of the blocks of the change file written after the given
+ * generation (default: all of them) to standard output, then start a new
+ * generation.  The generation the stream brings is reported so that the
+ * next stream can start from it.
+ */
+int
+main(int argc, char *argv[]) {
+    int error = 1;
+
+    if ((argc == 3) || (argc == 4)) {
+        void *imctx = (void *)NULL;
+        void *cfp   = (void *)NULL;
+        void *cfh;
+
+        char *   basefile   = argv[1];
+        char *   changefile = argv[2];
+        uint32_t since      = (argc == 4) ? strtoul(argv[3], NULL, 0) : 0;
+
+        /*
+         * The image gives the geometry.  The change file must exist.
+         */
+        if (((error = image_open(basefile, (char *)NULL, SYSDEP_OPEN_RO,
+                                 sysdep, 1, &imctx)) == 0) &&
+            ((error = image_verify(imctx)) == 0) &&
+            ((error = (*sysdep->sys_open)(&cfh, changefile, SYSDEP_OPEN_RO)) ==
+             0)) {
+            cf_stream_header_t sheader;
+
+            (void)(*sysdep->sys_close)(cfh);
+            memset(&sheader, 0, sizeof(sheader));
+            sheader.css_magic        = CF_STREAM_MAGIC;
+            sheader.css_version      = CF_STREAM_VERSION;
+            sheader.css_blocksize    = image_blocksize(imctx);
+            sheader.css_total_blocks = image_blockcount(imctx);
+            sheader.css_base         = since;
+            if (((error = cf_init(changefile, sysdep, sheader.css_blocksize,
+                                  sheader.css_total_blocks, 0, &cfp)) == 0) &&
+                ((error = cf_verify(cfp)) == 0)) {
+                /*
+                 * Starting a new generation under a server would be undone
+                 * by its next sync, and what it wrote meanwhile would be
+                 * left out of the next stream.
+                 */
+                if ((error = cf_exclusive(cfp)) != 0) {
+                    fprintf(stderr, "%s: %s is in use\n", argv[0],
+                            changefile);
+                } else if ((error = cf_generation(
+                                cfp, &sheader.css_generation)) == 0) {
+                    uint64_t nsent = 0;
+
+                    sheader.css_features =
+                        ((cf_context_t *)cfp)->cfc_header.cf_features;
+                    sheader.css_crc = update_crc32(
+                        init_crc32(), &sheader,
+                        offsetof(cf_stream_header_t, css_crc));
+                    if (since >= sheader.css_generation) {
+                        fprintf(stderr, "%s: %s is at generation %u\n",
+                                argv[0], changefile, sheader.css_generation);
+                        error = EINVAL;
+                    } else if (((error = send_changes(cfp, stdout, &sheader,
+                                                      &nsent)) == 0) &&
+                               ((error = cf_set_generation(
+                                     cfp, sheader.css_generation + 1)) == 0) &&
+                               ((error = cf_sync(cfp)) == 0)) {
+                        fprintf(stderr,
+                                "%s: sent %" PRIu64
+                                " blocks, generations %u to %u\n",
+                                argv[0], nsent, since + 1,
+                                sheader.css_generation);
+                    } else {
+                        fprintf(stderr, "%s: cannot send %s: %s\n", argv[0],
+                                changefile, strerror(error));
+                    }
+                } else {
+                    fprintf(stderr,
+                            "%s: %s does not record generations, compact it "
+                            "first\n",
+                            argv[0], changefile);
+                }
+            } else {
+                fprintf(stderr, "%s: cannot open %s: %s\n", argv[0],
+                        changefile, strerror(error));
+            }
+            if (cfp)
+                (void)cf_finish(cfp);
+        } else {
+            fprintf(stderr, "%s: cannot open %s with %s\n", argv[0], basefile,
+                    changefile);
+        }
+        if (imctx) {
+            (void)image_close(imctx);
+        }
+    } else {
+        fprintf(stderr, "%s: usage %s image-file change-file [generation]\n",
+                argv[0], argv[0]);
+    }
+
+    return error;
+}
@@ -9,123 +9,64 @@
 #endif /* HAVE_CONFIG_H */
 #include "changefile.h"
 #include "changefileint.h"
+#include "libchecksum.h"
+#include "libcompress.h"
 #include <errno.h>
 #include <string.h>
 
 /*
- * Initialize change file handling.
- *
- * Allocate and initialize change file handle.
+ * Find the end of the first path in a change file path list: the next
+ * separator that isn't escaped, or the end of the list.
  */
-int
-cf_init(const char *cfpath, const sysdep_dispatch_t *sysdep, uint64_t blocksize,
-        uint64_t blockcount, void **cfpp) {
-    int           error = EINVAL;
-    cf_context_t *cfp   = (cf_context_t *)NULL;
+static const char *
+cf_chain_next(const char *cp) {
+    while (*cp && (*cp != CF_CHAIN_SEPARATOR)) {
+        if ((*cp == CF_CHAIN_ESCAPE) && cp[1])
+            cp++;
+        cp++;
+    }
+    return cp;
+}
 
-    if ((error = (*sysdep->sys_malloc)(&cfp, sizeof(*cfp))) == 0) {
-        int i;
-        memset(cfp, 0, sizeof(*cfp));
+/*
+ * Find the top (writable) layer in a change file path list.
+ */
+static const char *
+cf_top_path(const char *cfpath) {
+    const char *top = cfpath;
+    const char *cp;
 
-        /*
-         * Open the file.
-         */
-        if ((error = (*sysdep->sys_open)(&cfp->cfc_fd, cfpath,
-                                         SYSDEP_OPEN_RW)) == 0) {
-            cfp->cfc_sysdep     = sysdep;
-            cfp->cfc_blocksize  = blocksize;
-            cfp->cfc_blockcount = blockcount;
-            /*
-             * Initialize the CRC table.
-             */
-            for (i = 0; i < CRC_TABLE_LEN; i++) {
-                int      j;
-                uint32_t init_crc = (uint32_t)i;
-                for (j = 0; j < CRC_UNIT_BITS; j++) {
-                    init_crc = (init_crc & 0x00000001L)
-                                   ? (init_crc >> 1) ^ 0xEDB88320L
-                                   : (init_crc >> 1);
-                }
-                cfp->cfc_crc_tab32[i] = init_crc;
-            }
-        } else {
-            (void)(*sysdep->sys_free)(cfp);
-            cfp = (cf_context_t *)NULL;
-        }
-    }
-    if (!error && cfp)
-        *cfpp = (void *)cfp;
-    return error;
+    for (cp = cf_chain_next(cfpath); *cp; cp = cf_chain_next(cp + 1))
+        top = cp + 1;
+    return top;
 }
 
 /*
- * Verify the change file.
- *
- * - Load the blockmap.
+ * Copy a path out of a change file path list, less its escapes.
  */
-int
-cf_verify(void *vcp) {
-    int           error = EINVAL;
-    cf_context_t *cfp   = (cf_context_t *)vcp;
-    uint64_t      nread;
+static int
+cf_chain_copy(const sysdep_dispatch_t *sysdep, const char *cp,
+              const char *ep, char **pathp) {
+    char *dp;
+    int   error;
 
-    /*
-     * Make sure we're at the beginning of the file.
-     */
-    (void)(*cfp->cfc_sysdep->sys_seek)(cfp->cfc_fd, 0, SYSDEP_SEEK_ABSOLUTE,
-                                       (uint64_t *)NULL);
-    if (((error = (*cfp->cfc_sysdep->sys_read)(cfp->cfc_fd, &cfp->cfc_header,
-                                               sizeof(cfp->cfc_header),
-                                               &nread)) == 0) &&
-        (nread == sizeof(cfp->cfc_header))) {
-        /*
-         * Verify read header.
-         */
-        if ((cfp->cfc_header.cf_magic == CF_MAGIC_1) &&
-            (cfp->cfc_header.cf_magic2 == CF_MAGIC_2) &&
-            /* [2013-12] ntfs chicanery could have added the trailing block */
-            ((cfp->cfc_header.cf_total_blocks == cfp->cfc_blockcount) ||
-             (cfp->cfc_header.cf_total_blocks == (cfp->cfc_blockcount + 1)))) {
-            uint64_t bhsize =
-                cfp->cfc_header.cf_total_blocks * sizeof(*cfp->cfc_blockmap);
-            /*
-             * Allocate, find and read the blockmap.
-             */
-            if ((error = (*cfp->cfc_sysdep->sys_malloc)(&cfp->cfc_blockmap,
-                                                        bhsize)) == 0) {
-                if ((error = (*cfp->cfc_sysdep->sys_seek)(
-                         cfp->cfc_fd, cfp->cfc_header.cf_blockmap_offset,
-                         SYSDEP_SEEK_ABSOLUTE, (uint64_t *)NULL)) == 0) {
-                    if (((error = (*cfp->cfc_sysdep->sys_read)(
-                              cfp->cfc_fd, cfp->cfc_blockmap, bhsize,
-                              &nread)) == 0) &&
-                        (nread == bhsize)) {
-                        /* xxx */
-                    } else {
-                        if (error == 0)
-                            error = EIO;
-                    }
-                }
-            }
-        } else {
-            error = ENODEV;
-        }
-    } else {
-        if (error == 0) {
-            /* Implies rsize != sizeof(cfp->cfc_header) */
-            error = EIO;
+    if ((error = (*sysdep->sys_malloc)(pathp, (ep - cp) + 1)) == 0) {
+        for (dp = *pathp; cp < ep; cp++) {
+            if ((*cp == CF_CHAIN_ESCAPE) && (cp + 1 < ep))
+                cp++;
+            *dp++ = *cp;
         }
+        *dp = '\0';
     }
-
     return error;
 }
 
 /*
- * Create change file if necessary.
+ * Create the change file if it does not exist already.
  */
-int
-cf_create(const char *cfpath, const sysdep_dispatch_t *sysdep,
-          uint64_t blocksize, uint64_t blockcount, void **cfpp) {
+static int
+cf_create_file(const char *cfpath, const sysdep_dispatch_t *sysdep,
+               uint64_t blockcount, uint32_t features) {
     int   error;
     void *cfh = (void *)NULL;
 
@@ -142,233 +83,2263 @@ cf_create(const char *cfpath, const sysdep_dispatch_t *sysdep,
             /*
              * A new file!
              */
+            memset(&ncfh, 0, sizeof(ncfh));
             ncfh.cf_magic           = CF_MAGIC_1;
-            ncfh.cf_version         = CF_VERSION_1;
+            ncfh.cf_version         = CF_VERSION_2;
             ncfh.cf_flags           = 0;
             ncfh.cf_total_blocks    = blockcount;
             ncfh.cf_used_blocks     = 0;
             ncfh.cf_blockmap_offset = sizeof(ncfh);
             ncfh.cf_magic2          = CF_MAGIC_2;
+            ncfh.cf_data_end = sizeof(ncfh) + (blockcount * sizeof(uint64_t)) +
+                               (blockcount * sizeof(uint32_t));
+            ncfh.cf_features = (features & CF_FEATURES_KNOWN) |
+                               CF_FEATURE_GENERATIONS | CF_FEATURE_ZERO;
+            ncfh.cf_generation = CF_GENERATION_INITIAL;
             if ((error = (*sysdep->sys_malloc)(
                      &bmp, blockcount * sizeof(uint64_t))) == 0) {
                 uint64_t nwritten;
                 memset(bmp, 0, blockcount * sizeof(uint64_t));
+                /*
+                 * The generation map is as empty as the blockmap.
+                 */
                 if (((error = (*sysdep->sys_write)(cfh, &ncfh, sizeof(ncfh),
                                                    &nwritten)) == 0) &&
                     (nwritten == sizeof(ncfh)) &&
                     ((error = (*sysdep->sys_write)(
                           cfh, bmp, blockcount * sizeof(uint64_t),
                           &nwritten)) == 0) &&
-                    (nwritten == (blockcount * sizeof(uint64_t)))) {
-                    /* close it - we'll open it again below. */
-                    (void)(*sysdep->sys_close)(cfh);
+                    (nwritten == (blockcount * sizeof(uint64_t))) &&
+                    ((error = (*sysdep->sys_write)(
+                          cfh, bmp, blockcount * sizeof(uint32_t),
+                          &nwritten)) == 0) &&
+                    (nwritten == (blockcount * sizeof(uint32_t)))) {
+                    /* A candidate change file. */
                 }
                 (void)(*sysdep->sys_free)(bmp);
             }
+            /* close it - it gets opened again by cf_init(). */
+            (void)(*sysdep->sys_close)(cfh);
         }
-    }
-    if (!error) {
-        /*
-         * If we are successful thus far, then we have a
-         * candidate change file.
-         */
-        if ((error = cf_init(cfpath, sysdep, blocksize, blockcount, cfpp)) ==
-            0) {
-            error = cf_verify(*cfpp);
-        }
+    } else {
+        (void)(*sysdep->sys_close)(cfh);
     }
 
     return error;
 }
 
 /*
- * Sync change file changes to image.
+ * Open the lower layers of a change file chain.
+ *
+ * The path list names the layers lowest first, separated by
+ * CF_CHAIN_SEPARATOR; a separator (or CF_CHAIN_ESCAPE) that is part of a
+ * path is escaped with CF_CHAIN_ESCAPE.  All but the last are opened
+ * read-only.
  */
-int
-cf_sync(void *vcp) {
-    int           error   = EROFS;
-    cf_context_t *cfp     = (cf_context_t *)vcp;
-    cf_header_t   oheader = cfp->cfc_header;
-    uint64_t      nwritten;
+static int
+cf_chain_open(cf_context_t *cfp, const char *cfpath) {
+    int         error = 0;
+    const char *cp;
+    uint32_t    nlower = 0;
 
-    oheader.cf_flags &= ~CF_HEADER_DIRTY;
-    /*
-     * Seek and write the sanitized header and block map.
-     */
-    if (((error = (*cfp->cfc_sysdep->sys_seek)(
-              cfp->cfc_fd, 0, SYSDEP_SEEK_ABSOLUTE, (uint64_t *)NULL)) == 0) &&
-        ((error = (*cfp->cfc_sysdep->sys_write)(
-              cfp->cfc_fd, &oheader, sizeof(oheader), &nwritten)) == 0) &&
-        (nwritten == sizeof(oheader)) &&
-        ((error = (*cfp->cfc_sysdep->sys_seek)(
-              cfp->cfc_fd, oheader.cf_blockmap_offset, SYSDEP_SEEK_ABSOLUTE,
-              (uint64_t *)NULL)) == 0) &&
-        ((error = (*cfp->cfc_sysdep->sys_write)(
-              cfp->cfc_fd, cfp->cfc_blockmap,
-              oheader.cf_total_blocks * sizeof(uint64_t), &nwritten)) == 0) &&
-        (nwritten == (oheader.cf_total_blocks * sizeof(uint64_t)))) {
-        /*
-         * If successful, then we're no longer dirty.
-         */
-        cfp->cfc_header.cf_flags &= ~CF_HEADER_DIRTY;
+    for (cp = cf_chain_next(cfpath); *cp; cp = cf_chain_next(cp + 1))
+        nlower++;
+    if (nlower > CF_CHAIN_MAX_LAYERS) {
+        error = E2BIG;
+    } else if (nlower &&
+               ((error = (*cfp->cfc_sysdep->sys_malloc)(
+                     &cfp->cfc_layers, nlower * sizeof(void *))) == 0)) {
+        for (cp = cfpath; !error && (cfp->cfc_nlayers < nlower);) {
+            const char *ep = cf_chain_next(cp);
+            char *      lpath;
+
+            if ((error = cf_chain_copy(cfp->cfc_sysdep, cp, ep, &lpath)) ==
+                0) {
+                if ((error = (*cfp->cfc_sysdep->sys_open)(
+                         &cfp->cfc_layers[cfp->cfc_nlayers], lpath,
+                         SYSDEP_OPEN_RO)) == 0) {
+                    cfp->cfc_nlayers++;
+                }
+                (void)(*cfp->cfc_sysdep->sys_free)(lpath);
+            }
+            cp = ep + 1;
+        }
     }
 
     return error;
 }
 
 /*
- * Finish change file handling.
- *
- * Free structures.
+ * Release the lower layers of a change file chain.
  */
-int
-cf_finish(void *vcp) {
-    cf_context_t *cfp = (cf_context_t *)vcp;
+static void
+cf_chain_close(cf_context_t *cfp) {
+    uint32_t lidx;
 
-    /*
-     * See if we're dirty first and flush what we have if we are.
-     */
-    if (cfp->cfc_header.cf_flags & CF_HEADER_DIRTY)
-        (void)cf_sync(vcp);
-    if (cfp->cfc_blockmap)
-        (void)(*cfp->cfc_sysdep->sys_free)(cfp->cfc_blockmap);
-    (void)(*cfp->cfc_sysdep->sys_close)(cfp->cfc_fd);
-    return (*cfp->cfc_sysdep->sys_free)(cfp);
+    for (lidx = 0; lidx < cfp->cfc_nlayers; lidx++)
+        (void)(*cfp->cfc_sysdep->sys_close)(cfp->cfc_layers[lidx]);
+    if (cfp->cfc_layers)
+        (void)(*cfp->cfc_sysdep->sys_free)(cfp->cfc_layers);
+    if (cfp->cfc_chainmap)
+        (void)(*cfp->cfc_sysdep->sys_free)(cfp->cfc_chainmap);
+    if (cfp->cfc_lfeatures)
+        (void)(*cfp->cfc_sysdep->sys_free)(cfp->cfc_lfeatures);
+    cfp->cfc_layers    = (void **)NULL;
+    cfp->cfc_chainmap  = (uint64_t *)NULL;
+    cfp->cfc_lfeatures = (uint32_t *)NULL;
+    cfp->cfc_nlayers   = 0;
 }
 
 /*
- * Change file handling for seeking to a particular block.
+ * The layers under a volatile change file: the whole chain, less a top
+ * layer (at toppath) that does not exist yet, and an empty top.
  */
-int
-cf_seek(void *vcp, uint64_t blockno) {
-    int           error = ENXIO;
-    cf_context_t *cfp   = (cf_context_t *)vcp;
-    if (blockno <= cfp->cfc_header.cf_total_blocks) {
-        cfp->cfc_curpos = blockno;
-        error           = 0;
+static int
+cf_volatile_chain(const char *cfpath, const sysdep_dispatch_t *sysdep,
+                  const char *toppath, char **lpathp) {
+    const char *top  = cf_top_path(cfpath);
+    size_t      len  = top - cfpath;
+    int         keep = 0;
+    void *      fh;
+    int         error;
+
+    if (*toppath && ((*sysdep->sys_open)(&fh, toppath, SYSDEP_OPEN_RO) == 0)) {
+        (void)(*sysdep->sys_close)(fh);
+        len  = strlen(cfpath);
+        keep = 1;
+    }
+    if ((error = (*sysdep->sys_malloc)(lpathp, len + 2)) == 0) {
+        memcpy(*lpathp, cfpath, len);
+        if (keep)
+            (*lpathp)[len++] = CF_CHAIN_SEPARATOR;
+        (*lpathp)[len] = '\0';
     }
 
     return error;
 }
 
 /*
- * CRC routine.
+ * Create the locks of a handle.
  */
-static inline uint32_t
-cf_crc32(cf_context_t *cfp, uint32_t crc, unsigned char *buf, uint64_t size) {
-    uint64_t s;
-    uint32_t tmp;
+static int
+cf_locks_init(cf_context_t *cfp) {
+    const sysdep_dispatch_t *sysdep = cfp->cfc_sysdep;
+    int                      error;
+    uint32_t                 si;
 
-    for (s = 0; s < size; s++) {
-        tmp = crc ^ (((uint32_t)buf[s]) & 0x000000ffL);
-        crc = (crc >> 8) ^ cfp->cfc_crc_tab32[tmp & 0xff];
+    if (((error = (*sysdep->sys_lock_init)(&cfp->cfc_lock)) == 0) &&
+        ((error = (*sysdep->sys_lock_init)(&cfp->cfc_dedup_lock)) == 0) &&
+        ((error = (*sysdep->sys_lock_init)(&cfp->cfc_alloc_lock)) == 0)) {
+        for (si = 0; !error && (si < CF_LOCK_STRIPES); si++)
+            error = (*sysdep->sys_lock_init)(&cfp->cfc_stripes[si]);
     }
 
-    return crc;
+    return error;
 }
 
 /*
- * Read the block at the current position.
+ * Release the locks of a handle.
+ */
+static void
+cf_locks_release(cf_context_t *cfp) {
+    const sysdep_dispatch_t *sysdep = cfp->cfc_sysdep;
+    uint32_t                 si;
+
+    if (cfp->cfc_lock)
+        (void)(*sysdep->sys_lock_destroy)(cfp->cfc_lock);
+    if (cfp->cfc_dedup_lock)
+        (void)(*sysdep->sys_lock_destroy)(cfp->cfc_dedup_lock);
+    if (cfp->cfc_alloc_lock)
+        (void)(*sysdep->sys_lock_destroy)(cfp->cfc_alloc_lock);
+    for (si = 0; si < CF_LOCK_STRIPES; si++) {
+        if (cfp->cfc_stripes[si])
+            (void)(*sysdep->sys_lock_destroy)(cfp->cfc_stripes[si]);
+    }
+}
+
+static inline void
+cf_lock(cf_context_t *cfp, void *lock, sysdep_lock_mode_t mode) {
+    (void)(*cfp->cfc_sysdep->sys_lock)(lock, mode);
+}
+
+static inline void
+cf_unlock(cf_context_t *cfp, void *lock) {
+    (void)(*cfp->cfc_sysdep->sys_unlock)(lock);
+}
+
+/*
+ * Initialize change file handling.
+ *
+ * Allocate and initialize change file handle.  For a chain, the top layer
+ * is created if it does not exist yet so that the lower layers are visible
+ * before the first write.  A volatile change file opens no top layer, and
+ * the whole chain, as far as it exists, lies under it.  So does a read-only
+ * one, which creates nothing and refuses writes.  The top layer is locked
+ * shared, and EBUSY returned while another process holds it exclusive.
  */
 int
-cf_readblock(void *vcp, void *buffer) {
+cf_init(const char *cfpath, const sysdep_dispatch_t *sysdep, uint64_t blocksize,
+        uint64_t blockcount, uint32_t features, void **cfpp) {
     int           error = EINVAL;
-    cf_context_t *cfp   = (cf_context_t *)vcp;
+    cf_context_t *cfp   = (cf_context_t *)NULL;
+    char *        vpath = (char *)NULL;
+    const char *  top   = cf_top_path(cfpath);
+
+    if ((error = (*sysdep->sys_malloc)(&cfp, sizeof(*cfp))) == 0) {
+        int i;
+        memset(cfp, 0, sizeof(*cfp));
+        cfp->cfc_sysdep     = sysdep;
+        cfp->cfc_blocksize  = blocksize;
+        cfp->cfc_blockcount = blockcount;
 
-    /*
-     * Check the block map for an offset.
-     */
-    if (cfp->cfc_blockmap[cfp->cfc_curpos]) {
         /*
-         * If present, seek and read the block and trailer.
+         * Open the file(s).
          */
-        if ((error = (*cfp->cfc_sysdep->sys_seek)(
-                 cfp->cfc_fd, cfp->cfc_blockmap[cfp->cfc_curpos],
-                 SYSDEP_SEEK_ABSOLUTE, (uint64_t *)NULL)) == 0) {
-            uint64_t           rsize = cfp->cfc_blocksize;
-            cf_block_trailer_t btrail;
-            uint64_t           nread;
-            if (((error = (*cfp->cfc_sysdep->sys_read)(cfp->cfc_fd, buffer,
-                                                       rsize, &nread)) == 0) &&
-                (nread == rsize)) {
-                rsize = sizeof(cf_block_trailer_t);
-                if (((error = (*cfp->cfc_sysdep->sys_read)(
-                          cfp->cfc_fd, &btrail, rsize, &nread)) == 0) &&
-                    (nread == rsize)) {
-                    /*
-                     * Verify the trailer.
-                     */
-                    if ((btrail.cfb_curblock == cfp->cfc_curpos) &&
-                        (btrail.cfb_magic == CF_MAGIC_3) &&
-                        (btrail.cfb_crc ==
-                         cf_crc32(cfp, 0L, buffer, cfp->cfc_blocksize))) {
-                        error = 0;
+        if (((error = cf_locks_init(cfp)) == 0) &&
+            ((error = cf_chain_copy(sysdep, top, top + strlen(top),
+                                    &cfp->cfc_path)) == 0) &&
+            ((features & (CF_FEATURE_VOLATILE | CF_FEATURE_READONLY))
+                 ? (((error = cf_volatile_chain(cfpath, sysdep, cfp->cfc_path,
+                                                &vpath)) == 0) &&
+                    ((error = cf_chain_open(cfp, vpath)) == 0))
+                 : (((error = cf_chain_open(cfp, cfpath)) == 0) &&
+                    (!cfp->cfc_nlayers ||
+                     ((error = cf_create_file(cfp->cfc_path, sysdep,
+                                              blockcount, features)) == 0)) &&
+                    ((error = (*sysdep->sys_open)(&cfp->cfc_fd, cfp->cfc_path,
+                                                  SYSDEP_OPEN_RW)) == 0) &&
+                    ((error = (*sysdep->sys_flock)(cfp->cfc_fd,
+                                                   SYSDEP_LOCK_SHARED)) ==
+                     0)))) {
+            if (features & (CF_FEATURE_VOLATILE | CF_FEATURE_READONLY))
+                cfp->cfc_flags |= CFC_VOLATILE;
+            if (features & CF_FEATURE_READONLY)
+                cfp->cfc_flags |= CFC_READONLY;
+            /*
+             * Initialize the CRC table.
+             */
+            for (i = 0; i < CRC_TABLE_LEN; i++) {
+                int      j;
+                uint32_t init_crc = (uint32_t)i;
+                for (j = 0; j < CRC_UNIT_BITS; j++) {
+                    init_crc = (init_crc & 0x00000001L)
+                                   ? (init_crc >> 1) ^ 0xEDB88320L
+                                   : (init_crc >> 1);
+                }
+                cfp->cfc_crc_tab32[i] = init_crc;
+            }
+        } else {
+            if (cfp->cfc_fd)
+                (void)(*sysdep->sys_close)(cfp->cfc_fd);
+            cf_chain_close(cfp);
+            cf_locks_release(cfp);
+            if (cfp->cfc_path)
+                (void)(*sysdep->sys_free)(cfp->cfc_path);
+            (void)(*sysdep->sys_free)(cfp);
+            cfp = (cf_context_t *)NULL;
+        }
+    }
+    if (vpath)
+        (void)(*sysdep->sys_free)(vpath);
+    if (!error && cfp)
+        *cfpp = (void *)cfp;
+    return error;
+}
+
+/*
+ * Merge the blockmaps of the lower layers of a chain.
+ *
+ * Each entry of the merged index names the layer and offset of the
+ * uppermost copy of the block, so reads never probe layer by layer.
+ */
+static int
+cf_chain_load(cf_context_t *cfp) {
+    int       error    = 0;
+    uint64_t  nentries = cfp->cfc_header.cf_total_blocks;
+    uint64_t *lbmap    = (uint64_t *)NULL;
+    uint32_t  lidx;
+
+    if (cfp->cfc_nlayers &&
+        ((error = (*cfp->cfc_sysdep->sys_malloc)(
+              &cfp->cfc_chainmap, nentries * sizeof(uint64_t))) == 0) &&
+        ((error = (*cfp->cfc_sysdep->sys_malloc)(
+              &cfp->cfc_lfeatures, cfp->cfc_nlayers * sizeof(uint32_t))) ==
+         0) &&
+        ((error = (*cfp->cfc_sysdep->sys_malloc)(
+              &lbmap, nentries * sizeof(uint64_t))) == 0)) {
+        memset(cfp->cfc_chainmap, 0, nentries * sizeof(uint64_t));
+        for (lidx = 0; !error && (lidx < cfp->cfc_nlayers); lidx++) {
+            void *      lfd = cfp->cfc_layers[lidx];
+            cf_header_t lheader;
+            uint64_t    nread;
+
+            (void)(*cfp->cfc_sysdep->sys_seek)(lfd, 0, SYSDEP_SEEK_ABSOLUTE,
+                                               (uint64_t *)NULL);
+            if (((error = (*cfp->cfc_sysdep->sys_read)(
+                      lfd, &lheader, sizeof(lheader), &nread)) == 0) &&
+                (nread >= CF_HEADER_V1_SIZE)) {
+                /*
+                 * Whatever follows a version 1 header is not header.
+                 */
+                if (lheader.cf_version < CF_VERSION_2)
+                    memset(&lheader.cf_data_end, 0,
+                           sizeof(lheader) - CF_HEADER_V1_SIZE);
+                if ((lheader.cf_magic == CF_MAGIC_1) &&
+                    (lheader.cf_magic2 == CF_MAGIC_2) &&
+                    (lheader.cf_version <= CF_VERSION_2) &&
+                    (nread >= CF_HEADER_SIZE(&lheader)) &&
+                    !(lheader.cf_features & ~CF_FEATURES_KNOWN) &&
+                    ((lheader.cf_total_blocks == cfp->cfc_blockcount) ||
+                     (lheader.cf_total_blocks == (cfp->cfc_blockcount + 1)))) {
+                    uint64_t lentries = (lheader.cf_total_blocks < nentries)
+                                            ? lheader.cf_total_blocks
+                                            : nentries;
+                    uint64_t bi;
+
+                    cfp->cfc_lfeatures[lidx] = lheader.cf_features;
+                    cfp->cfc_features |= lheader.cf_features;
+                    if (((error = (*cfp->cfc_sysdep->sys_seek)(
+                              lfd, lheader.cf_blockmap_offset,
+                              SYSDEP_SEEK_ABSOLUTE, (uint64_t *)NULL)) == 0) &&
+                        ((error = (*cfp->cfc_sysdep->sys_read)(
+                              lfd, lbmap, lentries * sizeof(uint64_t),
+                              &nread)) == 0) &&
+                        (nread == (lentries * sizeof(uint64_t)))) {
+                        for (bi = 0; bi < lentries; bi++) {
+                            if (lbmap[bi] & ~CF_CHAIN_OFFSET_MASK) {
+                                error = EFBIG;
+                                break;
+                            }
+                            if (lbmap[bi])
+                                cfp->cfc_chainmap[bi] =
+                                    CF_CHAIN_ENTRY(lidx, lbmap[bi]);
+                        }
                     } else {
-                        error = ESRCH;
+                        if (error == 0)
+                            error = EIO;
                     }
                 } else {
-                    if (!error)
-                        error = EIO;
+                    error = ENODEV;
                 }
             } else {
-                if (!error)
+                if (error == 0)
                     error = EIO;
             }
         }
-    } else {
-        error = ENXIO;
     }
+    if (lbmap)
+        (void)(*cfp->cfc_sysdep->sys_free)(lbmap);
 
     return error;
 }
 
 /*
- * Is the current block in use?
+ * Make sure that storage is preallocated for nbytes past the logical end of
+ * the data.  Growing in large extents keeps the change file from fragmenting
+ * and saves the filesystem from updating its metadata on every append.
  */
-int
-cf_blockused(void *vcp) {
-    cf_context_t *cfp = (cf_context_t *)vcp;
+static void
+cf_preallocate(cf_context_t *cfp, uint64_t nbytes) {
+    uint64_t need = cfp->cfc_header.cf_data_end + nbytes;
+    uint64_t extent, start;
+    int      error;
+
+    if (!(cfp->cfc_flags & CFC_NO_PREALLOC) && (need > cfp->cfc_alloc_end)) {
+        extent = cfp->cfc_header.cf_data_end >> 3;
+        start  = (cfp->cfc_alloc_end > cfp->cfc_header.cf_data_end)
+                     ? cfp->cfc_alloc_end
+                     : cfp->cfc_header.cf_data_end;
+        if (extent < CF_PREALLOC_MIN)
+            extent = CF_PREALLOC_MIN;
+        if (extent > CF_PREALLOC_MAX)
+            extent = CF_PREALLOC_MAX;
+        extent >>= cfp->cfc_alloc_fails;
+        error = (*cfp->cfc_sysdep->sys_allocate)(cfp->cfc_fd, start,
+                                                 need + extent - start);
+        if (error == 0) {
+            cfp->cfc_alloc_end = need + extent;
+        } else if ((error == EOPNOTSUPP) || (error == ENOSYS) ||
+                   (++cfp->cfc_alloc_fails >= CF_PREALLOC_TRIES)) {
+            /*
+             * Not supported here, or space is too short for it to be worth
+             * asking again.  Plain appends it is.
+             */
+            cfp->cfc_flags |= CFC_NO_PREALLOC;
+        }
+        /*
+         * Otherwise (no space, say), the append goes ahead unallocated
+         * and the next one asks for less.
+         */
+    }
+}
+
+/*
+ * Dedup table handling.
+ *
+ * The entries are indexed in memory by content hash and by record offset
+ * (open addressing, linear probing).  Only referenced records are in the
+ * hash index.  A record that loses its last reference is reused for new
+ * contents, but not before the on-disk blockmap has stopped referring to it,
+ * i.e. not before the next sync.
+ */
+#define CF_DEDUP_MIX(_o) (((_o)*0x9e3779b97f4a7c15ULL) >> 17)
+
+static uint32_t *
+cf_dedup_hash_slot(cf_dedup_table_t *dtp, const uint64_t *hash) {
+    uint64_t mask = dtp->cdt_nslots - 1;
+    uint64_t slot = hash[0] & mask;
+
+    while (dtp->cdt_byhash[slot]) {
+        cf_dedup_entry_t *dep = &dtp->cdt_entries[dtp->cdt_byhash[slot] - 1];
+
+        if ((dep->cfd_hash[0] == hash[0]) && (dep->cfd_hash[1] == hash[1]))
+            break;
+        slot = (slot + 1) & mask;
+    }
+    return &dtp->cdt_byhash[slot];
+}
+
+static uint32_t *
+cf_dedup_offset_slot(cf_dedup_table_t *dtp, uint64_t offset) {
+    uint64_t mask = dtp->cdt_nslots - 1;
+    uint64_t slot = CF_DEDUP_MIX(offset) & mask;
 
-    return (cfp->cfc_blockmap[cfp->cfc_curpos]) ? 1 : 0;
+    while (dtp->cdt_byoffset[slot] &&
+           (dtp->cdt_entries[dtp->cdt_byoffset[slot] - 1].cfd_offset != offset))
+        slot = (slot + 1) & mask;
+    return &dtp->cdt_byoffset[slot];
 }
 
 /*
- * Write block at current location.
+ * Remove a hash index slot, moving later members of its probe run back so
+ * that lookups do not stop short at the hole.
  */
-int
-cf_writeblock(void *vcp, void *buffer) {
-    int           error   = EROFS;
-    cf_context_t *cfp     = (cf_context_t *)vcp;
-    uint64_t      nbloffs = cfp->cfc_blockmap[cfp->cfc_curpos];
-    uint64_t      curpos;
+static void
+cf_dedup_unhash(cf_dedup_table_t *dtp, uint32_t *slotp) {
+    uint64_t mask = dtp->cdt_nslots - 1;
+    uint64_t hole = slotp - dtp->cdt_byhash;
+    uint64_t slot;
 
-    if ((error = (*cfp->cfc_sysdep->sys_seek)(
-             cfp->cfc_fd, nbloffs,
-             (nbloffs) ? SYSDEP_SEEK_ABSOLUTE : SYSDEP_SEEK_END, &curpos)) ==
-        0) {
-        cf_block_trailer_t btrail = {
-            cfp->cfc_curpos, cf_crc32(cfp, 0, buffer, cfp->cfc_blocksize),
-            CF_MAGIC_3};
-        uint64_t nwritten;
-        if (((error = (*cfp->cfc_sysdep->sys_write)(
-                  cfp->cfc_fd, buffer, cfp->cfc_blocksize, &nwritten)) == 0) &&
-            (nwritten == cfp->cfc_blocksize) &&
-            ((error = (*cfp->cfc_sysdep->sys_write)(
-                  cfp->cfc_fd, &btrail, sizeof(btrail), &nwritten)) == 0) &&
-            (nwritten == sizeof(btrail))) {
-            /*
-             * Write success.
-             */
-            if (!nbloffs) {
-                /*
-                 * We made a new block.
-                 */
-                cfp->cfc_blockmap[cfp->cfc_curpos] = curpos;
-                cfp->cfc_header.cf_used_blocks++;
-                cfp->cfc_header.cf_flags |= CF_HEADER_DIRTY;
-            }
+    for (slot = (hole + 1) & mask; dtp->cdt_byhash[slot];
+         slot = (slot + 1) & mask) {
+        uint64_t home =
+            dtp->cdt_entries[dtp->cdt_byhash[slot] - 1].cfd_hash[0] & mask;
+
+        if (((slot - home) & mask) >= ((slot - hole) & mask)) {
+            dtp->cdt_byhash[hole] = dtp->cdt_byhash[slot];
+            hole                  = slot;
         }
     }
+    dtp->cdt_byhash[hole] = 0;
+}
+
+/*
+ * Rebuild both indices from the entries.
+ */
+static void
+cf_dedup_index(cf_dedup_table_t *dtp) {
+    uint32_t ei;
+
+    memset(dtp->cdt_byhash, 0, dtp->cdt_nslots * sizeof(uint32_t));
+    memset(dtp->cdt_byoffset, 0, dtp->cdt_nslots * sizeof(uint32_t));
+    for (ei = 0; ei < dtp->cdt_count; ei++) {
+        cf_dedup_entry_t *dep = &dtp->cdt_entries[ei];
+        uint32_t *        hslot;
+
+        *cf_dedup_offset_slot(dtp, dep->cfd_offset) = ei + 1;
+        if (dep->cfd_refs && !*(hslot = cf_dedup_hash_slot(dtp, dep->cfd_hash)))
+            *hslot = ei + 1;
+    }
+}
+
+static void
+cf_dedup_release(const sysdep_dispatch_t *sysdep, cf_dedup_table_t *dtp) {
+    if (dtp->cdt_entries)
+        (void)(*sysdep->sys_free)(dtp->cdt_entries);
+    if (dtp->cdt_byhash)
+        (void)(*sysdep->sys_free)(dtp->cdt_byhash);
+    if (dtp->cdt_byoffset)
+        (void)(*sysdep->sys_free)(dtp->cdt_byoffset);
+    if (dtp->cdt_free)
+        (void)(*sysdep->sys_free)(dtp->cdt_free);
+    if (dtp->cdt_pending)
+        (void)(*sysdep->sys_free)(dtp->cdt_pending);
+}
+
+/*
+ * Resize the dedup table to hold capacity entries.
+ */
+static int
+cf_dedup_resize(cf_context_t *cfp, uint64_t capacity) {
+    const sysdep_dispatch_t *sysdep = cfp->cfc_sysdep;
+    cf_dedup_table_t *       dtp    = cfp->cfc_dedup;
+    cf_dedup_table_t         ntab   = *dtp;
+    int                      error;
+
+    if (capacity > 0x80000000ULL)
+        return ENOSPC;
+    ntab.cdt_entries  = (cf_dedup_entry_t *)NULL;
+    ntab.cdt_byhash   = (uint32_t *)NULL;
+    ntab.cdt_byoffset = (uint32_t *)NULL;
+    ntab.cdt_free     = (uint32_t *)NULL;
+    ntab.cdt_pending  = (uint32_t *)NULL;
+    ntab.cdt_capacity = capacity;
+    ntab.cdt_nslots   = 2 * capacity;
+    if (((error = (*sysdep->sys_malloc)(
+              &ntab.cdt_entries, capacity * sizeof(cf_dedup_entry_t))) == 0) &&
+        ((error = (*sysdep->sys_malloc)(
+              &ntab.cdt_byhash, ntab.cdt_nslots * sizeof(uint32_t))) == 0) &&
+        ((error = (*sysdep->sys_malloc)(
+              &ntab.cdt_byoffset, ntab.cdt_nslots * sizeof(uint32_t))) == 0) &&
+        ((error = (*sysdep->sys_malloc)(&ntab.cdt_free,
+                                        capacity * sizeof(uint32_t))) == 0) &&
+        ((error = (*sysdep->sys_malloc)(&ntab.cdt_pending,
+                                        capacity * sizeof(uint32_t))) == 0)) {
+        if (dtp->cdt_entries) {
+            memcpy(ntab.cdt_entries, dtp->cdt_entries,
+                   dtp->cdt_count * sizeof(cf_dedup_entry_t));
+            memcpy(ntab.cdt_free, dtp->cdt_free,
+                   dtp->cdt_nfree * sizeof(uint32_t));
+            memcpy(ntab.cdt_pending, dtp->cdt_pending,
+                   dtp->cdt_npending * sizeof(uint32_t));
+        }
+        cf_dedup_index(&ntab);
+        cf_dedup_release(sysdep, dtp);
+        *dtp = ntab;
+    } else {
+        cf_dedup_release(sysdep, &ntab);
+    }
+
+    return error;
+}
+
+/*
+ * Load the dedup table.
+ *
+ * Reference counts are recounted from the blockmap rather than trusted, as
+ * the table is written before the blockmap it goes with.
+ */
+static int
+cf_dedup_load(cf_context_t *cfp) {
+    int      error;
+    uint32_t count = cfp->cfc_header.cf_dedup_count;
+
+    if ((error = (*cfp->cfc_sysdep->sys_malloc)(&cfp->cfc_dedup,
+                                                sizeof(cf_dedup_table_t))) ==
+        0) {
+        cf_dedup_table_t *dtp = cfp->cfc_dedup;
+
+        memset(dtp, 0, sizeof(*dtp));
+        if (((error = cf_dedup_resize(cfp, CF_DEDUP_CAPACITY(count))) == 0) &&
+            count) {
+            uint64_t tsize = count * sizeof(cf_dedup_entry_t);
+            uint64_t nread;
+            uint64_t bi;
+            uint32_t ei;
+
+            if (((error = (*cfp->cfc_sysdep->sys_seek)(
+                      cfp->cfc_fd, cfp->cfc_header.cf_dedup_offset,
+                      SYSDEP_SEEK_ABSOLUTE, (uint64_t *)NULL)) == 0) &&
+                ((error = (*cfp->cfc_sysdep->sys_read)(
+                      cfp->cfc_fd, dtp->cdt_entries, tsize, &nread)) == 0) &&
+                (nread == tsize)) {
+                dtp->cdt_count  = count;
+                dtp->cdt_ondisk = CF_DEDUP_CAPACITY(count);
+                for (ei = 0; ei < count; ei++)
+                    dtp->cdt_entries[ei].cfd_refs = 0;
+                cf_dedup_index(dtp);
+                for (bi = 0; bi < cfp->cfc_header.cf_total_blocks; bi++) {
+                    uint32_t *oslot;
+
+                    if (cfp->cfc_blockmap[bi] &&
+                        *(oslot = cf_dedup_offset_slot(dtp,
+                                                       cfp->cfc_blockmap[bi])))
+                        dtp->cdt_entries[*oslot - 1].cfd_refs++;
+                }
+                cf_dedup_index(dtp);
+                for (ei = 0; ei < count; ei++) {
+                    if (!dtp->cdt_entries[ei].cfd_refs)
+                        dtp->cdt_free[dtp->cdt_nfree++] = ei;
+                }
+            } else {
+                if (error == 0)
+                    error = EIO;
+            }
+        }
+    }
+
+    return error;
+}
+
+/*
+ * Write the dedup table, moving it to the end of the data if it no longer
+ * fits where it is.
+ */
+static int
+cf_dedup_sync(cf_context_t *cfp) {
+    int               error;
+    cf_dedup_table_t *dtp   = cfp->cfc_dedup;
+    uint64_t          tsize = dtp->cdt_count * sizeof(cf_dedup_entry_t);
+    uint64_t          nwritten;
+
+    if (!cfp->cfc_header.cf_dedup_offset ||
+        (dtp->cdt_count > dtp->cdt_ondisk)) {
+        uint64_t rsize = dtp->cdt_capacity * sizeof(cf_dedup_entry_t);
+
+        cf_preallocate(cfp, rsize);
+        cfp->cfc_header.cf_dedup_offset = cfp->cfc_header.cf_data_end;
+        cfp->cfc_header.cf_data_end += rsize;
+        dtp->cdt_ondisk = dtp->cdt_capacity;
+    }
+    if (((error = (*cfp->cfc_sysdep->sys_seek)(
+              cfp->cfc_fd, cfp->cfc_header.cf_dedup_offset,
+              SYSDEP_SEEK_ABSOLUTE, (uint64_t *)NULL)) == 0) &&
+        ((error = (*cfp->cfc_sysdep->sys_write)(cfp->cfc_fd, dtp->cdt_entries,
+                                                tsize, &nwritten)) == 0) &&
+        (nwritten == tsize)) {
+        cfp->cfc_header.cf_dedup_count = dtp->cdt_count;
+    } else {
+        if (error == 0)
+            error = EIO;
+    }
+
+    return error;
+}
+
+/*
+ * Load the generation map.
+ */
+static int
+cf_genmap_load(cf_context_t *cfp) {
+    int      error;
+    uint64_t gsize = cfp->cfc_header.cf_total_blocks * sizeof(uint32_t);
+    uint64_t nread;
+
+    if (((error = (*cfp->cfc_sysdep->sys_malloc)(&cfp->cfc_genmap, gsize)) ==
+         0) &&
+        ((error = (*cfp->cfc_sysdep->sys_seek)(
+              cfp->cfc_fd, CF_GENMAP_OFFSET(&cfp->cfc_header),
+              SYSDEP_SEEK_ABSOLUTE, (uint64_t *)NULL)) == 0) &&
+        ((error = (*cfp->cfc_sysdep->sys_read)(cfp->cfc_fd, cfp->cfc_genmap,
+                                               gsize, &nread)) == 0) &&
+        (nread != gsize)) {
+        error = EIO;
+    }
+
+    return error;
+}
+
+/*
+ * Bytes of blocks that each volatile change file keeps in memory.
+ */
+static uint64_t cf_volatile_memory = UINT64_MAX;
+
+/*
+ * Limit the memory that each volatile change file keeps blocks in (by
+ * default there is no limit).  The blocks past it go to an unlinked file
+ * next to where its top layer would be.
+ */
+void
+cf_volatile_limit(uint64_t nbytes) {
+    cf_volatile_memory = nbytes;
+}
+
+/*
+ * Find the index slot of a block, or the empty one where it would go.
+ */
+static cf_volatile_entry_t *
+cf_volatile_slot(cf_volatile_table_t *vtp, uint64_t blockno) {
+    uint64_t mask = vtp->cvt_nslots - 1;
+    uint64_t slot = CF_DEDUP_MIX(blockno) & mask;
+
+    while (vtp->cvt_entries[slot].cve_block &&
+           (vtp->cvt_entries[slot].cve_block != blockno + 1))
+        slot = (slot + 1) & mask;
+    return &vtp->cvt_entries[slot];
+}
+
+/*
+ * The entry of a block in a volatile change file.
+ */
+static uint64_t
+cf_volatile_entry(cf_context_t *cfp, uint64_t blockno) {
+    uint64_t data;
+
+    cf_lock(cfp, cfp->cfc_alloc_lock, SYSDEP_LOCK_SHARED);
+    data = cf_volatile_slot(cfp->cfc_volatile, blockno)->cve_data;
+    cf_unlock(cfp, cfp->cfc_alloc_lock);
+    return data;
+}
+
+/*
+ * The entry of a block in the top layer: the offset of its record,
+ * CF_ZERO_RECORD or 0 if it has none.  Zeroed blocks of a change file on
+ * disk may have CF_ZERO_RECORD or'd into the record they kept; volatile
+ * entries are not offsets and are never marked that way.
+ */
+static inline uint64_t
+cf_top_entry(cf_context_t *cfp, uint64_t blockno) {
+    return (cfp->cfc_volatile) ? cf_volatile_entry(cfp, blockno)
+                               : cfp->cfc_blockmap[blockno];
+}
+
+/*
+ * Free the index and memory of a volatile change file.
+ */
+static void
+cf_volatile_release(const sysdep_dispatch_t *sysdep,
+                    cf_volatile_table_t *    vtp) {
+    uint64_t ci;
+
+    for (ci = 0; ci < vtp->cvt_nchunks; ci++)
+        (void)(*sysdep->sys_free)(vtp->cvt_chunks[ci]);
+    if (vtp->cvt_chunks)
+        (void)(*sysdep->sys_free)(vtp->cvt_chunks);
+    if (vtp->cvt_entries)
+        (void)(*sysdep->sys_free)(vtp->cvt_entries);
+    if (vtp->cvt_free)
+        (void)(*sysdep->sys_free)(vtp->cvt_free);
+}
+
+/*
+ * Empty a volatile change file.  Its spill file is kept, but truncated.
+ */
+static int
+cf_volatile_empty(cf_context_t *cfp) {
+    const sysdep_dispatch_t *sysdep = cfp->cfc_sysdep;
+    cf_volatile_table_t *    vtp    = cfp->cfc_volatile;
+    cf_volatile_entry_t *    entries;
+    void *                   spill = vtp->cvt_spill;
+    int                      error;
+
+    if ((error = (*sysdep->sys_malloc)(
+             &entries, CF_VOLATILE_MIN_SLOTS * sizeof(*entries))) == 0) {
+        memset(entries, 0, CF_VOLATILE_MIN_SLOTS * sizeof(*entries));
+        cf_volatile_release(sysdep, vtp);
+        if (spill)
+            (void)(*sysdep->sys_truncate)(spill, 0);
+        memset(vtp, 0, sizeof(*vtp));
+        vtp->cvt_entries               = entries;
+        vtp->cvt_nslots                = CF_VOLATILE_MIN_SLOTS;
+        vtp->cvt_spill                 = spill;
+        cfp->cfc_header.cf_used_blocks = 0;
+    }
+
+    return error;
+}
+
+/*
+ * Double the index of a volatile change file.
+ */
+static int
+cf_volatile_grow(cf_context_t *cfp) {
+    const sysdep_dispatch_t *sysdep   = cfp->cfc_sysdep;
+    cf_volatile_table_t *    vtp      = cfp->cfc_volatile;
+    cf_volatile_entry_t *    oentries = vtp->cvt_entries;
+    uint64_t                 onslots  = vtp->cvt_nslots;
+    uint64_t                 si;
+    int                      error;
+
+    if ((error = (*sysdep->sys_malloc)(
+             &vtp->cvt_entries, 2 * onslots * sizeof(*oentries))) == 0) {
+        memset(vtp->cvt_entries, 0, 2 * onslots * sizeof(*oentries));
+        vtp->cvt_nslots = 2 * onslots;
+        for (si = 0; si < onslots; si++) {
+            if (oentries[si].cve_block)
+                *cf_volatile_slot(vtp, oentries[si].cve_block - 1) =
+                    oentries[si];
+        }
+        (void)(*sysdep->sys_free)(oentries);
+    } else {
+        vtp->cvt_entries = oentries;
+    }
+
+    return error;
+}
+
+/*
+ * Find room for the data of a block: the room of a block that was zeroed
+ * again, memory while there is less than the limit of it, or else the
+ * spill file.  Called with cfc_alloc_lock held exclusive.
+ */
+static int
+cf_volatile_alloc(cf_context_t *cfp, uint64_t *datap) {
+    const sysdep_dispatch_t *sysdep    = cfp->cfc_sysdep;
+    cf_volatile_table_t *    vtp       = cfp->cfc_volatile;
+    uint64_t                 chunksize = CF_VOLATILE_CHUNK * cfp->cfc_blocksize;
+    int                      error     = 0;
+
+    if (vtp->cvt_nfree) {
+        *datap = vtp->cvt_free[--vtp->cvt_nfree];
+    } else if ((vtp->cvt_nmemory % CF_VOLATILE_CHUNK) ||
+               ((vtp->cvt_nchunks + 1) * chunksize <= cf_volatile_memory)) {
+        if (!(vtp->cvt_nmemory % CF_VOLATILE_CHUNK)) {
+            if (vtp->cvt_nchunks == vtp->cvt_chunkcap) {
+                uint64_t ncap = (vtp->cvt_chunkcap) ? 2 * vtp->cvt_chunkcap
+                                                    : 16;
+                char **  chunks;
+
+                if ((error = (*sysdep->sys_malloc)(
+                         &chunks, ncap * sizeof(*chunks))) == 0) {
+                    if (vtp->cvt_chunks) {
+                        memcpy(chunks, vtp->cvt_chunks,
+                               vtp->cvt_nchunks * sizeof(*chunks));
+                        (void)(*sysdep->sys_free)(vtp->cvt_chunks);
+                    }
+                    vtp->cvt_chunks   = chunks;
+                    vtp->cvt_chunkcap = ncap;
+                }
+            }
+            if (!error &&
+                ((error = (*sysdep->sys_malloc)(
+                      &vtp->cvt_chunks[vtp->cvt_nchunks], chunksize)) == 0))
+                vtp->cvt_nchunks++;
+        }
+        if (!error)
+            *datap = CF_VOLATILE_MEMORY + vtp->cvt_nmemory++;
+    } else if (vtp->cvt_spill ||
+               ((error = (*sysdep->sys_open)(&vtp->cvt_spill, cfp->cfc_path,
+                                             SYSDEP_TEMPORARY)) == 0)) {
+        *datap = CF_VOLATILE_SPILLED | vtp->cvt_nspill++;
+    }
+
+    return error;
+}
+
+/*
+ * Keep the room of a block's data for another one.  Should the list not
+ * grow, the room is not used again.
+ */
+static void
+cf_volatile_free(cf_context_t *cfp, uint64_t data) {
+    cf_volatile_table_t *vtp = cfp->cfc_volatile;
+
+    if (vtp->cvt_nfree == vtp->cvt_freecap) {
+        uint64_t  ncap = (vtp->cvt_freecap) ? 2 * vtp->cvt_freecap : 64;
+        uint64_t *nfree;
+
+        if ((*cfp->cfc_sysdep->sys_malloc)(&nfree, ncap * sizeof(*nfree)))
+            return;
+        if (vtp->cvt_free) {
+            memcpy(nfree, vtp->cvt_free, vtp->cvt_nfree * sizeof(*nfree));
+            (void)(*cfp->cfc_sysdep->sys_free)(vtp->cvt_free);
+        }
+        vtp->cvt_free    = nfree;
+        vtp->cvt_freecap = ncap;
+    }
+    vtp->cvt_free[vtp->cvt_nfree++] = data;
+}
+
+/*
+ * Point the entry of a block at its data, or mark it as zeros.  Data it
+ * had before is freed.  Called with cfc_alloc_lock held exclusive.
+ */
+static int
+cf_volatile_set(cf_context_t *cfp, uint64_t blockno, uint64_t data) {
+    cf_volatile_table_t *vtp = cfp->cfc_volatile;
+    cf_volatile_entry_t *vep = cf_volatile_slot(vtp, blockno);
+    int                  error;
+
+    if (!vep->cve_block) {
+        if (4 * (vtp->cvt_count + 1) > 3 * vtp->cvt_nslots) {
+            if ((error = cf_volatile_grow(cfp)) != 0)
+                return error;
+            vep = cf_volatile_slot(vtp, blockno);
+        }
+        vep->cve_block                 = blockno + 1;
+        cfp->cfc_header.cf_used_blocks = ++vtp->cvt_count;
+    } else if (vep->cve_data != CF_ZERO_RECORD) {
+        cf_volatile_free(cfp, vep->cve_data);
+    }
+    vep->cve_data = data;
+
+    return 0;
+}
+
+/*
+ * Copy the data of a block in or out of a volatile change file.  Called
+ * with the block's stripe locked.
+ */
+static int
+cf_volatile_copy(cf_context_t *cfp, uint64_t data, void *buffer, int out) {
+    cf_volatile_table_t *vtp   = cfp->cfc_volatile;
+    uint64_t             bsize = cfp->cfc_blocksize;
+    int                  error = 0;
+
+    if (data == CF_ZERO_RECORD) {
+        memset(buffer, 0, bsize);
+    } else if (data & CF_VOLATILE_SPILLED) {
+        uint64_t offset = (data & ~CF_VOLATILE_SPILLED) * bsize;
+        uint64_t ndone;
+
+        error = (out) ? (*cfp->cfc_sysdep->sys_pread)(vtp->cvt_spill, buffer,
+                                                      bsize, offset, &ndone)
+                      : (*cfp->cfc_sysdep->sys_pwrite)(vtp->cvt_spill, buffer,
+                                                       bsize, offset, &ndone);
+        if (!error && (ndone != bsize))
+            error = EIO;
+    } else {
+        uint64_t mi = data - CF_VOLATILE_MEMORY;
+        char *   mp;
+
+        cf_lock(cfp, cfp->cfc_alloc_lock, SYSDEP_LOCK_SHARED);
+        mp = vtp->cvt_chunks[mi / CF_VOLATILE_CHUNK] +
+             ((mi % CF_VOLATILE_CHUNK) * bsize);
+        cf_unlock(cfp, cfp->cfc_alloc_lock);
+        if (out)
+            memcpy(buffer, mp, bsize);
+        else
+            memcpy(mp, buffer, bsize);
+    }
+
+    return error;
+}
+
+/*
+ * Write a block to a volatile change file.  Data it already has is
+ * overwritten where it is.
+ */
+static int
+cf_volatile_write(cf_context_t *cfp, uint64_t blockno, void *buffer) {
+    uint64_t data;
+    int      error = 0;
+
+    cf_lock(cfp, cfp->cfc_lock, SYSDEP_LOCK_SHARED);
+    cf_lock(cfp, CF_STRIPE(cfp, blockno), SYSDEP_LOCK_EXCLUSIVE);
+    data = cf_volatile_entry(cfp, blockno);
+    if (!data || (data == CF_ZERO_RECORD)) {
+        cf_lock(cfp, cfp->cfc_alloc_lock, SYSDEP_LOCK_EXCLUSIVE);
+        if (((error = cf_volatile_alloc(cfp, &data)) == 0) &&
+            ((error = cf_volatile_set(cfp, blockno, data)) != 0))
+            cf_volatile_free(cfp, data);
+        cf_unlock(cfp, cfp->cfc_alloc_lock);
+    }
+    if (!error)
+        error = cf_volatile_copy(cfp, data, buffer, 0);
+    cf_unlock(cfp, CF_STRIPE(cfp, blockno));
+    cf_unlock(cfp, cfp->cfc_lock);
+
+    return error;
+}
+
+/*
+ * Set up the scratch buffers of a change file that has compressed records
+ * in any of its layers.
+ */
+static int
+cf_zbufs_init(cf_context_t *cfp) {
+    if (!(cfp->cfc_features & CF_FEATURE_COMPRESS))
+        return 0;
+    return (*cfp->cfc_sysdep->sys_malloc)(
+        &cfp->cfc_zbufs, CF_LOCK_STRIPES * CF_ZBUF_SIZE(cfp));
+}
+
+/*
+ * Set up a volatile change file: a header that no file has, the merged
+ * index of the layers under it and an empty index of its own.
+ */
+static int
+cf_volatile_verify(cf_context_t *cfp) {
+    int error;
+
+    memset(&cfp->cfc_header, 0, sizeof(cfp->cfc_header));
+    cfp->cfc_header.cf_magic        = CF_MAGIC_1;
+    cfp->cfc_header.cf_version      = CF_VERSION_2;
+    cfp->cfc_header.cf_total_blocks = cfp->cfc_blockcount;
+    cfp->cfc_header.cf_magic2       = CF_MAGIC_2;
+    cfp->cfc_header.cf_features     = CF_FEATURE_ZERO;
+    cfp->cfc_header.cf_generation   = CF_GENERATION_INITIAL;
+    cfp->cfc_features               = cfp->cfc_header.cf_features;
+    if (((error = cf_chain_load(cfp)) == 0) &&
+        ((error = cf_zbufs_init(cfp)) == 0) &&
+        ((error = (*cfp->cfc_sysdep->sys_malloc)(
+              &cfp->cfc_volatile, sizeof(*cfp->cfc_volatile))) == 0)) {
+        memset(cfp->cfc_volatile, 0, sizeof(*cfp->cfc_volatile));
+        if ((error = cf_volatile_empty(cfp)) != 0) {
+            (void)(*cfp->cfc_sysdep->sys_free)(cfp->cfc_volatile);
+            cfp->cfc_volatile = (cf_volatile_table_t *)NULL;
+        }
+    }
+    if (cfp->cfc_features & CF_FEATURE_DEDUP)
+        cfp->cfc_flags |= CFC_SHARED_BLOCKS;
+
+    return error;
+}
+
+/*
+ * Verify the change file.
+ *
+ * - Load the blockmap.
+ * - Find the logical end of the block data.
+ * - Load the generation map and dedup table, if there are any.
+ */
+int
+cf_verify(void *vcp) {
+    int           error = EINVAL;
+    cf_context_t *cfp   = (cf_context_t *)vcp;
+    uint64_t      nread;
+
+    if (cfp->cfc_flags & CFC_VOLATILE)
+        return cf_volatile_verify(cfp);
+    /*
+     * Make sure we're at the beginning of the file.
+     */
+    (void)(*cfp->cfc_sysdep->sys_seek)(cfp->cfc_fd, 0, SYSDEP_SEEK_ABSOLUTE,
+                                       (uint64_t *)NULL);
+    memset(&cfp->cfc_header, 0, sizeof(cfp->cfc_header));
+    if (((error = (*cfp->cfc_sysdep->sys_read)(cfp->cfc_fd, &cfp->cfc_header,
+                                               CF_HEADER_V1_SIZE, &nread)) ==
+         0) &&
+        (nread == CF_HEADER_V1_SIZE)) {
+        /*
+         * Verify read header.
+         */
+        if ((cfp->cfc_header.cf_magic == CF_MAGIC_1) &&
+            (cfp->cfc_header.cf_magic2 == CF_MAGIC_2) &&
+            (cfp->cfc_header.cf_version <= CF_VERSION_2) &&
+            /* [2013-12] ntfs chicanery could have added the trailing block */
+            ((cfp->cfc_header.cf_total_blocks == cfp->cfc_blockcount) ||
+             (cfp->cfc_header.cf_total_blocks == (cfp->cfc_blockcount + 1)))) {
+            uint64_t bhsize =
+                cfp->cfc_header.cf_total_blocks * sizeof(*cfp->cfc_blockmap);
+            uint64_t xsize = CF_HEADER_SIZE(&cfp->cfc_header) - nread;
+
+            /*
+             * Version 2 headers record where the block data ends.  Version
+             * 1 files simply end there.
+             */
+            if (xsize) {
+                if (((error = (*cfp->cfc_sysdep->sys_read)(
+                          cfp->cfc_fd, &cfp->cfc_header.cf_data_end, xsize,
+                          &nread)) == 0) &&
+                    (nread != xsize)) {
+                    error = EIO;
+                }
+                if (!error &&
+                    (cfp->cfc_header.cf_features & ~CF_FEATURES_KNOWN)) {
+                    error = ENODEV;
+                }
+            } else {
+                error = (*cfp->cfc_sysdep->sys_file_size)(
+                    cfp->cfc_fd, &cfp->cfc_header.cf_data_end);
+            }
+            cfp->cfc_alloc_end = cfp->cfc_header.cf_data_end;
+            /*
+             * Allocate, find and read the blockmap.
+             */
+            if (!error &&
+                ((error = (*cfp->cfc_sysdep->sys_malloc)(&cfp->cfc_blockmap,
+                                                         bhsize)) == 0)) {
+                if ((error = (*cfp->cfc_sysdep->sys_seek)(
+                         cfp->cfc_fd, cfp->cfc_header.cf_blockmap_offset,
+                         SYSDEP_SEEK_ABSOLUTE, (uint64_t *)NULL)) == 0) {
+                    if (((error = (*cfp->cfc_sysdep->sys_read)(
+                              cfp->cfc_fd, cfp->cfc_blockmap, bhsize,
+                              &nread)) == 0) &&
+                        (nread == bhsize)) {
+                        cfp->cfc_features = cfp->cfc_header.cf_features;
+                        if (cfp->cfc_header.cf_features &
+                            CF_FEATURE_GENERATIONS)
+                            error = cf_genmap_load(cfp);
+                        if (!error && ((error = cf_chain_load(cfp)) == 0) &&
+                            (cfp->cfc_header.cf_features & CF_FEATURE_DEDUP))
+                            error = cf_dedup_load(cfp);
+                        if (!error)
+                            error = cf_zbufs_init(cfp);
+                        if (cfp->cfc_features & CF_FEATURE_DEDUP)
+                            cfp->cfc_flags |= CFC_SHARED_BLOCKS;
+                    } else {
+                        if (error == 0)
+                            error = EIO;
+                    }
+                }
+            }
+        } else {
+            error = ENODEV;
+        }
+    } else {
+        if (error == 0) {
+            /* Implies rsize != CF_HEADER_V1_SIZE */
+            error = EIO;
+        }
+    }
+
+    return error;
+}
+
+/*
+ * Create change file if necessary.  A volatile or read-only one needs no
+ * file.
+ */
+int
+cf_create(const char *cfpath, const sysdep_dispatch_t *sysdep,
+          uint64_t blocksize, uint64_t blockcount, uint32_t features,
+          void **cfpp) {
+    const char *top = cf_top_path(cfpath);
+    char *      toppath;
+    int         error = 0;
+
+    if (!(features & (CF_FEATURE_VOLATILE | CF_FEATURE_READONLY)) &&
+        ((error = cf_chain_copy(sysdep, top, top + strlen(top), &toppath)) ==
+         0)) {
+        error = cf_create_file(toppath, sysdep, blockcount, features);
+        (void)(*sysdep->sys_free)(toppath);
+    }
+    if (!error) {
+        /*
+         * If we are successful thus far, then we have a
+         * candidate change file.
+         */
+        if ((error = cf_init(cfpath, sysdep, blocksize, blockcount, features,
+                             cfpp)) == 0) {
+            error = cf_verify(*cfpp);
+        }
+    }
+
+    return error;
+}
+
+/*
+ * Check that every layer of a change file path list exists.  Opening one
+ * read-only makes nothing, so a tool that only reads would otherwise take
+ * a misspelt path for an empty change file.
+ */
+int
+cf_exists(const char *cfpath, const sysdep_dispatch_t *sysdep) {
+    int         error;
+    const char *cp = cfpath;
+    const char *ep;
+    char *      lpath;
+    void *      fh;
+
+    do {
+        ep = cf_chain_next(cp);
+        if ((error = cf_chain_copy(sysdep, cp, ep, &lpath)) == 0) {
+            if ((error = (*sysdep->sys_open)(&fh, lpath, SYSDEP_OPEN_RO)) == 0)
+                (void)(*sysdep->sys_close)(fh);
+            (void)(*sysdep->sys_free)(lpath);
+        }
+        cp = ep + 1;
+    } while (!error && *ep);
+
+    return error;
+}
+
+/*
+ * Sync change file changes to image, with the handle locked.
+ */
+static int
+cf_sync_locked(cf_context_t *cfp) {
+    int         error = EROFS;
+    cf_header_t oheader;
+    uint64_t      nwritten;
+
+    /*
+     * The dedup table goes first as it may move, which changes the header.
+     */
+    if (cfp->cfc_dedup && ((error = cf_dedup_sync(cfp)) != 0))
+        return error;
+    oheader = cfp->cfc_header;
+    oheader.cf_flags &= ~CF_HEADER_DIRTY;
+    /*
+     * Seek and write the sanitized header and block map.
+     */
+    if (((error = (*cfp->cfc_sysdep->sys_seek)(
+              cfp->cfc_fd, 0, SYSDEP_SEEK_ABSOLUTE, (uint64_t *)NULL)) == 0) &&
+        ((error = (*cfp->cfc_sysdep->sys_write)(
+              cfp->cfc_fd, &oheader, CF_HEADER_SIZE(&oheader), &nwritten)) ==
+         0) &&
+        (nwritten == CF_HEADER_SIZE(&oheader)) &&
+        ((error = (*cfp->cfc_sysdep->sys_seek)(
+              cfp->cfc_fd, oheader.cf_blockmap_offset, SYSDEP_SEEK_ABSOLUTE,
+              (uint64_t *)NULL)) == 0) &&
+        ((error = (*cfp->cfc_sysdep->sys_write)(
+              cfp->cfc_fd, cfp->cfc_blockmap,
+              oheader.cf_total_blocks * sizeof(uint64_t), &nwritten)) == 0) &&
+        (nwritten == (oheader.cf_total_blocks * sizeof(uint64_t))) &&
+        (!cfp->cfc_genmap ||
+         (((error = (*cfp->cfc_sysdep->sys_write)(
+                cfp->cfc_fd, cfp->cfc_genmap,
+                oheader.cf_total_blocks * sizeof(uint32_t), &nwritten)) ==
+           0) &&
+          (nwritten == (oheader.cf_total_blocks * sizeof(uint32_t)))))) {
+        /*
+         * If successful, then we're no longer dirty.  Nothing on disk
+         * refers to the records released since the last sync any more.
+         */
+        cfp->cfc_header.cf_flags &= ~CF_HEADER_DIRTY;
+        if (cfp->cfc_dedup) {
+            cf_dedup_table_t *dtp = cfp->cfc_dedup;
+
+            memcpy(&dtp->cdt_free[dtp->cdt_nfree], dtp->cdt_pending,
+                   dtp->cdt_npending * sizeof(uint32_t));
+            dtp->cdt_nfree += dtp->cdt_npending;
+            dtp->cdt_npending = 0;
+        }
+    }
+
+    return error;
+}
+
+/*
+ * Sync change file changes to image and make them durable.
+ *
+ * Records must reach the disk before the block map that refers to them.
+ * Most of them are flushed before taking the handle lock, so that writers
+ * are only held up while the few that arrived since are flushed and the
+ * block map is written.  Flushing the block map needs no lock at all.
+ */
+int
+cf_sync(void *vcp) {
+    int           error;
+    cf_context_t *cfp = (cf_context_t *)vcp;
+
+    /*
+     * Nothing of a volatile change file is meant to last.
+     */
+    if (cfp->cfc_volatile)
+        return 0;
+    if ((error = (*cfp->cfc_sysdep->sys_flush)(cfp->cfc_fd)) == 0) {
+        int written = 0;
+
+        cf_lock(cfp, cfp->cfc_lock, SYSDEP_LOCK_EXCLUSIVE);
+        if (cfp->cfc_header.cf_flags & CF_HEADER_DIRTY) {
+            if (((error = (*cfp->cfc_sysdep->sys_flush)(cfp->cfc_fd)) ==
+                 0) &&
+                ((error = cf_sync_locked(cfp)) == 0))
+                written = 1;
+        }
+        cf_unlock(cfp, cfp->cfc_lock);
+        if (written)
+            error = (*cfp->cfc_sysdep->sys_flush)(cfp->cfc_fd);
+    }
+
+    return error;
+}
+
+/*
+ * Finish change file handling.
+ *
+ * Free structures.
+ */
+int
+cf_finish(void *vcp) {
+    cf_context_t *cfp = (cf_context_t *)vcp;
+
+    /*
+     * See if we're dirty first and flush what we have if we are.
+     */
+    if (cfp->cfc_header.cf_flags & CF_HEADER_DIRTY)
+        (void)cf_sync(vcp);
+    /*
+     * Give back whatever we preallocated and did not use.
+     */
+    if (cfp->cfc_alloc_end > cfp->cfc_header.cf_data_end)
+        (void)(*cfp->cfc_sysdep->sys_truncate)(cfp->cfc_fd,
+                                               cfp->cfc_header.cf_data_end);
+    if (cfp->cfc_blockmap)
+        (void)(*cfp->cfc_sysdep->sys_free)(cfp->cfc_blockmap);
+    if (cfp->cfc_dedup) {
+        cf_dedup_release(cfp->cfc_sysdep, cfp->cfc_dedup);
+        (void)(*cfp->cfc_sysdep->sys_free)(cfp->cfc_dedup);
+    }
+    if (cfp->cfc_dedup_buf)
+        (void)(*cfp->cfc_sysdep->sys_free)(cfp->cfc_dedup_buf);
+    if (cfp->cfc_zbufs)
+        (void)(*cfp->cfc_sysdep->sys_free)(cfp->cfc_zbufs);
+    if (cfp->cfc_genmap)
+        (void)(*cfp->cfc_sysdep->sys_free)(cfp->cfc_genmap);
+    if (cfp->cfc_volatile) {
+        cf_volatile_release(cfp->cfc_sysdep, cfp->cfc_volatile);
+        if (cfp->cfc_volatile->cvt_spill)
+            (void)(*cfp->cfc_sysdep->sys_close)(cfp->cfc_volatile->cvt_spill);
+        (void)(*cfp->cfc_sysdep->sys_free)(cfp->cfc_volatile);
+    }
+    cf_chain_close(cfp);
+    cf_locks_release(cfp);
+    if (cfp->cfc_fd)
+        (void)(*cfp->cfc_sysdep->sys_close)(cfp->cfc_fd);
+    if (cfp->cfc_path)
+        (void)(*cfp->cfc_sysdep->sys_free)(cfp->cfc_path);
+    return (*cfp->cfc_sysdep->sys_free)(cfp);
+}
+
+/*
+ * Change file handling for seeking to a particular block.
+ */
+int
+cf_seek(void *vcp, uint64_t blockno) {
+    int           error = ENXIO;
+    cf_context_t *cfp   = (cf_context_t *)vcp;
+    if (blockno <= cfp->cfc_header.cf_total_blocks) {
+        cfp->cfc_curpos = blockno;
+        error           = 0;
+    }
+
+    return error;
+}
+
+/*
+ * CRC routine.
+ */
+static inline uint32_t
+cf_crc32(cf_context_t *cfp, uint32_t crc, unsigned char *buf, uint64_t size) {
+    uint64_t s;
+    uint32_t tmp;
+
+    for (s = 0; s < size; s++) {
+        tmp = crc ^ (((uint32_t)buf[s]) & 0x000000ffL);
+        crc = (crc >> 8) ^ cfp->cfc_crc_tab32[tmp & 0xff];
+    }
+
+    return crc;
+}
+
+/*
+ * The scratch buffer of a block's lock stripe, for its compressed record.
+ */
+static unsigned char *
+cf_zbuf(cf_context_t *cfp, uint64_t blockno) {
+    return &cfp->cfc_zbufs[(blockno % CF_LOCK_STRIPES) * CF_ZBUF_SIZE(cfp)];
+}
+
+/*
+ * Read and check the compressed block record at the given offset.  Called
+ * with the block's stripe held exclusive.
+ */
+static int
+cf_read_zrecord(cf_context_t *cfp, void *fd, uint64_t offset,
+                uint64_t blockno, void *buffer) {
+    int                 error;
+    cf_zblock_trailer_t ztrail;
+    unsigned char *     zbuf = cf_zbuf(cfp, blockno);
+    uint64_t            nread;
+
+    if (((error = (*cfp->cfc_sysdep->sys_pread)(fd, &ztrail, sizeof(ztrail),
+                                                offset, &nread)) == 0) &&
+        (nread == sizeof(ztrail))) {
+        offset += sizeof(ztrail);
+        if ((ztrail.cfb_magic != CF_MAGIC_4) ||
+            (ztrail.cfb_length > cfp->cfc_blocksize)) {
+            error = ESRCH;
+        } else if (ztrail.cfb_length == cfp->cfc_blocksize) {
+            /*
+             * Stored as is.
+             */
+            if (((error = (*cfp->cfc_sysdep->sys_pread)(
+                      fd, buffer, cfp->cfc_blocksize, offset, &nread)) == 0) &&
+                (nread != cfp->cfc_blocksize))
+                error = EIO;
+        } else if (((error = (*cfp->cfc_sysdep->sys_pread)(
+                         fd, zbuf, ztrail.cfb_length, offset, &nread)) == 0) &&
+                   ((nread != ztrail.cfb_length) ||
+                    (lz_decompress(zbuf, ztrail.cfb_length, buffer,
+                                   cfp->cfc_blocksize) != 0))) {
+            error = ESRCH;
+        }
+        /*
+         * Verify the trailer.
+         */
+        if (!error && !(((cfp->cfc_flags & CFC_SHARED_BLOCKS) ||
+                         (ztrail.cfb_curblock == blockno)) &&
+                        (ztrail.cfb_crc ==
+                         cf_crc32(cfp, 0L, buffer, cfp->cfc_blocksize)))) {
+            error = ESRCH;
+        }
+    } else {
+        if (!error)
+            error = EIO;
+    }
+
+    return error;
+}
+
+/*
+ * Read and check the block record at the given offset of a change file.
+ */
+static int
+cf_read_record(cf_context_t *cfp, void *fd, uint32_t features,
+               uint64_t offset, uint64_t blockno, void *buffer) {
+    int                error;
+    uint64_t           rsize = cfp->cfc_blocksize;
+    cf_block_trailer_t btrail;
+    uint64_t           nread;
+
+    if (CF_ENTRY_ZERO(offset)) {
+        memset(buffer, 0, cfp->cfc_blocksize);
+        return 0;
+    }
+    if (features & CF_FEATURE_COMPRESS)
+        return cf_read_zrecord(cfp, fd, offset, blockno, buffer);
+    /*
+     * Read the block and trailer.
+     */
+    if (((error = (*cfp->cfc_sysdep->sys_pread)(fd, buffer, rsize, offset,
+                                                &nread)) == 0) &&
+        (nread == rsize)) {
+        offset += rsize;
+        rsize = sizeof(cf_block_trailer_t);
+        if (((error = (*cfp->cfc_sysdep->sys_pread)(fd, &btrail, rsize,
+                                                    offset, &nread)) == 0) &&
+            (nread == rsize)) {
+            /*
+             * Verify the trailer.  A shared record names only the
+             * first block it was written for.
+             */
+            if (((cfp->cfc_flags & CFC_SHARED_BLOCKS) ||
+                 (btrail.cfb_curblock == blockno)) &&
+                (btrail.cfb_magic == CF_MAGIC_3) &&
+                (btrail.cfb_crc ==
+                 cf_crc32(cfp, 0L, buffer, cfp->cfc_blocksize))) {
+                error = 0;
+            } else {
+                error = ESRCH;
+            }
+        } else {
+            if (!error)
+                error = EIO;
+        }
+    } else {
+        if (!error)
+            error = EIO;
+    }
+
+    return error;
+}
+
+/*
+ * Read the given block.
+ */
+int
+cf_readblock_at(void *vcp, uint64_t blockno, void *buffer) {
+    int           error = ENXIO;
+    cf_context_t *cfp   = (cf_context_t *)vcp;
+    uint64_t      tentry;
+
+    if (blockno >= cfp->cfc_header.cf_total_blocks)
+        return error;
+    cf_lock(cfp, cfp->cfc_lock, SYSDEP_LOCK_SHARED);
+    cf_lock(cfp, CF_STRIPE(cfp, blockno),
+            (cfp->cfc_zbufs) ? SYSDEP_LOCK_EXCLUSIVE : SYSDEP_LOCK_SHARED);
+    /*
+     * Check the block map for an offset, then the merged index of the
+     * lower layers.
+     */
+    if ((tentry = cf_top_entry(cfp, blockno))) {
+        error = (cfp->cfc_volatile)
+                    ? cf_volatile_copy(cfp, tentry, buffer, 1)
+                    : cf_read_record(cfp, cfp->cfc_fd,
+                                     cfp->cfc_header.cf_features, tentry,
+                                     blockno, buffer);
+    } else if (cfp->cfc_chainmap && cfp->cfc_chainmap[blockno]) {
+        uint64_t centry = cfp->cfc_chainmap[blockno];
+        uint32_t lidx   = CF_CHAIN_LAYER(centry);
+
+        error = cf_read_record(cfp, cfp->cfc_layers[lidx],
+                               cfp->cfc_lfeatures[lidx],
+                               CF_CHAIN_OFFSET(centry), blockno, buffer);
+    }
+    cf_unlock(cfp, CF_STRIPE(cfp, blockno));
+    cf_unlock(cfp, cfp->cfc_lock);
+
+    return error;
+}
+
+/*
+ * Read the block at the current position.
+ */
+int
+cf_readblock(void *vcp, void *buffer) {
+    return cf_readblock_at(vcp, ((cf_context_t *)vcp)->cfc_curpos, buffer);
+}
+
+/*
+ * Is the given block in use?
+ */
+int
+cf_blockused_at(void *vcp, uint64_t blockno) {
+    cf_context_t *cfp  = (cf_context_t *)vcp;
+    int           used = 0;
+
+    if (blockno < cfp->cfc_header.cf_total_blocks) {
+        cf_lock(cfp, cfp->cfc_lock, SYSDEP_LOCK_SHARED);
+        cf_lock(cfp, CF_STRIPE(cfp, blockno), SYSDEP_LOCK_SHARED);
+        used = (cf_top_entry(cfp, blockno) ||
+                (cfp->cfc_chainmap && cfp->cfc_chainmap[blockno]))
+                   ? 1
+                   : 0;
+        cf_unlock(cfp, CF_STRIPE(cfp, blockno));
+        cf_unlock(cfp, cfp->cfc_lock);
+    }
+
+    return used;
+}
+
+/*
+ * Is the current block in use?
+ */
+int
+cf_blockused(void *vcp) {
+    return cf_blockused_at(vcp, ((cf_context_t *)vcp)->cfc_curpos);
+}
+
+/*
+ * Is the given block marked as zeros?
+ */
+int
+cf_blockzero_at(void *vcp, uint64_t blockno) {
+    cf_context_t *cfp  = (cf_context_t *)vcp;
+    int           zero = 0;
+    uint64_t      tentry;
+
+    if (blockno < cfp->cfc_header.cf_total_blocks) {
+        cf_lock(cfp, cfp->cfc_lock, SYSDEP_LOCK_SHARED);
+        cf_lock(cfp, CF_STRIPE(cfp, blockno), SYSDEP_LOCK_SHARED);
+        if ((tentry = cf_top_entry(cfp, blockno)))
+            zero = (cfp->cfc_volatile) ? (tentry == CF_ZERO_RECORD)
+                                       : CF_ENTRY_ZERO(tentry);
+        else if (cfp->cfc_chainmap && cfp->cfc_chainmap[blockno])
+            zero = CF_ENTRY_ZERO(CF_CHAIN_OFFSET(cfp->cfc_chainmap[blockno]));
+        cf_unlock(cfp, CF_STRIPE(cfp, blockno));
+        cf_unlock(cfp, cfp->cfc_lock);
+    }
+
+    return zero;
+}
+
+/*
+ * Is the block all zeros?  Once its leading words are, it is if it matches
+ * itself shifted by their length, which leaves the scan to the vectorized
+ * memcmp of the C library.
+ */
+static int
+cf_block_zero(const void *buffer, uint64_t size) {
+    const char *bp = (const char *)buffer;
+    uint64_t    lead[2];
+
+    memcpy(lead, bp, sizeof(lead));
+    return !(lead[0] | lead[1]) &&
+           !memcmp(bp, bp + sizeof(lead), size - sizeof(lead));
+}
+
+/*
+ * Write a block record at the given offset.
+ */
+static int
+cf_write_record(cf_context_t *cfp, uint64_t offset, uint64_t blockno,
+                void *buffer) {
+    int                error;
+    cf_block_trailer_t btrail = {
+        blockno, cf_crc32(cfp, 0, buffer, cfp->cfc_blocksize), CF_MAGIC_3};
+    uint64_t nwritten;
+
+    if (((error = (*cfp->cfc_sysdep->sys_pwrite)(
+              cfp->cfc_fd, buffer, cfp->cfc_blocksize, offset, &nwritten)) ==
+         0) &&
+        ((error = (*cfp->cfc_sysdep->sys_pwrite)(
+              cfp->cfc_fd, &btrail, sizeof(btrail), offset + cfp->cfc_blocksize,
+              &nwritten)) == 0)) {
+        /*
+         * Write success.
+         */
+    }
+
+    return error;
+}
+
+/*
+ * Find how much room a compressed record has.
+ */
+static int
+cf_zrecord_space(cf_context_t *cfp, uint64_t offset, uint32_t *spacep) {
+    int                 error;
+    cf_zblock_trailer_t ztrail;
+    uint64_t            nread;
+
+    if ((error = (*cfp->cfc_sysdep->sys_pread)(cfp->cfc_fd, &ztrail,
+                                               sizeof(ztrail), offset,
+                                               &nread)) == 0) {
+        if ((nread == sizeof(ztrail)) && (ztrail.cfb_magic == CF_MAGIC_4) &&
+            (ztrail.cfb_space <= cfp->cfc_blocksize))
+            *spacep = ztrail.cfb_space;
+        else
+            error = ESRCH;
+    }
+
+    return error;
+}
+
+/*
+ * Reserve room for a new record at the logical end of the data.  The
+ * space is taken before the record is written so that writers of other
+ * blocks can append at the same time.
+ */
+static uint64_t
+cf_reserve(cf_context_t *cfp, uint64_t rsize) {
+    uint64_t offset;
+
+    cf_lock(cfp, cfp->cfc_alloc_lock, SYSDEP_LOCK_EXCLUSIVE);
+    cf_preallocate(cfp, rsize);
+    offset = cfp->cfc_header.cf_data_end;
+    cfp->cfc_header.cf_data_end += rsize;
+    cf_unlock(cfp, cfp->cfc_alloc_lock);
+
+    return offset;
+}
+
+/*
+ * Store a block.
+ *
+ * *offsetp names the record to rewrite, or is zero for a new one.  New
+ * records go at the logical end of the data, and so do compressed ones
+ * that have outgrown their room.  On success *offsetp is where the record
+ * went.
+ */
+static int
+cf_store_record(cf_context_t *cfp, uint64_t blockno, void *buffer,
+                uint64_t *offsetp) {
+    int      error  = 0;
+    uint64_t offset = *offsetp;
+
+    if (cfp->cfc_header.cf_features & CF_FEATURE_COMPRESS) {
+        unsigned char *      zbuf = cf_zbuf(cfp, blockno);
+        cf_zblock_trailer_t *ztp;
+        unsigned char *      zdata;
+        uint32_t             space = 0;
+        uint64_t             nwritten;
+
+        ztp               = (cf_zblock_trailer_t *)zbuf;
+        zdata             = zbuf + sizeof(*ztp);
+        ztp->cfb_curblock = blockno;
+        ztp->cfb_crc      = cf_crc32(cfp, 0, buffer, cfp->cfc_blocksize);
+        ztp->cfb_magic    = CF_MAGIC_4;
+        ztp->cfb_length   = lz_compress(buffer, cfp->cfc_blocksize, zdata,
+                                        cfp->cfc_blocksize - 1);
+        if (!ztp->cfb_length) {
+            /*
+             * Does not compress - store it as is.
+             */
+            memcpy(zdata, buffer, cfp->cfc_blocksize);
+            ztp->cfb_length = cfp->cfc_blocksize;
+        }
+        if (offset && ((cf_zrecord_space(cfp, offset, &space) != 0) ||
+                       (ztp->cfb_length > space)))
+            offset = 0;
+        if (!offset) {
+            space = (ztp->cfb_length + CF_ZSPACE_ROUND - 1) &
+                    ~(CF_ZSPACE_ROUND - 1);
+            if (space > cfp->cfc_blocksize)
+                space = cfp->cfc_blocksize;
+            offset = cf_reserve(cfp, sizeof(*ztp) + space);
+        }
+        ztp->cfb_space = space;
+        error          = (*cfp->cfc_sysdep->sys_pwrite)(
+            cfp->cfc_fd, zbuf, sizeof(*ztp) + ztp->cfb_length, offset,
+            &nwritten);
+    } else {
+        if (!offset)
+            offset = cf_reserve(cfp, cfp->cfc_blocksize +
+                                         sizeof(cf_block_trailer_t));
+        error = cf_write_record(cfp, offset, blockno, buffer);
+    }
+    if (!error)
+        *offsetp = offset;
+
+    return error;
+}
+
+/*
+ * Point a block at a stored record of a dedup change file, dropping the
+ * reference to its previous one.
+ */
+static void
+cf_dedup_map(cf_context_t *cfp, uint64_t blockno, uint64_t offset) {
+    cf_dedup_table_t *dtp    = cfp->cfc_dedup;
+    uint64_t          oldoff = cfp->cfc_blockmap[blockno];
+    uint32_t *        oslot;
+
+    if (oldoff && *(oslot = cf_dedup_offset_slot(dtp, oldoff))) {
+        uint32_t          ei  = *oslot - 1;
+        cf_dedup_entry_t *dep = &dtp->cdt_entries[ei];
+
+        if (dep->cfd_refs && (--dep->cfd_refs == 0)) {
+            uint32_t *hslot = cf_dedup_hash_slot(dtp, dep->cfd_hash);
+
+            if (*hslot == (ei + 1))
+                cf_dedup_unhash(dtp, hslot);
+            dtp->cdt_pending[dtp->cdt_npending++] = ei;
+        }
+    }
+    cfp->cfc_blockmap[blockno] = offset;
+    cf_lock(cfp, cfp->cfc_alloc_lock, SYSDEP_LOCK_EXCLUSIVE);
+    if (!oldoff)
+        cfp->cfc_header.cf_used_blocks++;
+    cfp->cfc_header.cf_flags |= CF_HEADER_DIRTY;
+    cf_unlock(cfp, cfp->cfc_alloc_lock);
+}
+
+/*
+ * See whether a record whose hash matches really holds the given contents.
+ * The hash only finds candidates; records are shared on equal bytes.
+ * Called with the dedup table locked, which also covers the scratch buffer.
+ */
+static int
+cf_dedup_match(cf_context_t *cfp, cf_dedup_entry_t *dep, uint64_t blockno,
+               const void *buffer) {
+    const sysdep_dispatch_t *sysdep = cfp->cfc_sysdep;
+
+    if (!cfp->cfc_dedup_buf &&
+        (*sysdep->sys_malloc)(&cfp->cfc_dedup_buf, cfp->cfc_blocksize))
+        return 0;
+    return (cf_read_record(cfp, cfp->cfc_fd, cfp->cfc_header.cf_features,
+                           dep->cfd_offset, blockno,
+                           cfp->cfc_dedup_buf) == 0) &&
+           (memcmp(cfp->cfc_dedup_buf, buffer, cfp->cfc_blocksize) == 0);
+}
+
+/*
+ * Write a block of a dedup change file.
+ *
+ * Contents that are stored already are shared, new contents go to a free
+ * record or to the logical end of the data.  Records are never rewritten
+ * in place as others may share them.  The contents are hashed before the
+ * table is locked.  Different contents that hash alike get a record of
+ * their own, which then takes over the hash slot.
+ */
+static int
+cf_dedup_writeblock(cf_context_t *cfp, uint64_t blockno, void *buffer) {
+    int               error = 0;
+    cf_dedup_table_t *dtp   = cfp->cfc_dedup;
+    uint64_t          hash[2];
+    uint32_t *        hslot;
+
+    hash128(buffer, cfp->cfc_blocksize, 0, hash);
+    cf_lock(cfp, cfp->cfc_dedup_lock, SYSDEP_LOCK_EXCLUSIVE);
+    if (*(hslot = cf_dedup_hash_slot(dtp, hash)) &&
+        cf_dedup_match(cfp, &dtp->cdt_entries[*hslot - 1], blockno, buffer)) {
+        cf_dedup_entry_t *dep = &dtp->cdt_entries[*hslot - 1];
+
+        if (dep->cfd_offset != cfp->cfc_blockmap[blockno]) {
+            dep->cfd_refs++;
+            cf_dedup_map(cfp, blockno, dep->cfd_offset);
+        }
+    } else {
+        int      reuse  = (dtp->cdt_nfree != 0);
+        uint32_t ei     = (reuse) ? dtp->cdt_free[--dtp->cdt_nfree] : 0;
+        uint64_t offset = (reuse) ? dtp->cdt_entries[ei].cfd_offset : 0;
+
+        if ((error = cf_store_record(cfp, blockno, buffer, &offset)) == 0) {
+            if (reuse && (offset != dtp->cdt_entries[ei].cfd_offset)) {
+                /*
+                 * Too small for these (compressed) contents.  It stays free.
+                 */
+                dtp->cdt_nfree++;
+                reuse = 0;
+            }
+            if (!reuse) {
+                if ((dtp->cdt_count < dtp->cdt_capacity) ||
+                    ((error = cf_dedup_resize(
+                          cfp, 2ULL * dtp->cdt_capacity)) == 0)) {
+                    ei                              = dtp->cdt_count++;
+                    dtp->cdt_entries[ei].cfd_offset = offset;
+                    dtp->cdt_entries[ei].cfd_pad    = 0;
+                    *cf_dedup_offset_slot(dtp, offset) = ei + 1;
+                }
+            }
+            if (!error) {
+                cf_dedup_entry_t *dep = &dtp->cdt_entries[ei];
+
+                dep->cfd_hash[0] = hash[0];
+                dep->cfd_hash[1] = hash[1];
+                dep->cfd_refs    = 1;
+                *cf_dedup_hash_slot(dtp, hash) = ei + 1;
+                cf_dedup_map(cfp, blockno, offset);
+            }
+        } else if (reuse) {
+            /* Still free. */
+            dtp->cdt_nfree++;
+        }
+    }
+    cf_unlock(cfp, cfp->cfc_dedup_lock);
+
+    return error;
+}
+
+/*
+ * Note that a block was written: which generation wrote it, and, while the
+ * change file is being compacted, that the copy of it may be stale.  Called
+ * with the block's stripe locked exclusive.
+ */
+static void
+cf_note_write(cf_context_t *cfp, uint64_t blockno) {
+    if (cfp->cfc_genmap) {
+        cf_lock(cfp, cfp->cfc_alloc_lock, SYSDEP_LOCK_EXCLUSIVE);
+        if (cfp->cfc_genmap[blockno] != cfp->cfc_header.cf_generation) {
+            cfp->cfc_genmap[blockno] = cfp->cfc_header.cf_generation;
+            cfp->cfc_header.cf_flags |= CF_HEADER_DIRTY;
+        }
+        cf_unlock(cfp, cfp->cfc_alloc_lock);
+    }
+    /*
+     * Neighbouring blocks share a word but not a stripe.
+     */
+    if (cfp->cfc_compact_map)
+        (void)__atomic_fetch_or(&cfp->cfc_compact_map[blockno / 64],
+                                1ULL << (blockno % 64), __ATOMIC_RELAXED);
+}
+
+/*
+ * Write the given block.
+ *
+ * Writers of different blocks proceed in parallel; only the reservation
+ * of new space and the shared header fields are serialized.
+ */
+int
+cf_writeblock_at(void *vcp, uint64_t blockno, void *buffer) {
+    int           error = ENXIO;
+    cf_context_t *cfp   = (cf_context_t *)vcp;
+    uint64_t      nbloffs;
+    uint64_t      curpos;
+
+    if (blockno >= cfp->cfc_header.cf_total_blocks)
+        return error;
+    if (cfp->cfc_flags & CFC_READONLY)
+        return EROFS;
+    if ((cfp->cfc_header.cf_features & CF_FEATURE_ZERO) &&
+        cf_block_zero(buffer, cfp->cfc_blocksize))
+        return cf_zeroblocks_at(vcp, blockno, 1);
+    if (cfp->cfc_volatile)
+        return cf_volatile_write(cfp, blockno, buffer);
+    cf_lock(cfp, cfp->cfc_lock, SYSDEP_LOCK_SHARED);
+    cf_lock(cfp, CF_STRIPE(cfp, blockno), SYSDEP_LOCK_EXCLUSIVE);
+    nbloffs = cfp->cfc_blockmap[blockno];
+    /*
+     * A block marked as zeros rewrites the record it kept, if any.
+     */
+    curpos = CF_ENTRY_RECORD(nbloffs);
+    if (cfp->cfc_dedup) {
+        error = cf_dedup_writeblock(cfp, blockno, buffer);
+    } else if (((error = cf_store_record(cfp, blockno, buffer, &curpos)) ==
+                0) &&
+               (curpos != nbloffs)) {
+        /*
+         * We made a new block (or moved one).
+         */
+        cfp->cfc_blockmap[blockno] = curpos;
+        cf_lock(cfp, cfp->cfc_alloc_lock, SYSDEP_LOCK_EXCLUSIVE);
+        if (!nbloffs)
+            cfp->cfc_header.cf_used_blocks++;
+        cfp->cfc_header.cf_flags |= CF_HEADER_DIRTY;
+        cf_unlock(cfp, cfp->cfc_alloc_lock);
+    }
+    if (!error)
+        cf_note_write(cfp, blockno);
+    cf_unlock(cfp, CF_STRIPE(cfp, blockno));
+    cf_unlock(cfp, cfp->cfc_lock);
+
+    return error;
+}
+
+/*
+ * Zero the given blocks.
+ *
+ * Change files with CF_FEATURE_ZERO only mark them in the block map, so
+ * zeroing any number of blocks writes no data.  A record they had stays
+ * with them for the next write to reuse; in dedup files it goes back to
+ * the dedup table.  Older files get records of zeros.
+ */
+int
+cf_zeroblocks_at(void *vcp, uint64_t blockno, uint64_t nblocks) {
+    int           error = 0;
+    cf_context_t *cfp   = (cf_context_t *)vcp;
+    uint64_t      bi;
+
+    if ((blockno > cfp->cfc_header.cf_total_blocks) ||
+        (nblocks > cfp->cfc_header.cf_total_blocks - blockno))
+        return ENXIO;
+    if (cfp->cfc_flags & CFC_READONLY)
+        return EROFS;
+    if (!(cfp->cfc_header.cf_features & CF_FEATURE_ZERO)) {
+        void *zbuf;
+
+        if ((error = (*cfp->cfc_sysdep->sys_malloc)(&zbuf,
+                                                    cfp->cfc_blocksize)) == 0) {
+            memset(zbuf, 0, cfp->cfc_blocksize);
+            for (bi = blockno; !error && (bi < blockno + nblocks); bi++)
+                error = cf_writeblock_at(vcp, bi, zbuf);
+            (void)(*cfp->cfc_sysdep->sys_free)(zbuf);
+        }
+        return error;
+    }
+    cf_lock(cfp, cfp->cfc_lock, SYSDEP_LOCK_SHARED);
+    for (bi = blockno; !error && (bi < blockno + nblocks); bi++) {
+        uint64_t oldoff;
+
+        cf_lock(cfp, CF_STRIPE(cfp, bi), SYSDEP_LOCK_EXCLUSIVE);
+        if (cfp->cfc_volatile) {
+            cf_lock(cfp, cfp->cfc_alloc_lock, SYSDEP_LOCK_EXCLUSIVE);
+            error = cf_volatile_set(cfp, bi, CF_ZERO_RECORD);
+            cf_unlock(cfp, cfp->cfc_alloc_lock);
+        } else if (!CF_ENTRY_ZERO(oldoff = cfp->cfc_blockmap[bi])) {
+            if (cfp->cfc_dedup) {
+                cf_lock(cfp, cfp->cfc_dedup_lock, SYSDEP_LOCK_EXCLUSIVE);
+                cf_dedup_map(cfp, bi, CF_ZERO_RECORD);
+                cf_unlock(cfp, cfp->cfc_dedup_lock);
+            } else {
+                cfp->cfc_blockmap[bi] = oldoff | CF_ZERO_RECORD;
+                cf_lock(cfp, cfp->cfc_alloc_lock, SYSDEP_LOCK_EXCLUSIVE);
+                if (!oldoff)
+                    cfp->cfc_header.cf_used_blocks++;
+                cfp->cfc_header.cf_flags |= CF_HEADER_DIRTY;
+                cf_unlock(cfp, cfp->cfc_alloc_lock);
+            }
+        }
+        cf_note_write(cfp, bi);
+        cf_unlock(cfp, CF_STRIPE(cfp, bi));
+    }
+    cf_unlock(cfp, cfp->cfc_lock);
+
+    return error;
+}
+
+/*
+ * Write block at current location.
+ */
+int
+cf_writeblock(void *vcp, void *buffer) {
+    return cf_writeblock_at(vcp, ((cf_context_t *)vcp)->cfc_curpos, buffer);
+}
+
+/*
+ * Copy a block of the top layer to the file it is being compacted into.
+ * Called with cfc_lock held.
+ */
+static int
+cf_compact_block(cf_context_t *cfp, cf_context_t *ncfp, uint64_t blockno,
+                 void *buffer) {
+    int      error = 0;
+    uint64_t entry;
+
+    cf_lock(cfp, CF_STRIPE(cfp, blockno),
+            (cfp->cfc_zbufs) ? SYSDEP_LOCK_EXCLUSIVE : SYSDEP_LOCK_SHARED);
+    entry = cfp->cfc_blockmap[blockno];
+    if (entry && !CF_ENTRY_ZERO(entry))
+        error = cf_read_record(cfp, cfp->cfc_fd, cfp->cfc_header.cf_features,
+                               entry, blockno, buffer);
+    cf_unlock(cfp, CF_STRIPE(cfp, blockno));
+    if (!error) {
+        if (CF_ENTRY_ZERO(entry))
+            error = cf_zeroblocks_at(ncfp, blockno, 1);
+        else if (entry)
+            error = cf_writeblock_at(ncfp, blockno, buffer);
+    }
+
+    return error;
+}
+
+/*
+ * Compact the top layer of the change file.
+ *
+ * Its live blocks are copied in block order to a new change file which then
+ * replaces it.  Changed regions read back with large sequential I/O
+ * afterwards, and the space of moved records and old dedup tables is
+ * returned.  The copy is made CF_COMPACT_CHUNK blocks at a time under the
+ * shared lock, so reads and writes carry on; blocks written meanwhile are
+ * noted and copied again under the exclusive lock just before the swap.
+ * The handle stays usable throughout.  Only one compaction runs at a time,
+ * and commits are refused while it does.
+ */
+int
+cf_compact(void *vcp) {
+    int                      error;
+    cf_context_t *           cfp    = (cf_context_t *)vcp;
+    const sysdep_dispatch_t *sysdep = cfp->cfc_sysdep;
+    uint64_t                 total  = cfp->cfc_header.cf_total_blocks;
+    size_t                   msize  = ((total + 63) / 64) * sizeof(uint64_t);
+    cf_context_t *           ncfp   = (cf_context_t *)NULL;
+    char *                   npath  = (char *)NULL;
+    void *                   buffer = (void *)NULL;
+    uint64_t *               map    = (uint64_t *)NULL;
+    uint64_t                 bi, ci;
+
+    /*
+     * A volatile change file has nothing on disk to compact.
+     */
+    if (cfp->cfc_volatile)
+        return 0;
+    cf_lock(cfp, cfp->cfc_lock, SYSDEP_LOCK_EXCLUSIVE);
+    if (cfp->cfc_compact_map) {
+        error = EBUSY;
+    } else if (((error = cf_sync_locked(cfp)) == 0) &&
+               ((error = (*sysdep->sys_malloc)(
+                     &npath, strlen(cfp->cfc_path) +
+                                 sizeof(CF_COMPACT_SUFFIX))) == 0) &&
+               ((error = (*sysdep->sys_malloc)(&buffer, cfp->cfc_blocksize)) ==
+                0) &&
+               ((error = (*sysdep->sys_malloc)(&map, msize)) == 0)) {
+        memset(map, 0, msize);
+        cfp->cfc_compact_map = map;
+    }
+    cf_unlock(cfp, cfp->cfc_lock);
+    if (!error) {
+        strcpy(npath, cfp->cfc_path);
+        strcat(npath, CF_COMPACT_SUFFIX);
+        /*
+         * Start afresh should an earlier attempt have left one behind.
+         */
+        (void)(*sysdep->sys_unlink)(npath);
+        if ((error = cf_create(npath, sysdep, cfp->cfc_blocksize, total,
+                               cfp->cfc_header.cf_features, (void **)&ncfp)) ==
+            0) {
+            for (bi = 0; !error && (bi < total); bi = ci) {
+                cf_lock(cfp, cfp->cfc_lock, SYSDEP_LOCK_SHARED);
+                for (ci = bi;
+                     !error && (ci < total) && (ci < bi + CF_COMPACT_CHUNK);
+                     ci++)
+                    error = cf_compact_block(cfp, ncfp, ci, buffer);
+                cf_unlock(cfp, cfp->cfc_lock);
+            }
+        }
+        cf_lock(cfp, cfp->cfc_lock, SYSDEP_LOCK_EXCLUSIVE);
+        /*
+         * Bring the copy up to date with the blocks written since it was
+         * made.
+         */
+        for (bi = 0; !error && (bi < total); bi++) {
+            if (!map[bi / 64])
+                bi |= 63;
+            else if (map[bi / 64] & (1ULL << (bi % 64)))
+                error = cf_compact_block(cfp, ncfp, bi, buffer);
+        }
+        /*
+         * Blocks keep the generations that wrote them.
+         */
+        if (!error && cfp->cfc_genmap) {
+            memcpy(ncfp->cfc_genmap, cfp->cfc_genmap, total * sizeof(uint32_t));
+            ncfp->cfc_header.cf_generation = cfp->cfc_header.cf_generation;
+        }
+        if (!error && ((error = cf_sync(ncfp)) == 0) &&
+            ((error = (*sysdep->sys_rename)(npath, cfp->cfc_path)) == 0) &&
+            ((error = (*sysdep->sys_syncdir)(cfp->cfc_path)) == 0)) {
+            cf_context_t ocf = *cfp;
+
+            /*
+             * The new file is in place.  Take over its state and let the
+             * old state go with the scratch handle; what the old file had
+             * yet to write no longer matters.
+             */
+            cfp->cfc_header     = ncfp->cfc_header;
+            cfp->cfc_fd         = ncfp->cfc_fd;
+            cfp->cfc_blockmap   = ncfp->cfc_blockmap;
+            cfp->cfc_alloc_end  = ncfp->cfc_alloc_end;
+            cfp->cfc_dedup      = ncfp->cfc_dedup;
+            cfp->cfc_genmap     = ncfp->cfc_genmap;
+            ncfp->cfc_header    = ocf.cfc_header;
+            ncfp->cfc_fd        = ocf.cfc_fd;
+            ncfp->cfc_blockmap  = ocf.cfc_blockmap;
+            ncfp->cfc_alloc_end = ocf.cfc_alloc_end;
+            ncfp->cfc_dedup     = ocf.cfc_dedup;
+            ncfp->cfc_genmap    = ocf.cfc_genmap;
+            ncfp->cfc_header.cf_flags &= ~CF_HEADER_DIRTY;
+        }
+        cfp->cfc_compact_map = (uint64_t *)NULL;
+        cf_unlock(cfp, cfp->cfc_lock);
+        if (ncfp) {
+            (void)cf_finish(ncfp);
+            if (error)
+                (void)(*sysdep->sys_unlink)(npath);
+        }
+    }
+    if (map)
+        (void)(*sysdep->sys_free)(map);
+    if (buffer)
+        (void)(*sysdep->sys_free)(buffer);
+    if (npath)
+        (void)(*sysdep->sys_free)(npath);
+
+    return error;
+}
+
+/*
+ * Commit the change file into the image it covers.
+ *
+ * Each changed block is copied to its place in the target, block n going
+ * to offset n * blocksize, and the change file is then emptied.  Blocks are
+ * visited in block order so the target is written front to back, and each
+ * run of consecutive changed blocks is read back into one buffer and goes
+ * out with a single write.  Until the emptied blockmap is synced the change
+ * file still holds what the target now does, so an interrupted commit can
+ * simply be run again.  Lower layers of a chain are shared and cannot be
+ * committed, and a volatile change file is meant to be thrown away.
+ */
+int
+cf_commit(void *vcp, void *target) {
+    int                      error;
+    cf_context_t *           cfp    = (cf_context_t *)vcp;
+    const sysdep_dispatch_t *sysdep = cfp->cfc_sysdep;
+    uint64_t                 total  = cfp->cfc_header.cf_total_blocks;
+    uint64_t                 bsize  = cfp->cfc_blocksize;
+    uint64_t                 nbuf   = CF_COMMIT_BYTES / bsize;
+    unsigned char *          buffer = (unsigned char *)NULL;
+    uint64_t                 bi;
+
+    if (cfp->cfc_nlayers || cfp->cfc_volatile)
+        return ENOTSUP;
+    if (!nbuf)
+        nbuf = 1;
+    cf_lock(cfp, cfp->cfc_lock, SYSDEP_LOCK_EXCLUSIVE);
+    /*
+     * A compaction under way would bring back what is committed.
+     */
+    if (cfp->cfc_compact_map) {
+        error = EBUSY;
+    } else if (((error = cf_sync_locked(cfp)) == 0) &&
+               ((error = (*sysdep->sys_malloc)(&buffer, nbuf * bsize)) == 0)) {
+        bi = 0;
+        while (!error && (bi < total)) {
+            uint64_t start = bi;
+            uint64_t ndone;
+
+            if (!cfp->cfc_blockmap[bi]) {
+                bi++;
+                continue;
+            }
+            /*
+             * Every record is read back and checked before it goes to the
+             * target; a bad one stops the commit with the image as it was
+             * up to that run and the change file still whole.
+             */
+            for (; !error && (bi < total) && cfp->cfc_blockmap[bi] &&
+                   (bi - start < nbuf);
+                 bi++)
+                error = cf_read_record(cfp, cfp->cfc_fd,
+                                       cfp->cfc_header.cf_features,
+                                       cfp->cfc_blockmap[bi], bi,
+                                       &buffer[(bi - start) * bsize]);
+            if (!error &&
+                ((error = (*sysdep->sys_pwrite)(target, buffer,
+                                                (bi - start) * bsize,
+                                                start * bsize, &ndone)) == 0) &&
+                (ndone != (bi - start) * bsize))
+                error = EIO;
+        }
+        /*
+         * The target must be stable before the change file lets go.
+         */
+        if (!error && ((error = (*sysdep->sys_flush)(target)) == 0)) {
+            memset(cfp->cfc_blockmap, 0, total * sizeof(uint64_t));
+            cfp->cfc_header.cf_used_blocks = 0;
+            cfp->cfc_header.cf_data_end =
+                cfp->cfc_header.cf_blockmap_offset + total * sizeof(uint64_t);
+            if (cfp->cfc_genmap) {
+                memset(cfp->cfc_genmap, 0, total * sizeof(uint32_t));
+                cfp->cfc_header.cf_data_end += total * sizeof(uint32_t);
+            }
+            if (cfp->cfc_dedup) {
+                cf_dedup_table_t *dtp = cfp->cfc_dedup;
+
+                dtp->cdt_count                  = 0;
+                dtp->cdt_nfree                  = 0;
+                dtp->cdt_npending               = 0;
+                dtp->cdt_ondisk                 = 0;
+                cfp->cfc_header.cf_dedup_count  = 0;
+                cfp->cfc_header.cf_dedup_offset = 0;
+                cf_dedup_index(dtp);
+                (void)cf_dedup_resize(cfp, CF_DEDUP_CAPACITY(0));
+            }
+            cfp->cfc_header.cf_flags |= CF_HEADER_DIRTY;
+            if (((error = cf_sync_locked(cfp)) == 0) &&
+                ((error = (*sysdep->sys_flush)(cfp->cfc_fd)) == 0) &&
+                ((error = (*sysdep->sys_truncate)(
+                      cfp->cfc_fd, cfp->cfc_header.cf_data_end)) == 0))
+                cfp->cfc_alloc_end = cfp->cfc_header.cf_data_end;
+        }
+    }
+    if (buffer)
+        (void)(*sysdep->sys_free)(buffer);
+    cf_unlock(cfp, cfp->cfc_lock);
+
+    return error;
+}
+
+/*
+ * Get the current generation.
+ */
+int
+cf_generation(void *vcp, uint32_t *genp) {
+    cf_context_t *cfp = (cf_context_t *)vcp;
+
+    if (!cfp->cfc_genmap)
+        return ENOTSUP;
+    *genp = cfp->cfc_header.cf_generation;
+    return 0;
+}
+
+/*
+ * Set the generation of subsequent writes.
+ */
+int
+cf_set_generation(void *vcp, uint32_t generation) {
+    cf_context_t *cfp = (cf_context_t *)vcp;
+
+    if (!cfp->cfc_genmap)
+        return ENOTSUP;
+    cf_lock(cfp, cfp->cfc_alloc_lock, SYSDEP_LOCK_EXCLUSIVE);
+    if (cfp->cfc_header.cf_generation != generation) {
+        cfp->cfc_header.cf_generation = generation;
+        cfp->cfc_header.cf_flags |= CF_HEADER_DIRTY;
+    }
+    cf_unlock(cfp, cfp->cfc_alloc_lock);
+    return 0;
+}
+
+/*
+ * Take the top layer of the change file for this handle alone.  Whatever
+ * changes the generation or writes blocks behind the back of a server of
+ * the file must do so first; EBUSY means it is open elsewhere.
+ */
+int
+cf_exclusive(void *vcp) {
+    cf_context_t *cfp = (cf_context_t *)vcp;
+
+    if (!cfp->cfc_fd)
+        return 0;
+    return (*cfp->cfc_sysdep->sys_flock)(cfp->cfc_fd, SYSDEP_LOCK_EXCLUSIVE);
+}
+
+/*
+ * Get the generation that last wrote the current block.
+ */
+int
+cf_blockgen(void *vcp, uint32_t *genp) {
+    cf_context_t *cfp   = (cf_context_t *)vcp;
+    int           error = ENOTSUP;
+
+    /*
+     * Compaction swaps the map, so hold it still.
+     */
+    cf_lock(cfp, cfp->cfc_lock, SYSDEP_LOCK_SHARED);
+    if (cfp->cfc_genmap) {
+        *genp = cfp->cfc_genmap[cfp->cfc_curpos];
+        error = 0;
+    }
+    cf_unlock(cfp, cfp->cfc_lock);
+    return error;
+}
+
+/*
+ * Throw away what has been written to a volatile change file.
+ */
+int
+cf_discard(void *vcp) {
+    int           error;
+    cf_context_t *cfp = (cf_context_t *)vcp;
+
+    if (!cfp->cfc_volatile)
+        return ENOTSUP;
+    cf_lock(cfp, cfp->cfc_lock, SYSDEP_LOCK_EXCLUSIVE);
+    error = cf_volatile_empty(cfp);
+    cf_unlock(cfp, cfp->cfc_lock);
 
     return error;
 }
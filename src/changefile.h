@@ -17,10 +17,26 @@
 #include "sysdep_int.h"
 #include <sys/types.h>
 
+/*
+ * Change file features.  These are requested when a change file is created
+ * and recorded in its header; an existing file keeps the ones it has.
+ */
+#define CF_FEATURE_DEDUP    0x0001 /* Identical blocks share one stored copy */
+#define CF_FEATURE_COMPRESS 0x0002 /* Blocks are stored compressed */
+#define CF_FEATURE_GENERATIONS \
+    0x0004 /* Blocks record the generation that wrote them (always set) */
+#define CF_FEATURE_ZERO \
+    0x0008 /* Blocks of zeros are marked, not stored (always set) */
+#define CF_FEATURE_VOLATILE \
+    0x0010 /* Writes are kept in memory until finished (never stored) */
+#define CF_FEATURE_READONLY \
+    0x0020 /* Opened for reading; nothing is created (never stored) */
+
 int cf_init(const char *, const sysdep_dispatch_t *, uint64_t, uint64_t,
-            void **);
+            uint32_t, void **);
 int cf_create(const char *, const sysdep_dispatch_t *, uint64_t, uint64_t,
-              void **);
+              uint32_t, void **);
+int cf_exists(const char *, const sysdep_dispatch_t *);
 int cf_verify(void *);
 int cf_sync(void *);
 int cf_finish(void *);
@@ -28,5 +44,18 @@ int cf_seek(void *, uint64_t);
 int cf_readblock(void *, void *);
 int cf_blockused(void *);
 int cf_writeblock(void *, void *);
+int cf_readblock_at(void *, uint64_t, void *);
+int cf_blockused_at(void *, uint64_t);
+int cf_writeblock_at(void *, uint64_t, void *);
+int cf_zeroblocks_at(void *, uint64_t, uint64_t);
+int cf_blockzero_at(void *, uint64_t);
+int cf_compact(void *);
+int cf_commit(void *, void *);
+int cf_generation(void *, uint32_t *);
+int cf_set_generation(void *, uint32_t);
+int cf_exclusive(void *);
+int cf_blockgen(void *, uint32_t *);
+int cf_discard(void *);
+void cf_volatile_limit(uint64_t);
 
 #endif /* _CHANGEFILE_H_ */
@@ -13,6 +13,7 @@
 #ifndef _CHANGEFILEINT_H_
 #define _CHANGEFILEINT_H_ 1
 
+#include "changefile.h"
 #include "sysdep_int.h"
 
 #define CRC_UNIT_BITS 8
@@ -24,7 +25,9 @@
 #define CF_MAGIC_1      0xdeadbeef
 #define CF_MAGIC_2      0xfeedf00d
 #define CF_MAGIC_3      0x3a070045
+#define CF_MAGIC_4      0x3a07005a
 #define CF_VERSION_1    1
+#define CF_VERSION_2    2
 #define CF_HEADER_DIRTY 1
 typedef struct change_file_header {
     uint32_t cf_magic;           /* 0x00 - magic */
@@ -34,16 +37,187 @@ typedef struct change_file_header {
     uint64_t cf_used_blocks;     /* 0x10 - used blocks */
     uint32_t cf_blockmap_offset; /* 0x18 - blockmap offset */
     uint32_t cf_magic2;          /* 0x1c - magic2 */
-} cf_header_t;                   /* 0x20 - total size */
+    /* Version 2 and later */
+    uint64_t cf_data_end;     /* 0x20 - logical end of block data */
+    uint32_t cf_features;     /* 0x28 - CF_FEATURE_* */
+    uint32_t cf_dedup_count;  /* 0x2c - dedup table entries */
+    uint64_t cf_dedup_offset; /* 0x30 - dedup table offset */
+    uint32_t cf_generation;   /* 0x38 - generation of current writes */
+    uint32_t cf_reserved;     /* 0x3c - reserved (zero) */
+} cf_header_t;                /* 0x40 - total size */
+
+#define CF_FEATURES_KNOWN                                                \
+    (CF_FEATURE_DEDUP | CF_FEATURE_COMPRESS | CF_FEATURE_GENERATIONS | \
+     CF_FEATURE_ZERO)
+
+/*
+ * Zero blocks.  Files with CF_FEATURE_ZERO mark a block written with zeros
+ * by this block map entry instead of storing a record for it.  No record
+ * starts this low in the file.
+ *
+ * Records start at even offsets.  A block that had a record when it was
+ * zeroed keeps it, marked by or-ing CF_ZERO_RECORD into its offset, so the
+ * next write to the block reuses the space instead of appending.  Dedup
+ * files give the record back to the dedup table instead.
+ */
+#define CF_ZERO_RECORD      1ULL
+#define CF_ENTRY_ZERO(_e)   (((_e)&CF_ZERO_RECORD) != 0)
+#define CF_ENTRY_RECORD(_e) ((_e) & ~CF_ZERO_RECORD)
+
+/*
+ * Generation map.  Files with CF_FEATURE_GENERATIONS keep, right after the
+ * blockmap, the generation that last wrote each block (0 == never).  New
+ * files start at generation 1; cfsend moves on to the next one.
+ */
+#define CF_GENERATION_INITIAL 1
+#define CF_GENMAP_OFFSET(_h) \
+    ((_h)->cf_blockmap_offset + ((_h)->cf_total_blocks * sizeof(uint64_t)))
+
+/*
+ * Version 1 headers stop at cf_magic2.
+ */
+#define CF_HEADER_V1_SIZE 0x20
+#define CF_HEADER_SIZE(_h)                                    \
+    (((_h)->cf_version >= CF_VERSION_2) ? sizeof(cf_header_t) \
+                                        : CF_HEADER_V1_SIZE)
+
+/*
+ * Preallocation extent limits.  Each extent is an eighth of the current
+ * data size, clamped to these, and halved for each time preallocation has
+ * failed for want of space.  After CF_PREALLOC_TRIES such failures it is
+ * given up.
+ */
+#define CF_PREALLOC_MIN   (16ULL * 1024 * 1024)
+#define CF_PREALLOC_MAX   (1024ULL * 1024 * 1024)
+#define CF_PREALLOC_TRIES 4
+
+#define CFC_NO_PREALLOC   0x0001 /* Preallocation unavailable */
+#define CFC_SHARED_BLOCKS 0x0002 /* Records may back several blocks */
+#define CFC_VOLATILE      0x0004 /* No top layer; writes stay in memory */
+#define CFC_READONLY      0x0008 /* No top layer; writes are refused */
+
+/*
+ * Change file chains.  The lower layers are read-only and their blockmaps
+ * are merged at open into one index of (layer, offset) per block.  A
+ * separator that is part of a path is escaped.
+ */
+#define CF_CHAIN_SEPARATOR   ':'
+#define CF_CHAIN_ESCAPE      '\\'
+#define CF_CHAIN_MAX_LAYERS  0xffff
+#define CF_CHAIN_LAYER_SHIFT 48
+#define CF_CHAIN_OFFSET_MASK ((1ULL << CF_CHAIN_LAYER_SHIFT) - 1)
+#define CF_CHAIN_ENTRY(_l, _o) \
+    ((((uint64_t)(_l)) << CF_CHAIN_LAYER_SHIFT) | (_o))
+#define CF_CHAIN_LAYER(_e)  ((_e) >> CF_CHAIN_LAYER_SHIFT)
+#define CF_CHAIN_OFFSET(_e) ((_e)&CF_CHAIN_OFFSET_MASK)
+
+/*
+ * Dedup table.  There is one entry per stored record of a dedup change
+ * file, giving its content hash and how many blocks refer to it.  On disk
+ * the entries live in a region of CF_DEDUP_CAPACITY(cf_dedup_count) entries
+ * which moves to the end of the data when it fills.
+ */
+typedef struct change_file_dedup_entry {
+    uint64_t cfd_hash[2]; /* 0x00 - content hash */
+    uint64_t cfd_offset;  /* 0x10 - record offset */
+    uint32_t cfd_refs;    /* 0x18 - referring blocks (0 == free) */
+    uint32_t cfd_pad;     /* 0x1c - reserved (zero) */
+} cf_dedup_entry_t;       /* 0x20 - total size */
+
+#define CF_DEDUP_MIN_CAPACITY 1024
+#define CF_DEDUP_CAPACITY(_n)                                                 \
+    (((_n) <= CF_DEDUP_MIN_CAPACITY) ? CF_DEDUP_MIN_CAPACITY                  \
+                                     : (1ULL << (64 - __builtin_clzll((_n)-1))))
+
+typedef struct change_file_dedup_table {
+    cf_dedup_entry_t *cdt_entries;  /* entries, by record */
+    uint32_t *        cdt_byhash;   /* entry index + 1, by content hash */
+    uint32_t *        cdt_byoffset; /* entry index + 1, by record offset */
+    uint32_t *        cdt_free;     /* unreferenced, reusable entries */
+    uint32_t *        cdt_pending;  /* unreferenced since the last sync */
+    uint64_t          cdt_nslots;   /* slots per index */
+    uint32_t          cdt_count;    /* entries in use */
+    uint32_t          cdt_capacity; /* entries allocated */
+    uint32_t          cdt_nfree;
+    uint32_t          cdt_npending;
+    uint32_t          cdt_ondisk;   /* entries the on-disk region holds */
+} cf_dedup_table_t;
+
+/*
+ * Volatile change files.  The blocks written to one are kept in an index
+ * by block number, open-addressed, of where their data is: in memory, in
+ * chunks of CF_VOLATILE_CHUNK blocks up to the limit of cf_volatile_limit(),
+ * or in an unlinked spill file past it.  The data of a block zeroed again
+ * is reused.  Entries take the place of blockmap entries, so an entry of
+ * CF_ZERO_RECORD marks zeros and 0 is no entry.
+ */
+#define CF_VOLATILE_CHUNK     256
+#define CF_VOLATILE_MIN_SLOTS 1024
+#define CF_VOLATILE_SPILLED   (1ULL << 63) /* the rest is a spill file slot */
+#define CF_VOLATILE_MEMORY    2ULL         /* memory slots start here */
+
+typedef struct change_file_volatile_entry {
+    uint64_t cve_block; /* block number + 1 (0 == empty slot) */
+    uint64_t cve_data;  /* CF_ZERO_RECORD, or where the data is */
+} cf_volatile_entry_t;
+
+typedef struct change_file_volatile_table {
+    cf_volatile_entry_t *cvt_entries; /* by block number */
+    uint64_t             cvt_nslots;
+    uint64_t             cvt_count;   /* blocks held */
+    char **              cvt_chunks;  /* memory slots */
+    uint64_t             cvt_nchunks;
+    uint64_t             cvt_chunkcap;
+    uint64_t             cvt_nmemory; /* memory slots made */
+    uint64_t             cvt_nspill;  /* spill file slots made */
+    uint64_t *           cvt_free;    /* slots of blocks zeroed again */
+    uint64_t             cvt_nfree;
+    uint64_t             cvt_freecap;
+    void *               cvt_spill;   /* spill file (opened when needed) */
+} cf_volatile_table_t;
+
+/*
+ * Locking.  Block reads and writes hold cfc_lock shared and whole-file
+ * operations (sync, commit) hold it exclusive.  Compaction copies under
+ * the shared lock, a chunk at a time, and holds it exclusive only to copy
+ * again the blocks written meanwhile and to swap files.  A block is
+ * guarded by its stripe lock: shared to read it, exclusive to write it.
+ * Compressed records go through the stripe's scratch buffer, so their
+ * reads hold it exclusive too.
+ * Dedup writes are serialized on cfc_dedup_lock.  cfc_alloc_lock guards
+ * the logical end of the data and the other header fields blocks share,
+ * and the index of a volatile change file.  Locks are taken in that order.
+ */
+#define CF_LOCK_STRIPES 64
+#define CF_STRIPE(_cfp, _b) ((_cfp)->cfc_stripes[(_b) % CF_LOCK_STRIPES])
 
 typedef struct change_file_context {
     cf_header_t              cfc_header;
     const sysdep_dispatch_t *cfc_sysdep;
     void *                   cfc_fd;
+    char *                   cfc_path; /* of the top layer */
     uint64_t *               cfc_blockmap;
     uint64_t                 cfc_blocksize;
     uint64_t                 cfc_blockcount;
     uint64_t                 cfc_curpos;
+    uint64_t                 cfc_alloc_end;
+    uint32_t                 cfc_alloc_fails; /* preallocations refused */
+    void **                  cfc_layers;
+    uint64_t *               cfc_chainmap;
+    uint32_t                 cfc_nlayers;
+    uint32_t                 cfc_flags;
+    uint32_t                 cfc_features; /* of all layers */
+    uint32_t *               cfc_lfeatures;
+    cf_dedup_table_t *       cfc_dedup;
+    void *                   cfc_dedup_buf;   /* under cfc_dedup_lock */
+    unsigned char *          cfc_zbufs;       /* per stripe, of CF_ZBUF_SIZE */
+    uint32_t *               cfc_genmap;      /* of the top layer */
+    uint64_t *               cfc_compact_map; /* written while compacting */
+    cf_volatile_table_t *    cfc_volatile;
+    void *                   cfc_lock;
+    void *                   cfc_dedup_lock;
+    void *                   cfc_alloc_lock;
+    void *                   cfc_stripes[CF_LOCK_STRIPES];
     uint32_t                 cfc_crc_tab32[CRC_TABLE_LEN];
 } cf_context_t;
 
@@ -53,4 +227,65 @@ typedef struct change_file_block_trailer {
     uint32_t cfb_magic;
 } cf_block_trailer_t;
 
+/*
+ * Compressed change files have variable-length records.  Their trailer
+ * leads the record so that the stored length is known before the data is
+ * read.  Records get some room to grow so rewrites can usually stay in
+ * place.
+ */
+typedef struct change_file_zblock_trailer {
+    uint64_t cfb_curblock;
+    uint32_t cfb_crc;    /* of the uncompressed block */
+    uint32_t cfb_magic;  /* CF_MAGIC_4 */
+    uint32_t cfb_length; /* stored length (block size: not compressed) */
+    uint32_t cfb_space;  /* room for the stored block */
+} cf_zblock_trailer_t;
+
+#define CF_ZSPACE_ROUND 64
+
+/*
+ * Room for a compressed record and its trailer.  Each lock stripe has a
+ * scratch buffer of this size.
+ */
+#define CF_ZBUF_SIZE(_cfp) (sizeof(cf_zblock_trailer_t) + (_cfp)->cfc_blocksize)
+
+/*
+ * Compaction writes a new top layer next to the old one.
+ */
+#define CF_COMPACT_SUFFIX ".compact"
+#define CF_COMPACT_CHUNK  1024 /* blocks copied per hold of cfc_lock */
+
+/*
+ * Committing writes runs of consecutive changed blocks to the target with
+ * one write of up to this many bytes.
+ */
+#define CF_COMMIT_BYTES (1024 * 1024)
+
+/*
+ * Change streams.  cfsend writes the blocks written since a generation as a
+ * stream header, then one record per block followed by its payload, then an
+ * end record.  Payloads are compressed when that makes them smaller.  The
+ * stream applies to a copy that has received everything up to css_base.
+ */
+#define CF_STREAM_MAGIC   0x3a0700c5
+#define CF_STREAM_VERSION 1
+#define CF_STREAM_END     (~0ULL)
+typedef struct change_stream_header {
+    uint32_t css_magic;        /* 0x00 - magic */
+    uint16_t css_version;      /* 0x04 - version */
+    uint16_t css_flags;        /* 0x06 - flags (zero) */
+    uint64_t css_blocksize;    /* 0x08 - block size */
+    uint64_t css_total_blocks; /* 0x10 - total blocks */
+    uint32_t css_features;     /* 0x18 - CF_FEATURE_* of the sender */
+    uint32_t css_base;         /* 0x1c - generation already received */
+    uint32_t css_generation;   /* 0x20 - generation the stream brings */
+    uint32_t css_crc;          /* 0x24 - of the preceding fields */
+} cf_stream_header_t;          /* 0x28 - total size */
+
+typedef struct change_stream_record {
+    uint64_t csr_block;  /* 0x00 - block number (CF_STREAM_END: end) */
+    uint32_t csr_length; /* 0x08 - payload length (block size: raw) */
+    uint32_t csr_crc;    /* 0x0c - of the block (end: of the stream) */
+} cf_stream_record_t;    /* 0x10 - total size */
+
 #endif /* _CHANGEFILEINT_H_ */
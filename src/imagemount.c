@@ -14,25 +14,45 @@
 #    include "config.h"
 #endif /* HAVE_CONFIG_H */
 #include <arpa/inet.h>
+#include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
 #include <inttypes.h>
 #include <linux/nbd.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#ifdef HAVE_LINUX_NBD_NETLINK_H
+#    include <linux/genetlink.h>
+#    include <linux/nbd-netlink.h>
+#    include <linux/netlink.h>
+#endif /* HAVE_LINUX_NBD_NETLINK_H */
+#include <pthread.h>
 #include <signal.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
 #include <sys/mount.h>
+#include <sys/signalfd.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 #include <syslog.h>
 #include <unistd.h>
 #ifdef HAVE_SYS_CAPABILITY_H
 #    include <sys/capability.h>
 #endif /* HAVE_SYS_CAPABILITY_H */
+#include "changefile.h"
+#include "imagemount.h"
 #include "libimage.h"
 #include "sysdep_posix.h"
 
@@ -40,15 +60,6 @@
 #    define RUNDIR "/var/run"
 #endif /* RUNDIR */
 
-/*
- * Initial size of the read buffer.  Grows to larger values as required.
- */
-#define READBUF_INITIAL 8192
-/*
- * NTOHLL - ntohl for 64 bit values.
- */
-#define NTOHLL(_x) be64toh(_x)
-
 #ifdef HAVE_SYS_CAPABILITY_H
 /*
  * List of required capabilities.
@@ -59,27 +70,60 @@ static const cap_value_t required_capabilities[] = {
 #endif /* HAVE_SYS_CAPABILITY_H */
 
 /*
- * Run context for program.
- */
-typedef struct nbd_context {
-    char *   svc_progname;
-    char *   svc_mount;
-    char *   svc_mtype;
-    char *   nbd_dev;
-    int      nbd_fh;
-    int      nbd_timeout;
-    int      svc_fh;
-    int      svc_verbose;
-    int      svc_daemon_mode;
-    int      svc_rdonly;
-    int      svc_tolerant;
-    int      svc_raw_available;
-    uint64_t svc_blocksize;
-    uint64_t svc_blockcount;
-    uint64_t svc_offsetmask;
-    uint64_t svc_blockmask;
-    pid_t    svc_toreap;
-} nbd_context_t;
+ * Change file options.
+ */
+static const struct {
+    const char *name;
+    uint32_t    feature;
+} cf_options[] = {
+    {"dedup", CF_FEATURE_DEDUP},
+    {"compress", CF_FEATURE_COMPRESS},
+    {"volatile", CF_FEATURE_VOLATILE},
+};
+
+#define CF_NOPTIONS (sizeof(cf_options) / sizeof(cf_options[0]))
+
+/*
+ * Parse a comma-separated list of change file options.  volatile may be
+ * given how many megabytes of blocks to keep in memory.
+ */
+static int
+parse_cf_options(const char *optstr, uint32_t *featuresp) {
+    const char *cp = optstr;
+
+    while (*cp) {
+        size_t len  = strcspn(cp, ",");
+        size_t nlen = strcspn(cp, ",=");
+        size_t oi;
+
+        for (oi = 0; oi < CF_NOPTIONS; oi++) {
+            if ((strlen(cf_options[oi].name) == nlen) &&
+                !strncmp(cp, cf_options[oi].name, nlen))
+                break;
+        }
+        if ((oi < CF_NOPTIONS) && (nlen < len)) {
+            char *             ep;
+            unsigned long long mb = strtoull(cp + nlen + 1, &ep, 10);
+
+            if ((cf_options[oi].feature == CF_FEATURE_VOLATILE) &&
+                (ep == cp + len) && (ep > cp + nlen + 1))
+                cf_volatile_limit(mb * 1024 * 1024);
+            else
+                oi = CF_NOPTIONS;
+        }
+        if (oi == CF_NOPTIONS) {
+            fprintf(stderr, "unknown change file option \"%.*s\"\n", (int)len,
+                    cp);
+            return EINVAL;
+        }
+        *featuresp |= cf_options[oi].feature;
+        cp += len;
+        if (*cp == ',')
+            cp++;
+    }
+
+    return 0;
+}
 
 /*
  * Initialize the interface to syslog (if required).
@@ -94,7 +138,7 @@ loginit(nbd_context_t *ncp) {
  * Generate a log message if the level threshold is met.  If running in
  * daemon mode, use syslog, otherwise log to stderr.
  */
-static void
+void
 logmsg(nbd_context_t *ncp, int level, char *fmt, ...) {
     va_list ap;
 
@@ -168,6 +212,300 @@ nbdev_open(nbd_context_t *ncp) {
     return error;
 }
 
+/*
+ * Take the device geometry from the image.
+ */
+static inline void
+nbd_geometry(nbd_context_t *ncp, void *pctx) {
+    ncp->svc_blocksize  = image_blocksize(pctx);
+    ncp->svc_blockcount = image_blockcount(pctx);
+    ncp->svc_offsetmask = ncp->svc_blocksize - 1;
+    ncp->svc_blockmask  = ~ncp->svc_offsetmask;
+}
+
+/*
+ * Transmission flags for the image.
+ */
+uint16_t
+nbd_export_flags(nbd_context_t *ncp) {
+    uint16_t flags = NBD_FLAG_HAS_FLAGS | NBD_FLAG_CAN_MULTI_CONN;
+
+    if (ncp->svc_rdonly)
+        flags |= NBD_FLAG_READ_ONLY;
+    else
+        flags |= NBD_FLAG_SEND_FLUSH | NBD_FLAG_SEND_FUA | NBD_FLAG_SEND_TRIM |
+                 NBD_FLAG_SEND_WRITE_ZEROES;
+    return flags;
+}
+
+#ifdef HAVE_LINUX_NBD_NETLINK_H
+/*
+ * Generic netlink interface to the nbd driver.
+ */
+
+/*
+ * A generic netlink message with room for the attributes of a connect
+ * with NBD_MAX_CONNECTIONS sockets.
+ */
+typedef struct nbd_nlmsg {
+    struct nlmsghdr   nm_hdr;
+    struct genlmsghdr nm_genl;
+    char              nm_attrs[1024];
+} nbd_nlmsg_t;
+
+/*
+ * Start a request message.
+ */
+static void
+nbd_nl_init(nbd_nlmsg_t *nmp, uint16_t family, uint8_t cmd, uint8_t version) {
+    memset(nmp, 0, sizeof(*nmp));
+    nmp->nm_hdr.nlmsg_len   = NLMSG_LENGTH(GENL_HDRLEN);
+    nmp->nm_hdr.nlmsg_type  = family;
+    nmp->nm_hdr.nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+    nmp->nm_genl.cmd        = cmd;
+    nmp->nm_genl.version    = version;
+}
+
+/*
+ * Append an attribute.  A nested attribute is put with no data, and its
+ * length is fixed up by nbd_nl_nest_end once its members are in.
+ */
+static struct nlattr *
+nbd_nl_put(nbd_nlmsg_t *nmp, uint16_t type, const void *data, size_t len) {
+    struct nlattr *nla =
+        (struct nlattr *)((char *)nmp + NLMSG_ALIGN(nmp->nm_hdr.nlmsg_len));
+
+    nla->nla_type = type;
+    nla->nla_len  = NLA_HDRLEN + len;
+    if (len)
+        memcpy((char *)nla + NLA_HDRLEN, data, len);
+    nmp->nm_hdr.nlmsg_len =
+        NLMSG_ALIGN(nmp->nm_hdr.nlmsg_len) + NLA_ALIGN(nla->nla_len);
+
+    return nla;
+}
+
+static inline void
+nbd_nl_nest_end(nbd_nlmsg_t *nmp, struct nlattr *nla) {
+    nla->nla_len = (char *)nmp + nmp->nm_hdr.nlmsg_len - (char *)nla;
+}
+
+/*
+ * Open a generic netlink socket.
+ */
+static int
+nbd_nl_open(int *sockp) {
+    struct sockaddr_nl sa;
+    int                error = 0;
+
+    if ((*sockp = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC,
+                         NETLINK_GENERIC)) < 0)
+        return errno;
+    memset(&sa, 0, sizeof(sa));
+    sa.nl_family = AF_NETLINK;
+    if (bind(*sockp, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+        error = errno;
+        close(*sockp);
+        *sockp = -1;
+    }
+
+    return error;
+}
+
+/*
+ * Send a request and wait for its acknowledgement.  The first reply
+ * before that is copied to replyp, if given.
+ */
+static int
+nbd_nl_transact(int sock, nbd_nlmsg_t *nmp, nbd_nlmsg_t *replyp) {
+    struct sockaddr_nl sa;
+    struct nlmsghdr *  nlh;
+    uint32_t           buf[2048];
+    int                rlen;
+    int                acked = 0;
+    int                error = 0;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.nl_family = AF_NETLINK;
+    if (sendto(sock, nmp, nmp->nm_hdr.nlmsg_len, 0, (struct sockaddr *)&sa,
+               sizeof(sa)) < 0)
+        return errno;
+    while (!acked) {
+        if ((rlen = recv(sock, buf, sizeof(buf), 0)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return errno;
+        }
+        for (nlh = (struct nlmsghdr *)buf; !acked && NLMSG_OK(nlh, rlen);
+             nlh = NLMSG_NEXT(nlh, rlen)) {
+            if (nlh->nlmsg_type == NLMSG_ERROR) {
+                error = -((struct nlmsgerr *)NLMSG_DATA(nlh))->error;
+                acked = 1;
+            } else if (replyp && (nlh->nlmsg_len <= sizeof(*replyp))) {
+                memcpy(replyp, nlh, nlh->nlmsg_len);
+                replyp = (nbd_nlmsg_t *)NULL;
+            }
+        }
+    }
+
+    return error;
+}
+
+/*
+ * Look up the generic netlink family of the nbd driver.
+ */
+static int
+nbd_nl_family(int sock, uint16_t *familyp) {
+    nbd_nlmsg_t    msg, reply;
+    struct nlattr *nla;
+    int            remaining;
+    int            error;
+
+    nbd_nl_init(&msg, GENL_ID_CTRL, CTRL_CMD_GETFAMILY, 1);
+    nbd_nl_put(&msg, CTRL_ATTR_FAMILY_NAME, NBD_GENL_FAMILY_NAME,
+               sizeof(NBD_GENL_FAMILY_NAME));
+    memset(&reply, 0, sizeof(reply));
+    if ((error = nbd_nl_transact(sock, &msg, &reply)) == 0) {
+        error     = ENOENT;
+        nla       = (struct nlattr *)reply.nm_attrs;
+        remaining = (int)reply.nm_hdr.nlmsg_len - NLMSG_LENGTH(GENL_HDRLEN);
+        while ((remaining >= NLA_HDRLEN) && (nla->nla_len >= NLA_HDRLEN) &&
+               (nla->nla_len <= remaining)) {
+            if ((nla->nla_type & NLA_TYPE_MASK) == CTRL_ATTR_FAMILY_ID) {
+                memcpy(familyp, (char *)nla + NLA_HDRLEN, sizeof(*familyp));
+                error = 0;
+                break;
+            }
+            remaining -= NLA_ALIGN(nla->nla_len);
+            nla = (struct nlattr *)((char *)nla + NLA_ALIGN(nla->nla_len));
+        }
+    }
+
+    return error;
+}
+
+/*
+ * The device index is the number at the end of the device name.
+ */
+static int
+nbd_nl_index(nbd_context_t *ncp, uint32_t *indexp) {
+    const char *cp = ncp->nbd_dev + strlen(ncp->nbd_dev);
+
+    while ((cp > ncp->nbd_dev) && isdigit((unsigned char)cp[-1]))
+        cp--;
+    if (!*cp)
+        return EINVAL;
+    *indexp = (uint32_t)strtoul(cp, (char **)NULL, 10);
+
+    return 0;
+}
+
+/*
+ * Connect the nbd device over netlink with a socket per connection.  The
+ * kernel spreads its queues over the sockets and runs the device itself,
+ * so no child waits in NBD_DO_IT.
+ */
+static int
+nbd_nl_connect(nbd_context_t *ncp, void *pctx) {
+    int            kfh[NBD_MAX_CONNECTIONS];
+    int            nlsock = -1;
+    int            nopen  = 0;
+    int            error;
+    int            ci;
+    uint16_t       family;
+    uint32_t       index, fd;
+    uint64_t       value;
+    nbd_nlmsg_t    msg;
+    struct nlattr *socks, *item;
+
+    nbd_geometry(ncp, pctx);
+    if ((error = nbd_nl_index(ncp, &index)) == 0) {
+        for (ci = 0; !error && (ci < ncp->svc_nconns); ci++) {
+            int spair[2];
+
+            if (socketpair(PF_UNIX, SOCK_STREAM, 0, spair) == 0) {
+                kfh[ci]         = spair[0];
+                ncp->svc_fh[ci] = spair[1];
+                nopen++;
+            } else {
+                error = errno;
+            }
+        }
+        if (!error && ((error = nbd_nl_open(&nlsock)) == 0) &&
+            ((error = nbd_nl_family(nlsock, &family)) == 0)) {
+            nbd_nl_init(&msg, family, NBD_CMD_CONNECT, NBD_GENL_VERSION);
+            nbd_nl_put(&msg, NBD_ATTR_INDEX, &index, sizeof(index));
+            value = ncp->svc_blocksize * ncp->svc_blockcount;
+            nbd_nl_put(&msg, NBD_ATTR_SIZE_BYTES, &value, sizeof(value));
+            value = ncp->svc_blocksize;
+            nbd_nl_put(&msg, NBD_ATTR_BLOCK_SIZE_BYTES, &value, sizeof(value));
+            value = nbd_export_flags(ncp);
+            nbd_nl_put(&msg, NBD_ATTR_SERVER_FLAGS, &value, sizeof(value));
+            if (ncp->nbd_timeout >= 0) {
+                value = ncp->nbd_timeout;
+                nbd_nl_put(&msg, NBD_ATTR_TIMEOUT, &value, sizeof(value));
+                logmsg(ncp, 1, "NBD_TIMEOUT %d\n", ncp->nbd_timeout);
+            }
+            socks = nbd_nl_put(&msg, NBD_ATTR_SOCKETS | NLA_F_NESTED, NULL, 0);
+            for (ci = 0; ci < ncp->svc_nconns; ci++) {
+                item = nbd_nl_put(&msg, NBD_SOCK_ITEM | NLA_F_NESTED, NULL, 0);
+                fd   = kfh[ci];
+                nbd_nl_put(&msg, NBD_SOCK_FD, &fd, sizeof(fd));
+                nbd_nl_nest_end(&msg, item);
+            }
+            nbd_nl_nest_end(&msg, socks);
+            error = nbd_nl_transact(nlsock, &msg, (nbd_nlmsg_t *)NULL);
+        }
+        if (nlsock >= 0)
+            close(nlsock);
+        /*
+         * The kernel holds its own references to its ends.
+         */
+        for (ci = 0; ci < nopen; ci++) {
+            close(kfh[ci]);
+            if (error) {
+                close(ncp->svc_fh[ci]);
+                ncp->svc_fh[ci] = -1;
+            }
+        }
+    }
+    if (error)
+        logmsg(ncp, 1, "nbd_nl_connect: fail with %d (%s)\n", error,
+               strerror(error));
+    else
+        logmsg(ncp, 1, "nbd_nl_connect: %d connections\n", ncp->svc_nconns);
+    return error;
+}
+
+/*
+ * Disconnect the nbd device over netlink.
+ */
+static void
+nbd_nl_disconnect(nbd_context_t *ncp) {
+    int         nlsock = -1;
+    int         error;
+    uint16_t    family;
+    uint32_t    index;
+    nbd_nlmsg_t msg;
+
+    if (((error = nbd_nl_index(ncp, &index)) == 0) &&
+        ((error = nbd_nl_open(&nlsock)) == 0) &&
+        ((error = nbd_nl_family(nlsock, &family)) == 0)) {
+        nbd_nl_init(&msg, family, NBD_CMD_DISCONNECT, NBD_GENL_VERSION);
+        nbd_nl_put(&msg, NBD_ATTR_INDEX, &index, sizeof(index));
+        error = nbd_nl_transact(nlsock, &msg, (nbd_nlmsg_t *)NULL);
+    }
+    if (nlsock >= 0)
+        close(nlsock);
+    if (error) {
+        logmsg(ncp, 1, "nbd_disconnect: fail with %d (%s)\n", error,
+               strerror(error));
+    } else {
+        logmsg(ncp, 2, "nbd_disconnect\n");
+    }
+}
+#endif /* HAVE_LINUX_NBD_NETLINK_H */
+
 /*
  * Connect the nbd device.
  */
@@ -176,16 +514,17 @@ nbd_connect(nbd_context_t *ncp, void *pctx) {
     int spair[2];
     int error = EINVAL;
 
-    if (ncp && (ncp->svc_fh == -1)) {
+#ifdef HAVE_LINUX_NBD_NETLINK_H
+    if (ncp && ncp->nbd_netlink && (ncp->svc_fh[0] == -1))
+        return nbd_nl_connect(ncp, pctx);
+#endif /* HAVE_LINUX_NBD_NETLINK_H */
+    if (ncp && (ncp->svc_fh[0] == -1)) {
         if ((error = socketpair(PF_UNIX, SOCK_STREAM, 0, spair)) == 0) {
             if ((error = nbdev_open(ncp)) == 0) {
                 /*
                  * setup the nbd connection.
                  */
-                ncp->svc_blocksize  = image_blocksize(pctx);
-                ncp->svc_blockcount = image_blockcount(pctx);
-                ncp->svc_offsetmask = ncp->svc_blocksize - 1;
-                ncp->svc_blockmask  = ~ncp->svc_offsetmask;
+                nbd_geometry(ncp, pctx);
                 /*
                  * if requested, set NBD connection timeout - avoid slow NBD
                  * server disconnect
@@ -201,6 +540,17 @@ nbd_connect(nbd_context_t *ncp, void *pctx) {
                     }
                     logmsg(ncp, 1, "NBD_TIMEOUT %d\n", ncp->nbd_timeout);
                 }
+#ifdef NBD_SET_FLAGS
+                /*
+                 * Without flags the kernel never sends flushes.
+                 */
+                if (ioctl(ncp->nbd_fh, NBD_SET_FLAGS,
+                          (unsigned long)nbd_export_flags(ncp)) == -1)
+                    logmsg(ncp, 1,
+                           "nbd_connect: ioctl NBD_SET_FLAGS fail with %d "
+                           "(%s)\n",
+                           errno, strerror(errno));
+#endif /* NBD_SET_FLAGS */
                 if ((ioctl(ncp->nbd_fh, NBD_CLEAR_SOCK) == -1) ||
                     (ioctl(ncp->nbd_fh, NBD_SET_SOCK, spair[0]) == -1) ||
                     (ioctl(ncp->nbd_fh, NBD_SET_BLKSIZE, ncp->svc_blocksize) ==
@@ -237,7 +587,7 @@ nbd_connect(nbd_context_t *ncp, void *pctx) {
                          * spair[0] is connected to the nbd side of things.
                          */
                         close(spair[0]);
-                        ncp->svc_fh = spair[1];
+                        ncp->svc_fh[0] = spair[1];
                         break;
                     }
                 }
@@ -262,6 +612,12 @@ nbd_connect(nbd_context_t *ncp, void *pctx) {
  */
 static void
 nbd_disconnect(nbd_context_t *ncp, void *pctx) {
+#ifdef HAVE_LINUX_NBD_NETLINK_H
+    if (ncp->nbd_netlink) {
+        nbd_nl_disconnect(ncp);
+        return;
+    }
+#endif /* HAVE_LINUX_NBD_NETLINK_H */
     if (ioctl(ncp->nbd_fh, NBD_DISCONNECT) == -1) {
         logmsg(ncp, 1, "nbd_disconnect: fail with %d (%s)\n", errno,
                strerror(errno));
@@ -271,439 +627,2605 @@ nbd_disconnect(nbd_context_t *ncp, void *pctx) {
 }
 
 /*
- * Signal handling.
+ * Event loop.  Signals are blocked and taken from a signalfd alongside the
+ * sockets, so nothing has to be interrupted for them to be noticed.
  */
 
 /*
- * Handle termination signals.  Set finish flag and let service request loop
- * finish up and potentially umount the filesystem.
+ * Block the termination, compaction, statistics and child signals and
+ * open a descriptor to take them from.  The old signal mask is returned so
+ * that it can be restored.
  */
-static int *finishflag = (int *)NULL;
-void
-nbd_finish(int sig, siginfo_t *si, void *vp) {
-    if (finishflag)
-        *finishflag = 1;
+static int
+nbd_signals_open(int *fhp, sigset_t *oldmaskp) {
+    sigset_t sigs;
+    int      error;
+
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGINT);
+    sigaddset(&sigs, SIGHUP);
+    sigaddset(&sigs, SIGTERM);
+    sigaddset(&sigs, SIGQUIT);
+    sigaddset(&sigs, SIGUSR1);
+    sigaddset(&sigs, SIGUSR2);
+    sigaddset(&sigs, SIGCHLD);
+    if ((error = pthread_sigmask(SIG_BLOCK, &sigs, oldmaskp)) == 0) {
+        if ((*fhp = signalfd(-1, &sigs, SFD_NONBLOCK | SFD_CLOEXEC)) < 0) {
+            error = errno;
+            pthread_sigmask(SIG_SETMASK, oldmaskp, NULL);
+        }
+    }
+
+    return error;
 }
 
 /*
- * Handle child termination.  Set the toreapp value to allow the service
- * request preamble to reap the particular child.
+ * Close the signal descriptor and restore the signal mask.
  */
-static pid_t *toreapp = (pid_t *)NULL;
-static int *  diedp   = (int *)NULL;
 static void
-nbd_reapchild(int sig, siginfo_t *si, void *vp) {
-    if (si && si->si_pid && toreapp) {
-        *toreapp = si->si_pid;
-    }
-    if (diedp) {
-        (*diedp)++;
-    }
+nbd_signals_close(int fh, const sigset_t *oldmaskp) {
+    close(fh);
+    pthread_sigmask(SIG_SETMASK, oldmaskp, NULL);
 }
 
 /*
- * Handle NBD resquest
- *
- * The main work processing loop.  This is very
- * serial and very unrobust.
+ * Reap the children that have finished.  Returns nonzero if the one
+ * we're waiting for was among them.
  */
 static int
-nbd_service_requests(nbd_context_t *ncp, void *pctx) {
-    char *           readbuf      = (char *)malloc(READBUF_INITIAL);
-    char *           pidfile      = (char *)NULL;
-    size_t           readbuf_size = READBUF_INITIAL;
-    int              error        = 0;
-    volatile int     timetoleave  = 0;
-    volatile int     someonedied  = 0;
-    volatile pid_t   whodied      = 0;
-    struct sigaction newsig, oldsig;
-
-    /*
-     * Prepare termination signal handlers.
-     */
-    finishflag = (int *)&timetoleave;
-    memset(&newsig, 0, sizeof(newsig));
-    newsig.sa_sigaction = nbd_finish;
-    sigaction(SIGINT, &newsig, &oldsig);
-    sigaction(SIGHUP, &newsig, &oldsig);
-    sigaction(SIGTERM, &newsig, &oldsig);
-    sigaction(SIGQUIT, &newsig, &oldsig);
+nbd_reap_children(nbd_context_t *ncp) {
+    int   existat;
+    int   reaped = 0;
+    pid_t corpse;
 
-    /*
-     * Make sure we have a read buffer.
-     */
-    if (!readbuf) {
-        timetoleave = 3;
-        error       = ENOMEM;
+    while ((corpse = waitpid(-1, &existat, WNOHANG)) > 0) {
+        logmsg(ncp, 2, "%s: pid %d finished with %d\n", ncp->svc_progname,
+               corpse, existat);
+        if (ncp->svc_toreap == corpse) {
+            ncp->svc_toreap = 0;
+            reaped          = 1;
+        }
     }
 
-    /*
-     * If we're setting up a mount, then for a child to do the mount and
-     * prepare the signal handler to be notified when the child completes.
-     */
-    if (ncp->svc_mount) {
-        pid_t cpid;
+    return reaped;
+}
 
-        newsig.sa_sigaction = nbd_reapchild;
-        newsig.sa_flags     = SA_RESETHAND | SA_SIGINFO;
-        diedp               = (int *)&someonedied;
-        toreapp             = (pid_t *)&whodied;
-        sigaction(SIGCHLD, &newsig, &oldsig);
-        switch ((cpid = fork())) {
-        case 0:
-            exit(mount(ncp->nbd_dev, ncp->svc_mount,
-                       (ncp->svc_mtype) ? ncp->svc_mtype : "ext2",
-                       (ncp->svc_rdonly) ? MS_RDONLY : 0, ""));
+/*
+ * Take the signals that have arrived.  Termination signals ask us to
+ * leave, SIGUSR1 to compact the change files, SIGUSR2 to log the
+ * statistics, and finished children are reaped.  Returns nonzero
+ * if the child we're waiting for has finished.
+ */
+static int
+nbd_signals_take(nbd_context_t *ncp, int fh, int *leavep, int *compactp,
+                 int *statsp) {
+    struct signalfd_siginfo ssi;
+    int                     reaped = 0;
+
+    while (read(fh, &ssi, sizeof(ssi)) == sizeof(ssi)) {
+        switch (ssi.ssi_signo) {
+        case SIGUSR1:
+            *compactp = 1;
             break;
-        case -1:
-            error = errno;
-            logmsg(ncp, -1, "%s: cannot fork to mount: %s\n", ncp->svc_progname,
-                   strerror(error));
-            /*
-             * We ignore this failure.  Someone else can try the mount.
-             */
+        case SIGUSR2:
+            *statsp = 1;
+            break;
+        case SIGCHLD:
+            reaped |= nbd_reap_children(ncp);
             break;
         default:
-            ncp->svc_toreap = cpid;
+            if (!*leavep)
+                *leavep = 1;
             break;
         }
     }
 
-    /*
-     * create pid file
-     */
-    create_pid_file(ncp, getpid(), &pidfile);
+    return reaped;
+}
 
-    if (ncp->svc_mount) {
-        logmsg(ncp, 0, "Mount \"%s\" is ready.\n", ncp->svc_mount);
-        logmsg(ncp, 0,
-               "When finished with the imagemount, run `umount %s` then "
-               "`nbd-client -d %s to cleanup.\n",
-               ncp->svc_mount, ncp->nbd_dev);
-    } else if (ncp->nbd_dev) {
-        logmsg(ncp, 0, "Device \"%s\" is now ready for further operations.\n",
-               ncp->nbd_dev);
-        logmsg(ncp, 0,
-               "When finished with the imagemount, run `nbd-client -d %s` to "
-               "disconnect from the NBD server.\n",
-               ncp->nbd_dev);
-    }
-    /*
-     * Do work until we're completely done.
-     */
-    while (timetoleave < 3) {
-        struct nbd_request request;
-        size_t             rlength;
+/*
+ * Start the housekeeping timer.
+ */
+static int
+nbd_timer_open(int *fhp) {
+    struct itimerspec its;
+    int               error = 0;
 
-        /*
-         * If signalled that someone died, reap the child to avoid zombies.
-         */
-        if (someonedied) {
-            int   existat;
-            pid_t corpse;
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec    = NBD_HOUSEKEEPING;
+    its.it_interval.tv_sec = NBD_HOUSEKEEPING;
+    if ((*fhp = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) <
+        0)
+        return errno;
+    if (timerfd_settime(*fhp, 0, &its, NULL) < 0) {
+        error = errno;
+        close(*fhp);
+        *fhp = -1;
+    }
 
-            if (whodied) {
-                corpse = waitpid(whodied, &existat, WNOHANG);
-            } else {
-                corpse = wait(&existat);
-            }
-            someonedied = 0;
-            whodied     = 0;
-            logmsg(ncp, 2, "%s: pid %d finished with %d\n", ncp->svc_progname,
-                   corpse, existat);
-            if (ncp->svc_toreap == corpse)
-                ncp->svc_toreap = 0;
-        }
+    return error;
+}
 
-        /*
-         * Read a request.
-         */
-        if ((rlength = read(ncp->svc_fh, &request, sizeof(request))) ==
-            sizeof(request)) {
-            struct nbd_reply reply;
-            char *           replyappend = (char *)NULL;
-            /*
-             * Calculate the start/end blocks.
-             */
-            off_t    offset         = NTOHLL(request.from);
-            size_t   length         = ntohl(request.len);
-            uint64_t startblockoffs = offset & ncp->svc_blockmask;
-            uint64_t sboffs         = offset & ncp->svc_offsetmask;
-            uint64_t endblockoffs = (offset + length - 1) & ncp->svc_blockmask;
-            uint64_t eboffs       = (offset + length - 1) & ncp->svc_offsetmask;
-            uint64_t startblock   = startblockoffs / ncp->svc_blocksize;
-            uint64_t blockcount =
-                (endblockoffs - startblockoffs) / ncp->svc_blocksize;
-            uint64_t req_readbuf;
+/*
+ * Clear a timer or wakeup descriptor that has fired.
+ */
+static void
+nbd_event_clear(int fh) {
+    uint64_t count;
 
-            /*
-             * Adjust block count.
-             */
-            if (length)
-                blockcount++;
+    while (read(fh, &count, sizeof(count)) == sizeof(count))
+        ;
+}
 
-            /*
-             * Calculate the required read buffer and adjust if necessary.
-             */
-            if (endblockoffs > startblockoffs) {
-                req_readbuf = blockcount * ncp->svc_blocksize;
-                while (req_readbuf > readbuf_size) {
-                    char *nrbuf = malloc(req_readbuf);
-
-                    if (nrbuf) {
-                        readbuf_size = req_readbuf;
-                        free(readbuf);
-                        readbuf = nrbuf;
-                    } else {
-                        if (req_readbuf < 0x80000000UL) {
-                            logmsg(
-                                ncp, 0,
-                                "[%s] retrying allocation of %d byte buffer\n",
-                                ncp->svc_progname, req_readbuf);
-                            sleep(10);
-                        } else {
-                            logmsg(ncp, 0,
-                                   "[%s] not retrying allocation of %d byte "
-                                   "buffer\n",
-                                   ncp->svc_progname, req_readbuf);
-                            timetoleave = 1;
-                            error       = ENOMEM;
-                            break;
-                        }
-                    }
-                }
-            }
+/*
+ * Watch a descriptor for input.  The event carries ptr.
+ */
+static int
+nbd_event_add(nbd_pool_t *np, int fh, void *ptr) {
+    struct epoll_event ev;
 
-            /*
-             * Verify that the message was correctly formed.
-             */
-            if (request.magic == htonl(NBD_REQUEST_MAGIC)) {
-                switch (ntohl(request.type)) {
-                case NBD_CMD_DISC:
-                    logmsg(ncp, 1, "NBD_SHUTDOWN\n");
-                    timetoleave = 1;
-                    break;
-                case NBD_CMD_WRITE:
-                    logmsg(ncp, 1, "NBD_WRITE0x%x@0x%x\n", length, offset);
-                    if (sboffs) {
-                        /* partial leading block write, ech. */
-                        if (!(error = image_seek(pctx, startblock))) {
-                            error = image_readblocks(pctx, readbuf, 1);
-                        }
-                    } else {
-                        error = 0;
-                    }
-                    if (!error) {
-                        if ((eboffs != ncp->svc_offsetmask) &&
-                            (blockcount != 1)) {
-                            /* partial trailing block write, double ech. */
-                            if (!(error = image_seek(
-                                      pctx, startblock + blockcount - 1))) {
-                                error = image_readblocks(
-                                    pctx,
-                                    readbuf +
-                                        ((blockcount - 1) * ncp->svc_blocksize),
-                                    1);
-                            }
-                        }
-                        if (!error) {
-                            char *   rembp  = readbuf;
-                            uint64_t remlen = length;
-                            for ((rembp = readbuf, remlen = length);
-                                 !error && remlen;) {
-                                /*
-                                 * Retry the read if we're interrupted but not
-                                 * if it's time to leave.
-                                 */
-                                while (((rlength = read(ncp->svc_fh, rembp,
-                                                        remlen)) == -1) &&
-                                       (errno == EINTR) && (!timetoleave))
-                                    ;
-                                if (rlength == remlen) {
-                                    if (!(error =
-                                              image_seek(pctx, startblock)) &&
-                                        !(error = image_writeblocks(
-                                              pctx, readbuf, blockcount))) {
-                                        logmsg(
-                                            ncp, 2,
-                                            "NBD_WRITE image write success\n");
-                                    } else {
-                                        logmsg(
-                                            ncp, 1,
-                                            "NBD_WRITE: write fail %d (%s)\n",
-                                            error, strerror(error));
-                                    }
-                                } else {
-                                    if (rlength >= 0) {
-                                        logmsg(ncp, 1,
-                                               "NBD_WRITE fail: short read of "
-                                               "data\n");
-                                    } else {
-                                        error = errno;
-                                        logmsg(ncp, 1,
-                                               "NBD_WRITE fail: read fail %d "
-                                               "(%s)\n",
-                                               error, strerror(error));
-                                    }
-                                }
-                                remlen -= rlength;
-                                rembp += rlength;
-                            }
-                        } else {
-                            logmsg(ncp, 1,
-                                   "NBD_WRITE: priming read fail %d (%s)\n",
-                                   error, strerror(error));
-                        }
-                    } else {
-                        logmsg(ncp, 1,
-                               "NBD_WRITE: lead priming read fail %d (%s)\n",
-                               error, strerror(error));
-                    }
-                    break;
-                case NBD_CMD_READ:
-                    logmsg(ncp, 1, "NBD_READ 0x%x@0x%x\n", length, offset);
-                    if (!(error = image_seek(pctx, startblock)) &&
-                        !(error =
-                              image_readblocks(pctx, readbuf, blockcount))) {
-                        logmsg(ncp, 2, "NBD_READ image read success\n");
-                        replyappend = &readbuf[sboffs];
-                    } else {
-                        logmsg(ncp, 2, "NBD_READ image read fail %d (%s)\n",
-                               error, strerror(error));
-                    }
-                    break;
-                default:
-                    error = EINVAL;
-                    break;
-                }
+    memset(&ev, 0, sizeof(ev));
+    ev.events   = EPOLLIN;
+    ev.data.ptr = ptr;
 
-                reply.magic = htonl(NBD_REPLY_MAGIC);
-                reply.error = error;
-                memcpy(reply.handle, request.handle, 8);
+    return (epoll_ctl(np->np_epfh, EPOLL_CTL_ADD, fh, &ev) < 0) ? errno : 0;
+}
 
-                /*
-                 * Retry the write if we're interrupted but if it's not time
-                 * to leave.
+/*
+ * Watch a watched descriptor for something else: EPOLLIN for input, or
+ * EPOLLOUT for room to send.
+ */
+static int
+nbd_event_mod(nbd_pool_t *np, int fh, void *ptr, uint32_t events) {
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events   = events;
+    ev.data.ptr = ptr;
+
+    return (epoll_ctl(np->np_epfh, EPOLL_CTL_MOD, fh, &ev) < 0) ? errno : 0;
+}
+
+/*
+ * Stop watching a descriptor.
+ */
+static void
+nbd_event_del(nbd_pool_t *np, int fh) {
+    (void)epoll_ctl(np->np_epfh, EPOLL_CTL_DEL, fh, (struct epoll_event *)NULL);
+}
+
+/*
+ * Wake the event loop from a worker or handshake thread.
+ */
+static void
+nbd_pool_wake(nbd_pool_t *np) {
+    uint64_t one = 1;
+
+    /*
+     * The count only fails to go up if it is already huge, and then the
+     * loop is due to wake anyway.
+     */
+    if (write(np->np_wakefh, &one, sizeof(one)) < 0)
+        return;
+}
+
+/*
+ * Request worker pool.
+ */
+
+/*
+ * Take what a connection has for us into its input buffer, as much as
+ * there is room for in one call, without waiting for it.  Returns what
+ * recv returned.
+ */
+static ssize_t
+nbd_conn_fill(nbd_conn_t *cnp) {
+    ssize_t rlength;
+
+    if (!cnp->cn_input && !(cnp->cn_input = (char *)malloc(NBD_INPUT_SIZE))) {
+        errno = ENOMEM;
+        return -1;
+    }
+    if (cnp->cn_inhead) {
+        memmove(cnp->cn_input, &cnp->cn_input[cnp->cn_inhead],
+                cnp->cn_intail - cnp->cn_inhead);
+        cnp->cn_intail -= cnp->cn_inhead;
+        cnp->cn_inhead = 0;
+    }
+    if ((rlength = recv(cnp->cn_fh, &cnp->cn_input[cnp->cn_intail],
+                        NBD_INPUT_SIZE - cnp->cn_intail, MSG_DONTWAIT)) > 0)
+        cnp->cn_intail += rlength;
+
+    return rlength;
+}
+
+/*
+ * Does the job change the image?
+ */
+static inline int
+nbd_job_writes(const nbd_job_t *njp) {
+    return (njp->nj_command == NBD_CMD_WRITE) ||
+           (njp->nj_command == NBD_CMD_TRIM) ||
+           (njp->nj_command == NBD_CMD_WRITE_ZEROES);
+}
+
+/*
+ * Must these jobs run in arrival order?  They must if they touch a block of
+ * the same image in common and one of them writes it.
+ */
+static inline int
+nbd_job_conflicts(const nbd_job_t *a, const nbd_job_t *b) {
+    return (a->nj_conn->cn_export == b->nj_conn->cn_export) &&
+           (a->nj_startblock < b->nj_startblock + b->nj_blockcount) &&
+           (b->nj_startblock < a->nj_startblock + a->nj_blockcount) &&
+           (nbd_job_writes(a) || nbd_job_writes(b));
+}
+
+/*
+ * Find the oldest job that waits on no older one, unless an urgent job
+ * can run ahead of it.  Called with the pool lock held.
+ */
+static nbd_job_t *
+nbd_pool_runnable(nbd_pool_t *np) {
+    nbd_job_t *njp, *ojp;
+    nbd_job_t *first = (nbd_job_t *)NULL;
+
+    for (njp = np->np_head; njp; njp = njp->nj_next) {
+        if (njp->nj_running || (first && !njp->nj_urgent))
+            continue;
+        for (ojp = np->np_head; ojp != njp; ojp = ojp->nj_next) {
+            if (nbd_job_conflicts(ojp, njp))
+                break;
+        }
+        if (ojp != njp)
+            continue;
+        if (njp->nj_urgent) {
+            if (first)
+                first->nj_passed++;
+            return njp;
+        }
+        first = njp;
+        if (!np->np_urgent || (first->nj_passed >= NBD_QOS_PASSES))
+            break;
+    }
+
+    return first;
+}
+
+/*
+ * Mark a job as picked up.  Called with the pool lock held.
+ */
+static inline void
+nbd_job_start(nbd_pool_t *np, nbd_job_t *njp) {
+    njp->nj_running = 1;
+    if (njp->nj_urgent)
+        np->np_urgent--;
+}
+
+/*
+ * Read-modify-write support.  Fill the parts of the first and last block
+ * of a write that the request does not cover from the image.
+ */
+static int
+nbd_job_prime(nbd_pool_t *np, nbd_job_t *njp) {
+    nbd_export_t * exp   = njp->nj_conn->cn_export;
+    nbd_context_t *ncp   = exp->ex_ncp;
+    uint64_t       bsize = ncp->svc_blocksize;
+    uint64_t       eboffs =
+        (njp->nj_sboffs + njp->nj_length - 1) & ncp->svc_offsetmask;
+    char *lastbp = njp->nj_buf + (njp->nj_blockcount - 1) * bsize;
+    char *scratch;
+    int   error = 0;
+
+    if (njp->nj_sboffs || (eboffs != ncp->svc_offsetmask)) {
+        if ((scratch = (char *)malloc(bsize))) {
+            if (njp->nj_sboffs &&
+                !(error = nbd_image_read(exp, njp->nj_startblock, scratch,
+                                         1))) {
+                /* partial leading block write, ech. */
+                memcpy(njp->nj_buf, scratch, njp->nj_sboffs);
+            }
+            if (!error && (eboffs != ncp->svc_offsetmask) &&
+                !(error = nbd_image_read(exp,
+                                         njp->nj_startblock +
+                                             njp->nj_blockcount - 1,
+                                         scratch, 1))) {
+                /* partial trailing block write, double ech. */
+                memcpy(lastbp + eboffs + 1, scratch + eboffs + 1,
+                       bsize - eboffs - 1);
+            }
+            free(scratch);
+        } else {
+            error = ENOMEM;
+        }
+    }
+
+    return error;
+}
+
+/*
+ * Zero part of a block, by rewriting it.
+ */
+static int
+nbd_zero_partial(nbd_pool_t *np, nbd_export_t *exp, uint64_t blockno,
+                 uint64_t offset, uint64_t length) {
+    char *scratch;
+    int   error;
+
+    if (!(scratch = (char *)malloc(exp->ex_ncp->svc_blocksize)))
+        return ENOMEM;
+    if (!(error = nbd_image_read(exp, blockno, scratch, 1))) {
+        memset(scratch + offset, 0, length);
+        error = nbd_image_write(np, exp, blockno, scratch, 1);
+    }
+    free(scratch);
+
+    return error;
+}
+
+/*
+ * Zero the bytes that a trim or write zeroes request covers.  The blocks it
+ * covers whole are zeroed without writing any data.  Trims may leave the
+ * others alone, writing zeroes rewrites them.
+ */
+static int
+nbd_job_zero(nbd_pool_t *np, nbd_job_t *njp) {
+    nbd_export_t * exp   = njp->nj_conn->cn_export;
+    nbd_context_t *ncp   = exp->ex_ncp;
+    uint64_t       bsize = ncp->svc_blocksize;
+    uint64_t       first = njp->nj_startblock;
+    uint64_t       end   = njp->nj_startblock + njp->nj_blockcount;
+    uint64_t       tail;
+    int            trim  = (njp->nj_command == NBD_CMD_TRIM);
+    int            error = 0;
+
+    if (!njp->nj_length)
+        return 0;
+    tail = (njp->nj_sboffs + njp->nj_length) & ncp->svc_offsetmask;
+    if (njp->nj_sboffs) {
+        uint64_t length = bsize - njp->nj_sboffs;
+
+        if (length > njp->nj_length)
+            length = njp->nj_length;
+        if (!trim)
+            error = nbd_zero_partial(np, exp, first, njp->nj_sboffs, length);
+        first++;
+    }
+    if (!error && tail && (end > first)) {
+        end--;
+        if (!trim)
+            error = nbd_zero_partial(np, exp, end, 0, tail);
+    }
+    if (!error && (end > first)) {
+        nbd_wb_drop(exp, first, end - first);
+        error = image_zeroblocks_at(exp->ex_pctx, first, end - first);
+    }
+
+    return error;
+}
+
+/*
+ * Describe the allocation of the bytes that a block status request
+ * covers, as length and NBD_STATE_xxx pairs in the job buffer.
+ */
+static int
+nbd_job_extents(nbd_pool_t *np, nbd_job_t *njp, size_t *lengthp) {
+    nbd_export_t * exp       = njp->nj_conn->cn_export;
+    nbd_context_t *ncp       = exp->ex_ncp;
+    uint32_t *     desc      = (uint32_t *)njp->nj_buf;
+    uint64_t       offset    = NTOHLL(njp->nj_request.from);
+    uint64_t       end       = offset + njp->nj_length;
+    uint64_t       blockno   = njp->nj_startblock;
+    uint64_t       lastblock = njp->nj_startblock + njp->nj_blockcount;
+    uint64_t       count, stop;
+    uint32_t       maxdesc, ndesc, flags;
+    int            state, cached;
+
+    if (!njp->nj_conn->cn_context || !njp->nj_length)
+        return EINVAL;
+    maxdesc = (ntohl(njp->nj_request.type) & NBD_CMD_FLAG_REQ_ONE)
+                  ? 1
+                  : NBD_MAX_EXTENTS;
+    for (ndesc = 0; (blockno < lastblock) && (ndesc < maxdesc); ndesc++) {
+        if (((state = image_extent_at(exp->ex_pctx, blockno,
+                                      lastblock - blockno, &count)) < 0) ||
+            !count)
+            return EIO;
+        /*
+         * Blocks in the write-back cache hold data, whatever the image says.
+         */
+        if (state && exp->ex_wb) {
+            count = nbd_wb_span(exp->ex_wb, blockno, count, &cached,
+                                (char *)NULL);
+            if (cached)
+                state = 0;
+        }
+        blockno += count;
+        stop  = (blockno * ncp->svc_blocksize < end)
+                    ? blockno * ncp->svc_blocksize
+                    : end;
+        flags = ((state & IMAGE_EXTENT_HOLE) ? NBD_STATE_HOLE : 0) |
+                ((state & IMAGE_EXTENT_ZERO) ? NBD_STATE_ZERO : 0);
+        desc[2 * ndesc]     = htonl((uint32_t)(stop - offset));
+        desc[2 * ndesc + 1] = htonl(flags);
+        offset              = stop;
+    }
+    *lengthp = ndesc * 2 * sizeof(uint32_t);
+
+    return 0;
+}
+
+/*
+ * Make every write to an image that has finished durable, writing back
+ * its cache first.  Syncs are grouped: callers that arrive while one is
+ * running wait for it, then share the next one, so a burst of flushes
+ * costs at most two image syncs.
+ */
+static int
+nbd_pool_sync(nbd_pool_t *np, nbd_export_t *exp) {
+    uint64_t target;
+    int      error;
+
+    if ((error = nbd_wb_sync(exp)))
+        return error;
+    pthread_mutex_lock(&np->np_lock);
+    /*
+     * A sync that is already running may have started before our writes
+     * finished, so it takes one started from now on.
+     */
+    target = exp->ex_syncgen + 1;
+    while (exp->ex_syncdone < target) {
+        if (exp->ex_syncing) {
+            pthread_cond_wait(&np->np_syncwait, &np->np_lock);
+        } else {
+            uint64_t sync = ++exp->ex_syncgen;
+
+            exp->ex_syncing = 1;
+            pthread_mutex_unlock(&np->np_lock);
+            error = image_sync(exp->ex_pctx);
+            pthread_mutex_lock(&np->np_lock);
+            exp->ex_syncing  = 0;
+            exp->ex_syncerr  = error;
+            exp->ex_syncdone = sync;
+            pthread_cond_broadcast(&np->np_syncwait);
+        }
+    }
+    error = exp->ex_syncerr;
+    pthread_mutex_unlock(&np->np_lock);
+
+    return error;
+}
+
+/*
+ * Read a job's blocks into its buffer, leaving out the runs that are
+ * stored as is in the image file.  The reply sends those straight from
+ * there.
+ */
+static int
+nbd_job_read(nbd_pool_t *np, nbd_job_t *njp) {
+    nbd_export_t *exp     = njp->nj_conn->cn_export;
+    uint64_t      blockno = njp->nj_startblock;
+    uint64_t      nblocks = njp->nj_blockcount;
+    uint64_t      offset, count;
+    void *        fh;
+    int           error = 0;
+
+    while (!error && nblocks) {
+        if ((error = nbd_job_run_at(np, njp, blockno, &fh, &offset,
+                                    &count)) == 0)
+            njp->nj_direct = 1;
+        else if (error == ENOENT)
+            error = nbd_image_read(exp, blockno,
+                                   &njp->nj_buf[(blockno - njp->nj_startblock) *
+                                                exp->ex_ncp->svc_blocksize],
+                                   count);
+        blockno += count;
+        nblocks -= count;
+    }
+
+    return error;
+}
+
+/*
+ * Do the image I/O for a job and send its reply.
+ */
+static void
+nbd_job_run(nbd_pool_t *np, nbd_job_t *njp) {
+    nbd_export_t * exp         = njp->nj_conn->cn_export;
+    nbd_context_t *ncp         = exp->ex_ncp;
+    char *         replyappend = (char *)NULL;
+    size_t         replylength = njp->nj_length;
+    int            error       = 0;
+    int            rerror;
+
+    if (njp->nj_refused) {
+        if ((rerror = nbd_conn_reply(njp->nj_conn, &njp->nj_request,
+                                     njp->nj_refused, (void *)NULL, 0,
+                                     (nbd_job_t *)NULL)))
+            logmsg(ncp, 0, "[%s] reply write error: %s\n", ncp->svc_progname,
+                   strerror(rerror));
+        nbd_stats_done(exp, njp, 1);
+        return;
+    }
+
+    switch (njp->nj_command) {
+    case NBD_CMD_WRITE:
+        /*
+         * The kernel doesn't write to a read-only device, but other
+         * clients may try.
+         */
+        if (ncp->svc_rdonly) {
+            error = EPERM;
+        } else if (njp->nj_length &&
+                   (!(error = nbd_job_prime(np, njp)) &&
+                    !(error = nbd_image_write(np, exp, njp->nj_startblock,
+                                              njp->nj_buf,
+                                              njp->nj_blockcount)) &&
+                    (!(ntohl(njp->nj_request.type) & NBD_CMD_FLAG_FUA) ||
+                     !(error = nbd_pool_sync(np, exp))))) {
+            logmsg(ncp, 2, "NBD_WRITE image write success\n");
+        } else if (error) {
+            logmsg(ncp, 1, "NBD_WRITE: write fail %d (%s)\n", error,
+                   strerror(error));
+        }
+        break;
+    case NBD_CMD_READ:
+        if (!(error = nbd_job_read(np, njp))) {
+            logmsg(ncp, 2, "NBD_READ image read success\n");
+            replyappend = &njp->nj_buf[njp->nj_sboffs];
+        } else {
+            logmsg(ncp, 2, "NBD_READ image read fail %d (%s)\n", error,
+                   strerror(error));
+        }
+        break;
+    case NBD_CMD_FLUSH:
+        /*
+         * Writes are only replied to once they are done or cached, so
+         * whatever the client has seen finish gets written back and synced.
+         */
+        if (!ncp->svc_rdonly && (error = nbd_pool_sync(np, exp)))
+            logmsg(ncp, 1, "NBD_FLUSH: sync fail %d (%s)\n", error,
+                   strerror(error));
+        replylength = 0;
+        break;
+    case NBD_CMD_TRIM:
+    case NBD_CMD_WRITE_ZEROES:
+        if (ncp->svc_rdonly) {
+            error = EPERM;
+        } else if ((error = nbd_job_zero(np, njp)) ||
+                   ((ntohl(njp->nj_request.type) & NBD_CMD_FLAG_FUA) &&
+                    (error = nbd_pool_sync(np, exp)))) {
+            logmsg(ncp, 1, "NBD_%s: zero fail %d (%s)\n",
+                   (njp->nj_command == NBD_CMD_TRIM) ? "TRIM" : "WRITE_ZEROES",
+                   error, strerror(error));
+        }
+        replylength = 0;
+        break;
+    case NBD_CMD_BLOCK_STATUS:
+        if (!(error = nbd_job_extents(np, njp, &replylength)))
+            replyappend = njp->nj_buf;
+        break;
+    default:
+        error = EINVAL;
+        break;
+    }
+
+    if ((rerror = nbd_conn_reply(njp->nj_conn, &njp->nj_request, error,
+                                 replyappend, replylength,
+                                 (njp->nj_direct) ? njp : (nbd_job_t *)NULL))) {
+        logmsg(ncp, 0, "[%s] reply write error: %s\n", ncp->svc_progname,
+               strerror(rerror));
+    }
+    if (njp->nj_direct)
+        IMAGE_STATS_ADD(exp->ex_stats.st_direct, 1);
+    nbd_stats_done(exp, njp, error || rerror);
+}
+
+/*
+ * Gather queued reads that are next to or overlap a runnable one into a
+ * batch, to be read from the image at once.  Called with the pool lock
+ * held.
+ */
+static void
+nbd_pool_gather(nbd_pool_t *np, nbd_job_t *first) {
+    nbd_export_t *exp   = first->nj_conn->cn_export;
+    uint64_t      start = first->nj_startblock;
+    uint64_t      end   = first->nj_startblock + first->nj_blockcount;
+    uint64_t      jstart, jend;
+    nbd_job_t *   njp, *ojp;
+    nbd_job_t **  tailp = &first->nj_batch;
+    int           added;
+
+    first->nj_batch = (nbd_job_t *)NULL;
+    do {
+        added = 0;
+        for (njp = np->np_head; njp; njp = njp->nj_next) {
+            jstart = (njp->nj_startblock < start) ? njp->nj_startblock : start;
+            jend   = njp->nj_startblock + njp->nj_blockcount;
+            jend   = (jend > end) ? jend : end;
+            if (njp->nj_running || (njp->nj_command != NBD_CMD_READ) ||
+                !njp->nj_blockcount || (njp->nj_startblock > end) ||
+                (njp->nj_startblock + njp->nj_blockcount < start) ||
+                (njp->nj_conn->cn_export != first->nj_conn->cn_export) ||
+                ((jend - jstart) * exp->ex_ncp->svc_blocksize >
+                 NBD_MAX_REQUEST))
+                continue;
+            for (ojp = np->np_head; ojp != njp; ojp = ojp->nj_next) {
+                if (nbd_job_conflicts(ojp, njp))
+                    break;
+            }
+            if (ojp != njp)
+                continue;
+            nbd_job_start(np, njp);
+            njp->nj_batch = (nbd_job_t *)NULL;
+            *tailp        = njp;
+            tailp           = &njp->nj_batch;
+            start           = jstart;
+            end             = jend;
+            added           = 1;
+        }
+    } while (added);
+    first->nj_batchstart = start;
+    first->nj_batchcount = end - start;
+}
+
+/*
+ * Read a batch of reads with one call and reply to each from the one
+ * buffer.  If there is no buffer for all of it, run them one at a time.
+ */
+static void
+nbd_batch_run(nbd_pool_t *np, nbd_job_t *first) {
+    nbd_export_t * exp   = first->nj_conn->cn_export;
+    nbd_context_t *ncp   = exp->ex_ncp;
+    uint64_t       bsize = ncp->svc_blocksize;
+    size_t         size  = first->nj_batchcount * bsize;
+    char *         buf   = first->nj_buf;
+    nbd_job_t *    njp;
+    int            rerror, error;
+
+    if (size > first->nj_bufsize) {
+        pthread_mutex_lock(&np->np_lock);
+        buf = nbd_buf_take(np, size, &size);
+        pthread_mutex_unlock(&np->np_lock);
+    }
+    if (!buf) {
+        for (njp = first; njp; njp = njp->nj_batch)
+            nbd_job_run(np, njp);
+        return;
+    }
+
+    if ((rerror = nbd_image_read(exp, first->nj_batchstart, buf,
+                                 first->nj_batchcount)))
+        logmsg(ncp, 2, "NBD_READ batch read fail %d (%s)\n", rerror,
+               strerror(rerror));
+    for (njp = first; njp; njp = njp->nj_batch) {
+        if ((error = nbd_conn_reply(
+                 njp->nj_conn, &njp->nj_request, rerror,
+                 (rerror) ? (char *)NULL
+                          : &buf[(njp->nj_startblock - first->nj_batchstart) *
+                                     bsize +
+                                 njp->nj_sboffs],
+                 njp->nj_length, (nbd_job_t *)NULL))) {
+            logmsg(ncp, 0, "[%s] reply write error: %s\n", ncp->svc_progname,
+                   strerror(error));
+        }
+        IMAGE_STATS_ADD(exp->ex_stats.st_batched, 1);
+        nbd_stats_done(exp, njp, rerror || error);
+    }
+    if (buf != first->nj_buf) {
+        pthread_mutex_lock(&np->np_lock);
+        nbd_buf_give(np, buf, size);
+        pthread_mutex_unlock(&np->np_lock);
+    }
+}
+
+/*
+ * Take a finished job off the in-flight list and keep it for reuse.
+ * Called with the pool lock held.
+ */
+static void
+nbd_pool_retire(nbd_pool_t *np, nbd_job_t *njp) {
+    nbd_job_t *ojp, *pjp;
+
+    for (pjp = (nbd_job_t *)NULL, ojp = np->np_head; ojp != njp;
+         pjp = ojp, ojp = ojp->nj_next)
+        ;
+    if (pjp)
+        pjp->nj_next = njp->nj_next;
+    else
+        np->np_head = njp->nj_next;
+    if (np->np_tail == njp)
+        np->np_tail = pjp;
+    nbd_buf_give(np, njp->nj_buf, njp->nj_bufsize);
+    njp->nj_buf  = (char *)NULL;
+    njp->nj_next = np->np_free;
+    np->np_free  = njp;
+    np->np_inflight--;
+
+    /*
+     * Let the event loop go on with a connection that waits for a job,
+     * or free one that is done with.
+     */
+    if ((--njp->nj_conn->cn_inflight == 0) && njp->nj_conn->cn_done)
+        nbd_pool_wake(np);
+    if (np->np_stalled) {
+        np->np_stalled = 0;
+        nbd_pool_wake(np);
+    }
+}
+
+/*
+ * Worker thread.  Take runnable jobs until told to quit.  Reads next to
+ * the one taken are taken with it.
+ */
+static void *
+nbd_worker(void *arg) {
+    nbd_pool_t *np = (nbd_pool_t *)arg;
+    nbd_job_t * njp, *bjp;
+
+    pthread_mutex_lock(&np->np_lock);
+    for (;;) {
+        if (!(njp = nbd_pool_runnable(np))) {
+            if (np->np_quit)
+                break;
+            pthread_cond_wait(&np->np_work, &np->np_lock);
+            continue;
+        }
+        nbd_job_start(np, njp);
+        njp->nj_batch = (nbd_job_t *)NULL;
+        if ((njp->nj_command == NBD_CMD_READ) && !njp->nj_refused)
+            nbd_pool_gather(np, njp);
+        pthread_mutex_unlock(&np->np_lock);
+
+        if (njp->nj_batch)
+            nbd_batch_run(np, njp);
+        else
+            nbd_job_run(np, njp);
+
+        pthread_mutex_lock(&np->np_lock);
+        while ((bjp = njp)) {
+            njp = njp->nj_batch;
+            nbd_pool_retire(np, bjp);
+        }
+        /*
+         * Jobs waiting on this one may run now.
+         */
+        pthread_cond_broadcast(&np->np_work);
+        pthread_cond_broadcast(&np->np_done);
+    }
+    pthread_mutex_unlock(&np->np_lock);
+
+    return NULL;
+}
+
+/*
+ * Return an unqueued job for reuse.
+ */
+static void
+nbd_pool_put(nbd_pool_t *np, nbd_job_t *njp) {
+    pthread_mutex_lock(&np->np_lock);
+    nbd_buf_give(np, njp->nj_buf, njp->nj_bufsize);
+    njp->nj_buf  = (char *)NULL;
+    njp->nj_next = np->np_free;
+    np->np_free  = njp;
+    pthread_cond_broadcast(&np->np_done);
+    pthread_mutex_unlock(&np->np_lock);
+}
+
+/*
+ * Get a job for a request and size its buffer for the blocks that the
+ * request touches.  Returns EBUSY if too many are in flight or the
+ * buffer would go over the memory cap; the event loop is woken when a
+ * job finishes.
+ */
+static int
+nbd_pool_get(nbd_pool_t *np, nbd_conn_t *cnp, const struct nbd_request *rqp,
+             nbd_job_t **njpp) {
+    nbd_context_t *ncp    = cnp->cn_export->ex_ncp;
+    off_t          offset = NTOHLL(rqp->from);
+    size_t         length = ntohl(rqp->len);
+    uint64_t       startblockoffs = offset & ncp->svc_blockmask;
+    uint64_t       endblockoffs = (offset + length - 1) & ncp->svc_blockmask;
+    uint64_t       req_readbuf;
+    nbd_job_t *    njp;
+    int            error = 0;
+
+    pthread_mutex_lock(&np->np_lock);
+    if (np->np_inflight >= NBD_MAX_INFLIGHT) {
+        np->np_stalled = 1;
+        pthread_mutex_unlock(&np->np_lock);
+        return EBUSY;
+    }
+    if ((njp = np->np_free))
+        np->np_free = njp->nj_next;
+    pthread_mutex_unlock(&np->np_lock);
+    if (!njp && !(njp = (nbd_job_t *)calloc(1, sizeof(*njp))))
+        return ENOMEM;
+
+    njp->nj_next       = (nbd_job_t *)NULL;
+    njp->nj_arrived    = nbd_now();
+    njp->nj_request    = *rqp;
+    njp->nj_command    = ntohl(rqp->type) & NBD_CMD_MASK_COMMAND;
+    njp->nj_running    = 0;
+    njp->nj_direct     = 0;
+    njp->nj_refused    = 0;
+    njp->nj_conn       = cnp;
+    njp->nj_length     = length;
+    njp->nj_sboffs     = offset & ncp->svc_offsetmask;
+    njp->nj_startblock = startblockoffs / ncp->svc_blocksize;
+    njp->nj_blockcount =
+        (length) ? (endblockoffs - startblockoffs) / ncp->svc_blocksize + 1
+                 : 0;
+
+    /*
+     * Only reads and writes carry data, but block status fills the least
+     * buffer with extents.  The connection waits for buffers to be
+     * released rather than go over the memory cap.
+     */
+    req_readbuf = ((njp->nj_command == NBD_CMD_READ) ||
+                   (njp->nj_command == NBD_CMD_WRITE))
+                      ? njp->nj_blockcount * ncp->svc_blocksize
+                      : READBUF_INITIAL;
+    pthread_mutex_lock(&np->np_lock);
+    if (!(njp->nj_buf = nbd_buf_take(np, req_readbuf, &njp->nj_bufsize))) {
+        if (np->np_bufinuse) {
+            np->np_stalled = 1;
+            error          = EBUSY;
+        } else {
+            error = ENOMEM;
+        }
+    }
+    pthread_mutex_unlock(&np->np_lock);
+    if (error == ENOMEM)
+        logmsg(ncp, 0, "[%s] cannot allocate %" PRIu64 " byte buffer\n",
+               ncp->svc_progname, req_readbuf);
+
+    if (error) {
+        nbd_pool_put(np, njp);
+    } else {
+        /*
+         * A small read that doesn't carry on from the last one is most
+         * likely someone waiting on it.
+         */
+        njp->nj_urgent = (njp->nj_command == NBD_CMD_READ) &&
+                         (length <= NBD_QOS_SMALL) &&
+                         ((uint64_t)offset != cnp->cn_nextread);
+        njp->nj_passed = 0;
+        if (njp->nj_command == NBD_CMD_READ)
+            cnp->cn_nextread = offset + length;
+        *njpp = njp;
+    }
+
+    return error;
+}
+
+/*
+ * Queue a job for the workers.
+ */
+static void
+nbd_pool_submit(nbd_pool_t *np, nbd_job_t *njp) {
+    pthread_mutex_lock(&np->np_lock);
+    if (np->np_tail)
+        np->np_tail->nj_next = njp;
+    else
+        np->np_head = njp;
+    np->np_tail = njp;
+    np->np_inflight++;
+    if (njp->nj_urgent)
+        np->np_urgent++;
+    njp->nj_conn->cn_inflight++;
+    pthread_cond_signal(&np->np_work);
+    pthread_mutex_unlock(&np->np_lock);
+}
+
+/*
+ * Rate limiting.  Each export has a limit on requests and one on data a
+ * second, adjustable while it is served.  A connection whose export is
+ * over its limits waits like one waiting for a job, and a timer wakes
+ * the event loop when it may go on.
+ */
+
+/*
+ * Set a limit, or none for a rate of 0.  What was taken under the old one
+ * is forgiven.
+ */
+static inline void
+nbd_bucket_set(nbd_bucket_t *tbp, uint64_t rate) {
+    tbp->tb_rate = rate;
+    tbp->tb_due  = 0;
+}
+
+/*
+ * How long to wait before a request may go.
+ */
+static inline uint64_t
+nbd_bucket_wait(const nbd_bucket_t *tbp, uint64_t now) {
+    return (tbp->tb_rate && (tbp->tb_due > now + NBD_QOS_BURST))
+               ? tbp->tb_due - NBD_QOS_BURST - now
+               : 0;
+}
+
+/*
+ * Take tokens for a request that goes.
+ */
+static inline void
+nbd_bucket_take(nbd_bucket_t *tbp, uint64_t tokens, uint64_t now) {
+    if (tbp->tb_rate) {
+        if (tbp->tb_due < now)
+            tbp->tb_due = now;
+        tbp->tb_due += tokens * 1000000000ULL / tbp->tb_rate;
+    }
+}
+
+/*
+ * Set an export's limits, in requests and megabytes a second.
+ */
+static void
+nbd_qos_set(nbd_export_t *exp, int iops, int bandwidth) {
+    nbd_bucket_set(&exp->ex_iops, (iops > 0) ? iops : 0);
+    nbd_bucket_set(&exp->ex_bytes,
+                   (bandwidth > 0) ? (uint64_t)bandwidth << 20 : 0);
+}
+
+/*
+ * May a request for an export go now?  If not, returns EBUSY with the
+ * timer set to wake the event loop when it may.
+ */
+static int
+nbd_qos_admit(nbd_pool_t *np, const nbd_export_t *exp) {
+    struct itimerspec its;
+    uint64_t          now, wait, bwait;
+
+    if (!exp->ex_iops.tb_rate && !exp->ex_bytes.tb_rate)
+        return 0;
+    now   = nbd_now();
+    wait  = nbd_bucket_wait(&exp->ex_iops, now);
+    bwait = nbd_bucket_wait(&exp->ex_bytes, now);
+    if (bwait > wait)
+        wait = bwait;
+    if (!wait)
+        return 0;
+    if (!np->np_qosdue || (now + wait < np->np_qosdue)) {
+        np->np_qosdue = now + wait;
+        memset(&its, 0, sizeof(its));
+        its.it_value.tv_sec  = np->np_qosdue / 1000000000ULL;
+        its.it_value.tv_nsec = np->np_qosdue % 1000000000ULL;
+        (void)timerfd_settime(np->np_qosfh, TFD_TIMER_ABSTIME, &its, NULL);
+    }
+
+    return EBUSY;
+}
+
+/*
+ * Charge an export for a request that goes.  Only reads and writes count
+ * against the data rate.
+ */
+static inline void
+nbd_qos_charge(nbd_export_t *exp, uint32_t command, size_t length) {
+    uint64_t now;
+
+    if (exp->ex_iops.tb_rate || exp->ex_bytes.tb_rate) {
+        now = nbd_now();
+        nbd_bucket_take(&exp->ex_iops, 1, now);
+        if ((command == NBD_CMD_READ) || (command == NBD_CMD_WRITE))
+            nbd_bucket_take(&exp->ex_bytes, length, now);
+    }
+}
+
+/*
+ * Take the request at the head of a connection's input and queue it.
+ * Requests other than a disconnect are replied to by the workers, and
+ * the data of a write is left for nbd_conn_input to take.  Returns EBUSY,
+ * with the request left in the input, if it has to wait for a job or for
+ * its export's rate limits.
+ */
+static int
+nbd_conn_request(nbd_pool_t *np, nbd_conn_t *cnp) {
+    nbd_context_t *    ncp  = cnp->cn_export->ex_ncp;
+    uint64_t           size = ncp->svc_blocksize * ncp->svc_blockcount;
+    struct nbd_request request;
+    uint64_t           offset;
+    size_t             length;
+    uint32_t           command;
+    nbd_job_t *        njp;
+    int                error = 0;
+
+    memcpy(&request, &cnp->cn_input[cnp->cn_inhead], sizeof(request));
+    offset  = NTOHLL(request.from);
+    length  = ntohl(request.len);
+    command = ntohl(request.type) & NBD_CMD_MASK_COMMAND;
+
+    /*
+     * Verify that the message was correctly formed.
+     */
+    if ((request.magic == htonl(NBD_REQUEST_MAGIC)) &&
+        ((command == NBD_CMD_READ) || (command == NBD_CMD_WRITE)) &&
+        (length > NBD_MAX_REQUEST)) {
+        logmsg(ncp, 0, "[%s] request for 0x%zx bytes refused\n",
+               ncp->svc_progname, length);
+        error = EINVAL;
+    } else if ((request.magic == htonl(NBD_REQUEST_MAGIC)) &&
+               ((offset > size) || (length > size - offset))) {
+        /*
+         * Refuse requests past the end of the image here, where the data
+         * of a write can be dropped.  The refusal is sent by a worker, as
+         * the client may not take it right away.
+         */
+        request.len = 0;
+        if ((error = nbd_pool_get(np, cnp, &request, &njp)) == 0) {
+            logmsg(ncp, 1, "[%s] request 0x%zx@0x%" PRIx64 " out of range\n",
+                   ncp->svc_progname, length, offset);
+            cnp->cn_inhead += sizeof(request);
+            if (command == NBD_CMD_WRITE) {
+                cnp->cn_dest = (char *)NULL;
+                cnp->cn_want = length;
+            }
+            njp->nj_refused = EINVAL;
+            nbd_pool_submit(np, njp);
+        }
+    } else if (request.magic == htonl(NBD_REQUEST_MAGIC)) {
+        switch (command) {
+        case NBD_CMD_DISC:
+            logmsg(ncp, 1, "NBD_SHUTDOWN\n");
+            cnp->cn_inhead += sizeof(request);
+            error = ESHUTDOWN;
+            break;
+        default:
+            if ((error = nbd_qos_admit(np, cnp->cn_export)) ||
+                (error = nbd_pool_get(np, cnp, &request, &njp)))
+                break;
+            nbd_qos_charge(cnp->cn_export, command, length);
+            cnp->cn_inhead += sizeof(request);
+            if (command == NBD_CMD_WRITE) {
+                logmsg(ncp, 2, "NBD_WRITE0x%x@0x%x\n", length, offset);
+                /*
+                 * The data follows the request; it goes where the request
+                 * starts in the first block.
+                 */
+                cnp->cn_job  = njp;
+                cnp->cn_dest = njp->nj_buf + njp->nj_sboffs;
+                cnp->cn_want = length;
+            } else {
+                if (command == NBD_CMD_READ)
+                    logmsg(ncp, 2, "NBD_READ 0x%x@0x%x\n", length, offset);
+                nbd_pool_submit(np, njp);
+            }
+            break;
+        }
+    } else {
+        logmsg(ncp, 1, "[%s] Bad message from kernel: %08x\n",
+               ncp->svc_progname, request.magic);
+        cnp->cn_inhead += sizeof(request);
+        /*
+         * It's unclear what to do here.  We've obviously lost sync with
+         * the kernel.  Will reading 32-bit quantities until we get back
+         * in sync work?  I dunno.  Without the following snippet, we read
+         * nbd_requests until we (hopefully) get back in sync.  The
+         * question then is if the kernel is waiting for a response, then
+         * we're completely hosed.
+         */
+#ifdef POTENTIAL_DISASTER
+        error = EIO;
+#endif /* POTENTIAL_DISASTER */
+    }
+
+    return error;
+}
+
+/*
+ * Take what a connection has sent and queue the requests in it, until
+ * there is nothing more for now.  A stream socket may deliver a request
+ * or its data in pieces, so what has arrived of them waits in the input
+ * buffer or the job for the rest.  Returns 0 then, EBUSY if a request
+ * has to wait for a job, or the reason the connection is finished.
+ */
+static int
+nbd_conn_input(nbd_pool_t *np, nbd_conn_t *cnp) {
+    nbd_context_t *ncp = np->np_ncp;
+    size_t         chunk;
+    ssize_t        rlength = 1;
+    int            error   = 0;
+
+    while (!error) {
+        chunk = cnp->cn_intail - cnp->cn_inhead;
+        if (cnp->cn_want && chunk) {
+            /*
+             * Data of a write, or to be dropped.
+             */
+            if (chunk > cnp->cn_want)
+                chunk = cnp->cn_want;
+            if (cnp->cn_dest) {
+                memcpy(cnp->cn_dest, &cnp->cn_input[cnp->cn_inhead], chunk);
+                cnp->cn_dest += chunk;
+            }
+            cnp->cn_inhead += chunk;
+            cnp->cn_want -= chunk;
+        } else if (cnp->cn_dest && (cnp->cn_want >= NBD_INPUT_SIZE)) {
+            /*
+             * What is left of a large write is read into it directly.
+             */
+            if ((rlength = recv(cnp->cn_fh, cnp->cn_dest, cnp->cn_want,
+                                MSG_DONTWAIT)) > 0) {
+                cnp->cn_dest += rlength;
+                cnp->cn_want -= rlength;
+            }
+        } else if (!cnp->cn_want && (chunk >= sizeof(struct nbd_request))) {
+            error = nbd_conn_request(np, cnp);
+        } else {
+            rlength = nbd_conn_fill(cnp);
+        }
+
+        if (cnp->cn_job && !cnp->cn_want) {
+            nbd_pool_submit(np, cnp->cn_job);
+            cnp->cn_job  = (nbd_job_t *)NULL;
+            cnp->cn_dest = (char *)NULL;
+        }
+        if (rlength == 0) {
+            logmsg(ncp, 1, "[%s] connection %d closed\n", ncp->svc_progname,
+                   cnp->cn_fh);
+            error = EPIPE;
+        } else if (rlength < 0) {
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+                break;
+            if (errno != EINTR) {
+                error = errno;
+                logmsg(ncp, 0, "[%s] connection %d read error: %s\n",
+                       ncp->svc_progname, cnp->cn_fh, strerror(error));
+            }
+            rlength = 1;
+        }
+    }
+
+    return error;
+}
+
+/*
+ * Finish with a connection's input.  The workers still reply on it until
+ * its requests are done.
+ */
+static void
+nbd_conn_stop(nbd_pool_t *np, nbd_conn_t *cnp, int error) {
+    if (!cnp->cn_stalled)
+        nbd_event_del(np, cnp->cn_fh);
+    cnp->cn_stalled = 0;
+    if (cnp->cn_job) {
+        nbd_pool_put(np, cnp->cn_job);
+        cnp->cn_job = (nbd_job_t *)NULL;
+    }
+    pthread_mutex_lock(&np->np_lock);
+    cnp->cn_error = (error == ESHUTDOWN) ? 0 : error;
+    cnp->cn_done  = 1;
+    pthread_mutex_unlock(&np->np_lock);
+}
+
+/*
+ * Service a connection that has input, or that may go on after waiting
+ * for a job.  A connection that waits isn't watched, so that its unread
+ * input doesn't keep waking the loop.
+ */
+static void
+nbd_conn_service(nbd_pool_t *np, nbd_conn_t *cnp) {
+    int error;
+
+    if (cnp->cn_done)
+        return;
+    if ((error = nbd_conn_input(np, cnp)) == EBUSY) {
+        if (!cnp->cn_stalled) {
+            nbd_event_del(np, cnp->cn_fh);
+            cnp->cn_stalled = 1;
+        }
+        return;
+    }
+    if (cnp->cn_stalled && !error) {
+        if ((error = nbd_event_add(np, cnp->cn_fh, cnp)) == 0)
+            cnp->cn_stalled = 0;
+    }
+    if (error)
+        nbd_conn_stop(np, cnp, error);
+}
+
+/*
+ * Go on with the connections that wait for a job.
+ */
+static void
+nbd_pool_resume(nbd_pool_t *np) {
+    nbd_conn_t *cnp;
+    int         ci;
+
+    for (ci = 0; ci < np->np_nconns; ci++) {
+        if (np->np_conns[ci].cn_stalled)
+            nbd_conn_service(np, &np->np_conns[ci]);
+    }
+    for (cnp = np->np_clients; cnp; cnp = cnp->cn_next) {
+        if (cnp->cn_stalled)
+            nbd_conn_service(np, cnp);
+    }
+}
+
+/*
+ * Set up a connection.
+ */
+static void
+nbd_conn_init(nbd_pool_t *np, nbd_conn_t *cnp, int fh) {
+    memset(cnp, 0, sizeof(*cnp));
+    cnp->cn_pool = np;
+    cnp->cn_fh   = fh;
+    pthread_mutex_init(&cnp->cn_reply, NULL);
+}
+
+/*
+ * Release what a connection holds.
+ */
+static void
+nbd_conn_fini(nbd_conn_t *cnp) {
+    pthread_mutex_destroy(&cnp->cn_reply);
+    free(cnp->cn_input);
+    free(cnp->cn_output);
+}
+
+/*
+ * Add an image to the exports.  One with a file name is the export's
+ * own, to be closed with it.  Writable ones get a write-back cache if
+ * asked for.
+ */
+static int
+nbd_export_new(nbd_pool_t *np, nbd_context_t *ncp, void *pctx,
+               const char *file, nbd_export_t **expp) {
+    nbd_export_t *exp, **expp_tail;
+
+    if (!(exp = (nbd_export_t *)calloc(1, sizeof(*exp))))
+        return ENOMEM;
+    if (file && !(exp->ex_file = strdup(file))) {
+        free(exp);
+        return ENOMEM;
+    }
+    exp->ex_ncp  = ncp;
+    exp->ex_pctx = pctx;
+    nbd_qos_set(exp, ncp->svc_iops, ncp->svc_bandwidth);
+    if (ncp->svc_wbcache && !ncp->svc_rdonly &&
+        nbd_wb_new(np, exp, ncp->svc_wbcache)) {
+        free(exp->ex_file);
+        free(exp);
+        return ENOMEM;
+    }
+
+    /*
+     * The first export stays first, for clients that name none.
+     */
+    pthread_mutex_lock(&np->np_lock);
+    for (expp_tail = &np->np_exports; *expp_tail;
+         expp_tail = &(*expp_tail)->ex_next)
+        ;
+    *expp_tail = exp;
+    pthread_mutex_unlock(&np->np_lock);
+    *expp = exp;
+
+    return 0;
+}
+
+/*
+ * Free an export that is no longer on the list, writing back its cache
+ * and closing its image if it owns it.
+ */
+static void
+nbd_export_free(nbd_export_t *exp) {
+    nbd_context_t *ncp = exp->ex_ncp;
+    int            ci;
+
+    if (exp->ex_wb) {
+        nbd_wb_sync(exp);
+        nbd_wb_free(exp->ex_wb);
+    }
+    if (exp->ex_file) {
+        image_close(exp->ex_pctx);
+        for (ci = 0; ci < NBD_MAX_CONNECTIONS; ci++) {
+            if (ncp->svc_fh[ci] >= 0)
+                close(ncp->svc_fh[ci]);
+        }
+        if (ncp->nbd_fh >= 0)
+            close(ncp->nbd_fh);
+        free(ncp->svc_export);
+        free(ncp->nbd_dev);
+        free(ncp);
+        free(exp->ex_file);
+    }
+    free(exp);
+}
+
+/*
+ * Find the export that a client names and take a reference to it.
+ * Clients that name none get the first one served over the network.
+ */
+nbd_export_t *
+nbd_export_get(nbd_pool_t *np, const char *name, uint32_t namelen) {
+    nbd_export_t *exp;
+    const char *  ename;
+
+    pthread_mutex_lock(&np->np_lock);
+    for (exp = np->np_exports; exp; exp = exp->ex_next) {
+        if (exp->ex_removed || !(ename = exp->ex_ncp->svc_export))
+            continue;
+        if (!namelen ||
+            ((namelen == strlen(ename)) && !memcmp(name, ename, namelen)))
+            break;
+    }
+    if (exp)
+        exp->ex_nconns++;
+    pthread_mutex_unlock(&np->np_lock);
+
+    return exp;
+}
+
+/*
+ * Drop a reference to an export.  The event loop closes a removed one
+ * once the last has gone.  What was written to a volatile network export
+ * is thrown away then, so that the next client starts from the image.
+ */
+void
+nbd_export_put(nbd_pool_t *np, nbd_export_t *exp) {
+    nbd_context_t *ncp = exp->ex_ncp;
+
+    pthread_mutex_lock(&np->np_lock);
+    if (--exp->ex_nconns == 0) {
+        if (exp->ex_removed) {
+            nbd_pool_wake(np);
+        } else if (!ncp->nbd_dev &&
+                   (ncp->svc_cf_features & CF_FEATURE_VOLATILE)) {
+            nbd_wb_drop(exp, 0, UINT64_MAX);
+            if (!image_discard(exp->ex_pctx))
+                logmsg(ncp, 1, "[%s] discarded writes to %s\n",
+                       ncp->svc_progname, ncp->svc_export);
+        }
+    }
+    pthread_mutex_unlock(&np->np_lock);
+}
+
+/*
+ * Start a thread that leaves signals to the event loop.
+ */
+static int
+nbd_thread_create(pthread_t *threadp, void *(*func)(void *), void *arg) {
+    sigset_t allsigs, oldsigs;
+    int      error;
+
+    sigfillset(&allsigs);
+    pthread_sigmask(SIG_BLOCK, &allsigs, &oldsigs);
+    error = pthread_create(threadp, NULL, func, arg);
+    pthread_sigmask(SIG_SETMASK, &oldsigs, NULL);
+
+    return error;
+}
+
+/*
+ * Start the workers and the event loop.  An image given is the first
+ * export, and the loop watches its device connections.
+ */
+static int
+nbd_pool_start(nbd_pool_t *np, nbd_context_t *ncp, void *pctx) {
+    nbd_export_t *exp   = (nbd_export_t *)NULL;
+    int           error = 0;
+    int           ci;
+
+    memset(np, 0, sizeof(*np));
+    np->np_epfh   = -1;
+    np->np_wakefh = -1;
+    np->np_qosfh  = -1;
+    np->np_ncp    = ncp;
+    pthread_mutex_init(&np->np_lock, NULL);
+    pthread_cond_init(&np->np_work, NULL);
+    pthread_cond_init(&np->np_done, NULL);
+    pthread_cond_init(&np->np_syncwait, NULL);
+    pthread_cond_init(&np->np_wbwork, NULL);
+    nbd_buf_init(np, (pctx) ? ncp->svc_blocksize : NBD_BLOCKSIZE_DEFAULT,
+                 ncp->svc_nworkers + ncp->svc_nconns);
+    if (pctx && (error = nbd_export_new(np, ncp, pctx, (char *)NULL, &exp)))
+        return error;
+    for (np->np_nconns = 0; exp && (np->np_nconns < ncp->svc_nconns);
+         np->np_nconns++) {
+        nbd_conn_init(np, &np->np_conns[np->np_nconns],
+                      ncp->svc_fh[np->np_nconns]);
+        np->np_conns[np->np_nconns].cn_export = exp;
+        exp->ex_nconns++;
+    }
+
+    if (((np->np_epfh = epoll_create1(EPOLL_CLOEXEC)) < 0) ||
+        ((np->np_wakefh = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) ||
+        ((np->np_qosfh = timerfd_create(CLOCK_MONOTONIC,
+                                        TFD_NONBLOCK | TFD_CLOEXEC)) < 0))
+        return errno;
+    if ((error = nbd_event_add(np, np->np_wakefh, &np->np_wakefh)) ||
+        (error = nbd_event_add(np, np->np_qosfh, &np->np_qosfh)))
+        return error;
+    for (ci = 0; ci < np->np_nconns; ci++) {
+        if ((error = nbd_event_add(np, np->np_conns[ci].cn_fh,
+                                   &np->np_conns[ci])))
+            return error;
+    }
+
+    while (np->np_nworkers < ncp->svc_nworkers) {
+        if ((error = nbd_thread_create(&np->np_workers[np->np_nworkers],
+                                       nbd_worker, np)))
+            break;
+        np->np_nworkers++;
+    }
+    if (np->np_nworkers)
+        error = 0;
+    logmsg(ncp, 1, "%d request workers, %d connections\n", np->np_nworkers,
+           np->np_nconns);
+    if (!error && ncp->svc_wbcache && !ncp->svc_rdonly &&
+        !(error = nbd_thread_create(&np->np_wbthread, nbd_wb_thread, np)))
+        np->np_wbalive = 1;
+
+    return error;
+}
+
+/*
+ * Wait until every queued job has been replied to.
+ */
+static void
+nbd_pool_drain(nbd_pool_t *np) {
+    pthread_mutex_lock(&np->np_lock);
+    while (np->np_head)
+        pthread_cond_wait(&np->np_done, &np->np_lock);
+    pthread_mutex_unlock(&np->np_lock);
+}
+
+/*
+ * Compaction thread.  Compact the change file of each export in turn,
+ * holding a reference to it meanwhile so that it is not closed under us.
+ * Volatile change files have nothing to compact.
+ */
+static void *
+nbd_cf_thread(void *arg) {
+    nbd_pool_t *   np  = (nbd_pool_t *)arg;
+    nbd_context_t *ncp = np->np_ncp;
+    nbd_export_t * exp, *next;
+    int            error;
+
+    pthread_mutex_lock(&np->np_lock);
+    for (exp = np->np_exports; exp; exp = next) {
+        if (!exp->ex_removed &&
+            !(exp->ex_ncp->svc_cf_features & CF_FEATURE_VOLATILE)) {
+            exp->ex_nconns++;
+            pthread_mutex_unlock(&np->np_lock);
+            if ((error = image_compact(exp->ex_pctx))) {
+                logmsg(ncp, 0, "[%s] change file compaction failed: %s\n",
+                       ncp->svc_progname, strerror(error));
+            } else {
+                logmsg(ncp, 1, "[%s] change file compacted\n",
+                       ncp->svc_progname);
+            }
+            pthread_mutex_lock(&np->np_lock);
+            if ((--exp->ex_nconns == 0) && exp->ex_removed)
+                nbd_pool_wake(np);
+        }
+        next = exp->ex_next;
+    }
+    np->np_cfdone = 1;
+    nbd_pool_wake(np);
+    pthread_mutex_unlock(&np->np_lock);
+
+    return NULL;
+}
+
+/*
+ * Compact the change files on a thread of their own, so that the event
+ * loop and the workers carry on meanwhile, and join it once it is done.
+ * A compaction asked for while one runs starts when that one finishes.
+ * Returns whether the request is still waiting.
+ */
+static int
+nbd_pool_compact(nbd_pool_t *np, int compact) {
+    int done, error;
+
+    pthread_mutex_lock(&np->np_lock);
+    done = np->np_cfdone;
+    pthread_mutex_unlock(&np->np_lock);
+    if (np->np_cfalive && done) {
+        pthread_join(np->np_cfthread, NULL);
+        np->np_cfalive = 0;
+    }
+    if (compact && !np->np_cfalive) {
+        np->np_cfdone = 0;
+        if ((error = nbd_thread_create(&np->np_cfthread, nbd_cf_thread, np)))
+            logmsg(np->np_ncp, 0, "[%s] cannot start compaction: %s\n",
+                   np->np_ncp->svc_progname, strerror(error));
+        else
+            np->np_cfalive = 1;
+        compact = 0;
+    }
+
+    return compact;
+}
+
+/*
+ * Finish the outstanding jobs, stop the workers and free the jobs.  The
+ * exports' caches are written back as they are freed.
+ */
+static void
+nbd_pool_stop(nbd_pool_t *np) {
+    nbd_export_t *exp;
+    nbd_job_t *   njp;
+    int           wi;
+
+    for (wi = 0; wi < np->np_nconns; wi++) {
+        if (np->np_conns[wi].cn_job)
+            nbd_pool_put(np, np->np_conns[wi].cn_job);
+    }
+    nbd_pool_drain(np);
+    pthread_mutex_lock(&np->np_lock);
+    np->np_quit = 1;
+    pthread_cond_broadcast(&np->np_work);
+    pthread_cond_broadcast(&np->np_wbwork);
+    pthread_mutex_unlock(&np->np_lock);
+    for (wi = 0; wi < np->np_nworkers; wi++)
+        pthread_join(np->np_workers[wi], NULL);
+    if (np->np_wbalive)
+        pthread_join(np->np_wbthread, NULL);
+    if (np->np_cfalive)
+        pthread_join(np->np_cfthread, NULL);
+    while ((njp = np->np_free)) {
+        np->np_free = njp->nj_next;
+        free(njp);
+    }
+    nbd_buf_fini(np);
+    for (wi = 0; wi < np->np_nconns; wi++)
+        nbd_conn_fini(&np->np_conns[wi]);
+    while ((exp = np->np_exports)) {
+        np->np_exports = exp->ex_next;
+        nbd_export_free(exp);
+    }
+    if (np->np_qosfh >= 0)
+        close(np->np_qosfh);
+    if (np->np_wakefh >= 0)
+        close(np->np_wakefh);
+    if (np->np_epfh >= 0)
+        close(np->np_epfh);
+    pthread_cond_destroy(&np->np_wbwork);
+    pthread_cond_destroy(&np->np_syncwait);
+    pthread_cond_destroy(&np->np_done);
+    pthread_cond_destroy(&np->np_work);
+    pthread_mutex_destroy(&np->np_lock);
+}
+
+/*
+ * Have the event loop take signals and run the housekeeping timer.
+ */
+static int
+nbd_pool_events(nbd_pool_t *np, int *sigfhp, int *timerfhp,
+                sigset_t *oldmaskp) {
+    int error;
+
+    if ((error = nbd_signals_open(sigfhp, oldmaskp)) == 0) {
+        if ((error = nbd_timer_open(timerfhp)) == 0) {
+            if ((error = nbd_event_add(np, *sigfhp, sigfhp)) == 0)
+                error = nbd_event_add(np, *timerfhp, timerfhp);
+        }
+    }
+
+    return error;
+}
+
+/*
+ * Handle NBD resquest
+ *
+ * The main work processing loop.  Requests are read here and handed to
+ * the worker pool, which may reply to them in any order.  The loop waits
+ * on the device connections, signals and the housekeeping timer at once.
+ */
+static int
+nbd_service_requests(nbd_context_t *ncp, void *pctx) {
+    char *             pidfile = (char *)NULL;
+    int                error   = 0;
+    int                leave   = 0;
+    int                compact = 0;
+    int                stats   = 0;
+    int                sigfh   = -1;
+    int                timerfh = -1;
+    sigset_t           oldmask;
+    struct epoll_event events[NBD_MAX_EVENTS];
+    nbd_pool_t         pool;
+    void *             ptr;
+    int                nev, ei;
+
+    /*
+     * Start the workers, and take the termination, compaction and child
+     * signals and the housekeeping timer in the event loop.
+     */
+    if ((error = nbd_pool_start(&pool, ncp, pctx)) == 0)
+        error = nbd_pool_events(&pool, &sigfh, &timerfh, &oldmask);
+    if (error) {
+        logmsg(ncp, -1, "%s: cannot start workers: %s\n", ncp->svc_progname,
+               strerror(error));
+        leave = 3;
+    }
+
+    /*
+     * If we're setting up a mount, then fork a child to do the mount.  The
+     * event loop reaps it when it completes.
+     */
+    if (ncp->svc_mount) {
+        pid_t cpid;
+
+        switch ((cpid = fork())) {
+        case 0:
+            exit(mount(ncp->nbd_dev, ncp->svc_mount,
+                       (ncp->svc_mtype) ? ncp->svc_mtype : "ext2",
+                       (ncp->svc_rdonly) ? MS_RDONLY : 0, ""));
+            break;
+        case -1:
+            error = errno;
+            logmsg(ncp, -1, "%s: cannot fork to mount: %s\n", ncp->svc_progname,
+                   strerror(error));
+            /*
+             * We ignore this failure.  Someone else can try the mount.
+             */
+            break;
+        default:
+            ncp->svc_toreap = cpid;
+            break;
+        }
+    }
+
+    /*
+     * create pid file
+     */
+    create_pid_file(ncp, getpid(), &pidfile);
+
+    if (ncp->svc_mount) {
+        logmsg(ncp, 0, "Mount \"%s\" is ready.\n", ncp->svc_mount);
+        logmsg(ncp, 0,
+               "When finished with the imagemount, run `umount %s` then "
+               "`nbd-client -d %s to cleanup.\n",
+               ncp->svc_mount, ncp->nbd_dev);
+    } else if (ncp->nbd_dev) {
+        logmsg(ncp, 0, "Device \"%s\" is now ready for further operations.\n",
+               ncp->nbd_dev);
+        logmsg(ncp, 0,
+               "When finished with the imagemount, run `nbd-client -d %s` to "
+               "disconnect from the NBD server.\n",
+               ncp->nbd_dev);
+    }
+    /*
+     * Do work until we're completely done.  We're asked to leave by a
+     * termination signal or by the kernel through the first connection,
+     * then wait for the unmount, if any, to finish.
+     */
+    while (leave < 3) {
+        if ((nev = epoll_wait(pool.np_epfh, events, NBD_MAX_EVENTS, -1)) < 0) {
+            if (errno != EINTR) {
+                error = errno;
+                logmsg(ncp, 0, "[%s] event wait failed: %s\n",
+                       ncp->svc_progname, strerror(error));
+                leave = 3;
+            }
+            continue;
+        }
+        for (ei = 0; ei < nev; ei++) {
+            ptr = events[ei].data.ptr;
+            if (ptr == &sigfh) {
+                if (nbd_signals_take(ncp, sigfh, &leave, &compact, &stats) &&
+                    (leave == 2))
+                    leave = 3;
+            } else if (ptr == &timerfh) {
+                /*
+                 * Housekeeping.  Nothing should be left waiting here, but
+                 * make sure.
                  */
-                while (((rlength = write(ncp->svc_fh, &reply, sizeof(reply))) ==
-                        -1) &&
-                       (errno == EINTR) && (!timetoleave))
-                    ;
-                if (rlength == sizeof(reply)) {
+                nbd_event_clear(timerfh);
+                if (nbd_reap_children(ncp) && (leave == 2))
+                    leave = 3;
+                nbd_pool_resume(&pool);
+            } else if (ptr == &pool.np_qosfh) {
+                nbd_event_clear(pool.np_qosfh);
+                pool.np_qosdue = 0;
+                nbd_pool_resume(&pool);
+            } else if (ptr == &pool.np_wakefh) {
+                nbd_event_clear(pool.np_wakefh);
+                nbd_pool_resume(&pool);
+            } else {
+                nbd_conn_service(&pool, (nbd_conn_t *)ptr);
+            }
+        }
+        if (!leave && pool.np_conns[0].cn_done) {
+            error = pool.np_conns[0].cn_error;
+            leave = 1;
+        }
+
+        /*
+         * Compact the change file if asked to.
+         */
+        compact = nbd_pool_compact(&pool, compact && !leave);
+
+        /*
+         * Log the statistics if asked to.
+         */
+        if (stats) {
+            stats = 0;
+            (void)nbd_stats_report(&pool, (nbd_export_t *)NULL,
+                                   (nbd_conn_t *)NULL);
+        }
+
+        /*
+         * Check to see if we're to leave.
+         */
+        if (leave == 1) {
+            /*
+             * Getting ready to punt.  Requests are still served while the
+             * unmount goes on.
+             */
+            if (ncp->svc_mount) {
+                pid_t cpid;
+
+                leave = 2;
+                switch ((cpid = fork())) {
+                case 0:
                     /*
-                     * Write the reply appendage if it's a read and there
-                     * was no error.
+                     * If we had an error, try to force the unmount.
                      */
-                    if ((request.type == htonl(NBD_CMD_READ)) &&
-                        (reply.error == 0)) {
-                        /*
-                         * Write the data reply.
-                         */
-                        while (((rlength = write(ncp->svc_fh, replyappend,
-                                                 length)) == -1) &&
-                               (errno == EINTR) && (!timetoleave))
-                            ;
-                        if (rlength == length) {
-                            error = 0;
-                        } else {
-                            if (rlength == -1) {
-                                error = errno;
-                                logmsg(ncp, 0,
-                                       "[%s] reply addendum write error: %s\n",
-                                       ncp->svc_progname, strerror(error));
-                            }
-                        }
-                    }
-                } else {
-                    if ((rlength == -1) && (errno != EINTR)) {
-                        error = errno;
-                        logmsg(ncp, 0, "[%s] reply write error: %s\n",
-                               ncp->svc_progname, strerror(error));
+                    if (error) {
+                        exit(umount2(ncp->svc_mount, MNT_FORCE));
+                    } else {
+                        exit(umount(ncp->svc_mount));
                     }
+                    break;
+                case -1:
+                    error = errno;
+                    logmsg(ncp, -1, "%s: cannot fork to unmount: %s\n",
+                           ncp->svc_progname, strerror(error));
+                    leave = 3; /* Just punt. */
+                    break;
+                default:
+                    ncp->svc_toreap = cpid;
+                    break;
                 }
             } else {
-                logmsg(ncp, 1, "[%s] Bad message from kernel: %08x\n",
-                       ncp->svc_progname, request.magic);
-                /*
-                 * It's unclear what to do here.  We've obviously lost sync
-                 * with the kernel.  Will reading 32-bit quantities until we
-                 * get back in sync work?  I dunno.  Without the following
-                 * snippet, we read nbd_requests until we (hopefully) get
-                 * back in sync.  The question then is if the kernel is
-                 * waiting for a response, then we're completely hosed.
-                 */
-#ifdef POTENTIAL_DISASTER
-                timetoleave = 1;
-                error       = EIO;
-#endif /* POTENTIAL_DISASTER */
+                leave = 3;
+            }
+        }
+    }
+    if (pool.np_nworkers)
+        nbd_pool_stop(&pool);
+    if (ncp->svc_toreap) {
+        int   existat;
+        pid_t corpse;
+
+        corpse = waitpid(ncp->svc_toreap, &existat, 0);
+        logmsg(ncp, 2, "%s: pid %d finished with %d\n", ncp->svc_progname,
+               corpse, existat);
+        ncp->svc_toreap = 0;
+    }
+    if (timerfh >= 0)
+        close(timerfh);
+    if (sigfh >= 0)
+        nbd_signals_close(sigfh, &oldmask);
+
+    /*
+     * Remove the pid file.
+     */
+    remove_pid_file(pidfile);
+    return error;
+}
+
+/*
+ * Network server.
+ */
+
+/*
+ * Handshake with one client.  Once past it, the event loop takes the
+ * client's requests to the pool like the kernel's.
+ */
+static void *
+nbd_client(void *arg) {
+    nbd_conn_t *   cnp = (nbd_conn_t *)arg;
+    nbd_pool_t *   np  = cnp->cn_pool;
+    nbd_context_t *ncp = np->np_ncp;
+    int            error;
+
+    if (!(error = nbd_handshake(ncp, cnp))) {
+        logmsg(ncp, 1, "[%s] client %d transmitting\n", ncp->svc_progname,
+               cnp->cn_fh);
+    } else if (error != EPIPE) {
+        logmsg(ncp, 1, "[%s] client %d: %s\n", ncp->svc_progname, cnp->cn_fh,
+               strerror(error));
+    }
+
+    pthread_mutex_lock(&np->np_lock);
+    cnp->cn_error  = error;
+    cnp->cn_shaken = 1;
+    nbd_pool_wake(np);
+    pthread_mutex_unlock(&np->np_lock);
+
+    return NULL;
+}
+
+/*
+ * Release a client that is done with.
+ */
+static void
+nbd_client_free(nbd_conn_t *cnp) {
+    if (cnp->cn_export)
+        nbd_export_put(cnp->cn_pool, cnp->cn_export);
+    close(cnp->cn_fh);
+    nbd_conn_fini(cnp);
+    free(cnp);
+}
+
+/*
+ * Take the clients whose handshakes have finished into the event loop,
+ * and free the ones that are done with.
+ */
+static void
+nbd_pool_clients(nbd_pool_t *np) {
+    nbd_conn_t *  cnp, **cnpp;
+    nbd_export_t *exp, **expp;
+    nbd_export_t *closed = (nbd_export_t *)NULL;
+    int           shaken, gone;
+
+    for (cnpp = &np->np_clients; (cnp = *cnpp);) {
+        pthread_mutex_lock(&np->np_lock);
+        shaken = cnp->cn_shaking && cnp->cn_shaken;
+        if (shaken && !cnp->cn_error && cnp->cn_export->ex_removed)
+            cnp->cn_error = ESHUTDOWN;
+        pthread_mutex_unlock(&np->np_lock);
+        if (shaken) {
+            pthread_join(cnp->cn_thread, NULL);
+            cnp->cn_shaking = 0;
+            if (!cnp->cn_error)
+                cnp->cn_error = nbd_event_add(np, cnp->cn_fh, cnp);
+            if (cnp->cn_error) {
+                pthread_mutex_lock(&np->np_lock);
+                cnp->cn_done = 1;
+                pthread_mutex_unlock(&np->np_lock);
+            }
+        }
+        pthread_mutex_lock(&np->np_lock);
+        gone = cnp->cn_done && !cnp->cn_inflight && !cnp->cn_shaking;
+        pthread_mutex_unlock(&np->np_lock);
+        if (gone) {
+            /*
+             * A device that has been let go of is done with.
+             */
+            exp = cnp->cn_export;
+            if (exp && exp->ex_ncp->nbd_dev && exp->ex_file) {
+                pthread_mutex_lock(&np->np_lock);
+                exp->ex_removed = 1;
+                pthread_mutex_unlock(&np->np_lock);
             }
+            *cnpp = cnp->cn_next;
+            nbd_client_free(cnp);
+        } else {
+            cnpp = &cnp->cn_next;
+        }
+    }
+
+    /*
+     * Close the removed exports that nothing uses any more.
+     */
+    pthread_mutex_lock(&np->np_lock);
+    for (expp = &np->np_exports; (exp = *expp);) {
+        if (exp->ex_removed && !exp->ex_nconns) {
+            *expp        = exp->ex_next;
+            exp->ex_next = closed;
+            closed       = exp;
         } else {
-            if ((rlength == -1) && (errno != EINTR)) {
-                error = errno;
-                logmsg(ncp, 0, "[%s] kernel command read error: %s\n",
-                       ncp->svc_progname, strerror(error));
-            }
+            expp = &exp->ex_next;
         }
+    }
+    pthread_mutex_unlock(&np->np_lock);
+    while ((exp = closed)) {
+        closed = exp->ex_next;
+        logmsg(np->np_ncp, 0, "[%s] closed %s\n", np->np_ncp->svc_progname,
+               exp->ex_file);
+        nbd_export_free(exp);
+    }
+}
 
-        /*
-         * Check to see if we received a termination signal.
-         */
-        if (timetoleave == 1) {
+/*
+ * Accept the clients that are waiting to connect, and start a thread for
+ * each one's handshake.  Control clients go straight to the event loop.
+ * Sends to a client, from the handshake on, give up after NBD_SEND_TIMEOUT.
+ */
+static int
+nbd_pool_accept(nbd_pool_t *np, int lfh, int control) {
+    nbd_context_t *ncp = np->np_ncp;
+    nbd_conn_t *   cnp;
+    struct timeval timeout;
+    int            one = 1;
+    int            fh;
+
+    memset(&timeout, 0, sizeof(timeout));
+    timeout.tv_sec = NBD_SEND_TIMEOUT;
+    for (;;) {
+        if ((fh = accept(lfh, (struct sockaddr *)NULL, (socklen_t *)NULL)) <
+            0) {
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+                return 0;
+            if ((errno != EINTR) && (errno != ECONNABORTED))
+                return errno;
+            continue;
+        }
+        (void)setsockopt(fh, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        (void)setsockopt(fh, SOL_SOCKET, SO_SNDTIMEO, &timeout,
+                         sizeof(timeout));
+        if (!(cnp = (nbd_conn_t *)malloc(sizeof(*cnp)))) {
+            close(fh);
+            continue;
+        }
+        nbd_conn_init(np, cnp, fh);
+        cnp->cn_control = control;
+        if ((control) ? nbd_event_add(np, fh, cnp)
+                      : nbd_thread_create(&cnp->cn_thread, nbd_client, cnp)) {
+            nbd_conn_fini(cnp);
+            free(cnp);
+            close(fh);
+            continue;
+        }
+        cnp->cn_shaking = !control;
+        cnp->cn_next    = np->np_clients;
+        np->np_clients  = cnp;
+        logmsg(ncp, 1, "[%s] %s %d connected\n", ncp->svc_progname,
+               (control) ? "control" : "client", fh);
+    }
+}
+
+/*
+ * Open a listening socket.  An address with a slash in it is the path of
+ * a Unix socket, anything else is [host:]port.
+ */
+static int
+nbd_listen(nbd_context_t *ncp, const char *address, int *fhp) {
+    int fh    = -1;
+    int error = 0;
+    int one   = 1;
+
+    if (strchr(address, '/')) {
+        struct sockaddr_un sun;
+        struct stat        sb;
+
+        memset(&sun, 0, sizeof(sun));
+        sun.sun_family = AF_UNIX;
+        if (strlen(address) >= sizeof(sun.sun_path)) {
+            error = ENAMETOOLONG;
+        } else if ((fh = socket(PF_UNIX, SOCK_STREAM, 0)) < 0) {
+            error = errno;
+        } else {
+            strcpy(sun.sun_path, address);
             /*
-             * Getting ready to punt.
+             * A socket left over from an earlier run is in the way.
              */
-            if (ncp->svc_mount) {
-                pid_t cpid;
+            if (!stat(address, &sb) && S_ISSOCK(sb.st_mode))
+                (void)unlink(address);
+            if ((bind(fh, (struct sockaddr *)&sun, sizeof(sun)) < 0) ||
+                (listen(fh, SOMAXCONN) < 0))
+                error = errno;
+        }
+    } else {
+        char *           hostport = strdup(address);
+        char *           host     = (char *)NULL;
+        char *           port     = hostport;
+        char *           cp;
+        struct addrinfo  hints, *ai, *aip;
+        int              gerror;
 
-                newsig.sa_sigaction = nbd_reapchild;
-                newsig.sa_flags     = SA_RESETHAND | SA_SIGINFO;
-                diedp               = (int *)&timetoleave;
-                toreapp             = (pid_t *)&whodied;
-                sigaction(SIGCHLD, &newsig, &oldsig);
-                timetoleave = 2;
-                switch ((cpid = fork())) {
-                case 0:
-                    /*
-                     * If we had an error, try to force the unmount.
-                     */
-                    if (error) {
-                        exit(umount2(ncp->svc_mount, MNT_FORCE));
-                    } else {
-                        exit(umount(ncp->svc_mount));
-                    }
-                    break;
-                case -1:
+        if (!hostport)
+            return ENOMEM;
+        if ((cp = strrchr(hostport, ':'))) {
+            *cp  = '\0';
+            host = hostport;
+            port = cp + 1;
+            if ((host[0] == '[') && (cp > host) && (cp[-1] == ']')) {
+                cp[-1] = '\0';
+                host++;
+            }
+        }
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family   = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags    = AI_PASSIVE;
+        if ((gerror = getaddrinfo((host && *host) ? host : (char *)NULL, port,
+                                  &hints, &ai))) {
+            logmsg(ncp, -1, "%s: %s: %s\n", ncp->svc_progname, address,
+                   gai_strerror(gerror));
+            error = EINVAL;
+        } else {
+            error = EADDRNOTAVAIL;
+            for (aip = ai; aip; aip = aip->ai_next) {
+                if ((fh = socket(aip->ai_family, aip->ai_socktype,
+                                 aip->ai_protocol)) < 0) {
                     error = errno;
-                    logmsg(ncp, -1, "%s: cannot fork to unmount: %s\n",
-                           ncp->svc_progname, strerror(error));
-                    timetoleave = 3; /* Just punt. */
-                    break;
-                default:
-                    ncp->svc_toreap = cpid;
+                    continue;
+                }
+                (void)setsockopt(fh, SOL_SOCKET, SO_REUSEADDR, &one,
+                                 sizeof(one));
+                if (!bind(fh, aip->ai_addr, aip->ai_addrlen) &&
+                    !listen(fh, SOMAXCONN)) {
+                    error = 0;
                     break;
                 }
-            } else {
-                timetoleave = 3;
+                error = errno;
+                close(fh);
+                fh = -1;
             }
+            freeaddrinfo(ai);
         }
+        free(hostport);
     }
-    if (ncp->svc_toreap) {
-        int   existat;
-        pid_t corpse;
 
-        if (whodied) {
-            corpse = waitpid(whodied, &existat, WNOHANG);
+    if (error) {
+        if (fh >= 0)
+            close(fh);
+    } else {
+        *fhp = fh;
+    }
+    return error;
+}
+
+/*
+ * Exports opened at run time.  The configuration file and the control
+ * socket take the same commands, one to a line:
+ *
+ *   export NAME IMAGE [CHANGEFILE]   serve an image to network clients
+ *   device DEVICE IMAGE [CHANGEFILE] attach an image to an nbd device
+ *   remove NAME|DEVICE               close an export once it is let go of
+ *   limit NAME|DEVICE IOPS MBPS      limit an export's rates, 0 for none
+ *   list                             list the exports
+ *
+ * Everything after a '#' is ignored.
+ */
+
+/*
+ * Find an open export by its name or device.
+ */
+static nbd_export_t *
+nbd_export_find(nbd_pool_t *np, const char *name) {
+    nbd_export_t * exp;
+    nbd_context_t *ncp;
+
+    pthread_mutex_lock(&np->np_lock);
+    for (exp = np->np_exports; exp; exp = exp->ex_next) {
+        ncp = exp->ex_ncp;
+        if (!exp->ex_removed &&
+            ((ncp->svc_export && !strcmp(ncp->svc_export, name)) ||
+             (ncp->nbd_dev && !strcmp(ncp->nbd_dev, name))))
+            break;
+    }
+    pthread_mutex_unlock(&np->np_lock);
+
+    return exp;
+}
+
+/*
+ * Watch the device connections of a newly attached export.
+ */
+static int
+nbd_export_attach(nbd_pool_t *np, nbd_export_t *exp) {
+    nbd_context_t *ncp = exp->ex_ncp;
+    nbd_conn_t *   cnp;
+    int            error = 0;
+    int            ci;
+
+    for (ci = 0; !error && (ci < ncp->svc_nconns); ci++) {
+        if (ncp->svc_fh[ci] < 0)
+            continue;
+        if (!(cnp = (nbd_conn_t *)malloc(sizeof(*cnp)))) {
+            error = ENOMEM;
+            break;
+        }
+        nbd_conn_init(np, cnp, ncp->svc_fh[ci]);
+        ncp->svc_fh[ci] = -1;
+        cnp->cn_export  = exp;
+        pthread_mutex_lock(&np->np_lock);
+        exp->ex_nconns++;
+        pthread_mutex_unlock(&np->np_lock);
+        cnp->cn_next   = np->np_clients;
+        np->np_clients = cnp;
+        if ((error = nbd_event_add(np, cnp->cn_fh, cnp)))
+            cnp->cn_done = 1;
+    }
+
+    return error;
+}
+
+/*
+ * Let go of an export.  Network clients using it are hung up on and a
+ * device is disconnected, and the event loop closes it when they have
+ * gone.
+ */
+static void
+nbd_export_remove(nbd_pool_t *np, nbd_export_t *exp) {
+    nbd_conn_t *cnp;
+
+    pthread_mutex_lock(&np->np_lock);
+    exp->ex_removed = 1;
+    pthread_mutex_unlock(&np->np_lock);
+    if (exp->ex_ncp->nbd_dev) {
+        nbd_disconnect(exp->ex_ncp, exp->ex_pctx);
+    } else {
+        for (cnp = np->np_clients; cnp; cnp = cnp->cn_next) {
+            if (!cnp->cn_shaking && (cnp->cn_export == exp))
+                (void)shutdown(cnp->cn_fh, SHUT_RDWR);
+        }
+    }
+    nbd_pool_wake(np);
+}
+
+/*
+ * Open an image and export it under a name or on a device, with the
+ * settings the server was started with.
+ */
+static int
+nbd_export_open(nbd_pool_t *np, const char *name, const char *device,
+                const char *file, const char *cfile) {
+    nbd_context_t *ncp;
+    nbd_export_t * exp;
+    void *         pctx = (void *)NULL;
+    int            error;
+    int            ci;
+
+    if (nbd_export_find(np, (name) ? name : device))
+        return EEXIST;
+    if (name && (strlen(name) > NBD_MAX_OPTION - 4))
+        return ENAMETOOLONG;
+    if (!(ncp = (nbd_context_t *)malloc(sizeof(*ncp))))
+        return ENOMEM;
+    *ncp            = *np->np_ncp;
+    ncp->nbd_fh     = -1;
+    ncp->svc_export = (name) ? strdup(name) : (char *)NULL;
+    ncp->nbd_dev    = (device) ? strdup(device) : (char *)NULL;
+    for (ci = 0; ci < NBD_MAX_CONNECTIONS; ci++)
+        ncp->svc_fh[ci] = -1;
+
+    if ((name && !ncp->svc_export) || (device && !ncp->nbd_dev)) {
+        error = ENOMEM;
+    } else if (!(error = image_open(file, cfile,
+                                    (ncp->svc_rdonly) ? SYSDEP_OPEN_RO
+                                                      : SYSDEP_OPEN_RW,
+                                    &posix_dispatch, ncp->svc_raw_available,
+                                    &pctx))) {
+        if (ncp->svc_tolerant)
+            image_tolerant_mode(pctx);
+        if (ncp->svc_cf_features)
+            image_cf_features(pctx, ncp->svc_cf_features);
+        if (!(error = image_verify(pctx))) {
+            nbd_geometry(ncp, pctx);
+            if (!device || !(error = nbd_connect(ncp, pctx))) {
+                if (!(error = nbd_export_new(np, ncp, pctx, file, &exp))) {
+                    logmsg(ncp, 0, "[%s] serving %s as %s\n",
+                           ncp->svc_progname, file, (name) ? name : device);
+                    if (device && (error = nbd_export_attach(np, exp)))
+                        nbd_export_remove(np, exp);
+                    return error;
+                }
+                if (device)
+                    nbd_disconnect(ncp, pctx);
+                for (ci = 0; ci < NBD_MAX_CONNECTIONS; ci++) {
+                    if (ncp->svc_fh[ci] >= 0)
+                        close(ncp->svc_fh[ci]);
+                }
+            }
+        }
+        image_close(pctx);
+    }
+    if (ncp->nbd_fh >= 0)
+        close(ncp->nbd_fh);
+    free(ncp->svc_export);
+    free(ncp->nbd_dev);
+    free(ncp);
+
+    return error;
+}
+
+/*
+ * Queue output for a control connection.  It is sent as the client takes
+ * it, so that one that doesn't read can't hold up the event loop.
+ */
+int
+nbd_ctl_write(nbd_conn_t *cnp, const char *data, size_t len) {
+    char * output;
+    size_t size = (cnp->cn_outsize) ? cnp->cn_outsize : NBD_CTL_LINE;
+
+    while (cnp->cn_outlen + len > size)
+        size *= 2;
+    if (size != cnp->cn_outsize) {
+        if (!(output = (char *)realloc(cnp->cn_output, size)))
+            return ENOMEM;
+        cnp->cn_output  = output;
+        cnp->cn_outsize = size;
+    }
+    memcpy(&cnp->cn_output[cnp->cn_outlen], data, len);
+    cnp->cn_outlen += len;
+
+    return 0;
+}
+
+/*
+ * Send what a control connection has queued, as much as it takes now.
+ * While some is left the connection is watched for room to send instead
+ * of for input, so it gives no more commands until all has gone.  Returns
+ * EAGAIN then.
+ */
+static int
+nbd_ctl_flush(nbd_pool_t *np, nbd_conn_t *cnp) {
+    size_t  sent  = 0;
+    int     error = 0;
+    ssize_t wlength;
+    int     wait;
+
+    while (!error && (sent < cnp->cn_outlen)) {
+        if ((wlength = send(cnp->cn_fh, &cnp->cn_output[sent],
+                            cnp->cn_outlen - sent, MSG_DONTWAIT)) >= 0)
+            sent += wlength;
+        else if (errno != EINTR)
+            error = (errno == EWOULDBLOCK) ? EAGAIN : errno;
+    }
+    memmove(cnp->cn_output, &cnp->cn_output[sent], cnp->cn_outlen - sent);
+    cnp->cn_outlen -= sent;
+    wait = (error == EAGAIN);
+    if ((!error || wait) && (cnp->cn_outwait != wait) &&
+        !(error = nbd_event_mod(np, cnp->cn_fh, cnp,
+                                (wait) ? EPOLLOUT : EPOLLIN))) {
+        cnp->cn_outwait = wait;
+        error           = (wait) ? EAGAIN : 0;
+    }
+
+    return error;
+}
+
+/*
+ * List the exports on a control connection.  The list may change while
+ * we write, so each line is made under the lock.
+ */
+static int
+nbd_ctl_list(nbd_pool_t *np, nbd_conn_t *cnp) {
+    char           line[NBD_CTL_LINE];
+    nbd_export_t * exp;
+    nbd_context_t *ncp;
+    int            index, i, len;
+    int            error = 0;
+
+    for (index = 0; !error; index++) {
+        len = 0;
+        pthread_mutex_lock(&np->np_lock);
+        for (exp = np->np_exports, i = 0; exp; exp = exp->ex_next) {
+            if (exp->ex_removed || (i++ != index))
+                continue;
+            ncp = exp->ex_ncp;
+            len = snprintf(line, sizeof(line),
+                           "%s %s %s %u %" PRIu64 " %" PRIu64 "\n",
+                           (ncp->nbd_dev) ? "device" : "export",
+                           (ncp->nbd_dev) ? ncp->nbd_dev : ncp->svc_export,
+                           (exp->ex_file) ? exp->ex_file : "-",
+                           exp->ex_nconns, exp->ex_iops.tb_rate,
+                           exp->ex_bytes.tb_rate >> 20);
+            break;
+        }
+        pthread_mutex_unlock(&np->np_lock);
+        if (!exp)
+            break;
+        if (len >= (int)sizeof(line)) {
+            len           = sizeof(line) - 1;
+            line[len - 1] = '\n';
+        }
+        error = nbd_ctl_write(cnp, line, len);
+    }
+
+    return error;
+}
+
+/*
+ * Carry out a command.  The reply goes to the control connection if there
+ * is one.
+ */
+static int
+nbd_ctl_command(nbd_pool_t *np, char *line, nbd_conn_t *cnp) {
+    nbd_context_t *ncp = np->np_ncp;
+    char *         argv[NBD_CTL_MAXARGS];
+    char           reply[NBD_CTL_LINE];
+    nbd_export_t * exp;
+    char *         cp, *lasts;
+    int            iops, bandwidth;
+    int            argc  = 0;
+    int            error = 0;
+
+    if ((cp = strchr(line, '#')))
+        *cp = '\0';
+    for (cp = strtok_r(line, " \t\r", &lasts); cp && (argc < NBD_CTL_MAXARGS);
+         cp = strtok_r((char *)NULL, " \t\r", &lasts))
+        argv[argc++] = cp;
+    if (!argc)
+        return 0;
+
+    if (cp) {
+        error = E2BIG;
+    } else if (!strcmp(argv[0], "export") && ((argc == 3) || (argc == 4))) {
+        error = nbd_export_open(np, argv[1], (char *)NULL, argv[2],
+                                (argc == 4) ? argv[3] : (char *)NULL);
+    } else if (!strcmp(argv[0], "device") && ((argc == 3) || (argc == 4))) {
+        error = nbd_export_open(np, (char *)NULL, argv[1], argv[2],
+                                (argc == 4) ? argv[3] : (char *)NULL);
+    } else if (!strcmp(argv[0], "remove") && (argc == 2)) {
+        if ((exp = nbd_export_find(np, argv[1])))
+            nbd_export_remove(np, exp);
+        else
+            error = ENOENT;
+    } else if (!strcmp(argv[0], "limit") && (argc == 4)) {
+        if (!(exp = nbd_export_find(np, argv[1]))) {
+            error = ENOENT;
+        } else if ((sscanf(argv[2], "%d", &iops) != 1) ||
+                   (sscanf(argv[3], "%d", &bandwidth) != 1)) {
+            error = EINVAL;
         } else {
-            corpse = wait(&existat);
+            /*
+             * Connections waiting on the old limits go on if they may.
+             */
+            nbd_qos_set(exp, iops, bandwidth);
+            nbd_pool_wake(np);
         }
-        logmsg(ncp, 2, "%s: pid %d finished with %d\n", ncp->svc_progname,
-               corpse, existat);
+    } else if (!strcmp(argv[0], "list") && (argc == 1) && cnp) {
+        error = nbd_ctl_list(np, cnp);
+    } else if (!strcmp(argv[0], "stats") && ((argc == 1) || (argc == 2))) {
+        if ((argc == 1) || (exp = nbd_export_find(np, argv[1])))
+            error = nbd_stats_report(
+                np, (argc == 2) ? exp : (nbd_export_t *)NULL, cnp);
+        else
+            error = ENOENT;
+    } else {
+        error = EINVAL;
+    }
+
+    if (error)
+        logmsg(ncp, 0, "[%s] %s%s%s: %s\n", ncp->svc_progname, argv[0],
+               (argc > 1) ? " " : "", (argc > 1) ? argv[1] : "",
+               strerror(error));
+    if (cnp) {
+        if (error)
+            snprintf(reply, sizeof(reply), "error: %s\n", strerror(error));
+        else
+            strcpy(reply, "ok\n");
+        (void)nbd_ctl_write(cnp, reply, strlen(reply));
+    }
+
+    return error;
+}
+
+/*
+ * Carry out the commands of the configuration file.  One that fails is
+ * logged and passed over.
+ */
+static int
+nbd_ctl_load(nbd_pool_t *np, const char *path) {
+    char  line[NBD_CTL_LINE];
+    FILE *fp;
+
+    if (!(fp = fopen(path, "r")))
+        return errno;
+    while (fgets(line, sizeof(line), fp)) {
+        line[strcspn(line, "\n")] = '\0';
+        (void)nbd_ctl_command(np, line, (nbd_conn_t *)NULL);
+    }
+    fclose(fp);
+
+    return 0;
+}
+
+/*
+ * Take the commands a control connection has sent, each once the replies
+ * to the one before have gone.
+ */
+static void
+nbd_ctl_service(nbd_pool_t *np, nbd_conn_t *cnp) {
+    char *  eol;
+    ssize_t rlength;
+    int     error = 0;
+
+    while (!cnp->cn_done && !error) {
+        if (cnp->cn_outlen) {
+            if ((error = nbd_ctl_flush(np, cnp)) == EAGAIN)
+                return;
+        } else if (cnp->cn_input &&
+            (eol = (char *)memchr(&cnp->cn_input[cnp->cn_inhead], '\n',
+                                  cnp->cn_intail - cnp->cn_inhead))) {
+            *eol = '\0';
+            (void)nbd_ctl_command(np, &cnp->cn_input[cnp->cn_inhead], cnp);
+            cnp->cn_inhead = eol + 1 - cnp->cn_input;
+        } else if (cnp->cn_intail - cnp->cn_inhead == NBD_INPUT_SIZE) {
+            error = E2BIG;
+        } else if ((rlength = nbd_conn_fill(cnp)) == 0) {
+            error = ESHUTDOWN;
+        } else if (rlength < 0) {
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+                return;
+            if (errno != EINTR)
+                error = errno;
+        }
+    }
+    if (error)
+        nbd_conn_stop(np, cnp, error);
+}
+
+/*
+ * Serve images until told to finish.  One event loop accepts clients and
+ * reads the requests of all of them, and the worker pool is shared.  Only
+ * the handshakes have threads of their own.  Without an image given, the
+ * exports are those of the configuration file and the control socket.
+ */
+static int
+nbd_serve(nbd_context_t *ncp, void *pctx) {
+    int                leave   = 0;
+    int                compact = 0;
+    int                stats   = 0;
+    int                sigfh   = -1;
+    int                timerfh = -1;
+    int                lfh     = -1;
+    int                cfh     = -1;
+    sigset_t           oldmask;
+    struct sigaction   newsig, oldsig;
+    struct epoll_event events[NBD_MAX_EVENTS];
+    nbd_pool_t         pool;
+    nbd_export_t *     exp;
+    nbd_conn_t *       cnp;
+    void *             ptr;
+    int                error, nev, ei;
+
+    if (pctx) {
+        nbd_geometry(ncp, pctx);
+        ncp->svc_nconns = 0;
     }
 
     /*
-     * Remove the pid file.
+     * A client that hangs up shows as a failed write, not as a signal.
      */
-    remove_pid_file(pidfile);
+    memset(&newsig, 0, sizeof(newsig));
+    newsig.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &newsig, &oldsig);
+
+    if (ncp->svc_listen && (error = nbd_listen(ncp, ncp->svc_listen, &lfh))) {
+        logmsg(ncp, -1, "%s: cannot listen on %s: %s\n", ncp->svc_progname,
+               ncp->svc_listen, strerror(error));
+        return error;
+    }
+    if (ncp->svc_control &&
+        (error = nbd_listen(ncp, ncp->svc_control, &cfh))) {
+        logmsg(ncp, -1, "%s: cannot listen on %s: %s\n", ncp->svc_progname,
+               ncp->svc_control, strerror(error));
+        if (lfh >= 0)
+            close(lfh);
+        return error;
+    }
+    if ((error = nbd_pool_start(&pool, ncp, pctx)) == 0) {
+        if ((error = nbd_pool_events(&pool, &sigfh, &timerfh, &oldmask)) ==
+            0) {
+            if ((lfh >= 0) && (fcntl(lfh, F_SETFL, O_NONBLOCK) < 0))
+                error = errno;
+            else if (lfh >= 0)
+                error = nbd_event_add(&pool, lfh, &lfh);
+        }
+        if (!error && (cfh >= 0)) {
+            if (fcntl(cfh, F_SETFL, O_NONBLOCK) < 0)
+                error = errno;
+            else
+                error = nbd_event_add(&pool, cfh, &cfh);
+        }
+    }
+    if (error) {
+        logmsg(ncp, -1, "%s: cannot start workers: %s\n", ncp->svc_progname,
+               strerror(error));
+    } else if (pctx) {
+        logmsg(ncp, 0, "Export \"%s\" is being served on %s.\n",
+               ncp->svc_export, ncp->svc_listen);
+    } else if (ncp->svc_config &&
+               (error = nbd_ctl_load(&pool, ncp->svc_config))) {
+        logmsg(ncp, -1, "%s: cannot load %s: %s\n", ncp->svc_progname,
+               ncp->svc_config, strerror(error));
+    } else {
+        logmsg(ncp, 0, "Exports are being served on %s.\n",
+               (ncp->svc_listen) ? ncp->svc_listen : "devices");
+    }
+
+    while (!error && !leave) {
+        if ((nev = epoll_wait(pool.np_epfh, events, NBD_MAX_EVENTS, -1)) < 0) {
+            if (errno != EINTR) {
+                error = errno;
+                logmsg(ncp, 0, "[%s] event wait failed: %s\n",
+                       ncp->svc_progname, strerror(error));
+            }
+            continue;
+        }
+        for (ei = 0; !error && (ei < nev); ei++) {
+            ptr = events[ei].data.ptr;
+            if (ptr == &sigfh) {
+                (void)nbd_signals_take(ncp, sigfh, &leave, &compact,
+                                       &stats);
+            } else if (ptr == &timerfh) {
+                /*
+                 * Housekeeping.  Nothing should be left waiting here, but
+                 * make sure.
+                 */
+                nbd_event_clear(timerfh);
+                (void)nbd_reap_children(ncp);
+                nbd_pool_resume(&pool);
+            } else if (ptr == &pool.np_qosfh) {
+                nbd_event_clear(pool.np_qosfh);
+                pool.np_qosdue = 0;
+                nbd_pool_resume(&pool);
+            } else if (ptr == &pool.np_wakefh) {
+                nbd_event_clear(pool.np_wakefh);
+                nbd_pool_resume(&pool);
+            } else if ((ptr == &lfh) || (ptr == &cfh)) {
+                if ((error = nbd_pool_accept(&pool, *(int *)ptr,
+                                             (ptr == &cfh))))
+                    logmsg(ncp, 0, "[%s] accept failed: %s\n",
+                           ncp->svc_progname, strerror(error));
+            } else if (((nbd_conn_t *)ptr)->cn_control) {
+                nbd_ctl_service(&pool, (nbd_conn_t *)ptr);
+            } else {
+                nbd_conn_service(&pool, (nbd_conn_t *)ptr);
+            }
+        }
+
+        /*
+         * Take in the clients that have shaken hands and clean up after
+         * the ones that have gone.  None is freed while its events may
+         * still be on hand.
+         */
+        nbd_pool_clients(&pool);
+
+        /*
+         * Compact the change files if asked to.
+         */
+        compact = nbd_pool_compact(&pool, compact);
+
+        /*
+         * Log the statistics if asked to.
+         */
+        if (stats) {
+            stats = 0;
+            (void)nbd_stats_report(&pool, (nbd_export_t *)NULL,
+                                   (nbd_conn_t *)NULL);
+        }
+    }
+
+    /*
+     * Let go of the devices and hang up on everyone.  The handshakes
+     * fail, and replies still to be sent go nowhere.
+     */
+    for (exp = pool.np_exports; exp; exp = exp->ex_next) {
+        if (exp->ex_ncp->nbd_dev && !exp->ex_removed)
+            nbd_disconnect(exp->ex_ncp, exp->ex_pctx);
+    }
+    for (cnp = pool.np_clients; cnp; cnp = cnp->cn_next)
+        (void)shutdown(cnp->cn_fh, SHUT_RDWR);
+    for (cnp = pool.np_clients; cnp; cnp = cnp->cn_next) {
+        if (cnp->cn_shaking) {
+            pthread_join(cnp->cn_thread, NULL);
+            cnp->cn_shaking = 0;
+        }
+        if (!cnp->cn_done)
+            nbd_conn_stop(&pool, cnp, EPIPE);
+    }
+    nbd_pool_drain(&pool);
+    while ((cnp = pool.np_clients)) {
+        pool.np_clients = cnp->cn_next;
+        nbd_client_free(cnp);
+    }
+    if (pool.np_nworkers)
+        nbd_pool_stop(&pool);
+    if (timerfh >= 0)
+        close(timerfh);
+    if (sigfh >= 0)
+        nbd_signals_close(sigfh, &oldmask);
+    if (lfh >= 0) {
+        close(lfh);
+        if (strchr(ncp->svc_listen, '/'))
+            (void)unlink(ncp->svc_listen);
+    }
+    if (cfh >= 0) {
+        close(cfh);
+        if (strchr(ncp->svc_control, '/'))
+            (void)unlink(ncp->svc_control);
+    }
+
     return error;
 }
 
@@ -768,6 +3290,7 @@ nbd_daemon_mode(nbd_context_t *ncp, void *pctx) {
 int
 main(int argc, char *argv[]) {
     int           option;
+    int           ci;
     extern char * optarg;
     char *        file  = (char *)NULL;
     char *        cfile = (char *)NULL;
@@ -777,13 +3300,19 @@ main(int argc, char *argv[]) {
     memset(&nc, 0, sizeof(nc));
     nc.nbd_fh          = -1;
     nc.nbd_timeout     = -1;
-    nc.svc_fh          = -1;
+    nc.svc_nconns      = 1;
     nc.svc_daemon_mode = 1;
+    nc.svc_nworkers    = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    nc.svc_memory      = NBD_MEMORY_DEFAULT;
+    for (ci = 0; ci < NBD_MAX_CONNECTIONS; ci++)
+        nc.svc_fh[ci] = -1;
 
     /*
      * Parse options.
      */
-    while ((option = getopt(argc, argv, "c:d:f:v:i:m:t:DrwTR")) != -1) {
+    while ((option = getopt(argc, argv,
+                            "c:d:e:f:l:o:v:i:j:m:n:t:B:C:I:M:S:W:DrwTR")) !=
+           -1) {
         switch (option) {
         case 'c':
             cfile = optarg;
@@ -791,21 +3320,56 @@ main(int argc, char *argv[]) {
         case 'd':
             nc.nbd_dev = optarg;
             break;
+        case 'e':
+            nc.svc_export = optarg;
+            break;
         case 'f':
             file = optarg;
             break;
+        case 'l':
+            nc.svc_listen = optarg;
+            break;
+        case 'o':
+            if (parse_cf_options(optarg, &nc.svc_cf_features))
+                error = 1;
+            break;
         case 'v':
             sscanf(optarg, "%d", &nc.svc_verbose);
             break;
         case 'i':
             sscanf(optarg, "%d", &nc.nbd_timeout);
             break;
+        case 'j':
+            sscanf(optarg, "%d", &nc.svc_nworkers);
+            break;
         case 'm':
             nc.svc_mount = optarg;
             break;
+        case 'n':
+            sscanf(optarg, "%d", &nc.svc_nconns);
+            nc.nbd_netlink = 1;
+            break;
         case 't':
             nc.svc_mtype = optarg;
             break;
+        case 'B':
+            sscanf(optarg, "%d", &nc.svc_bandwidth);
+            break;
+        case 'C':
+            nc.svc_config = optarg;
+            break;
+        case 'I':
+            sscanf(optarg, "%d", &nc.svc_iops);
+            break;
+        case 'M':
+            sscanf(optarg, "%d", &nc.svc_memory);
+            break;
+        case 'S':
+            nc.svc_control = optarg;
+            break;
+        case 'W':
+            sscanf(optarg, "%d", &nc.svc_wbcache);
+            break;
         case 'D':
             nc.svc_daemon_mode = !nc.svc_daemon_mode;
             break;
@@ -826,6 +3390,54 @@ main(int argc, char *argv[]) {
             break;
         }
     }
+#ifndef HAVE_LINUX_NBD_NETLINK_H
+    if (nc.nbd_netlink) {
+        fprintf(stderr, "%s: netlink connections are not supported\n",
+                argv[0]);
+        error = 1;
+    }
+#endif /* HAVE_LINUX_NBD_NETLINK_H */
+    if (nc.svc_listen && file) {
+        /*
+         * Serve instead of attaching a device.  Clients that don't name
+         * an export get the only one.
+         */
+        if (!nc.svc_export)
+            nc.svc_export = (char *)my_strrchr(file, '/');
+        if (nc.nbd_dev || nc.nbd_netlink || nc.svc_mount) {
+            fprintf(stderr, "%s: -l serves without a device\n", argv[0]);
+            error = 1;
+        } else if (strlen(nc.svc_export) > NBD_MAX_OPTION - 4) {
+            fprintf(stderr, "%s: export name too long\n", argv[0]);
+            error = 1;
+        }
+    }
+    if (!file && (nc.svc_config || nc.svc_control)) {
+        /*
+         * Serve the exports that the configuration file and the control
+         * socket ask for.
+         */
+        if (nc.nbd_dev || nc.svc_export || nc.svc_mount) {
+            fprintf(stderr, "%s: -C and -S name exports in their commands\n",
+                    argv[0]);
+            error = 1;
+        }
+    } else if (file && !nc.svc_listen && (nc.svc_config || nc.svc_control)) {
+        fprintf(stderr, "%s: -C and -S serve without a device\n", argv[0]);
+        error = 1;
+    }
+    if (nc.svc_nconns < 1)
+        nc.svc_nconns = 1;
+    if (nc.svc_nconns > NBD_MAX_CONNECTIONS)
+        nc.svc_nconns = NBD_MAX_CONNECTIONS;
+    if (nc.svc_nworkers < 1)
+        nc.svc_nworkers = 1;
+    if (nc.svc_nworkers > NBD_MAX_WORKERS)
+        nc.svc_nworkers = NBD_MAX_WORKERS;
+    if (nc.svc_memory < 1)
+        nc.svc_memory = 1;
+    if (nc.svc_wbcache < 0)
+        nc.svc_wbcache = 0;
     if (nc.svc_daemon_mode) {
         printf("Launched in daemon mode: All logging output being written to "
                "the system log.\n");
@@ -834,7 +3446,12 @@ main(int argc, char *argv[]) {
     /*
      * If successful, then do it!.
      */
-    if (!error && nc.nbd_dev && file) {
+    if (!error && !file && (nc.svc_config || nc.svc_control)) {
+        nc.svc_progname = argv[0];
+        loginit(&nc);
+        if (!(error = nbd_daemon_mode(&nc, (void *)NULL)))
+            error = nbd_serve(&nc, (void *)NULL);
+    } else if (!error && (nc.nbd_dev || nc.svc_listen) && file) {
         void *pctx = (void *)NULL;
         /*
          * Open the image.
@@ -850,6 +3467,12 @@ main(int argc, char *argv[]) {
             if (nc.svc_tolerant) {
                 image_tolerant_mode(pctx);
             }
+            /*
+             * Select change file features (if specified).
+             */
+            if (nc.svc_cf_features) {
+                image_cf_features(pctx, nc.svc_cf_features);
+            }
             /*
              * Verify the image.
              */
@@ -859,7 +3482,13 @@ main(int argc, char *argv[]) {
                  * Initialize the logger and check capabilities.
                  */
                 loginit(&nc);
-                if (!(error = nbd_check_capabilities(&nc, pctx))) {
+                if (nc.svc_listen) {
+                    /*
+                     * No device, so no capabilities needed.
+                     */
+                    if (!(error = nbd_daemon_mode(&nc, pctx)))
+                        error = nbd_serve(&nc, pctx);
+                } else if (!(error = nbd_check_capabilities(&nc, pctx))) {
                     /*
                      * Enter daemon mode - no more stderr messages if so.
                      */
@@ -911,9 +3540,20 @@ main(int argc, char *argv[]) {
         }
     } else {
         fprintf(stderr,
-                "%s: usage %s -d disk -f file [-c cfile] "
-                "[-m mount [-t type]] [-i timeout] [-v verbose] [-Drw]\n",
-                argv[0], argv[0]);
+                "%s: usage %s -d disk -f file [-c cfile] [-o cfopts] "
+                "[-m mount [-t type]] [-i timeout] [-j workers] "
+                "[-M megabytes] [-W megabytes] [-I iops] [-B mbps] "
+                "[-n connections] [-v verbose] [-Drw]\n"
+                "       %s -l address -f file [-e export] [-c cfile] "
+                "[-o cfopts] [-S control] [-j workers] [-M megabytes] "
+                "[-W megabytes] [-I iops] [-B mbps] [-v verbose] [-Drw]\n"
+                "       %s -S control | -C config [-l address] [-o cfopts] "
+                "[-i timeout] [-j workers] [-M megabytes] [-W megabytes] "
+                "[-I iops] [-B mbps] [-n connections] [-v verbose] "
+                "[-Drw]\n"
+                "       -M caps request buffers and -W caches together; "
+                "a cache is cut to fit\n",
+                argv[0], argv[0], argv[0], argv[0]);
     }
 
     return error;
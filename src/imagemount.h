@@ -0,0 +1,457 @@
+/*
+ * imagemount.h - Internals shared by the parts of imagemount.
+ */
+/*
+ * Copyright (c) 2010, Ideal World, Inc.  All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ */
+#ifndef _IMAGEMOUNT_H_
+#define _IMAGEMOUNT_H_ 1
+
+#include "libimage.h"
+#include <linux/nbd.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
+/*
+ * Size of the scratch buffers for data that is dropped, and the least a
+ * request buffer holds.
+ */
+#define READBUF_INITIAL 8192
+/*
+ * Request buffers.  Pooled ones hold the largest request the kernel makes
+ * by default (max_sectors_kb), plus a block either side for unaligned
+ * requests; larger requests get a buffer of their own.  All of them count
+ * against a cap, in megabytes.
+ */
+#define NBD_BUFFER_SIZE    (1280 * 1024)
+#define NBD_MEMORY_DEFAULT 256
+/*
+ * Worker pool limits.  Past NBD_MAX_INFLIGHT requests, the kernel waits
+ * for replies before more are read.
+ */
+#define NBD_MAX_WORKERS  64
+#define NBD_MAX_INFLIGHT 256
+/*
+ * Most sockets to connect a device with over netlink.
+ */
+#define NBD_MAX_CONNECTIONS 16
+/*
+ * Largest request accepted.  A client asking for more is out of sync or
+ * hostile, so its connection is dropped.
+ */
+#define NBD_MAX_REQUEST (32 * 1024 * 1024)
+/*
+ * Shortest run of a read that is sent straight from the image file.
+ * Shorter ones cost more in system calls than copying them saves.
+ */
+#define NBD_DIRECT_MIN (32 * 1024)
+/*
+ * Size of a connection's input buffer.  One read takes in as many queued
+ * requests as fit.
+ */
+#define NBD_INPUT_SIZE (64 * 1024)
+/*
+ * Block size that pooled buffers allow for when images of any block size
+ * may come and go.
+ */
+#define NBD_BLOCKSIZE_DEFAULT 4096
+/*
+ * Longest command line, and most words in one, of the configuration file
+ * and the control socket.
+ */
+#define NBD_CTL_LINE    4096
+#define NBD_CTL_MAXARGS 4
+/*
+ * Seconds a send to a client may wait for it to take data.  A client that
+ * takes no more is hung up on rather than hold up a worker.
+ */
+#define NBD_SEND_TIMEOUT 30
+/*
+ * Quality of service.  Rate limits allow a burst of this many nanoseconds'
+ * worth of requests.  Reads of at most NBD_QOS_SMALL bytes that don't
+ * follow on from the last one are run ahead of other jobs, but a job is
+ * passed over at most NBD_QOS_PASSES times.
+ */
+#define NBD_QOS_BURST  100000000ULL
+#define NBD_QOS_SMALL  (64 * 1024)
+#define NBD_QOS_PASSES 8
+/*
+ * Most events taken from the event loop at once, and the interval in
+ * seconds of its housekeeping.
+ */
+#define NBD_MAX_EVENTS   64
+#define NBD_HOUSEKEEPING 1
+/*
+ * Write-back cache.  An export's cache is written back once half of it is
+ * dirty or its oldest block has waited NBD_WB_AGE seconds, in runs of at
+ * most NBD_WB_BATCH bytes.  Writes larger than a run bypass it.
+ */
+#define NBD_WB_AGE   5
+#define NBD_WB_BATCH (4 * 1024 * 1024)
+/*
+ * Statistics.  Requests are counted by command, and their latencies kept
+ * in histograms of microseconds whose buckets are a power of two split
+ * into 1 << NBD_STATS_SUBBITS, which puts a value within an eighth.
+ */
+#define NBD_STATS_COMMANDS 8
+#define NBD_STATS_SUBBITS  3
+#define NBD_STATS_BUCKETS  240
+/*
+ * Newstyle handshake, for serving clients over the network.  linux/nbd.h
+ * only has what the kernel uses in transmission.
+ */
+#define NBD_INIT_MAGIC            0x4e42444d41474943ULL /* "NBDMAGIC" */
+#define NBD_OPTS_MAGIC            0x49484156454f5054ULL /* "IHAVEOPT" */
+#define NBD_REP_MAGIC             0x3e889045565a9ULL
+#define NBD_FLAG_FIXED_NEWSTYLE   (1 << 0)
+#define NBD_FLAG_NO_ZEROES        (1 << 1)
+#define NBD_OPT_EXPORT_NAME       1
+#define NBD_OPT_ABORT             2
+#define NBD_OPT_LIST              3
+#define NBD_OPT_INFO              6
+#define NBD_OPT_GO                7
+#define NBD_OPT_STRUCTURED_REPLY  8
+#define NBD_OPT_LIST_META_CONTEXT 9
+#define NBD_OPT_SET_META_CONTEXT  10
+#define NBD_REP_ACK               1
+#define NBD_REP_SERVER            2
+#define NBD_REP_INFO              3
+#define NBD_REP_META_CONTEXT      4
+#define NBD_REP_FLAG_ERROR        (1U << 31)
+#define NBD_REP_ERR_UNSUP         (1 | NBD_REP_FLAG_ERROR)
+#define NBD_REP_ERR_INVALID       (3 | NBD_REP_FLAG_ERROR)
+#define NBD_REP_ERR_UNKNOWN       (6 | NBD_REP_FLAG_ERROR)
+#define NBD_INFO_EXPORT           0
+#define NBD_INFO_NAME             1
+#define NBD_INFO_BLOCK_SIZE       3
+/*
+ * Structured replies and block status, which clients other than the kernel
+ * may ask for.  The upper 16 bits of a request's type are its flags.
+ */
+#define NBD_STRUCTURED_REPLY_MAGIC  0x668e33ef
+#define NBD_REPLY_FLAG_DONE         (1 << 0)
+#define NBD_REPLY_TYPE_OFFSET_DATA  1
+#define NBD_REPLY_TYPE_BLOCK_STATUS 5
+#define NBD_REPLY_TYPE_ERROR        ((1 << 15) | 1)
+#define NBD_CMD_BLOCK_STATUS        7
+#define NBD_CMD_MASK_COMMAND        0xffff
+#define NBD_CMD_FLAG_REQ_ONE        (1 << 19)
+#define NBD_STATE_HOLE              (1 << 0)
+#define NBD_STATE_ZERO              (1 << 1)
+#define NBD_META_ALLOCATION         "base:allocation"
+#define NBD_META_ALLOCATION_ID      1
+/*
+ * Zeroing, which older linux/nbd.h lack.  Trims use the same path.
+ */
+#ifndef NBD_FLAG_SEND_WRITE_ZEROES
+#    define NBD_FLAG_SEND_WRITE_ZEROES (1 << 6)
+#endif /* NBD_FLAG_SEND_WRITE_ZEROES */
+#define NBD_CMD_WRITE_ZEROES 6
+/*
+ * Longest option a client may send during the handshake.
+ */
+#define NBD_MAX_OPTION 4096
+/*
+ * Most extents in a block status reply, which fill a job's initial buffer.
+ */
+#define NBD_MAX_EXTENTS (READBUF_INITIAL / (2 * sizeof(uint32_t)))
+/*
+ * NTOHLL - ntohl for 64 bit values.
+ */
+#define NTOHLL(_x) be64toh(_x)
+
+/*
+ * Run context for program.
+ */
+typedef struct nbd_context {
+    char *   svc_progname;
+    char *   svc_mount;
+    char *   svc_mtype;
+    char *   nbd_dev;
+    int      nbd_fh;
+    int      nbd_timeout;
+    int      nbd_netlink;
+    char *   svc_listen;
+    char *   svc_export;
+    char *   svc_config;
+    char *   svc_control;
+    int      svc_fh[NBD_MAX_CONNECTIONS];
+    int      svc_nconns;
+    int      svc_verbose;
+    int      svc_daemon_mode;
+    int      svc_rdonly;
+    int      svc_tolerant;
+    int      svc_raw_available;
+    int      svc_nworkers;
+    int      svc_memory;
+    int      svc_wbcache;
+    int      svc_iops;
+    int      svc_bandwidth;
+    uint32_t svc_cf_features;
+    uint64_t svc_blocksize;
+    uint64_t svc_blockcount;
+    uint64_t svc_offsetmask;
+    uint64_t svc_blockmask;
+    pid_t    svc_toreap;
+} nbd_context_t;
+
+/*
+ * A rate limit.  Requests are let through while the time at which what
+ * they have taken is paid for is no more than a burst ahead.
+ */
+typedef struct nbd_bucket {
+    uint64_t tb_rate; /* Tokens a second, or 0 for no limit */
+    uint64_t tb_due;  /* When the tokens taken are paid for, in ns */
+} nbd_bucket_t;
+
+/*
+ * A block in a write-back cache.
+ */
+typedef struct nbd_wbentry {
+    struct nbd_wbentry *we_next;  /* Next on its hash chain, or free */
+    uint64_t            we_block; /* Block number */
+    uint64_t            we_seq;   /* Write that last changed it */
+    char *              we_data;  /* Contents */
+} nbd_wbentry_t;
+
+struct nbd_pool;
+
+/*
+ * Write-back cache of an export.  Writes are replied to once their blocks
+ * are here, and the blocks are written to the image later, sorted into
+ * runs, so that a block rewritten meanwhile is written once.  One thread
+ * at a time writes back.  A block stays until it is written, so reads
+ * find it, and stays dirty if it was rewritten while being written.  Its
+ * memory counts against the pool's memory cap.
+ */
+typedef struct nbd_wbcache {
+    pthread_mutex_t  wb_lock;     /* Protects the rest */
+    pthread_cond_t   wb_idle;     /* Writing back has finished */
+    uint64_t         wb_bsize;    /* Block size */
+    nbd_wbentry_t *  wb_entries;  /* All entries */
+    char *           wb_data;     /* Contents of all entries */
+    nbd_wbentry_t ** wb_hash;     /* Entries in use, by block */
+    uint64_t         wb_hashmask; /* Number of hash chains, less one */
+    nbd_wbentry_t *  wb_free;     /* Entries not in use */
+    uint64_t         wb_nentries; /* Most blocks held */
+    uint64_t         wb_count;    /* Blocks held */
+    uint64_t         wb_seq;      /* Number of block writes */
+    uint64_t         wb_since;    /* When the oldest was written, or 0 */
+    int              wb_busy;     /* Being written back */
+    uint64_t *       wb_blocks;   /* Blocks being written back, sorted */
+    uint64_t *       wb_seqs;     /* Writes copied to the run */
+    char *           wb_run;      /* Run being written back */
+    uint64_t         wb_nrun;     /* Most blocks in a run */
+    struct nbd_pool *wb_pool;     /* Pool its memory is counted in */
+    uint64_t         wb_memory;   /* Bytes of it counted */
+} nbd_wbcache_t;
+
+/*
+ * Counters of an export.  They are updated without a lock.
+ */
+typedef struct nbd_stats {
+    uint64_t st_ops[NBD_STATS_COMMANDS];    /* Requests done */
+    uint64_t st_bytes[NBD_STATS_COMMANDS];  /* Bytes they covered */
+    uint64_t st_errors[NBD_STATS_COMMANDS]; /* Requests that failed */
+    uint64_t st_max[NBD_STATS_COMMANDS];    /* Longest latency, in us */
+    uint64_t st_batched;                    /* Reads done in a batch */
+    uint64_t st_direct;                     /* Reads sent from the file */
+    uint64_t st_wbhits;                     /* Blocks read from the cache */
+    uint64_t st_wbmerged;                   /* Cached blocks written again */
+    uint64_t st_wbblocks;                   /* Blocks written back */
+    uint64_t st_wbruns;                     /* Runs written back */
+    uint64_t st_latency[NBD_STATS_COMMANDS][NBD_STATS_BUCKETS];
+} nbd_stats_t;
+
+/*
+ * An image being served.  Requests reach it through their connection.
+ */
+typedef struct nbd_export {
+    struct nbd_export *ex_next;     /* Next export */
+    nbd_context_t *    ex_ncp;      /* Geometry and settings */
+    void *             ex_pctx;     /* Image */
+    char *             ex_file;     /* Image file, if the export owns it */
+    uint32_t           ex_nconns;   /* Connections using it */
+    int                ex_removed;  /* Close once no longer used */
+    int                ex_syncing;  /* An image sync is running */
+    int                ex_syncerr;  /* Result of the last image sync */
+    uint64_t           ex_syncgen;  /* Number of image syncs started */
+    uint64_t           ex_syncdone; /* Number of image syncs finished */
+    nbd_bucket_t       ex_iops;     /* Request rate limit */
+    nbd_bucket_t       ex_bytes;    /* Data rate limit */
+    nbd_wbcache_t *    ex_wb;       /* Write-back cache, if any */
+    nbd_stats_t        ex_stats;    /* Counters */
+} nbd_export_t;
+
+struct nbd_conn;
+
+/*
+ * A request being serviced.  Jobs stay on the in-flight list in arrival
+ * order until their reply is sent.
+ */
+typedef struct nbd_job {
+    struct nbd_job *   nj_next;       /* Next job */
+    struct nbd_request nj_request;    /* Request from the kernel */
+    uint32_t           nj_command;    /* Command without its flags */
+    uint64_t           nj_startblock; /* First block touched */
+    uint64_t           nj_blockcount; /* Number of blocks touched */
+    uint64_t           nj_sboffs;     /* Offset into the first block */
+    struct nbd_conn *  nj_conn;       /* Connection to reply on */
+    size_t             nj_length;     /* Length of the transfer */
+    int                nj_running;    /* Picked up by a worker */
+    char *             nj_buf;        /* Block buffer */
+    size_t             nj_bufsize;    /* Size of the block buffer */
+    int                nj_direct;     /* Data sent from the image file */
+    struct nbd_job *   nj_batch;      /* Next read in the same batch */
+    uint64_t           nj_batchstart; /* First block of the batch */
+    uint64_t           nj_batchcount; /* Number of blocks in the batch */
+    int                nj_urgent;     /* Small random read, run first */
+    int                nj_passed;     /* Times urgent jobs went first */
+    uint64_t           nj_arrived;    /* When the request came, in ns */
+    int                nj_refused;    /* Only to be replied to with this */
+} nbd_job_t;
+
+/*
+ * A connection to the kernel or to a remote client.  Each is read by the
+ * event loop, and replies to it are written one at a time.
+ */
+typedef struct nbd_conn {
+    struct nbd_conn *cn_next;       /* Next client */
+    struct nbd_pool *cn_pool;       /* Pool requests go to */
+    nbd_export_t *   cn_export;     /* Image requests are for */
+    int              cn_fh;         /* Socket */
+    int              cn_done;       /* Finished with its input */
+    int              cn_error;      /* Why it finished */
+    int              cn_stalled;    /* Waiting for a job or buffer */
+    uint32_t         cn_inflight;   /* Requests not yet replied to */
+    int              cn_structured; /* Client takes structured replies */
+    int              cn_control;    /* Takes commands, not requests */
+    uint32_t         cn_context;    /* Block status context, if any */
+    pthread_t        cn_thread;     /* Handshake thread */
+    int              cn_shaking;    /* Handshake thread not yet joined */
+    int              cn_shaken;     /* Handshake thread has finished */
+    pthread_mutex_t  cn_reply;      /* Serializes replies */
+    char *           cn_input;      /* Input read ahead */
+    size_t           cn_inhead;     /* Start of unused input */
+    size_t           cn_intail;     /* End of unused input */
+    struct nbd_job * cn_job;        /* Write whose data is arriving */
+    char *           cn_dest;       /* Where the data goes, if anywhere */
+    size_t           cn_want;       /* Bytes of data still to arrive */
+    uint64_t         cn_nextread;   /* Where the last read ended */
+    char *           cn_output;     /* Control replies not yet sent */
+    size_t           cn_outlen;     /* Bytes of them */
+    size_t           cn_outsize;    /* Size of the output buffer */
+    int              cn_outwait;    /* Watched for room to send them */
+} nbd_conn_t;
+
+/*
+ * Worker pool.  The event loop reads requests and queues them, the
+ * workers do the image I/O and send the replies one at a time.
+ */
+typedef struct nbd_pool {
+    nbd_context_t * np_ncp;
+    nbd_export_t *  np_exports;  /* Images served */
+    pthread_mutex_t np_lock;     /* Protects the jobs and buffers */
+    pthread_cond_t  np_work;     /* A job may have become runnable */
+    pthread_cond_t  np_done;     /* A job has finished */
+    nbd_job_t *     np_head;     /* In-flight jobs, oldest first */
+    nbd_job_t *     np_tail;     /* Newest in-flight job */
+    nbd_job_t *     np_free;     /* Finished jobs for reuse */
+    uint32_t        np_inflight; /* Number of in-flight jobs */
+    int             np_quit;     /* Workers are to exit */
+    int             np_nworkers; /* Number of workers started */
+    int             np_nconns;   /* Number of device connections */
+    nbd_conn_t *    np_clients;  /* Other connections */
+    int             np_epfh;     /* Event loop */
+    int             np_wakefh;   /* Wakes the event loop */
+    int             np_stalled;  /* A connection waits for a job */
+    int             np_qosfh;    /* Wakes the loop when limits allow */
+    uint64_t        np_qosdue;   /* When it is set for, or 0 */
+    uint32_t        np_urgent;   /* Number of urgent jobs not running */
+    char *          np_buffers;  /* Pooled buffers not in use */
+    size_t          np_bufsize;  /* Size of a pooled buffer */
+    size_t          np_align;    /* Alignment of buffers */
+    uint64_t        np_memory;   /* Bytes of buffers and caches allocated */
+    uint64_t        np_memcap;   /* Most bytes of them to allocate */
+    uint32_t        np_bufinuse; /* Number of buffers in use */
+    pthread_cond_t  np_syncwait; /* An image sync has finished */
+    pthread_cond_t  np_wbwork;   /* A cache may want writing back */
+    pthread_t       np_wbthread; /* Writes back the caches */
+    int             np_wbalive;  /* The write-back thread runs */
+    pthread_t       np_cfthread; /* Compacts the change files */
+    int             np_cfalive;  /* The compaction thread is not joined */
+    int             np_cfdone;   /* The compaction thread has finished */
+    pthread_t       np_workers[NBD_MAX_WORKERS];
+    nbd_conn_t      np_conns[NBD_MAX_CONNECTIONS];
+} nbd_pool_t;
+
+/*
+ * The time now, in nanoseconds.
+ */
+static inline uint64_t
+nbd_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * imagemount.c
+ */
+void          logmsg(nbd_context_t *ncp, int level, char *fmt, ...);
+uint16_t      nbd_export_flags(nbd_context_t *ncp);
+nbd_export_t *nbd_export_get(nbd_pool_t *np, const char *name,
+                             uint32_t namelen);
+void          nbd_export_put(nbd_pool_t *np, nbd_export_t *exp);
+int           nbd_ctl_write(nbd_conn_t *cnp, const char *data, size_t len);
+
+/*
+ * nbdbuffer.c - request buffers
+ */
+void  nbd_buf_init(nbd_pool_t *np, uint64_t bsize, int count);
+char *nbd_buf_take(nbd_pool_t *np, size_t size, size_t *sizep);
+void  nbd_buf_give(nbd_pool_t *np, char *buf, size_t size);
+void  nbd_buf_fini(nbd_pool_t *np);
+
+/*
+ * nbdprotocol.c - the wire protocol
+ */
+int nbd_write_full(int fd, const void *buf, size_t len);
+int nbd_job_run_at(nbd_pool_t *np, nbd_job_t *njp, uint64_t blockno,
+                   void **fhp, uint64_t *offsetp, uint64_t *countp);
+int nbd_conn_reply(nbd_conn_t *cnp, const struct nbd_request *rqp, int rerror,
+                   const void *data, size_t length, nbd_job_t *direct);
+int nbd_handshake(nbd_context_t *ncp, nbd_conn_t *cnp);
+
+/*
+ * nbdwbcache.c - write-back caches
+ */
+int      nbd_wb_new(nbd_pool_t *np, nbd_export_t *exp, int megabytes);
+void     nbd_wb_free(nbd_wbcache_t *wbp);
+uint64_t nbd_wb_span(nbd_wbcache_t *wbp, uint64_t blockno, uint64_t nblocks,
+                     int *cachedp, char *buf);
+int      nbd_wb_sync(nbd_export_t *exp);
+void     nbd_wb_drop(nbd_export_t *exp, uint64_t blockno, uint64_t nblocks);
+int      nbd_image_read(nbd_export_t *exp, uint64_t blockno, char *buf,
+                        uint64_t nblocks);
+int      nbd_image_write(nbd_pool_t *np, nbd_export_t *exp, uint64_t blockno,
+                         char *buf, uint64_t nblocks);
+void *   nbd_wb_thread(void *arg);
+
+/*
+ * nbdstats.c - statistics
+ */
+void nbd_stats_done(nbd_export_t *exp, const nbd_job_t *njp, int error);
+int  nbd_stats_report(nbd_pool_t *np, const nbd_export_t *named,
+                      nbd_conn_t *cnp);
+
+#endif /* _IMAGEMOUNT_H_ */
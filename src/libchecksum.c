@@ -6,7 +6,14 @@
 #define CRC32_SEED      0xFFFFFFFFL
 #define CRC32_TABLE_LEN 256
 
-static uint32_t crc_tab32[CRC32_TABLE_LEN] = {0};
+#define CRC32_SLICES    8
+
+/*
+ * crc_tab32[0] is the usual byte table.  crc_tab32[k] advances a byte
+ * followed by k zero bytes, so that eight bytes are done per step.
+ */
+static uint32_t crc_tab32[CRC32_SLICES][CRC32_TABLE_LEN] = {{0}};
+static int      crc_tab32_done                           = 0;
 
 /**
  * Initialise crc32 lookup table if it is not already done and initialise the
@@ -14,7 +21,7 @@ static uint32_t crc_tab32[CRC32_TABLE_LEN] = {0};
  */
 crc32_t
 init_crc32() {
-    if (crc_tab32[0] == 0) {
+    if (!crc_tab32_done) {
         crc32_t  init_crc;
         uint32_t i, j;
 
@@ -27,8 +34,13 @@ init_crc32() {
                     init_crc = init_crc >> 1;
             }
 
-            crc_tab32[i] = init_crc;
+            crc_tab32[0][i] = init_crc;
         }
+        for (i = 0; i < CRC32_TABLE_LEN; ++i)
+            for (j = 1; j < CRC32_SLICES; j++)
+                crc_tab32[j][i] = (crc_tab32[j - 1][i] >> 8) ^
+                                  crc_tab32[0][crc_tab32[j - 1][i] & 0xff];
+        crc_tab32_done = 1;
     }
 
     return CRC32_SEED;
@@ -47,11 +59,122 @@ update_crc32(crc32_t seed, void *buffer, uint64_t size) {
     crc32_t              crc = seed;
     int32_t              tmp, long_c;
 
+    while ((end - buf) >= CRC32_SLICES) {
+        uint32_t lo = crc ^ (buf[0] | (buf[1] << 8) | (buf[2] << 16) |
+                             ((uint32_t)buf[3] << 24));
+        uint32_t hi =
+            buf[4] | (buf[5] << 8) | (buf[6] << 16) | ((uint32_t)buf[7] << 24);
+
+        crc = crc_tab32[7][lo & 0xff] ^ crc_tab32[6][(lo >> 8) & 0xff] ^
+              crc_tab32[5][(lo >> 16) & 0xff] ^ crc_tab32[4][lo >> 24] ^
+              crc_tab32[3][hi & 0xff] ^ crc_tab32[2][(hi >> 8) & 0xff] ^
+              crc_tab32[1][(hi >> 16) & 0xff] ^ crc_tab32[0][hi >> 24];
+        buf += CRC32_SLICES;
+    }
     while (buf != end) {
         long_c = *(buf++);
         tmp    = crc ^ long_c;
-        crc    = (crc >> 8) ^ crc_tab32[tmp & 0xff];
+        crc    = (crc >> 8) ^ crc_tab32[0][tmp & 0xff];
     };
 
     return crc;
 }
+
+/*
+ * 128-bit content hash (MurmurHash3 x64_128, by Austin Appleby, placed in
+ * the public domain).  Not cryptographic, but fast and well distributed.
+ */
+#define HASH128_C1 0x87c37b91114253d5ULL
+#define HASH128_C2 0x4cf5ad432745937fULL
+
+static inline uint64_t
+hash128_rotl(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t
+hash128_fmix(uint64_t k) {
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+}
+
+static inline uint64_t
+hash128_load(const uint8_t *p) {
+    uint64_t v = 0;
+    int      i;
+
+    /* Little-endian regardless of host, so stored hashes are portable. */
+    for (i = 7; i >= 0; i--)
+        v = (v << 8) | p[i];
+    return v;
+}
+
+void
+hash128(const void *buf, uint64_t size, uint64_t seed, uint64_t *hash) {
+    const uint8_t *data    = (const uint8_t *)buf;
+    uint64_t       nblocks = size / 16;
+    uint64_t       h1      = seed;
+    uint64_t       h2      = seed;
+    uint64_t       k1, k2;
+    uint64_t       i;
+
+    for (i = 0; i < nblocks; i++) {
+        k1 = hash128_load(data + (i * 16));
+        k2 = hash128_load(data + (i * 16) + 8);
+
+        k1 *= HASH128_C1;
+        k1 = hash128_rotl(k1, 31);
+        k1 *= HASH128_C2;
+        h1 ^= k1;
+        h1 = hash128_rotl(h1, 27);
+        h1 += h2;
+        h1 = h1 * 5 + 0x52dce729;
+
+        k2 *= HASH128_C2;
+        k2 = hash128_rotl(k2, 33);
+        k2 *= HASH128_C1;
+        h2 ^= k2;
+        h2 = hash128_rotl(h2, 31);
+        h2 += h1;
+        h2 = h2 * 5 + 0x38495ab5;
+    }
+
+    /*
+     * Tail.
+     */
+    data += nblocks * 16;
+    k1 = 0;
+    k2 = 0;
+    for (i = size & 15; i > 8; i--)
+        k2 ^= ((uint64_t)data[i - 1]) << ((i - 9) * 8);
+    if (k2) {
+        k2 *= HASH128_C2;
+        k2 = hash128_rotl(k2, 33);
+        k2 *= HASH128_C1;
+        h2 ^= k2;
+    }
+    for (; i > 0; i--)
+        k1 ^= ((uint64_t)data[i - 1]) << ((i - 1) * 8);
+    if (k1) {
+        k1 *= HASH128_C1;
+        k1 = hash128_rotl(k1, 31);
+        k1 *= HASH128_C2;
+        h1 ^= k1;
+    }
+
+    h1 ^= size;
+    h2 ^= size;
+    h1 += h2;
+    h2 += h1;
+    h1 = hash128_fmix(h1);
+    h2 = hash128_fmix(h2);
+    h1 += h2;
+    h2 += h1;
+
+    hash[0] = h1;
+    hash[1] = h2;
+}
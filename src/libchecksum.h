@@ -11,5 +11,6 @@ typedef uint32_t crc32_t;
 
 crc32_t init_crc32();
 crc32_t update_crc32(crc32_t seed, void *buf, uint64_t size);
+void    hash128(const void *buf, uint64_t size, uint64_t seed, uint64_t *hash);
 
 #endif /* _PU_LIBCHECKSUM_H_ */
@@ -0,0 +1,194 @@
+/*
+ * libcompress.c - a small, fast LZ77 block codec
+ *
+ * The stream is a series of sequences, each a token byte (literal count in
+ * the high nibble, match length less LZ_MIN_MATCH in the low nibble), any
+ * extra literal count bytes, the literals, a 16-bit little-endian match
+ * offset and any extra match length bytes.  A nibble of 15 is followed by
+ * length bytes that are added on until one is less than 255.  The last
+ * sequence has literals only.  This is the LZ4 block layout, so decoding is
+ * little more than a series of copies.
+ */
+#include "libcompress.h"
+#include <errno.h>
+#include <string.h>
+
+#define LZ_MIN_MATCH  4
+#define LZ_MAX_OFFSET 65535
+#define LZ_HASH_BITS  12
+#define LZ_LAST_LITS  5  /* The last bytes are always literals */
+#define LZ_MF_LIMIT   12 /* No match starts this close to the end */
+
+static inline uint32_t
+lz_read32(const uint8_t *p) {
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t
+lz_hash(uint32_t seq) {
+    return (seq * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+static inline uint8_t *
+lz_put_length(uint8_t *op, uint64_t len) {
+    for (; len >= 255; len -= 255)
+        *op++ = 255;
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+/*
+ * Compress slen bytes at src into at most dcap bytes at dst.  Returns the
+ * compressed size, or 0 if it does not fit.
+ */
+uint64_t
+lz_compress(const void *src, uint64_t slen, void *dst, uint64_t dcap) {
+    const uint8_t *const base   = (const uint8_t *)src;
+    const uint8_t *const iend   = base + slen;
+    const uint8_t *      ip     = base;
+    const uint8_t *      anchor = base;
+    uint8_t *const       obase  = (uint8_t *)dst;
+    uint8_t *const       oend   = obase + dcap;
+    uint8_t *            op     = obase;
+    uint32_t             table[1 << LZ_HASH_BITS];
+    uint64_t             litlen;
+
+    memset(table, 0, sizeof(table));
+    if (slen > LZ_MF_LIMIT) {
+        const uint8_t *const mflimit    = iend - LZ_MF_LIMIT;
+        const uint8_t *const matchlimit = iend - LZ_LAST_LITS;
+
+        while (ip < mflimit) {
+            uint32_t       seq = lz_read32(ip);
+            uint32_t       h   = lz_hash(seq);
+            const uint8_t *ref = base + table[h];
+
+            table[h] = (uint32_t)(ip - base);
+            if ((ref < ip) && ((ip - ref) <= LZ_MAX_OFFSET) &&
+                (lz_read32(ref) == seq)) {
+                const uint8_t *mp = ip + LZ_MIN_MATCH;
+                uint64_t       mlen;
+                uint8_t *      token;
+
+                while ((mp < matchlimit) && (*mp == *(ref + (mp - ip))))
+                    mp++;
+                litlen = ip - anchor;
+                mlen   = (mp - ip) - LZ_MIN_MATCH;
+                if ((oend - op) < (int64_t)(1 + litlen + (litlen / 255) + 1 +
+                                            2 + (mlen / 255) + 1))
+                    return 0;
+                token = op++;
+                if (litlen >= 15) {
+                    *token = 15 << 4;
+                    op     = lz_put_length(op, litlen - 15);
+                } else {
+                    *token = (uint8_t)(litlen << 4);
+                }
+                memcpy(op, anchor, litlen);
+                op += litlen;
+                *op++ = (uint8_t)((ip - ref) & 0xff);
+                *op++ = (uint8_t)((ip - ref) >> 8);
+                if (mlen >= 15) {
+                    *token |= 15;
+                    op = lz_put_length(op, mlen - 15);
+                } else {
+                    *token |= (uint8_t)mlen;
+                }
+                ip = anchor = mp;
+            } else {
+                /*
+                 * Skip faster through data that does not compress.
+                 */
+                ip += 1 + ((ip - anchor) >> 6);
+            }
+        }
+    }
+
+    /*
+     * The rest are literals.
+     */
+    litlen = iend - anchor;
+    if ((oend - op) < (int64_t)(1 + litlen + (litlen / 255) + 1))
+        return 0;
+    if (litlen >= 15) {
+        *op++ = 15 << 4;
+        op    = lz_put_length(op, litlen - 15);
+    } else {
+        *op++ = (uint8_t)(litlen << 4);
+    }
+    memcpy(op, anchor, litlen);
+    op += litlen;
+
+    return op - obase;
+}
+
+/*
+ * Decompress slen bytes at src into exactly dlen bytes at dst.  Malformed
+ * input is rejected, never overrun.
+ */
+int
+lz_decompress(const void *src, uint64_t slen, void *dst, uint64_t dlen) {
+    const uint8_t *      ip    = (const uint8_t *)src;
+    const uint8_t *const iend  = ip + slen;
+    uint8_t *const       obase = (uint8_t *)dst;
+    uint8_t *const       oend  = obase + dlen;
+    uint8_t *            op    = obase;
+
+    while (ip < iend) {
+        unsigned int token  = *ip++;
+        uint64_t     litlen = token >> 4;
+        uint64_t     mlen   = token & 15;
+        uint64_t     offset;
+        uint8_t      b;
+
+        if (litlen == 15) {
+            do {
+                if (ip >= iend)
+                    return EINVAL;
+                b = *ip++;
+                litlen += b;
+            } while (b == 255);
+        }
+        if ((litlen > (uint64_t)(iend - ip)) ||
+            (litlen > (uint64_t)(oend - op)))
+            return EINVAL;
+        memcpy(op, ip, litlen);
+        op += litlen;
+        ip += litlen;
+        if (ip == iend)
+            break;
+
+        if ((iend - ip) < 2)
+            return EINVAL;
+        offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (!offset || (offset > (uint64_t)(op - obase)))
+            return EINVAL;
+        if (mlen == 15) {
+            do {
+                if (ip >= iend)
+                    return EINVAL;
+                b = *ip++;
+                mlen += b;
+            } while (b == 255);
+        }
+        mlen += LZ_MIN_MATCH;
+        if (mlen > (uint64_t)(oend - op))
+            return EINVAL;
+        if (offset >= mlen) {
+            memcpy(op, op - offset, mlen);
+            op += mlen;
+        } else {
+            /* Overlapping: a repeating pattern. */
+            const uint8_t *mp = op - offset;
+
+            while (mlen--)
+                *op++ = *mp++;
+        }
+    }
+
+    return (op == oend) ? 0 : EINVAL;
+}
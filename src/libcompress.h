@@ -0,0 +1,14 @@
+/*
+ * libcompress.h - interfaces to the block compression codec
+ */
+
+#ifndef _PU_LIBCOMPRESS_H_
+#define _PU_LIBCOMPRESS_H_ 1
+
+#include <stdint.h>
+
+uint64_t lz_compress(const void *src, uint64_t slen, void *dst, uint64_t dcap);
+int      lz_decompress(const void *src, uint64_t slen, void *dst,
+                       uint64_t dlen);
+
+#endif /* _PU_LIBCOMPRESS_H_ */
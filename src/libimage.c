@@ -16,6 +16,7 @@
 #include "librawimage.h"
 #include <errno.h>
 #include <stdlib.h>
+#include <string.h>
 
 extern image_dispatch_t partclone_image_type;
 extern image_dispatch_t ntfsclone_image_type;
@@ -32,6 +33,7 @@ typedef struct image_handle {
     image_dispatch_t * i_dispatch;
     sysdep_dispatch_t *i_sysdep;
     void *             i_type_handle;
+    void *             i_lock; /* Serializes positional I/O fallback */
     uint32_t           i_magic;
 } image_handle_t;
 
@@ -57,8 +59,10 @@ image_open(const char *path, const char *cfpath, sysdep_open_mode_t omode,
             ihp->i_magic        = IMAGE_MAGIC;
             ihp->i_sysdep       = (sysdep_dispatch_t *)sysdep;
             ihp->i_dispatch     = (image_dispatch_t *)fentry;
-            error = (*ihp->i_dispatch->open)(path, cfpath, omode, sysdep,
-                                             &ihp->i_type_handle);
+            ihp->i_lock         = (void *)NULL;
+            if (!(error = (*sysdep->sys_lock_init)(&ihp->i_lock)))
+                error = (*ihp->i_dispatch->open)(path, cfpath, omode, sysdep,
+                                                 &ihp->i_type_handle);
         }
     }
 
@@ -72,6 +76,8 @@ image_close(void *rp) {
     if (ihp && (ihp->i_magic == IMAGE_MAGIC)) {
         error        = (*ihp->i_dispatch->close)(ihp->i_type_handle);
         ihp->i_magic = 0;
+        if (ihp->i_lock)
+            (void)(*ihp->i_sysdep->sys_lock_destroy)(ihp->i_lock);
         (void)(ihp->i_sysdep->sys_free)(ihp);
     } else {
         error = ESTALE;
@@ -88,6 +94,17 @@ image_tolerant_mode(void *rp) {
     }
 }
 
+/*
+ * Select the features of a change file that is created for the image.
+ */
+void
+image_cf_features(void *rp, uint32_t features) {
+    image_handle_t *ihp = (image_handle_t *)rp;
+    if (ihp && (ihp->i_magic == IMAGE_MAGIC)) {
+        (*ihp->i_dispatch->cf_features)(ihp->i_type_handle, features);
+    }
+}
+
 int
 image_verify(void *rp) {
     image_handle_t *ihp   = (image_handle_t *)rp;
@@ -166,13 +183,252 @@ image_writeblocks(void *rp, void *buffer, uint64_t nblocks) {
     return error;
 }
 
+/*
+ * Make the changes to the image durable.  Runs under the shared image lock
+ * so that it can overlap positional readers and writers.
+ */
 int
 image_sync(void *rp) {
     image_handle_t *ihp   = (image_handle_t *)rp;
     int             error = EINVAL;
     if (ihp && (ihp->i_magic == IMAGE_MAGIC)) {
+        (void)(*ihp->i_sysdep->sys_lock)(ihp->i_lock, SYSDEP_LOCK_SHARED);
         error = (*ihp->i_dispatch->sync)(ihp->i_type_handle);
+        (void)(*ihp->i_sysdep->sys_unlock)(ihp->i_lock);
+    }
+
+    return error;
+}
+
+/*
+ * Compact the change file of the image.  The change file keeps serving
+ * reads and writes while it is copied, so this holds the image lock
+ * shared; positional I/O only waits out the final swap.
+ */
+int
+image_compact(void *rp) {
+    image_handle_t *ihp   = (image_handle_t *)rp;
+    int             error = EINVAL;
+    if (ihp && (ihp->i_magic == IMAGE_MAGIC)) {
+        (void)(*ihp->i_sysdep->sys_lock)(ihp->i_lock, SYSDEP_LOCK_SHARED);
+        error = (*ihp->i_dispatch->compact)(ihp->i_type_handle);
+        (void)(*ihp->i_sysdep->sys_unlock)(ihp->i_lock);
+    }
+    return error;
+}
+
+/*
+ * Commit the change file into the image.
+ */
+int
+image_commit(void *rp) {
+    image_handle_t *ihp   = (image_handle_t *)rp;
+    int             error = EINVAL;
+    if (ihp && (ihp->i_magic == IMAGE_MAGIC)) {
+        error = (*ihp->i_dispatch->commit)(ihp->i_type_handle);
+    }
+    return error;
+}
+
+/*
+ * Read blocks starting at the given block without moving the current
+ * position.  Safe to call from several threads at once.
+ *
+ * Types with positional I/O run under the shared image lock, the others
+ * seek and read under the exclusive one.
+ */
+int
+image_readblocks_at(void *rp, uint64_t blockno, void *buffer,
+                    uint64_t nblocks) {
+    image_handle_t *ihp   = (image_handle_t *)rp;
+    int             error = EINVAL;
+    if (ihp && (ihp->i_magic == IMAGE_MAGIC)) {
+        error = EAGAIN;
+        if (ihp->i_dispatch->readblocks_at) {
+            (void)(*ihp->i_sysdep->sys_lock)(ihp->i_lock, SYSDEP_LOCK_SHARED);
+            error = (*ihp->i_dispatch->readblocks_at)(
+                ihp->i_type_handle, blockno, buffer, nblocks);
+            (void)(*ihp->i_sysdep->sys_unlock)(ihp->i_lock);
+        }
+        if (error == EAGAIN) {
+            (void)(*ihp->i_sysdep->sys_lock)(ihp->i_lock,
+                                             SYSDEP_LOCK_EXCLUSIVE);
+            if (!(error = (*ihp->i_dispatch->seek)(ihp->i_type_handle,
+                                                   blockno)))
+                error = (*ihp->i_dispatch->readblocks)(ihp->i_type_handle,
+                                                       buffer, nblocks);
+            (void)(*ihp->i_sysdep->sys_unlock)(ihp->i_lock);
+        }
+    }
+
+    return error;
+}
+
+/*
+ * Write blocks starting at the given block without moving the current
+ * position.  Safe to call from several threads at once.
+ *
+ * The first write of an image creates its change file, which types do
+ * by returning EAGAIN so that it happens under the exclusive lock.
+ */
+int
+image_writeblocks_at(void *rp, uint64_t blockno, void *buffer,
+                     uint64_t nblocks) {
+    image_handle_t *ihp   = (image_handle_t *)rp;
+    int             error = EINVAL;
+    if (ihp && (ihp->i_magic == IMAGE_MAGIC)) {
+        error = EAGAIN;
+        if (ihp->i_dispatch->writeblocks_at) {
+            (void)(*ihp->i_sysdep->sys_lock)(ihp->i_lock, SYSDEP_LOCK_SHARED);
+            error = (*ihp->i_dispatch->writeblocks_at)(
+                ihp->i_type_handle, blockno, buffer, nblocks);
+            (void)(*ihp->i_sysdep->sys_unlock)(ihp->i_lock);
+        }
+        if (error == EAGAIN) {
+            (void)(*ihp->i_sysdep->sys_lock)(ihp->i_lock,
+                                             SYSDEP_LOCK_EXCLUSIVE);
+            if (!(error = (*ihp->i_dispatch->seek)(ihp->i_type_handle,
+                                                   blockno)))
+                error = (*ihp->i_dispatch->writeblocks)(ihp->i_type_handle,
+                                                        buffer, nblocks);
+            (void)(*ihp->i_sysdep->sys_unlock)(ihp->i_lock);
+        }
+    }
+
+    return error;
+}
+
+/*
+ * Find the run of blocks starting at the given block that are all stored,
+ * or all not.  Safe to call from several threads at once.
+ */
+int
+image_extent_at(void *rp, uint64_t blockno, uint64_t nblocks,
+                uint64_t *countp) {
+    image_handle_t *ihp   = (image_handle_t *)rp;
+    int             state = BLOCK_ERROR;
+    if (ihp && (ihp->i_magic == IMAGE_MAGIC) && nblocks) {
+        if (ihp->i_dispatch->extent_at) {
+            (void)(*ihp->i_sysdep->sys_lock)(ihp->i_lock, SYSDEP_LOCK_SHARED);
+            state = (*ihp->i_dispatch->extent_at)(ihp->i_type_handle, blockno,
+                                                  nblocks, countp);
+            (void)(*ihp->i_sysdep->sys_unlock)(ihp->i_lock);
+        } else {
+            *countp = nblocks;
+            state   = 0;
+        }
+    }
+
+    return state;
+}
+
+/*
+ * Zero blocks through the type, under the shared image lock.
+ */
+static int
+image_zero_marked(image_handle_t *ihp, uint64_t blockno, uint64_t nblocks) {
+    int error = EAGAIN;
+    if (ihp->i_dispatch->zeroblocks_at) {
+        (void)(*ihp->i_sysdep->sys_lock)(ihp->i_lock, SYSDEP_LOCK_SHARED);
+        error = (*ihp->i_dispatch->zeroblocks_at)(ihp->i_type_handle, blockno,
+                                                  nblocks);
+        (void)(*ihp->i_sysdep->sys_unlock)(ihp->i_lock);
+    }
+
+    return error;
+}
+
+/*
+ * Zero blocks starting at the given block without moving the current
+ * position.  Safe to call from several threads at once.
+ *
+ * Types that mark zeroed blocks do so without writing any data.  Until
+ * they can, blocks of zeros are written one at a time, the first of which
+ * creates the change file that can take the rest.
+ */
+int
+image_zeroblocks_at(void *rp, uint64_t blockno, uint64_t nblocks) {
+    image_handle_t *ihp   = (image_handle_t *)rp;
+    int             error = EINVAL;
+    if (ihp && (ihp->i_magic == IMAGE_MAGIC)) {
+        uint64_t bsize = (*ihp->i_dispatch->blocksize)(ihp->i_type_handle);
+        void *   zbuf;
+
+        error = (nblocks) ? image_zero_marked(ihp, blockno, nblocks) : 0;
+        if ((error == EAGAIN) &&
+            ((error = (*ihp->i_sysdep->sys_malloc)(&zbuf, bsize)) == 0)) {
+            memset(zbuf, 0, bsize);
+            while (!(error = image_writeblocks_at(rp, blockno++, zbuf, 1)) &&
+                   --nblocks &&
+                   ((error = image_zero_marked(ihp, blockno, nblocks)) ==
+                    EAGAIN))
+                ;
+            (void)(*ihp->i_sysdep->sys_free)(zbuf);
+        }
+    }
+
+    return error;
+}
+
+/*
+ * Find where the run of blocks starting at the given block is stored in
+ * the image file, if it is stored as is.  Safe to call from several
+ * threads at once.
+ */
+int
+image_locate_at(void *rp, uint64_t blockno, uint64_t nblocks, void **fhp,
+                uint64_t *offsetp, uint64_t *countp) {
+    image_handle_t *ihp   = (image_handle_t *)rp;
+    int             error = EINVAL;
+    if (ihp && (ihp->i_magic == IMAGE_MAGIC) && nblocks) {
+        if (ihp->i_dispatch->locate_at) {
+            (void)(*ihp->i_sysdep->sys_lock)(ihp->i_lock, SYSDEP_LOCK_SHARED);
+            error = (*ihp->i_dispatch->locate_at)(
+                ihp->i_type_handle, blockno, nblocks, fhp, offsetp, countp);
+            (void)(*ihp->i_sysdep->sys_unlock)(ihp->i_lock);
+        } else {
+            *countp = nblocks;
+            error   = ENOENT;
+        }
+    }
+
+    return error;
+}
+
+/*
+ * Throw away what has been written to the image, if its change file is
+ * volatile.
+ */
+int
+image_discard(void *rp) {
+    image_handle_t *ihp   = (image_handle_t *)rp;
+    int             error = EINVAL;
+    if (ihp && (ihp->i_magic == IMAGE_MAGIC)) {
+        (void)(*ihp->i_sysdep->sys_lock)(ihp->i_lock, SYSDEP_LOCK_EXCLUSIVE);
+        error = (*ihp->i_dispatch->discard)(ihp->i_type_handle);
+        (void)(*ihp->i_sysdep->sys_unlock)(ihp->i_lock);
     }
+    return error;
+}
 
+/*
+ * Copy the image's counters.  Safe to call while it is in use.
+ */
+int
+image_stats(void *rp, image_stats_t *isp) {
+    image_handle_t *ihp   = (image_handle_t *)rp;
+    int             error = EINVAL;
+    if (ihp && (ihp->i_magic == IMAGE_MAGIC)) {
+        uint64_t *from = (ihp->i_dispatch->stats)
+                             ? (uint64_t *)(*ihp->i_dispatch->stats)(
+                                   ihp->i_type_handle)
+                             : (uint64_t *)NULL;
+        uint64_t *to   = (uint64_t *)isp;
+        size_t    ci;
+
+        for (ci = 0; ci < sizeof(*isp) / sizeof(uint64_t); ci++)
+            to[ci] = (from) ? __atomic_load_n(&from[ci], __ATOMIC_RELAXED) : 0;
+        error = 0;
+    }
     return error;
 }
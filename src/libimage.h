@@ -19,6 +19,33 @@
 
 #define BLOCK_ERROR -2
 
+/*
+ * Extent states.  A hole is a run of blocks that the image doesn't store,
+ * which reads as zeroes if IMAGE_EXTENT_ZERO is also set.
+ */
+#define IMAGE_EXTENT_HOLE 1
+#define IMAGE_EXTENT_ZERO 2
+
+/*
+ * Counters that an open image keeps, for monitoring.  Concurrent readers
+ * bump them without locks, so a copy taken meanwhile is only roughly
+ * consistent.  Walks through ntfsclone atoms are counted by length in
+ * IMAGE_STATS_WALKS buckets: none, one, then up to twice the one before.
+ */
+#define IMAGE_STATS_WALKS 16
+#define IMAGE_STATS_ADD(_counter, _n) \
+    ((void)__atomic_fetch_add(&(_counter), (_n), __ATOMIC_RELAXED))
+
+typedef struct image_stats {
+    uint64_t is_imageblocks;  /* Blocks read from the image file */
+    uint64_t is_cfblocks;     /* Blocks read from the change file */
+    uint64_t is_unusedblocks; /* Unused blocks read as filler */
+    uint64_t is_seeks;        /* Clusters found by walking atoms */
+    uint64_t is_seekhits;     /* Walks started from the current bucket */
+    uint64_t is_atoms;        /* Atoms walked */
+    uint64_t is_walks[IMAGE_STATS_WALKS]; /* Walks by length */
+} image_stats_t;
+
 /*
  * Per-image type dispatch table.
  */
@@ -38,6 +65,49 @@ typedef struct image_type_dispatch {
     int (*block_used)(void *rp);
     int (*writeblocks)(void *rp, void *buffer, uint64_t nblocks);
     int (*sync)(void *rp);
+    void (*cf_features)(void *rp, uint32_t features);
+    int (*compact)(void *rp);
+    int (*commit)(void *rp);
+    /*
+     * Positional block I/O.  These may run concurrently with each other
+     * and do not move the current position.  A type without them, or one
+     * that returns EAGAIN, is driven through seek and readblocks or
+     * writeblocks under the image lock instead.
+     */
+    int (*readblocks_at)(void *rp, uint64_t blockno, void *buffer,
+                         uint64_t nblocks);
+    int (*writeblocks_at)(void *rp, uint64_t blockno, void *buffer,
+                          uint64_t nblocks);
+    /*
+     * State of the run of blocks at blockno, up to nblocks long.  Returns
+     * IMAGE_EXTENT_xxx flags or BLOCK_ERROR, and the length of the run in
+     * *countp.  A type without it stores every block.
+     */
+    int (*extent_at)(void *rp, uint64_t blockno, uint64_t nblocks,
+                     uint64_t *countp);
+    /*
+     * Zero a run of blocks without writing their data.  Like the
+     * positional I/O it may return EAGAIN, and a type without it is
+     * written blocks of zeros.
+     */
+    int (*zeroblocks_at)(void *rp, uint64_t blockno, uint64_t nblocks);
+    /*
+     * Where the run of blocks at blockno, up to nblocks long, is stored
+     * as is in the image file.  Returns 0 with the file handle and the
+     * offset of the run, or ENOENT if the blocks have to be read, and the
+     * length of the run in *countp either way.  A type without it is
+     * always read.
+     */
+    int (*locate_at)(void *rp, uint64_t blockno, uint64_t nblocks,
+                     void **fhp, uint64_t *offsetp, uint64_t *countp);
+    /*
+     * Throw away what has been written to a volatile change file.
+     */
+    int (*discard)(void *rp);
+    /*
+     * The image's counters.  A type without them counts nothing.
+     */
+    image_stats_t *(*stats)(void *rp);
 } image_dispatch_t;
 
 /*
@@ -56,5 +126,19 @@ int      image_readblocks(void *rp, void *buffer, uint64_t nblocks);
 int      image_block_used(void *rp);
 int      image_writeblocks(void *rp, void *buffer, uint64_t nblocks);
 int      image_sync(void *rp);
+void     image_cf_features(void *rp, uint32_t features);
+int      image_compact(void *rp);
+int      image_commit(void *rp);
+int image_readblocks_at(void *rp, uint64_t blockno, void *buffer,
+                        uint64_t nblocks);
+int image_writeblocks_at(void *rp, uint64_t blockno, void *buffer,
+                         uint64_t nblocks);
+int image_extent_at(void *rp, uint64_t blockno, uint64_t nblocks,
+                    uint64_t *countp);
+int image_zeroblocks_at(void *rp, uint64_t blockno, uint64_t nblocks);
+int image_locate_at(void *rp, uint64_t blockno, uint64_t nblocks, void **fhp,
+                    uint64_t *offsetp, uint64_t *countp);
+int image_discard(void *rp);
+int image_stats(void *rp, image_stats_t *isp);
 
 #endif /* _LIBIMAGE_H_ */
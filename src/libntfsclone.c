@@ -55,6 +55,8 @@ typedef struct libntfsclone_context {
     uint64_t                       nc_curblock; /* Current position */
     uint32_t                       nc_flags;    /* Handle flags */
     sysdep_open_mode_t             nc_omode;    /* Open mode */
+    uint32_t                       nc_cf_features; /* Features for new cf */
+    image_stats_t                  nc_stats;       /* Counters */
 } nc_context_t;
 
 /*
@@ -105,6 +107,8 @@ typedef struct version_dispatch_table {
     int (*version_blockused)(nc_context_t *ntcp);
     int (*version_writeblock)(nc_context_t *ntcp, void *buffer);
     int (*version_sync)(nc_context_t *ntcp);
+    int (*version_extent_at)(nc_context_t *ntcp, uint64_t blockno,
+                             uint64_t nblocks, uint64_t *countp);
 } v_dispatch_table_t;
 
 /*
@@ -164,28 +168,27 @@ v10_init(nc_context_t *ntcp) {
             ntcp->nc_verdep = v10p;
             ntcp->nc_flags |= (NC_HAVE_VERDEP | NC_VERSION_INIT);
 
+            if ((int)ntcp->nc_omode < (int)SYSDEP_OPEN_RW)
+                ntcp->nc_flags |= NC_READ_ONLY;
+            /*
+             * A read-only image only reads its change file.
+             */
             if (ntcp->nc_cf_path &&
-                ((int)ntcp->nc_omode >= (int)SYSDEP_OPEN_RW)) {
-                if ((error = cf_init(ntcp->nc_cf_path, ntcp->nc_sysdep,
-                                     ntcp->nc_head.cluster_size,
-                                     ntcp->nc_head.nr_clusters +
-                                         1, /* for trailing cluster */
-                                     &ntcp->nc_cf_handle)) == 0) {
-                    ntcp->nc_flags |= NC_CF_OPEN;
-                } else {
-                    /*
-                     * We'll create later...
-                     */
-                    error = 0;
-                }
-            } else {
-                if ((int)ntcp->nc_omode < (int)SYSDEP_OPEN_RW)
-                    ntcp->nc_flags |= NC_READ_ONLY;
-                else
-                    /*
-                     * Completely discard errors here.
-                     */
-                    error = 0;
+                ((error = cf_init(ntcp->nc_cf_path, ntcp->nc_sysdep,
+                                  ntcp->nc_head.cluster_size,
+                                  ntcp->nc_head.nr_clusters +
+                                      1, /* for trailing cluster */
+                                  ntcp->nc_cf_features |
+                                      ((NTCTX_READ_ONLY(ntcp))
+                                           ? CF_FEATURE_READONLY
+                                           : 0),
+                                  &ntcp->nc_cf_handle)) == 0)) {
+                ntcp->nc_flags |= (NC_CF_OPEN | NC_HAVE_CFDEP);
+            } else if (error != EBUSY) {
+                /*
+                 * We'll create later...  unless another process has it.
+                 */
+                error = 0;
             }
             v10p->v10_bucket_factor = V10_DEFAULT_FACTOR;
         }
@@ -399,6 +402,20 @@ v10_seek(nc_context_t *ntcp, uint64_t blockno) {
     return error;
 }
 
+/*
+ * Count a walk through the atoms of a bucket.
+ */
+static inline void
+seek2cluster_count(nc_context_t *ntcp, uint64_t natoms) {
+    unsigned int wi;
+
+    for (wi = 0; (wi < IMAGE_STATS_WALKS - 1) && (natoms >> wi); wi++)
+        ;
+    IMAGE_STATS_ADD(ntcp->nc_stats.is_seeks, 1);
+    IMAGE_STATS_ADD(ntcp->nc_stats.is_atoms, natoms);
+    IMAGE_STATS_ADD(ntcp->nc_stats.is_walks[wi], 1);
+}
+
 /*
  * Seek to the specified cluster in the image.
  */
@@ -408,10 +425,12 @@ seek2cluster(nc_context_t *ntcp, uint64_t cnum) {
     v10_context_t *v10p    = (v10_context_t *)ntcp->nc_verdep;
     uint64_t       cbucket = cnum >> v10p->v10_bucket_factor;
     uint64_t       imgpos  = v10p->v10_bucket_offset[cbucket];
+    uint64_t       natoms  = 0;
     uint64_t       cpos, cfoffs;
 
     if (bitmap_bit_value(v10p->v10_bitmap, cnum) && imgpos) {
         if (cbucket == v10p->v10_current_bucket) {
+            IMAGE_STATS_ADD(ntcp->nc_stats.is_seekhits, 1);
             cpos = (v10p->v10_current_bucket << v10p->v10_bucket_factor) +
                    v10p->v10_bsfcount;
         } else {
@@ -430,6 +449,7 @@ seek2cluster(nc_context_t *ntcp, uint64_t cnum) {
         while (!error && (cpos < cnum)) {
             ntfsclone_atom_t ibuf;
             uint64_t         rsize;
+            natoms++;
             if ((error = (*ntcp->nc_sysdep->sys_read)(
                      ntcp->nc_fd, &ibuf, sizeof(ibuf), &rsize)) == 0) {
                 switch (ibuf.nca_atype) {
@@ -451,6 +471,7 @@ seek2cluster(nc_context_t *ntcp, uint64_t cnum) {
                 }
             }
         }
+        seek2cluster_count(ntcp, natoms);
         /*
          * Now, we are ostensibly at the right place.  Our count had
          * better match...
@@ -478,7 +499,8 @@ v10_readblock(nc_context_t *ntcp, void *buffer) {
     if (NTCTX_HAVE_VERDEP(ntcp)) {
         if (ntcp->nc_cf_handle) {
             cf_seek(ntcp->nc_cf_handle, ntcp->nc_curblock);
-            error = cf_readblock(ntcp->nc_cf_handle, buffer);
+            if (!(error = cf_readblock(ntcp->nc_cf_handle, buffer)))
+                IMAGE_STATS_ADD(ntcp->nc_stats.is_cfblocks, 1);
         }
         if (error) {
             v10_context_t *v10p = (v10_context_t *)ntcp->nc_verdep;
@@ -500,6 +522,7 @@ v10_readblock(nc_context_t *ntcp, void *buffer) {
                     if (r_size != ntcp->nc_head.cluster_size) {
                         error = EIO;
                     }
+                    IMAGE_STATS_ADD(ntcp->nc_stats.is_imageblocks, 1);
                 }
             } else {
                 /*
@@ -507,6 +530,7 @@ v10_readblock(nc_context_t *ntcp, void *buffer) {
                  */
                 memcpy(buffer, ntcp->nc_ivblock, ntcp->nc_head.cluster_size);
                 error = 0; /* This shouldn't be necessary... */
+                IMAGE_STATS_ADD(ntcp->nc_stats.is_unusedblocks, 1);
             }
         }
     }
@@ -523,6 +547,8 @@ v10_blockused(nc_context_t *ntcp) {
     if (NTCTX_HAVE_VERDEP(ntcp)) {
         v10_context_t *v10p = (v10_context_t *)ntcp->nc_verdep;
 
+        if (ntcp->nc_cf_handle)
+            cf_seek(ntcp->nc_cf_handle, ntcp->nc_curblock);
         retval = (ntcp->nc_cf_handle && cf_blockused(ntcp->nc_cf_handle))
                      ? 1
                      : bitmap_bit_value(v10p->v10_bitmap, ntcp->nc_curblock);
@@ -531,6 +557,41 @@ v10_blockused(nc_context_t *ntcp) {
     return retval;
 }
 
+/*
+ * Find the run of blocks at a given position that are all in the same
+ * state.  Unused blocks read as the invalid block, which isn't zeroed,
+ * unlike the ones the change file marks as zeros.
+ */
+static int
+v10_extent_at(nc_context_t *ntcp, uint64_t blockno, uint64_t nblocks,
+              uint64_t *countp) {
+    int state = BLOCK_ERROR;
+
+    if (NTCTX_HAVE_VERDEP(ntcp)) {
+        v10_context_t *v10p = (v10_context_t *)ntcp->nc_verdep;
+        uint64_t       pbn;
+        int            bstate;
+
+        for (pbn = blockno; pbn < blockno + nblocks; pbn++) {
+            if (ntcp->nc_cf_handle && cf_blockused_at(ntcp->nc_cf_handle, pbn))
+                bstate = (cf_blockzero_at(ntcp->nc_cf_handle, pbn))
+                             ? IMAGE_EXTENT_ZERO
+                             : 0;
+            else
+                bstate = (bitmap_bit_value(v10p->v10_bitmap, pbn))
+                             ? 0
+                             : IMAGE_EXTENT_HOLE;
+            if (pbn == blockno)
+                state = bstate;
+            else if (bstate != state)
+                break;
+        }
+        *countp = pbn - blockno;
+    }
+
+    return state;
+}
+
 /*
  * Write block at current location.
  */
@@ -559,7 +620,8 @@ v10_writeblock(nc_context_t *ntcp, void *buffer) {
             }
             error = cf_create(ntcp->nc_cf_path, ntcp->nc_sysdep,
                               ntcp->nc_head.cluster_size,
-                              ntcp->nc_head.nr_clusters, &ntcp->nc_cf_handle);
+                              ntcp->nc_head.nr_clusters,
+                              ntcp->nc_cf_features, &ntcp->nc_cf_handle);
             if (!error) {
                 ntcp->nc_flags |= (NC_HAVE_CFDEP | NC_CF_VERIFIED);
             }
@@ -594,10 +656,10 @@ v10_sync(nc_context_t *ntcp) {
 static const v_dispatch_table_t version_table[] = {
     {VDT_VERSION_KEY(10, 1), /* version 10.1 */
      v10_init, v10_verify, v10_finish, v10_seek, v10_readblock, v10_blockused,
-     v10_writeblock, v10_sync},
+     v10_writeblock, v10_sync, v10_extent_at},
     {VDT_VERSION_KEY(10, 0), /* version 10.0 */
      v10_init, v10_verify, v10_finish, v10_seek, v10_readblock, v10_blockused,
-     v10_writeblock, v10_sync},
+     v10_writeblock, v10_sync, v10_extent_at},
 };
 
 /*
@@ -693,6 +755,18 @@ ntfsclone_tolerant_mode(void *rp) {
     }
 }
 
+/*
+ * Set the features for a change file we create.
+ */
+void
+ntfsclone_cf_features(void *rp, uint32_t features) {
+    nc_context_t *ntcp = (nc_context_t *)rp;
+
+    if (NTCTX_OPEN(ntcp)) {
+        ntcp->nc_cf_features = features;
+    }
+}
+
 /*
  * Determine the version of the file and verify it.
  */
@@ -870,6 +944,21 @@ ntfsclone_block_used(void *rp) {
                : BLOCK_ERROR;
 }
 
+/*
+ * Find the run of blocks in the same state at a given position.
+ */
+int
+ntfsclone_extent_at(void *rp, uint64_t blockno, uint64_t nblocks,
+                    uint64_t *countp) {
+    nc_context_t *ntcp = (nc_context_t *)rp;
+
+    return (NTCTX_READREADY(ntcp) &&
+            (blockno + nblocks <= ntcp->nc_head.nr_clusters))
+               ? (*ntcp->nc_dispatch->version_extent_at)(ntcp, blockno,
+                                                         nblocks, countp)
+               : BLOCK_ERROR;
+}
+
 /*
  * Write blocks to the current position.
  */
@@ -905,8 +994,53 @@ int
 ntfsclone_sync(void *rp) {
     nc_context_t *ntcp = (nc_context_t *)rp;
 
-    return (NTCTX_WRITEREADY(ntcp)) ? (*ntcp->nc_dispatch->version_sync)(ntcp)
-                                    : EINVAL;
+    if (NTCTX_WRITEREADY(ntcp))
+        return (*ntcp->nc_dispatch->version_sync)(ntcp);
+    /*
+     * Until the change file is created nothing has been written.
+     */
+    return (NTCTX_WRITEABLE(ntcp)) ? 0 : EINVAL;
+}
+
+/*
+ * Compact the change file.
+ */
+int
+ntfsclone_compact(void *rp) {
+    nc_context_t *ntcp = (nc_context_t *)rp;
+
+    return (NTCTX_WRITEREADY(ntcp)) ? cf_compact(ntcp->nc_cf_handle) : EINVAL;
+}
+
+/*
+ * Commit the change file into the image.  Blocks are packed in the image,
+ * so changed ones have no place to go; build a new image instead.
+ */
+int
+ntfsclone_commit(void *rp) {
+    nc_context_t *ntcp = (nc_context_t *)rp;
+
+    return (NTCTX_WRITEABLE(ntcp)) ? ENOTSUP : EINVAL;
+}
+
+/*
+ * Throw away what the change file holds, if it is volatile.  Until it
+ * exists nothing has been written.
+ */
+int
+ntfsclone_discard(void *rp) {
+    nc_context_t *ntcp = (nc_context_t *)rp;
+
+    return (NTCTX_WRITEREADY(ntcp)) ? cf_discard(ntcp->nc_cf_handle) : 0;
+}
+
+/*
+ * Return the image's counters.
+ */
+image_stats_t *
+ntfsclone_stats(void *rp) {
+    nc_context_t *ntcp = (nc_context_t *)rp;
+    return (NTCTX_VALID(ntcp)) ? &ntcp->nc_stats : (image_stats_t *)NULL;
 }
 
 /*
@@ -926,11 +1060,17 @@ ntfsclone_probe(const char *path, const sysdep_dispatch_t *sysdep) {
 }
 
 /*
- * The image type dispatch table.
+ * The image type dispatch table.  Clusters are found by walking the atoms
+ * of a bucket through the shared file position, so there is no positional
+ * I/O and libimage serializes it instead.  Finding extents needs only the
+ * bitmaps.
  */
 const image_dispatch_t ntfsclone_image_type = {
     "ntfsclone image",     ntfsclone_probe,         ntfsclone_open,
     ntfsclone_close,       ntfsclone_tolerant_mode, ntfsclone_verify,
     ntfsclone_blocksize,   ntfsclone_blockcount,    ntfsclone_seek,
     ntfsclone_tell,        ntfsclone_readblocks,    ntfsclone_block_used,
-    ntfsclone_writeblocks, ntfsclone_sync};
+    ntfsclone_writeblocks, ntfsclone_sync,          ntfsclone_cf_features,
+    ntfsclone_compact,     ntfsclone_commit,        NULL,
+    NULL,                  ntfsclone_extent_at,     NULL,
+    NULL,                  ntfsclone_discard,       ntfsclone_stats};
@@ -30,5 +30,7 @@ int      ntfsclone_readblocks(void *rp, void *buffer, uint64_t nblocks);
 int      ntfsclone_block_used(void *rp);
 int      ntfsclone_writeblocks(void *rp, void *buffer, uint64_t nblocks);
 int      ntfsclone_sync(void *rp);
+int      ntfsclone_extent_at(void *rp, uint64_t blockno, uint64_t nblocks,
+                             uint64_t *countp);
 
 #endif /* _LIBNTFSCLONE_H_ */
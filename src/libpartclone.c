@@ -85,6 +85,17 @@ typedef struct version_dispatch_table {
     int (*version_blockused)(pc_context_t *pcp);
     int (*version_writeblock)(pc_context_t *pcp, void *buffer);
     int (*version_sync)(pc_context_t *pcp);
+    int (*version_readblocks_at)(pc_context_t *pcp, uint64_t blockno,
+                                 void *buffer, uint64_t nblocks);
+    int (*version_writeblocks_at)(pc_context_t *pcp, uint64_t blockno,
+                                  void *buffer, uint64_t nblocks);
+    int (*version_extent_at)(pc_context_t *pcp, uint64_t blockno,
+                             uint64_t nblocks, uint64_t *countp);
+    int (*version_zeroblocks_at)(pc_context_t *pcp, uint64_t blockno,
+                                 uint64_t nblocks);
+    int (*version_locate_at)(pc_context_t *pcp, uint64_t blockno,
+                             uint64_t nblocks, void **fhp, uint64_t *offsetp,
+                             uint64_t *countp);
 } v_dispatch_table_t;
 
 /*
@@ -133,28 +144,11 @@ v1_init(pc_context_t *pcp) {
             pcp->pc_verdep = v1p;
             pcp->pc_flags |= (PC_HAVE_VERDEP | PC_VERSION_INIT);
 
-            if (pcp->pc_cf_path &&
-                ((int)pcp->pc_omode >= (int)SYSDEP_OPEN_RW)) {
-                if ((error = cf_init(pcp->pc_cf_path, pcp->pc_sysdep,
-                                     pcp->pc_head.block_size,
-                                     pcp->pc_head.totalblock,
-                                     &pcp->pc_cf_handle)) == 0) {
-                    pcp->pc_flags |= PC_CF_OPEN;
-                } else {
-                    /*
-                     * We'll create later...
-                     */
-                    error = 0;
-                }
-            } else {
-                if ((int)pcp->pc_omode < (int)SYSDEP_OPEN_RW)
-                    pcp->pc_flags |= PC_READ_ONLY;
-                else
-                    /*
-                     * Completely discard errors here.
-                     */
-                    error = 0;
-            }
+            /*
+             * The change file is opened once the header gives the geometry.
+             */
+            if ((int)pcp->pc_omode < (int)SYSDEP_OPEN_RW)
+                pcp->pc_flags |= PC_READ_ONLY;
             /*
              * Initialize the CRC table.
              */
@@ -211,13 +205,25 @@ precalculate_sumcount(pc_context_t *pcp) {
         i = pcp->pc_head.totalblock * pcp->pc_head.block_size;
         if (pcp->pc_head.device_size != i)
             pcp->pc_head.device_size = i;
-        if (!error && pcp->pc_cf_handle) {
-            /*
-             * Verify the change file, if present.
-             */
-            error = cf_verify(pcp->pc_cf_handle);
-            if (!error)
-                pcp->pc_flags |= PC_CF_VERIFIED;
+        /*
+         * Open and verify the change file, if present.  Otherwise it gets
+         * created on the first write.  A read-only image only reads it.  One
+         * that another process holds exclusive cannot be used at all.
+         */
+        if (!error && pcp->pc_cf_path) {
+            if ((error = cf_init(
+                     pcp->pc_cf_path, pcp->pc_sysdep, pcp->pc_head.block_size,
+                     pcp->pc_head.totalblock,
+                     pcp->pc_cf_features |
+                         ((PCTX_READ_ONLY(pcp)) ? CF_FEATURE_READONLY : 0),
+                     &pcp->pc_cf_handle)) == 0) {
+                pcp->pc_flags |= (PC_CF_OPEN | PC_HAVE_CFDEP);
+                error = cf_verify(pcp->pc_cf_handle);
+                if (!error)
+                    pcp->pc_flags |= PC_CF_VERIFIED;
+            } else if (error != EBUSY) {
+                error = 0;
+            }
         }
     }
 
@@ -310,6 +316,25 @@ v1_finish(pc_context_t *pcp) {
     return error;
 }
 
+/*
+ * Count the valid blocks preceding a block.  Start with the hint that is
+ * nearest and count the rest from the bitmap.
+ */
+static inline uint64_t
+v1_nvbcount(v1_context_t *v1p, uint64_t blockno) {
+    uint64_t nvbcount = v1p->v1_sumcount[blockno >> v1p->v1_bitmap_factor];
+    uint64_t pbn;
+
+    for (pbn = blockno & ~((1 << v1p->v1_bitmap_factor) - 1); pbn < blockno;
+         pbn++) {
+        if (v1p->v1_bitmap[pbn]) {
+            nvbcount++;
+        }
+    }
+
+    return nvbcount;
+}
+
 /*
  * Version-specific handling for seeking to a particular block.
  *
@@ -321,19 +346,8 @@ v1_seek(pc_context_t *pcp, uint64_t blockno) {
 
     if (PCTX_HAVE_VERDEP(pcp)) {
         v1_context_t *v1p = (v1_context_t *)pcp->pc_verdep;
-        uint64_t      pbn;
 
-        /*
-         * Starting with the hint that is nearest, start calculating
-         * the preceding valid blocks.
-         */
-        v1p->v1_nvbcount = v1p->v1_sumcount[blockno >> v1p->v1_bitmap_factor];
-        for (pbn = blockno & ~((1 << v1p->v1_bitmap_factor) - 1); pbn < blockno;
-             pbn++) {
-            if (v1p->v1_bitmap[pbn]) {
-                v1p->v1_nvbcount++;
-            }
-        }
+        v1p->v1_nvbcount = v1_nvbcount(v1p, blockno);
         error = (pcp->pc_cf_handle) ? cf_seek(pcp->pc_cf_handle, blockno) : 0;
     }
 
@@ -391,13 +405,21 @@ v1_readblock(pc_context_t *pcp, void *buffer) {
      * Check to see if we can get the result from the change file.
      */
     if (PCTX_HAVE_VERDEP(pcp)) {
+        v1_context_t *v1p = (v1_context_t *)pcp->pc_verdep;
+
         if (pcp->pc_cf_handle) {
             cf_seek(pcp->pc_cf_handle, pcp->pc_curblock);
             error = cf_readblock(pcp->pc_cf_handle, buffer);
+            /*
+             * The image still holds the old copy of the block, so step
+             * over it for the next block.
+             */
+            if (!error && v1p->v1_bitmap[pcp->pc_curblock])
+                v1p->v1_nvbcount++;
+            if (!error)
+                IMAGE_STATS_ADD(pcp->pc_stats.is_cfblocks, 1);
         }
         if (error) {
-            v1_context_t *v1p = (v1_context_t *)pcp->pc_verdep;
-
             /*
              * Determine whether the block is used/valid.
              */
@@ -414,6 +436,7 @@ v1_readblock(pc_context_t *pcp, void *buffer) {
                         error = EIO;
                     }
                     v1p->v1_nvbcount++;
+                    IMAGE_STATS_ADD(pcp->pc_stats.is_imageblocks, 1);
                 }
             } else {
                 /*
@@ -421,6 +444,7 @@ v1_readblock(pc_context_t *pcp, void *buffer) {
                  */
                 memcpy(buffer, pcp->pc_ivblock, pcp->pc_head.block_size);
                 error = 0; /* This shouldn't be necessary... */
+                IMAGE_STATS_ADD(pcp->pc_stats.is_unusedblocks, 1);
             }
         }
     }
@@ -437,6 +461,8 @@ v1_blockused(pc_context_t *pcp) {
     if (PCTX_HAVE_VERDEP(pcp)) {
         v1_context_t *v1p = (v1_context_t *)pcp->pc_verdep;
 
+        if (pcp->pc_cf_handle)
+            cf_seek(pcp->pc_cf_handle, pcp->pc_curblock);
         retval = (pcp->pc_cf_handle && cf_blockused(pcp->pc_cf_handle))
                      ? 1
                      : v1p->v1_bitmap[pcp->pc_curblock];
@@ -445,6 +471,41 @@ v1_blockused(pc_context_t *pcp) {
     return retval;
 }
 
+/*
+ * Find the run of blocks at a given position that are all in the same
+ * state.  Unused blocks read as the zeroed invalid block, and so do the
+ * ones the change file marks as zeros.
+ */
+static int
+v1_extent_at(pc_context_t *pcp, uint64_t blockno, uint64_t nblocks,
+             uint64_t *countp) {
+    int state = BLOCK_ERROR;
+
+    if (PCTX_HAVE_VERDEP(pcp)) {
+        v1_context_t *v1p = (v1_context_t *)pcp->pc_verdep;
+        uint64_t      pbn;
+        int           bstate;
+
+        for (pbn = blockno; pbn < blockno + nblocks; pbn++) {
+            if (pcp->pc_cf_handle && cf_blockused_at(pcp->pc_cf_handle, pbn))
+                bstate = (cf_blockzero_at(pcp->pc_cf_handle, pbn))
+                             ? IMAGE_EXTENT_ZERO
+                             : 0;
+            else
+                bstate = (v1p->v1_bitmap[pbn])
+                             ? 0
+                             : IMAGE_EXTENT_HOLE | IMAGE_EXTENT_ZERO;
+            if (pbn == blockno)
+                state = bstate;
+            else if (bstate != state)
+                break;
+        }
+        *countp = pbn - blockno;
+    }
+
+    return state;
+}
+
 /*
  * Write block at current location.
  */
@@ -472,7 +533,7 @@ v1_writeblock(pc_context_t *pcp, void *buffer) {
             }
             error = cf_create(pcp->pc_cf_path, pcp->pc_sysdep,
                               pcp->pc_head.block_size, pcp->pc_head.totalblock,
-                              &pcp->pc_cf_handle);
+                              pcp->pc_cf_features, &pcp->pc_cf_handle);
             if (!error) {
                 pcp->pc_flags |= (PC_HAVE_CFDEP | PC_CF_VERIFIED);
             }
@@ -501,6 +562,140 @@ v1_sync(pc_context_t *pcp) {
     return error;
 }
 
+/*
+ * Find where a run of blocks is stored in the image.  Used blocks that
+ * the change file doesn't have are packed in the image, and a run of them
+ * is contiguous until it crosses a checksum.
+ */
+static int
+v1_locate_at(pc_context_t *pcp, uint64_t blockno, uint64_t nblocks,
+             void **fhp, uint64_t *offsetp, uint64_t *countp) {
+    int error = EINVAL;
+
+    if (PCTX_HAVE_VERDEP(pcp)) {
+        v1_context_t *v1p      = (v1_context_t *)pcp->pc_verdep;
+        uint64_t      nvbcount = v1_nvbcount(v1p, blockno);
+        uint64_t      pbn;
+        int           stored;
+
+        for (pbn = blockno; pbn < blockno + nblocks; pbn++) {
+            stored = (v1p->v1_bitmap[pbn] &&
+                      !(pcp->pc_cf_handle &&
+                        cf_blockused_at(pcp->pc_cf_handle, pbn)));
+            if (pbn == blockno) {
+                error    = (stored) ? 0 : ENOENT;
+                *offsetp = rblock2offset(pcp, nvbcount);
+            } else if ((stored != !error) ||
+                       (stored && (rblock2offset(pcp, nvbcount) !=
+                                   *offsetp + (pbn - blockno) *
+                                                  pcp->pc_head.block_size))) {
+                break;
+            }
+            if (v1p->v1_bitmap[pbn])
+                nvbcount++;
+        }
+        *fhp    = pcp->pc_fd;
+        *countp = pbn - blockno;
+    }
+
+    return error;
+}
+
+/*
+ * Read blocks at a given position.  Unlike v1_readblock, the count of
+ * preceding valid blocks is kept locally so that readers can run in
+ * parallel.  Each run of blocks packed together in the image is read
+ * with one call.
+ */
+static int
+v1_readblocks_at(pc_context_t *pcp, uint64_t blockno, void *buffer,
+                 uint64_t nblocks) {
+    int error = EINVAL;
+
+    if (PCTX_HAVE_VERDEP(pcp)) {
+        uint64_t offset, count, r_size;
+        uint64_t pbn;
+        void *   fh;
+        char *   cbp = (char *)buffer;
+
+        error = 0;
+        while (!error && nblocks) {
+            if ((error = v1_locate_at(pcp, blockno, nblocks, &fh, &offset,
+                                      &count)) == 0) {
+                if (((error = (*pcp->pc_sysdep->sys_pread)(
+                          fh, cbp, count * pcp->pc_head.block_size, offset,
+                          &r_size)) == 0) &&
+                    (r_size != count * pcp->pc_head.block_size))
+                    error = EIO;
+                IMAGE_STATS_ADD(pcp->pc_stats.is_imageblocks, count);
+                cbp += count * pcp->pc_head.block_size;
+            } else if (error == ENOENT) {
+                /*
+                 * Changed blocks, and unused ones that read as the
+                 * invalid block.
+                 */
+                error = 0;
+                for (pbn = blockno; !error && (pbn < blockno + count); pbn++) {
+                    error = (pcp->pc_cf_handle)
+                                ? cf_readblock_at(pcp->pc_cf_handle, pbn, cbp)
+                                : ENXIO;
+                    if (error == ENXIO) {
+                        memcpy(cbp, pcp->pc_ivblock, pcp->pc_head.block_size);
+                        error = 0;
+                        IMAGE_STATS_ADD(pcp->pc_stats.is_unusedblocks, 1);
+                    } else if (!error) {
+                        IMAGE_STATS_ADD(pcp->pc_stats.is_cfblocks, 1);
+                    }
+                    cbp += pcp->pc_head.block_size;
+                }
+            }
+            blockno += count;
+            nblocks -= count;
+        }
+    }
+
+    return error;
+}
+
+/*
+ * Write blocks at a given position.  The change file is created by
+ * v1_writeblock, so leave the first write to the serialized path.
+ */
+static int
+v1_writeblocks_at(pc_context_t *pcp, uint64_t blockno, void *buffer,
+                  uint64_t nblocks) {
+    int error = EINVAL;
+
+    if (PCTX_HAVE_VERDEP(pcp)) {
+        uint64_t pbn;
+        char *   cbp = (char *)buffer;
+
+        error = (PCTX_WRITEREADY(pcp)) ? 0 : EAGAIN;
+        for (pbn = blockno; !error && (pbn < blockno + nblocks); pbn++) {
+            error = cf_writeblock_at(pcp->pc_cf_handle, pbn, cbp);
+            cbp += pcp->pc_head.block_size;
+        }
+    }
+
+    return error;
+}
+
+/*
+ * Zero blocks at a given position.  Like v1_writeblocks_at, this needs
+ * the change file to exist.
+ */
+static int
+v1_zeroblocks_at(pc_context_t *pcp, uint64_t blockno, uint64_t nblocks) {
+    int error = EINVAL;
+
+    if (PCTX_HAVE_VERDEP(pcp))
+        error = (PCTX_WRITEREADY(pcp))
+                    ? cf_zeroblocks_at(pcp->pc_cf_handle, blockno, nblocks)
+                    : EAGAIN;
+
+    return error;
+}
+
 static int
 v2_verify(pc_context_t *pcp) {
     int            error = EINVAL;
@@ -582,9 +777,11 @@ v2_verify(pc_context_t *pcp) {
  */
 static const v_dispatch_table_t version_table[] = {
     {"0001", v1_init, v1_verify, v1_finish, v1_seek, v1_readblock, v1_blockused,
-     v1_writeblock, v1_sync},
+     v1_writeblock, v1_sync, v1_readblocks_at, v1_writeblocks_at,
+     v1_extent_at, v1_zeroblocks_at, v1_locate_at},
     {"0002", v1_init, v2_verify, v1_finish, v1_seek, v1_readblock, v1_blockused,
-     v1_writeblock, v1_sync},
+     v1_writeblock, v1_sync, v1_readblocks_at, v1_writeblocks_at,
+     v1_extent_at, v1_zeroblocks_at, v1_locate_at},
 };
 
 /*
@@ -680,6 +877,18 @@ partclone_tolerant_mode(void *rp) {
     }
 }
 
+/*
+ * Set the features for a change file we create.
+ */
+void
+partclone_cf_features(void *rp, uint32_t features) {
+    pc_context_t *pcp = (pc_context_t *)rp;
+
+    if (PCTX_OPEN(pcp)) {
+        pcp->pc_cf_features = features;
+    }
+}
+
 /*
  * Determine the version of the file and verify it.
  */
@@ -868,6 +1077,80 @@ partclone_writeblocks(void *rp, void *buffer, uint64_t nblocks) {
     return error;
 }
 
+/*
+ * Read blocks at a given position.
+ */
+int
+partclone_readblocks_at(void *rp, uint64_t blockno, void *buffer,
+                        uint64_t nblocks) {
+    pc_context_t *pcp = (pc_context_t *)rp;
+
+    return (PCTX_READREADY(pcp) &&
+            (blockno + nblocks <= pcp->pc_head.totalblock))
+               ? (*pcp->pc_dispatch->version_readblocks_at)(pcp, blockno,
+                                                             buffer, nblocks)
+               : EINVAL;
+}
+
+/*
+ * Write blocks at a given position.
+ */
+int
+partclone_writeblocks_at(void *rp, uint64_t blockno, void *buffer,
+                         uint64_t nblocks) {
+    pc_context_t *pcp = (pc_context_t *)rp;
+
+    return (PCTX_WRITEABLE(pcp) &&
+            (blockno + nblocks <= pcp->pc_head.totalblock))
+               ? (*pcp->pc_dispatch->version_writeblocks_at)(pcp, blockno,
+                                                              buffer, nblocks)
+               : EINVAL;
+}
+
+/*
+ * Find the run of blocks in the same state at a given position.
+ */
+int
+partclone_extent_at(void *rp, uint64_t blockno, uint64_t nblocks,
+                    uint64_t *countp) {
+    pc_context_t *pcp = (pc_context_t *)rp;
+
+    return (PCTX_READREADY(pcp) &&
+            (blockno + nblocks <= pcp->pc_head.totalblock))
+               ? (*pcp->pc_dispatch->version_extent_at)(pcp, blockno, nblocks,
+                                                        countp)
+               : BLOCK_ERROR;
+}
+
+/*
+ * Zero blocks at a given position.
+ */
+int
+partclone_zeroblocks_at(void *rp, uint64_t blockno, uint64_t nblocks) {
+    pc_context_t *pcp = (pc_context_t *)rp;
+
+    return (PCTX_WRITEABLE(pcp) &&
+            (blockno + nblocks <= pcp->pc_head.totalblock))
+               ? (*pcp->pc_dispatch->version_zeroblocks_at)(pcp, blockno,
+                                                            nblocks)
+               : EINVAL;
+}
+
+/*
+ * Find where a run of blocks is stored in the image.
+ */
+int
+partclone_locate_at(void *rp, uint64_t blockno, uint64_t nblocks,
+                    void **fhp, uint64_t *offsetp, uint64_t *countp) {
+    pc_context_t *pcp = (pc_context_t *)rp;
+
+    return (PCTX_READREADY(pcp) &&
+            (blockno + nblocks <= pcp->pc_head.totalblock))
+               ? (*pcp->pc_dispatch->version_locate_at)(
+                     pcp, blockno, nblocks, fhp, offsetp, countp)
+               : EINVAL;
+}
+
 /*
  * Commit changes to image.
  */
@@ -875,8 +1158,53 @@ int
 partclone_sync(void *rp) {
     pc_context_t *pcp = (pc_context_t *)rp;
 
-    return (PCTX_WRITEREADY(pcp)) ? (*pcp->pc_dispatch->version_sync)(pcp)
-                                  : EINVAL;
+    if (PCTX_WRITEREADY(pcp))
+        return (*pcp->pc_dispatch->version_sync)(pcp);
+    /*
+     * Until the change file is created nothing has been written.
+     */
+    return (PCTX_WRITEABLE(pcp)) ? 0 : EINVAL;
+}
+
+/*
+ * Compact the change file.
+ */
+int
+partclone_compact(void *rp) {
+    pc_context_t *pcp = (pc_context_t *)rp;
+
+    return (PCTX_WRITEREADY(pcp)) ? cf_compact(pcp->pc_cf_handle) : EINVAL;
+}
+
+/*
+ * Commit the change file into the image.  Blocks are packed in the image,
+ * so changed ones have no place to go; build a new image instead.
+ */
+int
+partclone_commit(void *rp) {
+    pc_context_t *pcp = (pc_context_t *)rp;
+
+    return (PCTX_WRITEABLE(pcp)) ? ENOTSUP : EINVAL;
+}
+
+/*
+ * Throw away what the change file holds, if it is volatile.  Until it
+ * exists nothing has been written.
+ */
+int
+partclone_discard(void *rp) {
+    pc_context_t *pcp = (pc_context_t *)rp;
+
+    return (PCTX_WRITEREADY(pcp)) ? cf_discard(pcp->pc_cf_handle) : 0;
+}
+
+/*
+ * Return the image's counters.
+ */
+image_stats_t *
+partclone_stats(void *rp) {
+    pc_context_t *pcp = (pc_context_t *)rp;
+    return (PCTX_VALID(pcp)) ? &pcp->pc_stats : (image_stats_t *)NULL;
 }
 
 /*
@@ -903,4 +1231,7 @@ const image_dispatch_t partclone_image_type = {
     partclone_close,       partclone_tolerant_mode, partclone_verify,
     partclone_blocksize,   partclone_blockcount,    partclone_seek,
     partclone_tell,        partclone_readblocks,    partclone_block_used,
-    partclone_writeblocks, partclone_sync};
+    partclone_writeblocks, partclone_sync,          partclone_cf_features,
+    partclone_compact,     partclone_commit,        partclone_readblocks_at,
+    partclone_writeblocks_at, partclone_extent_at, partclone_zeroblocks_at,
+    partclone_locate_at,   partclone_discard,       partclone_stats};
@@ -14,6 +14,7 @@
 #ifndef _LIBPARTCLONE_H_
 #define _LIBPARTCLONE_H_ 1
 
+#include "libimage.h"
 #include "partclone.h"
 #include "sysdep_int.h"
 #include <sys/types.h>
@@ -33,6 +34,15 @@ int      partclone_readblocks(void *rp, void *buffer, uint64_t nblocks);
 int      partclone_block_used(void *rp);
 int      partclone_writeblocks(void *rp, void *buffer, uint64_t nblocks);
 int      partclone_sync(void *rp);
+int      partclone_readblocks_at(void *rp, uint64_t blockno, void *buffer,
+                                 uint64_t nblocks);
+int      partclone_writeblocks_at(void *rp, uint64_t blockno, void *buffer,
+                                  uint64_t nblocks);
+int      partclone_extent_at(void *rp, uint64_t blockno, uint64_t nblocks,
+                             uint64_t *countp);
+int      partclone_zeroblocks_at(void *rp, uint64_t blockno, uint64_t nblocks);
+int      partclone_locate_at(void *rp, uint64_t blockno, uint64_t nblocks,
+                             void **fhp, uint64_t *offsetp, uint64_t *countp);
 
 typedef struct libpc_context {
     void *                         pc_fd;        /* File handle */
@@ -58,6 +68,8 @@ typedef struct libpc_context {
     uint64_t           pc_curblock; /* Current position */
     uint32_t           pc_flags;    /* Handle flags */
     sysdep_open_mode_t pc_omode;    /* Open mode */
+    uint32_t           pc_cf_features; /* Features for a new change file */
+    image_stats_t      pc_stats;       /* Counters */
 } pc_context_t;
 
 #endif /* _LIBPARTCLONE_H_ */
@@ -49,6 +49,8 @@ typedef struct libraw_context {
     uint64_t                 raw_curblock;    /* Current position */
     uint32_t                 raw_flags;       /* Handle flags */
     sysdep_open_mode_t       raw_omode;       /* Open mode */
+    uint32_t                 raw_cf_features; /* Features for a new cf */
+    image_stats_t            raw_stats;       /* Counters */
 } raw_context_t;
 
 /*
@@ -145,6 +147,7 @@ rawimage_open(const char *path, const char *cfpath, sysdep_open_mode_t omode,
                     if ((error = (*rcp->raw_sysdep->sys_malloc)(
                              &rcp->raw_path, strlen(path) + 1)) == 0) {
                         rcp->raw_flags |= RAW_HAVE_PATH;
+                        memcpy(rcp->raw_path, path, strlen(path) + 1);
                         rcp->raw_omode = omode;
                         if (cfpath && ((error = (*rcp->raw_sysdep->sys_malloc)(
                                             &rcp->raw_cf_path,
@@ -182,6 +185,18 @@ rawimage_tolerant_mode(void *rp) {
     }
 }
 
+/*
+ * Set the features for a change file we create.
+ */
+void
+rawimage_cf_features(void *rp, uint32_t features) {
+    raw_context_t *rcp = (raw_context_t *)rp;
+
+    if (RAWCTX_OPEN(rcp)) {
+        rcp->raw_cf_features = features;
+    }
+}
+
 /*
  * Verify the image.
  */
@@ -192,23 +207,29 @@ rawimage_verify(void *rp) {
 
     if (RAWCTX_OPEN(rcp)) {
         error = 0;
-        if (rcp->raw_cf_path && ((int)rcp->raw_omode >= (int)SYSDEP_OPEN_RW)) {
+        if ((int)rcp->raw_omode < (int)SYSDEP_OPEN_RW)
+            rcp->raw_flags |= RAW_READ_ONLY;
+        /*
+         * A read-only image only reads its change file.
+         */
+        if (rcp->raw_cf_path) {
             if ((error = cf_init(rcp->raw_cf_path, rcp->raw_sysdep,
                                  rcp->raw_blocksize, rcp->raw_totalblocks,
+                                 rcp->raw_cf_features |
+                                     ((RAWCTX_READ_ONLY(rcp))
+                                          ? CF_FEATURE_READONLY
+                                          : 0),
                                  &rcp->raw_cf_handle)) == 0) {
-                rcp->raw_flags |= RAW_CF_OPEN;
+                rcp->raw_flags |= (RAW_CF_OPEN | RAW_HAVE_CFDEP);
                 if ((error = cf_verify(rcp->raw_cf_handle)) == 0) {
                     rcp->raw_flags |= RAW_CF_VERIFIED;
                 }
-            } else {
+            } else if (error != EBUSY) {
                 /*
-                 * We'll create this later.
+                 * We'll create this later, unless another process has it.
                  */
                 error = 0;
             }
-        } else {
-            if ((int)rcp->raw_omode < (int)SYSDEP_OPEN_RW)
-                rcp->raw_flags |= RAW_READ_ONLY;
         }
         if (!error) {
             rcp->raw_flags |= RAW_VERIFIED;
@@ -284,10 +305,13 @@ rawimage_readblocks(void *rp, void *buffer, uint64_t nblocks) {
                              SYSDEP_SEEK_ABSOLUTE, (uint64_t *)NULL)) == 0) {
                         error = (*rcp->raw_sysdep->sys_read)(
                             rcp->raw_fd, cbp, rcp->raw_blocksize, &nread);
+                        IMAGE_STATS_ADD(rcp->raw_stats.is_imageblocks, 1);
                     }
                     if (error) {
                         break;
                     }
+                } else {
+                    IMAGE_STATS_ADD(rcp->raw_stats.is_cfblocks, 1);
                 }
                 rcp->raw_curblock++;
                 cbp += rcp->raw_blocksize;
@@ -298,6 +322,7 @@ rawimage_readblocks(void *rp, void *buffer, uint64_t nblocks) {
                      SYSDEP_SEEK_ABSOLUTE, (uint64_t *)NULL)) == 0) {
                 error = (*rcp->raw_sysdep->sys_read)(
                     rcp->raw_fd, buffer, nblocks * rcp->raw_blocksize, &nread);
+                IMAGE_STATS_ADD(rcp->raw_stats.is_imageblocks, nblocks);
             }
         }
     }
@@ -345,7 +370,8 @@ rawimage_writeblocks(void *rp, void *buffer, uint64_t nblocks) {
             }
             error =
                 cf_create(rcp->raw_cf_path, rcp->raw_sysdep, rcp->raw_blocksize,
-                          rcp->raw_totalblocks, &rcp->raw_cf_handle);
+                          rcp->raw_totalblocks, rcp->raw_cf_features,
+                          &rcp->raw_cf_handle);
             if (!error) {
                 rcp->raw_flags |=
                     (RAW_HAVE_CFDEP | RAW_CF_VERIFIED | RAW_CF_OPEN);
@@ -371,6 +397,107 @@ rawimage_writeblocks(void *rp, void *buffer, uint64_t nblocks) {
     return error;
 }
 
+/*
+ * Find where a run of blocks is stored.  Blocks are where their number
+ * puts them unless the change file has them.
+ */
+int
+rawimage_locate_at(void *rp, uint64_t blockno, uint64_t nblocks, void **fhp,
+                   uint64_t *offsetp, uint64_t *countp) {
+    int            error = EINVAL;
+    raw_context_t *rcp   = (raw_context_t *)rp;
+
+    if (RAWCTX_READREADY(rcp) && (blockno + nblocks <= rcp->raw_totalblocks)) {
+        uint64_t bindex;
+        int      changed;
+
+        for (bindex = 0; bindex < nblocks; bindex++) {
+            changed = (rcp->raw_cf_handle &&
+                       cf_blockused_at(rcp->raw_cf_handle, blockno + bindex));
+            if (bindex == 0)
+                error = (changed) ? ENOENT : 0;
+            else if (changed != (error == ENOENT))
+                break;
+        }
+        *fhp     = rcp->raw_fd;
+        *offsetp = rblock2offset(rcp, blockno);
+        *countp  = bindex;
+    }
+
+    return error;
+}
+
+/*
+ * Read blocks at a given position.  Each run of blocks that the change
+ * file doesn't have is read from the image with one call.
+ */
+int
+rawimage_readblocks_at(void *rp, uint64_t blockno, void *buffer,
+                       uint64_t nblocks) {
+    int            error = EINVAL;
+    raw_context_t *rcp   = (raw_context_t *)rp;
+
+    if (RAWCTX_READREADY(rcp) && (blockno + nblocks <= rcp->raw_totalblocks)) {
+        uint64_t nread, offset, count;
+        uint64_t bindex;
+        void *   fh;
+        char *   cbp = (char *)buffer;
+
+        error = 0;
+        while (!error && nblocks) {
+            if ((error = rawimage_locate_at(rp, blockno, nblocks, &fh, &offset,
+                                            &count)) == 0) {
+                if (((error = (*rcp->raw_sysdep->sys_pread)(
+                          fh, cbp, count * rcp->raw_blocksize, offset,
+                          &nread)) == 0) &&
+                    (nread != count * rcp->raw_blocksize))
+                    error = EIO;
+                IMAGE_STATS_ADD(rcp->raw_stats.is_imageblocks, count);
+            } else if (error == ENOENT) {
+                error = 0;
+                IMAGE_STATS_ADD(rcp->raw_stats.is_cfblocks, count);
+                for (bindex = 0; !error && (bindex < count); bindex++)
+                    error = cf_readblock_at(rcp->raw_cf_handle,
+                                            blockno + bindex,
+                                            cbp + bindex * rcp->raw_blocksize);
+            }
+            blockno += count;
+            nblocks -= count;
+            cbp += count * rcp->raw_blocksize;
+        }
+    }
+
+    return error;
+}
+
+/*
+ * Write blocks at a given position.  Until the change file exists, leave
+ * the write to the caller's serialized path, which creates it.
+ */
+int
+rawimage_writeblocks_at(void *rp, uint64_t blockno, void *buffer,
+                        uint64_t nblocks) {
+    int            error = EINVAL;
+    raw_context_t *rcp   = (raw_context_t *)rp;
+
+    if (RAWCTX_WRITEABLE(rcp) && (blockno + nblocks <= rcp->raw_totalblocks)) {
+        error = EAGAIN;
+        if (RAWCTX_WRITEREADY(rcp)) {
+            void *   cbp = buffer;
+            uint64_t bindex;
+
+            error = 0;
+            for (bindex = 0; !error && (bindex < nblocks); bindex++) {
+                error = cf_writeblock_at(rcp->raw_cf_handle, blockno + bindex,
+                                         cbp);
+                cbp += rcp->raw_blocksize;
+            }
+        }
+    }
+
+    return error;
+}
+
 /*
  * Commit changes to image.
  */
@@ -378,7 +505,59 @@ int
 rawimage_sync(void *rp) {
     raw_context_t *rcp = (raw_context_t *)rp;
 
-    return (RAWCTX_WRITEREADY(rcp)) ? cf_sync(rcp->raw_cf_handle) : EINVAL;
+    if (RAWCTX_WRITEREADY(rcp))
+        return cf_sync(rcp->raw_cf_handle);
+    /*
+     * Until the change file is created nothing has been written.
+     */
+    return (RAWCTX_WRITEABLE(rcp)) ? 0 : EINVAL;
+}
+
+/*
+ * Compact the change file.
+ */
+int
+rawimage_compact(void *rp) {
+    raw_context_t *rcp = (raw_context_t *)rp;
+
+    return (RAWCTX_WRITEREADY(rcp)) ? cf_compact(rcp->raw_cf_handle) : EINVAL;
+}
+
+/*
+ * Commit the change file into the image.  Blocks of a raw image are where
+ * the change file numbers them.  The image is otherwise only read, so it
+ * is opened for writing just for this.  A change file that is served
+ * elsewhere is not committed (EBUSY), as the server would go on reading
+ * and writing it.
+ */
+int
+rawimage_commit(void *rp) {
+    raw_context_t *rcp   = (raw_context_t *)rp;
+    int            error = EINVAL;
+
+    if (RAWCTX_WRITEREADY(rcp)) {
+        void *wfd;
+
+        if (((error = cf_exclusive(rcp->raw_cf_handle)) == 0) &&
+            ((error = (*rcp->raw_sysdep->sys_open)(&wfd, rcp->raw_path,
+                                                   SYSDEP_OPEN_RW)) == 0)) {
+            error = cf_commit(rcp->raw_cf_handle, wfd);
+            (void)(*rcp->raw_sysdep->sys_close)(wfd);
+        }
+    }
+
+    return error;
+}
+
+/*
+ * Throw away what the change file holds, if it is volatile.  Until it
+ * exists nothing has been written.
+ */
+int
+rawimage_discard(void *rp) {
+    raw_context_t *rcp = (raw_context_t *)rp;
+
+    return (RAWCTX_WRITEREADY(rcp)) ? cf_discard(rcp->raw_cf_handle) : 0;
 }
 
 /*
@@ -397,6 +576,32 @@ rawimage_probe(const char *path, const sysdep_dispatch_t *sysdep) {
     return error;
 }
 
+/*
+ * Zero blocks at a given position.  Until the change file exists, leave
+ * it to the caller, as with writes.
+ */
+int
+rawimage_zeroblocks_at(void *rp, uint64_t blockno, uint64_t nblocks) {
+    int            error = EINVAL;
+    raw_context_t *rcp   = (raw_context_t *)rp;
+
+    if (RAWCTX_WRITEABLE(rcp) && (blockno + nblocks <= rcp->raw_totalblocks))
+        error = (RAWCTX_WRITEREADY(rcp))
+                    ? cf_zeroblocks_at(rcp->raw_cf_handle, blockno, nblocks)
+                    : EAGAIN;
+
+    return error;
+}
+
+/*
+ * Return the image's counters.
+ */
+image_stats_t *
+rawimage_stats(void *rp) {
+    raw_context_t *rcp = (raw_context_t *)rp;
+    return (RAWCTX_VALID(rcp)) ? &rcp->raw_stats : (image_stats_t *)NULL;
+}
+
 /*
  * The image type dispatch table.
  */
@@ -405,4 +610,7 @@ const image_dispatch_t raw_image_type = {
     rawimage_close,       rawimage_tolerant_mode, rawimage_verify,
     rawimage_blocksize,   rawimage_blockcount,    rawimage_seek,
     rawimage_tell,        rawimage_readblocks,    rawimage_block_used,
-    rawimage_writeblocks, rawimage_sync};
+    rawimage_writeblocks, rawimage_sync,          rawimage_cf_features,
+    rawimage_compact,     rawimage_commit,        rawimage_readblocks_at,
+    rawimage_writeblocks_at, NULL, rawimage_zeroblocks_at, rawimage_locate_at,
+    rawimage_discard,     rawimage_stats};
@@ -30,5 +30,12 @@ int      rawimage_readblocks(void *rp, void *buffer, uint64_t nblocks);
 int      rawimage_block_used(void *rp);
 int      rawimage_writeblocks(void *rp, void *buffer, uint64_t nblocks);
 int      rawimage_sync(void *rp);
+int      rawimage_readblocks_at(void *rp, uint64_t blockno, void *buffer,
+                                uint64_t nblocks);
+int      rawimage_writeblocks_at(void *rp, uint64_t blockno, void *buffer,
+                                 uint64_t nblocks);
+int      rawimage_zeroblocks_at(void *rp, uint64_t blockno, uint64_t nblocks);
+int      rawimage_locate_at(void *rp, uint64_t blockno, uint64_t nblocks,
+                            void **fhp, uint64_t *offsetp, uint64_t *countp);
 
 #endif /* _LIBRAWIMAGE_H_ */
@@ -0,0 +1,119 @@
+/*
+ * nbdbuffer.c - Request buffers of the imagemount worker pool.
+ */
+/*
+ * Copyright (c) 2010, Ideal World, Inc.  All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ */
+#ifdef HAVE_CONFIG_H
+#    include "config.h"
+#endif /* HAVE_CONFIG_H */
+#include "imagemount.h"
+#include <stdlib.h>
+#include <unistd.h>
+
+/*
+ * Request buffers.  Buffers of the pool's size are kept on a free list for
+ * reuse; larger ones are allocated for their request.  All of them count
+ * against the pool's memory cap.
+ */
+
+/*
+ * Set up the buffers of a pool for images of the given block size, and
+ * start with count of them, as far as the cap allows.
+ */
+void
+nbd_buf_init(nbd_pool_t *np, uint64_t bsize, int count) {
+    char * prealloc = (char *)NULL;
+    char * buf;
+    size_t size;
+    int    bi;
+
+    np->np_align   = (size_t)sysconf(_SC_PAGESIZE);
+    np->np_memcap  = (uint64_t)np->np_ncp->svc_memory << 20;
+    np->np_bufsize = (NBD_BUFFER_SIZE + 2 * bsize + np->np_align - 1) &
+                     ~(np->np_align - 1);
+    for (bi = 0;
+         (bi < count) && (buf = nbd_buf_take(np, np->np_bufsize, &size));
+         bi++) {
+        *(char **)buf = prealloc;
+        prealloc      = buf;
+    }
+    while ((buf = prealloc)) {
+        prealloc = *(char **)buf;
+        nbd_buf_give(np, buf, size);
+    }
+}
+
+/*
+ * Get a request buffer of at least size bytes without waiting.  Pooled
+ * buffers are reused, and allocated while memory is under the cap; a
+ * larger one is allocated for the request, first releasing pooled ones to
+ * make room.  While no buffer is in use the cap gives way, so that any
+ * request can go through.  Called with the pool lock held.
+ */
+char *
+nbd_buf_take(nbd_pool_t *np, size_t size, size_t *sizep) {
+    char * buf   = (char *)NULL;
+    size_t bsize = (size <= np->np_bufsize) ? np->np_bufsize : size;
+
+    if ((bsize == np->np_bufsize) && np->np_buffers) {
+        buf            = np->np_buffers;
+        np->np_buffers = *(char **)buf;
+    } else {
+        while ((np->np_memory + bsize > np->np_memcap) && np->np_buffers) {
+            buf            = np->np_buffers;
+            np->np_buffers = *(char **)buf;
+            np->np_memory -= np->np_bufsize;
+            free(buf);
+            buf = (char *)NULL;
+        }
+        if (((np->np_memory + bsize <= np->np_memcap) || !np->np_bufinuse) &&
+            !posix_memalign((void **)&buf, np->np_align, bsize))
+            np->np_memory += bsize;
+        else
+            buf = (char *)NULL;
+    }
+    if (buf) {
+        np->np_bufinuse++;
+        *sizep = bsize;
+    }
+
+    return buf;
+}
+
+/*
+ * Return a request buffer.  Pooled buffers are kept for reuse, others
+ * freed.  Called with the pool lock held.
+ */
+void
+nbd_buf_give(nbd_pool_t *np, char *buf, size_t size) {
+    if (buf) {
+        if (size == np->np_bufsize) {
+            *(char **)buf  = np->np_buffers;
+            np->np_buffers = buf;
+        } else {
+            free(buf);
+            np->np_memory -= size;
+        }
+        np->np_bufinuse--;
+    }
+}
+
+/*
+ * Free the pooled buffers.  None may be in use.
+ */
+void
+nbd_buf_fini(nbd_pool_t *np) {
+    char *buf;
+
+    while ((buf = np->np_buffers)) {
+        np->np_buffers = *(char **)buf;
+        free(buf);
+    }
+}
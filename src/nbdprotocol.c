@@ -0,0 +1,620 @@
+/*
+ * nbdprotocol.c - NBD handshake and replies for imagemount.
+ */
+/*
+ * Copyright (c) 2010, Ideal World, Inc.  All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ */
+#ifdef HAVE_CONFIG_H
+#    include "config.h"
+#endif /* HAVE_CONFIG_H */
+#include "imagemount.h"
+#include "sysdep_posix.h"
+#include <arpa/inet.h>
+#include <endian.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+/*
+ * Write all of a buffer to the kernel.
+ */
+int
+nbd_write_full(int fd, const void *buf, size_t len) {
+    const char *bp = (const char *)buf;
+    ssize_t     wlength;
+
+    while (len) {
+        if ((wlength = write(fd, bp, len)) == -1) {
+            if (errno == EINTR)
+                continue;
+            return errno;
+        }
+        bp += wlength;
+        len -= wlength;
+    }
+
+    return 0;
+}
+
+/*
+ * Write all of a set of buffers to a socket, in one call if it takes
+ * them.  The vector is used up.
+ */
+static int
+nbd_sendmsg_full(int fd, struct iovec *iov, int iovcnt, int flags) {
+    struct msghdr msg;
+    ssize_t       wlength;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov    = iov;
+    msg.msg_iovlen = iovcnt;
+    while (msg.msg_iovlen) {
+        if ((wlength = sendmsg(fd, &msg, flags)) == -1) {
+            if (errno == EINTR)
+                continue;
+            return errno;
+        }
+        while (msg.msg_iovlen && ((size_t)wlength >= msg.msg_iov->iov_len)) {
+            wlength -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (msg.msg_iovlen) {
+            msg.msg_iov->iov_base = (char *)msg.msg_iov->iov_base + wlength;
+            msg.msg_iov->iov_len -= wlength;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Read all of a buffer from a socket.  Only the handshake reads this way,
+ * in a thread of its own.
+ */
+static int
+nbd_read_full(int fd, void *buf, size_t len) {
+    char *  bp = (char *)buf;
+    ssize_t rlength;
+
+    while (len) {
+        if ((rlength = read(fd, bp, len)) == -1) {
+            if (errno == EINTR)
+                continue;
+            return errno;
+        }
+        if (rlength == 0)
+            return EPIPE;
+        bp += rlength;
+        len -= rlength;
+    }
+
+    return 0;
+}
+
+/*
+ * Find the run of a read job's blocks at blockno and whether it is to be
+ * sent straight from the image file.  Returns 0 if it is, ENOENT if it is
+ * read into the job's buffer.
+ */
+int
+nbd_job_run_at(nbd_pool_t *np, nbd_job_t *njp, uint64_t blockno, void **fhp,
+               uint64_t *offsetp, uint64_t *countp) {
+    nbd_export_t *exp = njp->nj_conn->cn_export;
+    int           cached;
+    int           error =
+        image_locate_at(exp->ex_pctx, blockno,
+                        njp->nj_startblock + njp->nj_blockcount - blockno, fhp,
+                        offsetp, countp);
+
+    /*
+     * Blocks in the write-back cache go in the buffer.  One written back
+     * between reading and sending is the same in the image.
+     */
+    if ((error == 0) && exp->ex_wb) {
+        *countp = nbd_wb_span(exp->ex_wb, blockno, *countp, &cached,
+                              (char *)NULL);
+        if (cached)
+            error = ENOENT;
+    }
+    return ((error == 0) &&
+            (*countp * exp->ex_ncp->svc_blocksize < NBD_DIRECT_MIN))
+               ? ENOENT
+               : error;
+}
+
+/*
+ * Send the data of a read, the runs that nbd_job_read left in the image
+ * file straight from it and the rest from the job's buffer.  Runs in the
+ * buffer that follow one another go in one write.
+ */
+static int
+nbd_job_send(nbd_pool_t *np, nbd_job_t *njp) {
+    int      fh      = njp->nj_conn->cn_fh;
+    uint64_t bsize   = njp->nj_conn->cn_export->ex_ncp->svc_blocksize;
+    uint64_t blockno = njp->nj_startblock;
+    uint64_t pos     = njp->nj_sboffs;
+    uint64_t bufpos  = pos;
+    uint64_t end     = njp->nj_sboffs + njp->nj_length;
+    uint64_t runend, offset, count, nsent;
+    void *   ifh;
+    int      error = 0;
+
+    while (!error && (pos < end)) {
+        error = nbd_job_run_at(np, njp, blockno, &ifh, &offset, &count);
+        blockno += count;
+        if ((runend = (blockno - njp->nj_startblock) * bsize) > end)
+            runend = end;
+        if (error == ENOENT) {
+            error = 0;
+        } else if (!error) {
+            if (bufpos < pos)
+                error = nbd_write_full(fh, &njp->nj_buf[bufpos], pos - bufpos);
+            if (!error)
+                error = (*posix_dispatch.sys_send)(
+                    ifh, offset + (pos % bsize), runend - pos, fh, &nsent);
+            bufpos = runend;
+        }
+        pos = runend;
+    }
+    if (!error && (bufpos < end))
+        error = nbd_write_full(fh, &njp->nj_buf[bufpos], end - bufpos);
+
+    return error;
+}
+
+/*
+ * Send a reply without interleaving with other replies on the connection.
+ * The last piece is the data, unless direct is given, in which case that
+ * job's data is sent after the rest.  A reply that cannot be sent whole,
+ * as when the client takes nothing for NBD_SEND_TIMEOUT, leaves the client
+ * out of step, so the connection is shut down.
+ */
+static int
+nbd_conn_send(nbd_conn_t *cnp, struct iovec *iov, int iovcnt,
+              nbd_job_t *direct) {
+    int error;
+
+    pthread_mutex_lock(&cnp->cn_reply);
+    if (!direct)
+        error = nbd_sendmsg_full(cnp->cn_fh, iov, iovcnt, 0);
+    else if (!(error = nbd_sendmsg_full(cnp->cn_fh, iov, iovcnt - 1,
+                                        MSG_MORE)))
+        error = nbd_job_send(cnp->cn_pool, direct);
+    if (error)
+        (void)shutdown(cnp->cn_fh, SHUT_RDWR);
+    pthread_mutex_unlock(&cnp->cn_reply);
+
+    return error;
+}
+
+/*
+ * Send a structured reply as a single chunk: the header, the part that
+ * its type always has, and then any data.
+ */
+static int
+nbd_conn_chunk(nbd_conn_t *cnp, const struct nbd_request *rqp, uint16_t type,
+               const void *fixed, size_t fixedlen, const void *data,
+               size_t length, nbd_job_t *direct) {
+    struct {
+        uint32_t sr_magic;
+        uint16_t sr_flags;
+        uint16_t sr_type;
+        char     sr_handle[8];
+        uint32_t sr_length;
+    } __attribute__((packed)) reply;
+    struct iovec iov[3];
+
+    reply.sr_magic  = htonl(NBD_STRUCTURED_REPLY_MAGIC);
+    reply.sr_flags  = htons(NBD_REPLY_FLAG_DONE);
+    reply.sr_type   = htons(type);
+    reply.sr_length = htonl(fixedlen + length);
+    memcpy(reply.sr_handle, rqp->handle, sizeof(reply.sr_handle));
+    iov[0].iov_base = &reply;
+    iov[0].iov_len  = sizeof(reply);
+    iov[1].iov_base = (void *)fixed;
+    iov[1].iov_len  = fixedlen;
+    iov[2].iov_base = (void *)data;
+    iov[2].iov_len  = length;
+
+    return nbd_conn_send(cnp, iov, 3, direct);
+}
+
+/*
+ * Reply to a request.  Reads and block status get structured replies
+ * once the client has asked for them, everything else gets a simple one.
+ * The data of a read job given as direct is sent by nbd_job_send.
+ */
+int
+nbd_conn_reply(nbd_conn_t *cnp, const struct nbd_request *rqp, int rerror,
+               const void *data, size_t length, nbd_job_t *direct) {
+    uint32_t         command = ntohl(rqp->type) & NBD_CMD_MASK_COMMAND;
+    char             fixed[8];
+    uint32_t         value;
+    struct nbd_reply reply;
+    struct iovec     iov[2];
+    int              error;
+
+    if (cnp->cn_structured &&
+        ((command == NBD_CMD_READ) || (command == NBD_CMD_BLOCK_STATUS))) {
+        if (rerror) {
+            /*
+             * An error code and an empty message.
+             */
+            value = htonl(rerror);
+            memcpy(&fixed[0], &value, sizeof(value));
+            memset(&fixed[4], 0, sizeof(uint16_t));
+            error = nbd_conn_chunk(cnp, rqp, NBD_REPLY_TYPE_ERROR, fixed, 6,
+                                   (void *)NULL, 0, (nbd_job_t *)NULL);
+        } else if (command == NBD_CMD_READ) {
+            error = nbd_conn_chunk(cnp, rqp, NBD_REPLY_TYPE_OFFSET_DATA,
+                                   &rqp->from, sizeof(rqp->from), data,
+                                   length, direct);
+        } else {
+            value = htonl(cnp->cn_context);
+            error = nbd_conn_chunk(cnp, rqp, NBD_REPLY_TYPE_BLOCK_STATUS,
+                                   &value, sizeof(value), data, length,
+                                   (nbd_job_t *)NULL);
+        }
+        return error;
+    }
+
+    reply.magic = htonl(NBD_REPLY_MAGIC);
+    reply.error = htonl(rerror);
+    memcpy(reply.handle, rqp->handle, sizeof(reply.handle));
+    iov[0].iov_base = &reply;
+    iov[0].iov_len  = sizeof(reply);
+    iov[1].iov_base = (void *)data;
+    iov[1].iov_len  = (data || direct) ? length : 0;
+
+    return nbd_conn_send(cnp, iov, 2, (rerror) ? (nbd_job_t *)NULL : direct);
+}
+
+/*
+ * Option request from a client during the handshake.
+ */
+typedef struct nbd_opt_request {
+    uint64_t or_magic;  /* NBD_OPTS_MAGIC */
+    uint32_t or_option; /* Option */
+    uint32_t or_length; /* Length of the data that follows */
+} __attribute__((packed)) nbd_opt_request_t;
+
+/*
+ * Reply to an option.
+ */
+typedef struct nbd_opt_reply {
+    uint64_t op_magic;  /* NBD_REP_MAGIC */
+    uint32_t op_option; /* Option replied to */
+    uint32_t op_type;   /* NBD_REP_xxx */
+    uint32_t op_length; /* Length of the data that follows */
+} __attribute__((packed)) nbd_opt_reply_t;
+
+/*
+ * Send a reply to an option.
+ */
+static int
+nbd_opt_send(int fh, uint32_t option, uint32_t type, const void *data,
+             uint32_t length) {
+    nbd_opt_reply_t reply;
+    int             error;
+
+    reply.op_magic  = htobe64(NBD_REP_MAGIC);
+    reply.op_option = htonl(option);
+    reply.op_type   = htonl(type);
+    reply.op_length = htonl(length);
+    if (!(error = nbd_write_full(fh, &reply, sizeof(reply))) && length)
+        error = nbd_write_full(fh, data, length);
+
+    return error;
+}
+
+/*
+ * Reply to NBD_OPT_LIST with the name of each export.  The list may
+ * change while we send, so each name is copied out under the lock.
+ */
+static int
+nbd_opt_list(nbd_pool_t *np, int fh, uint32_t option, char *data) {
+    nbd_export_t *exp;
+    uint32_t      namelen;
+    size_t        len;
+    int           index, i;
+    int           error = 0;
+
+    for (index = 0; !error; index++) {
+        len = 0;
+        pthread_mutex_lock(&np->np_lock);
+        for (exp = np->np_exports, i = 0; exp; exp = exp->ex_next) {
+            if (exp->ex_removed || !exp->ex_ncp->svc_export)
+                continue;
+            if (i++ == index) {
+                len = strlen(exp->ex_ncp->svc_export);
+                if (len > NBD_MAX_OPTION - 4)
+                    len = NBD_MAX_OPTION - 4;
+                memcpy(&data[4], exp->ex_ncp->svc_export, len);
+                break;
+            }
+        }
+        pthread_mutex_unlock(&np->np_lock);
+        if (!exp)
+            break;
+        namelen = htonl(len);
+        memcpy(&data[0], &namelen, sizeof(namelen));
+        error = nbd_opt_send(fh, option, NBD_REP_SERVER, data, 4 + len);
+    }
+
+    return (error) ? error : nbd_opt_send(fh, option, NBD_REP_ACK, NULL, 0);
+}
+
+/*
+ * Reply to NBD_OPT_INFO or NBD_OPT_GO.  The export is described, along
+ * with whatever else the client asked for that we know, and then
+ * accepted.  An accepted export is returned with a reference taken.
+ */
+static int
+nbd_opt_info(nbd_pool_t *np, int fh, uint32_t option, const char *data,
+             uint32_t length, nbd_export_t **expp) {
+    char           info[NBD_MAX_OPTION + 2];
+    uint32_t       namelen   = 0;
+    uint16_t       nrequests = 0;
+    nbd_export_t * exp;
+    nbd_context_t *ncp;
+    uint16_t       itype, flags;
+    uint32_t       bsize;
+    uint64_t       size;
+    uint32_t       ri;
+    int            error;
+
+    if (length >= 6) {
+        memcpy(&namelen, data, sizeof(namelen));
+        namelen = ntohl(namelen);
+    }
+    if ((length >= 6) && (namelen <= length - 6)) {
+        memcpy(&nrequests, &data[4 + namelen], sizeof(nrequests));
+        nrequests = ntohs(nrequests);
+    }
+    if ((length < 6) || (namelen > length - 6) ||
+        (length != 6 + namelen + 2 * nrequests))
+        return nbd_opt_send(fh, option, NBD_REP_ERR_INVALID, NULL, 0);
+    if (!(exp = nbd_export_get(np, &data[4], namelen)))
+        return nbd_opt_send(fh, option, NBD_REP_ERR_UNKNOWN, NULL, 0);
+
+    ncp   = exp->ex_ncp;
+    itype = htons(NBD_INFO_EXPORT);
+    size  = htobe64(ncp->svc_blocksize * ncp->svc_blockcount);
+    flags = htons(nbd_export_flags(ncp));
+    memcpy(&info[0], &itype, sizeof(itype));
+    memcpy(&info[2], &size, sizeof(size));
+    memcpy(&info[10], &flags, sizeof(flags));
+    error = nbd_opt_send(fh, option, NBD_REP_INFO, info, 12);
+    for (ri = 0; !error && (ri < nrequests); ri++) {
+        memcpy(&itype, &data[6 + namelen + 2 * ri], sizeof(itype));
+        memcpy(&info[0], &itype, sizeof(itype));
+        switch (ntohs(itype)) {
+        case NBD_INFO_NAME:
+            memcpy(&info[2], ncp->svc_export, strlen(ncp->svc_export));
+            error = nbd_opt_send(fh, option, NBD_REP_INFO, info,
+                                 2 + strlen(ncp->svc_export));
+            break;
+        case NBD_INFO_BLOCK_SIZE:
+            /*
+             * Any alignment works, but whole blocks avoid a read of the
+             * ends of a partial write.
+             */
+            bsize = htonl(1);
+            memcpy(&info[2], &bsize, sizeof(bsize));
+            bsize = htonl((uint32_t)ncp->svc_blocksize);
+            memcpy(&info[6], &bsize, sizeof(bsize));
+            bsize = htonl(NBD_MAX_REQUEST);
+            memcpy(&info[10], &bsize, sizeof(bsize));
+            error = nbd_opt_send(fh, option, NBD_REP_INFO, info, 14);
+            break;
+        default:
+            break;
+        }
+    }
+    if (!error && !(error = nbd_opt_send(fh, option, NBD_REP_ACK, NULL, 0)))
+        *expp = exp;
+    else
+        nbd_export_put(np, exp);
+
+    return error;
+}
+
+/*
+ * Reply to NBD_OPT_LIST_META_CONTEXT or NBD_OPT_SET_META_CONTEXT.  The
+ * only context is base:allocation.  Setting it selects it for block
+ * status, and setting anything else clears it.
+ */
+static int
+nbd_opt_meta(nbd_context_t *ncp, nbd_conn_t *cnp, uint32_t option,
+             const char *data, uint32_t length) {
+    static const char allocation[] = NBD_META_ALLOCATION;
+    char              reply[4 + sizeof(allocation) - 1];
+    nbd_export_t *    exp;
+    uint32_t          namelen  = 0;
+    uint32_t          nqueries = 0;
+    uint32_t          pos      = 0;
+    uint32_t          qlen, qi, id;
+    int               invalid, found = 0;
+    int               error;
+
+    /*
+     * The export name, then the number of queries and the queries, each
+     * with its length.
+     */
+    if (length >= 8) {
+        memcpy(&namelen, data, sizeof(namelen));
+        namelen = ntohl(namelen);
+    }
+    if (!(invalid = (length < 8) || (namelen > length - 8))) {
+        memcpy(&nqueries, &data[4 + namelen], sizeof(nqueries));
+        nqueries = ntohl(nqueries);
+        pos      = 8 + namelen;
+    }
+    for (qi = 0; !invalid && (qi < nqueries); qi++) {
+        if (!(invalid = (length - pos < sizeof(qlen)))) {
+            memcpy(&qlen, &data[pos], sizeof(qlen));
+            qlen = ntohl(qlen);
+            pos += sizeof(qlen);
+            if (!(invalid = (qlen > length - pos))) {
+                if (((qlen == sizeof(allocation) - 1) &&
+                     !memcmp(&data[pos], allocation, qlen)) ||
+                    ((option == NBD_OPT_LIST_META_CONTEXT) && (qlen == 5) &&
+                     !memcmp(&data[pos], allocation, qlen)))
+                    found = 1;
+                pos += qlen;
+            }
+        }
+    }
+    if (invalid || (pos != length) ||
+        ((option == NBD_OPT_SET_META_CONTEXT) && !cnp->cn_structured))
+        return nbd_opt_send(cnp->cn_fh, option, NBD_REP_ERR_INVALID, NULL, 0);
+    if (!(exp = nbd_export_get(cnp->cn_pool, &data[4], namelen)))
+        return nbd_opt_send(cnp->cn_fh, option, NBD_REP_ERR_UNKNOWN, NULL, 0);
+    nbd_export_put(cnp->cn_pool, exp);
+
+    /*
+     * Listing nothing in particular lists everything.
+     */
+    if ((option == NBD_OPT_LIST_META_CONTEXT) && !nqueries)
+        found = 1;
+    if (option == NBD_OPT_SET_META_CONTEXT)
+        cnp->cn_context = (found) ? NBD_META_ALLOCATION_ID : 0;
+    if (found) {
+        id = htonl(NBD_META_ALLOCATION_ID);
+        memcpy(&reply[0], &id, sizeof(id));
+        memcpy(&reply[4], allocation, sizeof(allocation) - 1);
+        if ((error = nbd_opt_send(cnp->cn_fh, option, NBD_REP_META_CONTEXT,
+                                  reply, sizeof(reply))))
+            return error;
+    }
+
+    return nbd_opt_send(cnp->cn_fh, option, NBD_REP_ACK, NULL, 0);
+}
+
+/*
+ * Newstyle fixed handshake.  Haggle over options until the client picks
+ * the export and moves to transmission.
+ */
+int
+nbd_handshake(nbd_context_t *ncp, nbd_conn_t *cnp) {
+    struct {
+        uint64_t g_magic;
+        uint64_t g_opts;
+        uint16_t g_flags;
+    } __attribute__((packed)) greeting;
+    struct {
+        uint64_t e_size;
+        uint16_t e_flags;
+        char     e_zeroes[124];
+    } __attribute__((packed)) exportinfo;
+    nbd_opt_request_t request;
+    char              data[NBD_MAX_OPTION];
+    nbd_export_t *    exp;
+    uint32_t          cflags, option, length;
+    int               transmitting = 0;
+    int               error;
+
+    greeting.g_magic = htobe64(NBD_INIT_MAGIC);
+    greeting.g_opts  = htobe64(NBD_OPTS_MAGIC);
+    greeting.g_flags = htons(NBD_FLAG_FIXED_NEWSTYLE | NBD_FLAG_NO_ZEROES);
+    if ((error = nbd_write_full(cnp->cn_fh, &greeting, sizeof(greeting))) ||
+        (error = nbd_read_full(cnp->cn_fh, &cflags, sizeof(cflags))))
+        return error;
+
+    /*
+     * The client's flags are the ones we offered that it takes up.
+     */
+    cflags = ntohl(cflags);
+    if (cflags & ~(NBD_FLAG_FIXED_NEWSTYLE | NBD_FLAG_NO_ZEROES))
+        return EPROTO;
+
+    while (!error && !transmitting) {
+        if ((error = nbd_read_full(cnp->cn_fh, &request, sizeof(request))))
+            break;
+        option = ntohl(request.or_option);
+        length = ntohl(request.or_length);
+        if ((request.or_magic != htobe64(NBD_OPTS_MAGIC)) ||
+            (length > sizeof(data))) {
+            error = EPROTO;
+            break;
+        }
+        if ((error = nbd_read_full(cnp->cn_fh, data, length)))
+            break;
+        logmsg(ncp, 1, "NBD_OPT %u 0x%x\n", option, length);
+
+        switch (option) {
+        case NBD_OPT_EXPORT_NAME:
+            /*
+             * There is no refusing this one but to hang up.
+             */
+            if (!(exp = nbd_export_get(cnp->cn_pool, data, length))) {
+                error = ENOENT;
+                break;
+            }
+            cnp->cn_export = exp;
+            memset(&exportinfo, 0, sizeof(exportinfo));
+            exportinfo.e_size  = htobe64(exp->ex_ncp->svc_blocksize *
+                                        exp->ex_ncp->svc_blockcount);
+            exportinfo.e_flags = htons(nbd_export_flags(exp->ex_ncp));
+            error = nbd_write_full(cnp->cn_fh, &exportinfo,
+                                   (cflags & NBD_FLAG_NO_ZEROES)
+                                       ? sizeof(exportinfo) -
+                                             sizeof(exportinfo.e_zeroes)
+                                       : sizeof(exportinfo));
+            transmitting = 1;
+            break;
+        case NBD_OPT_ABORT:
+            (void)nbd_opt_send(cnp->cn_fh, option, NBD_REP_ACK, NULL, 0);
+            error = ECONNABORTED;
+            break;
+        case NBD_OPT_LIST:
+            if (length) {
+                error = nbd_opt_send(cnp->cn_fh, option, NBD_REP_ERR_INVALID,
+                                     NULL, 0);
+            } else {
+                error = nbd_opt_list(cnp->cn_pool, cnp->cn_fh, option, data);
+            }
+            break;
+        case NBD_OPT_STRUCTURED_REPLY:
+            if (length) {
+                error = nbd_opt_send(cnp->cn_fh, option, NBD_REP_ERR_INVALID,
+                                     NULL, 0);
+            } else {
+                cnp->cn_structured = 1;
+                error = nbd_opt_send(cnp->cn_fh, option, NBD_REP_ACK, NULL, 0);
+            }
+            break;
+        case NBD_OPT_LIST_META_CONTEXT:
+        case NBD_OPT_SET_META_CONTEXT:
+            error = nbd_opt_meta(ncp, cnp, option, data, length);
+            break;
+        case NBD_OPT_INFO:
+        case NBD_OPT_GO:
+            exp   = NULL;
+            error = nbd_opt_info(cnp->cn_pool, cnp->cn_fh, option, data,
+                                 length, &exp);
+            if (exp && (option == NBD_OPT_GO)) {
+                cnp->cn_export = exp;
+                transmitting   = 1;
+            } else if (exp) {
+                nbd_export_put(cnp->cn_pool, exp);
+            }
+            break;
+        default:
+            error =
+                nbd_opt_send(cnp->cn_fh, option, NBD_REP_ERR_UNSUP, NULL, 0);
+            break;
+        }
+    }
+
+    return error;
+}
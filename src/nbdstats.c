@@ -0,0 +1,238 @@
+/*
+ * nbdstats.c - Request statistics of imagemount exports.
+ */
+/*
+ * Copyright (c) 2010, Ideal World, Inc.  All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ */
+#ifdef HAVE_CONFIG_H
+#    include "config.h"
+#endif /* HAVE_CONFIG_H */
+#include "imagemount.h"
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Names of the commands that are counted.
+ */
+static const char *const nbd_stats_names[NBD_STATS_COMMANDS] = {
+    "read", "write", NULL, "flush", "trim", NULL, "write_zeroes",
+    "block_status"};
+
+/*
+ * Histogram bucket of a latency in microseconds.
+ */
+static inline unsigned int
+nbd_stats_bucket(uint64_t us) {
+    unsigned int msb, bucket;
+
+    if (us < (1 << NBD_STATS_SUBBITS))
+        return us;
+    msb    = 63 - __builtin_clzll(us);
+    bucket = ((msb - NBD_STATS_SUBBITS + 1) << NBD_STATS_SUBBITS) +
+             ((us >> (msb - NBD_STATS_SUBBITS)) &
+              ((1 << NBD_STATS_SUBBITS) - 1));
+    return (bucket < NBD_STATS_BUCKETS) ? bucket : NBD_STATS_BUCKETS - 1;
+}
+
+/*
+ * Least latency that falls in a histogram bucket.
+ */
+static inline uint64_t
+nbd_stats_floor(unsigned int bucket) {
+    unsigned int sub = 1 << NBD_STATS_SUBBITS;
+
+    return (bucket < sub) ? bucket
+                          : (uint64_t)(sub + (bucket & (sub - 1)))
+                                << ((bucket >> NBD_STATS_SUBBITS) - 1);
+}
+
+/*
+ * Count a request that has been replied to, and how long it took from
+ * its arrival.
+ */
+void
+nbd_stats_done(nbd_export_t *exp, const nbd_job_t *njp, int error) {
+    nbd_stats_t *stp = &exp->ex_stats;
+    uint32_t     ci  = njp->nj_command;
+    uint64_t     us  = (nbd_now() - njp->nj_arrived) / 1000;
+    uint64_t     max;
+
+    if (ci >= NBD_STATS_COMMANDS)
+        return;
+    IMAGE_STATS_ADD(stp->st_ops[ci], 1);
+    IMAGE_STATS_ADD(stp->st_bytes[ci], njp->nj_length);
+    if (error)
+        IMAGE_STATS_ADD(stp->st_errors[ci], 1);
+    IMAGE_STATS_ADD(stp->st_latency[ci][nbd_stats_bucket(us)], 1);
+    max = __atomic_load_n(&stp->st_max[ci], __ATOMIC_RELAXED);
+    while ((us > max) &&
+           !__atomic_compare_exchange_n(&stp->st_max[ci], &max, us, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+/*
+ * Latency that a share, in thousandths, of the requests of a command took
+ * at most, to within its histogram bucket.
+ */
+static uint64_t
+nbd_stats_quantile(const nbd_stats_t *stp, uint32_t ci, uint64_t permille) {
+    uint64_t     total = 0;
+    uint64_t     seen  = 0;
+    uint64_t     want, most;
+    unsigned int bi;
+
+    for (bi = 0; bi < NBD_STATS_BUCKETS; bi++)
+        total += stp->st_latency[ci][bi];
+    want = (total * permille + 999) / 1000;
+    for (bi = 0; bi < NBD_STATS_BUCKETS - 1; bi++) {
+        if ((seen += stp->st_latency[ci][bi]) >= want)
+            break;
+    }
+    most = nbd_stats_floor(bi + 1) - 1;
+
+    return (most < stp->st_max[ci]) ? most : stp->st_max[ci];
+}
+
+/*
+ * Copy the counters of an export and of its image.
+ */
+static void
+nbd_stats_copy(nbd_export_t *exp, nbd_stats_t *stp, image_stats_t *isp) {
+    const uint64_t *from = (const uint64_t *)&exp->ex_stats;
+    uint64_t *      to   = (uint64_t *)stp;
+    size_t          i;
+
+    for (i = 0; i < sizeof(*stp) / sizeof(uint64_t); i++)
+        to[i] = __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+    (void)image_stats(exp->ex_pctx, isp);
+}
+
+/*
+ * Write a line of statistics to a control connection, or log it if there
+ * is none.
+ */
+static int
+nbd_stats_line(nbd_context_t *ncp, nbd_conn_t *cnp, char *line, int len) {
+    if (len >= NBD_CTL_LINE) {
+        len           = NBD_CTL_LINE - 1;
+        line[len - 1] = '\n';
+    }
+    if (!cnp) {
+        logmsg(ncp, 0, "[%s] %s", ncp->svc_progname, line);
+        return 0;
+    }
+
+    return nbd_ctl_write(cnp, line, len);
+}
+
+/*
+ * Write the statistics of an export, one line for each command and one
+ * each for reads, its write-back cache and its image.  Latencies are in
+ * microseconds.
+ */
+static int
+nbd_stats_write(nbd_context_t *ncp, const char *name, const nbd_stats_t *stp,
+                const image_stats_t *isp, nbd_conn_t *cnp) {
+    char         line[NBD_CTL_LINE];
+    char         walks[IMAGE_STATS_WALKS * 24];
+    uint32_t     ci;
+    unsigned int wi;
+    int          len, wlen;
+    int          error = 0;
+
+    for (ci = 0; !error && (ci < NBD_STATS_COMMANDS); ci++) {
+        if (!nbd_stats_names[ci])
+            continue;
+        len   = snprintf(line, sizeof(line),
+                       "%s %s ops=%" PRIu64 " bytes=%" PRIu64
+                       " errors=%" PRIu64 " p50=%" PRIu64 " p90=%" PRIu64
+                       " p99=%" PRIu64 " p999=%" PRIu64 " max=%" PRIu64 "\n",
+                       name, nbd_stats_names[ci], stp->st_ops[ci],
+                       stp->st_bytes[ci], stp->st_errors[ci],
+                       nbd_stats_quantile(stp, ci, 500),
+                       nbd_stats_quantile(stp, ci, 900),
+                       nbd_stats_quantile(stp, ci, 990),
+                       nbd_stats_quantile(stp, ci, 999), stp->st_max[ci]);
+        error = nbd_stats_line(ncp, cnp, line, len);
+    }
+    if (!error) {
+        len   = snprintf(line, sizeof(line),
+                       "%s reads batched=%" PRIu64 " direct=%" PRIu64 "\n",
+                       name, stp->st_batched, stp->st_direct);
+        error = nbd_stats_line(ncp, cnp, line, len);
+    }
+    if (!error) {
+        len   = snprintf(line, sizeof(line),
+                       "%s writeback hits=%" PRIu64 " merged=%" PRIu64
+                       " blocks=%" PRIu64 " runs=%" PRIu64 "\n",
+                       name, stp->st_wbhits, stp->st_wbmerged,
+                       stp->st_wbblocks, stp->st_wbruns);
+        error = nbd_stats_line(ncp, cnp, line, len);
+    }
+    if (!error) {
+        for (wlen = 0, wi = 0; wi < IMAGE_STATS_WALKS; wi++)
+            wlen += snprintf(&walks[wlen], sizeof(walks) - wlen,
+                             "%s%" PRIu64, (wi) ? "," : "", isp->is_walks[wi]);
+        len   = snprintf(line, sizeof(line),
+                       "%s image imageblocks=%" PRIu64 " cfblocks=%" PRIu64
+                       " unusedblocks=%" PRIu64 " seeks=%" PRIu64
+                       " seekhits=%" PRIu64 " atoms=%" PRIu64 " walks=%s\n",
+                       name, isp->is_imageblocks, isp->is_cfblocks,
+                       isp->is_unusedblocks, isp->is_seeks, isp->is_seekhits,
+                       isp->is_atoms, walks);
+        error = nbd_stats_line(ncp, cnp, line, len);
+    }
+
+    return error;
+}
+
+/*
+ * Report the statistics of the exports, or of the one named, on a control
+ * connection, or to the log if there is none.  The list may change while
+ * we write, so the counters of each export are copied under the lock.
+ */
+int
+nbd_stats_report(nbd_pool_t *np, const nbd_export_t *named, nbd_conn_t *cnp) {
+    char           ename[NBD_CTL_LINE];
+    nbd_stats_t *  stp;
+    image_stats_t  is;
+    nbd_export_t * exp;
+    nbd_context_t *ncp;
+    int            index, i;
+    int            error = 0;
+
+    if (!(stp = (nbd_stats_t *)malloc(sizeof(*stp))))
+        return ENOMEM;
+    for (index = 0; !error; index++) {
+        pthread_mutex_lock(&np->np_lock);
+        for (exp = np->np_exports, i = 0; exp; exp = exp->ex_next) {
+            if (exp->ex_removed || (named && (exp != named)) ||
+                (i++ != index))
+                continue;
+            ncp = exp->ex_ncp;
+            snprintf(ename, sizeof(ename), "%s",
+                     (ncp->nbd_dev)      ? ncp->nbd_dev
+                     : (ncp->svc_export) ? ncp->svc_export
+                                         : "-");
+            nbd_stats_copy(exp, stp, &is);
+            break;
+        }
+        pthread_mutex_unlock(&np->np_lock);
+        if (!exp)
+            break;
+        error = nbd_stats_write(np->np_ncp, ename, stp, &is, cnp);
+    }
+    free(stp);
+
+    return error;
+}
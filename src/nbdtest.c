@@ -0,0 +1,987 @@
+/*
+ * nbdtest.c - Exercise an imagemount network export.
+ */
+/*
+ * Copyright (c) 2010, Ideal World, Inc.  All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ */
+#ifdef HAVE_CONFIG_H
+#    include "config.h"
+#endif /* HAVE_CONFIG_H */
+#include "imagemount.h"
+#include <arpa/inet.h>
+#include <endian.h>
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/*
+ * The part of the export that the tests write, the largest number of
+ * requests sent before any reply is read, and the largest random write.
+ */
+#define NT_REGION      (4 * 1024 * 1024)
+#define NT_MAX_PENDING 128
+#define NT_MAX_WRITE   (64 * 1024)
+
+/*
+ * A connection to the export.
+ */
+typedef struct nbdtest {
+    int      nt_fh;         /* Socket */
+    int      nt_structured; /* Structured replies negotiated */
+    uint32_t nt_context;    /* base:allocation context id */
+    uint16_t nt_flags;      /* Transmission flags */
+    uint64_t nt_size;       /* Export size */
+    uint32_t nt_minblock;   /* Minimum block size */
+    uint32_t nt_prefblock;  /* Preferred block size */
+    uint64_t nt_handle;     /* Handle of the next batch */
+} nbdtest_t;
+
+/*
+ * A request and what came back for it.
+ */
+typedef struct nt_request {
+    uint32_t r_type;    /* Command and flags */
+    uint64_t r_offset;  /* Offset of the request */
+    uint32_t r_length;  /* Length of the request */
+    char *   r_data;    /* Data to write, or room for what is read */
+    uint32_t r_error;   /* Error replied */
+    uint32_t r_count;   /* Bytes of r_data received */
+    int      r_done;    /* Final reply seen */
+    uint32_t r_ndesc;   /* Block status descriptors received */
+
+    /*
+     * Length and flags of each descriptor.
+     */
+    uint32_t r_desc[2 * NBD_MAX_EXTENTS];
+} nt_request_t;
+
+static const char *progname;
+static int         verbose = 0;
+
+/*
+ * Report a failed check.
+ */
+static int
+nt_fail(const char *check, const char *what, int error) {
+    fprintf(stderr, "%s: %s: %s%s%s\n", progname, check, what,
+            (error) ? ": " : "", (error) ? strerror(error) : "");
+    return (error) ? error : EIO;
+}
+
+static int
+nt_read_full(int fh, void *buf, size_t length) {
+    ssize_t n;
+    char *  cp = (char *)buf;
+
+    while (length) {
+        if ((n = read(fh, cp, length)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return errno;
+        }
+        if (n == 0)
+            return ECONNRESET;
+        cp += n;
+        length -= n;
+    }
+    return 0;
+}
+
+static int
+nt_write_full(int fh, const void *buf, size_t length) {
+    ssize_t     n;
+    const char *cp = (const char *)buf;
+
+    while (length) {
+        if ((n = write(fh, cp, length)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return errno;
+        }
+        cp += n;
+        length -= n;
+    }
+    return 0;
+}
+
+/*
+ * Connect to a unix socket path or to host:port.
+ */
+static int
+nt_connect(const char *address, int *fhp) {
+    int fh    = -1;
+    int error = 0;
+
+    if (strchr(address, '/')) {
+        struct sockaddr_un sun;
+
+        memset(&sun, 0, sizeof(sun));
+        sun.sun_family = AF_UNIX;
+        if (strlen(address) >= sizeof(sun.sun_path)) {
+            error = ENAMETOOLONG;
+        } else if ((fh = socket(PF_UNIX, SOCK_STREAM, 0)) < 0) {
+            error = errno;
+        } else {
+            strcpy(sun.sun_path, address);
+            if (connect(fh, (struct sockaddr *)&sun, sizeof(sun)))
+                error = errno;
+        }
+    } else {
+        char *          host = strdup(address);
+        char *          port;
+        struct addrinfo hints, *res = (struct addrinfo *)NULL, *ai;
+        int             gerror;
+
+        if (!host || !(port = strrchr(host, ':'))) {
+            error = (host) ? EINVAL : ENOMEM;
+        } else {
+            *port++ = '\0';
+            memset(&hints, 0, sizeof(hints));
+            hints.ai_family   = AF_UNSPEC;
+            hints.ai_socktype = SOCK_STREAM;
+            if ((gerror = getaddrinfo(host, port, &hints, &res))) {
+                error = (gerror == EAI_SYSTEM) ? errno : EHOSTUNREACH;
+            } else {
+                error = ECONNREFUSED;
+                for (ai = res; ai && error; ai = ai->ai_next) {
+                    if ((fh = socket(ai->ai_family, ai->ai_socktype,
+                                     ai->ai_protocol)) < 0) {
+                        error = errno;
+                    } else if (connect(fh, ai->ai_addr, ai->ai_addrlen)) {
+                        error = errno;
+                        close(fh);
+                        fh = -1;
+                    } else {
+                        error = 0;
+                    }
+                }
+                freeaddrinfo(res);
+            }
+        }
+        free(host);
+    }
+    if (error && (fh >= 0))
+        close(fh);
+    else if (!error)
+        *fhp = fh;
+
+    return error;
+}
+
+/*
+ * Send an option.
+ */
+static int
+nt_option(nbdtest_t *ntp, uint32_t option, const void *data,
+          uint32_t length) {
+    uint64_t magic = htobe64(NBD_OPTS_MAGIC);
+    uint32_t value;
+    int      error;
+
+    if (!(error = nt_write_full(ntp->nt_fh, &magic, sizeof(magic)))) {
+        value = htonl(option);
+        if (!(error = nt_write_full(ntp->nt_fh, &value, sizeof(value)))) {
+            value = htonl(length);
+            if (!(error = nt_write_full(ntp->nt_fh, &value, sizeof(value))))
+                error = nt_write_full(ntp->nt_fh, data, length);
+        }
+    }
+    return error;
+}
+
+/*
+ * Receive a reply to an option into data, which has room for NBD_MAX_OPTION
+ * bytes.
+ */
+static int
+nt_option_reply(nbdtest_t *ntp, uint32_t option, uint32_t *typep, char *data,
+                uint32_t *lengthp) {
+    struct {
+        uint64_t magic;
+        uint32_t option;
+        uint32_t type;
+        uint32_t length;
+    } __attribute__((packed)) reply;
+    int error;
+
+    if (!(error = nt_read_full(ntp->nt_fh, &reply, sizeof(reply)))) {
+        *typep   = ntohl(reply.type);
+        *lengthp = ntohl(reply.length);
+        if ((be64toh(reply.magic) != NBD_REP_MAGIC) ||
+            (ntohl(reply.option) != option) || (*lengthp > NBD_MAX_OPTION))
+            error = EPROTO;
+        else
+            error = nt_read_full(ntp->nt_fh, data, *lengthp);
+    }
+    return error;
+}
+
+/*
+ * Negotiate the fixed newstyle handshake.  A structured connection asks
+ * for structured replies and base:allocation, then NBD_OPT_GO with the
+ * block size; any other uses NBD_OPT_EXPORT_NAME.
+ */
+static int
+nt_handshake(nbdtest_t *ntp, const char *export, int structured) {
+    static const char allocation[] = NBD_META_ALLOCATION;
+    const char *      check        = "handshake";
+    char              data[NBD_MAX_OPTION];
+    uint32_t          namelen = strlen(export);
+    uint32_t          type, length, value;
+    uint64_t          magic[2];
+    uint16_t          sflags, itype;
+    int               error;
+
+    if ((error = nt_read_full(ntp->nt_fh, magic, sizeof(magic))) ||
+        (error = nt_read_full(ntp->nt_fh, &sflags, sizeof(sflags))))
+        return nt_fail(check, "greeting", error);
+    sflags = ntohs(sflags);
+    if ((be64toh(magic[0]) != NBD_INIT_MAGIC) ||
+        (be64toh(magic[1]) != NBD_OPTS_MAGIC) ||
+        !(sflags & NBD_FLAG_FIXED_NEWSTYLE) || !(sflags & NBD_FLAG_NO_ZEROES))
+        return nt_fail(check, "not a fixed newstyle server", 0);
+    value = htonl(NBD_FLAG_FIXED_NEWSTYLE | NBD_FLAG_NO_ZEROES);
+    if ((error = nt_write_full(ntp->nt_fh, &value, sizeof(value))))
+        return nt_fail(check, "client flags", error);
+
+    /*
+     * Something the server does not know is refused, not hung up on.
+     */
+    if ((error = nt_option(ntp, 0x7fff, NULL, 0)) ||
+        (error = nt_option_reply(ntp, 0x7fff, &type, data, &length)))
+        return nt_fail(check, "unknown option", error);
+    if (type != NBD_REP_ERR_UNSUP)
+        return nt_fail(check, "unknown option not refused", 0);
+
+    if (!structured) {
+        struct {
+            uint64_t size;
+            uint16_t flags;
+        } __attribute__((packed)) exportinfo;
+
+        if ((error = nt_option(ntp, NBD_OPT_EXPORT_NAME, export, namelen)) ||
+            (error = nt_read_full(ntp->nt_fh, &exportinfo,
+                                  sizeof(exportinfo))))
+            return nt_fail(check, "NBD_OPT_EXPORT_NAME", error);
+        ntp->nt_size  = be64toh(exportinfo.size);
+        ntp->nt_flags = ntohs(exportinfo.flags);
+        return 0;
+    }
+
+    if ((error = nt_option(ntp, NBD_OPT_STRUCTURED_REPLY, NULL, 0)) ||
+        (error = nt_option_reply(ntp, NBD_OPT_STRUCTURED_REPLY, &type, data,
+                                 &length)))
+        return nt_fail(check, "NBD_OPT_STRUCTURED_REPLY", error);
+    if (type != NBD_REP_ACK)
+        return nt_fail(check, "structured replies refused", 0);
+    ntp->nt_structured = 1;
+
+    /*
+     * Export name, one query.
+     */
+    value = htonl(namelen);
+    memcpy(&data[0], &value, sizeof(value));
+    memcpy(&data[4], export, namelen);
+    value = htonl(1);
+    memcpy(&data[4 + namelen], &value, sizeof(value));
+    value = htonl(sizeof(allocation) - 1);
+    memcpy(&data[8 + namelen], &value, sizeof(value));
+    memcpy(&data[12 + namelen], allocation, sizeof(allocation) - 1);
+    if ((error = nt_option(ntp, NBD_OPT_SET_META_CONTEXT, data,
+                           12 + namelen + sizeof(allocation) - 1)))
+        return nt_fail(check, "NBD_OPT_SET_META_CONTEXT", error);
+    do {
+        if ((error = nt_option_reply(ntp, NBD_OPT_SET_META_CONTEXT, &type,
+                                     data, &length)))
+            return nt_fail(check, "NBD_OPT_SET_META_CONTEXT", error);
+        if ((type == NBD_REP_META_CONTEXT) && (length > 4) &&
+            (length - 4 == sizeof(allocation) - 1) &&
+            !memcmp(&data[4], allocation, length - 4)) {
+            memcpy(&value, data, sizeof(value));
+            ntp->nt_context = ntohl(value);
+        }
+    } while (type == NBD_REP_META_CONTEXT);
+    if ((type != NBD_REP_ACK) || !ntp->nt_context)
+        return nt_fail(check, "base:allocation not selected", 0);
+
+    /*
+     * Export name, one information request.
+     */
+    value = htonl(namelen);
+    memcpy(&data[0], &value, sizeof(value));
+    memcpy(&data[4], export, namelen);
+    itype = htons(1);
+    memcpy(&data[4 + namelen], &itype, sizeof(itype));
+    itype = htons(NBD_INFO_BLOCK_SIZE);
+    memcpy(&data[6 + namelen], &itype, sizeof(itype));
+    if ((error = nt_option(ntp, NBD_OPT_GO, data, 8 + namelen)))
+        return nt_fail(check, "NBD_OPT_GO", error);
+    do {
+        if ((error = nt_option_reply(ntp, NBD_OPT_GO, &type, data, &length)))
+            return nt_fail(check, "NBD_OPT_GO", error);
+        if ((type == NBD_REP_INFO) && (length >= 2)) {
+            memcpy(&itype, data, sizeof(itype));
+            if ((ntohs(itype) == NBD_INFO_EXPORT) && (length == 12)) {
+                memcpy(&ntp->nt_size, &data[2], sizeof(ntp->nt_size));
+                memcpy(&ntp->nt_flags, &data[10], sizeof(ntp->nt_flags));
+                ntp->nt_size  = be64toh(ntp->nt_size);
+                ntp->nt_flags = ntohs(ntp->nt_flags);
+            } else if ((ntohs(itype) == NBD_INFO_BLOCK_SIZE) &&
+                       (length == 14)) {
+                memcpy(&value, &data[2], sizeof(value));
+                ntp->nt_minblock = ntohl(value);
+                memcpy(&value, &data[6], sizeof(value));
+                ntp->nt_prefblock = ntohl(value);
+            }
+        }
+    } while (type == NBD_REP_INFO);
+    if (type != NBD_REP_ACK)
+        return nt_fail(check, "NBD_OPT_GO refused", 0);
+    if (!ntp->nt_size || !ntp->nt_minblock || !ntp->nt_prefblock)
+        return nt_fail(check, "no size or block size given", 0);
+
+    return 0;
+}
+
+/*
+ * Receive one reply, simple or a structured chunk, and file it with its
+ * request.
+ */
+static int
+nt_receive(nbdtest_t *ntp, nt_request_t *reqs, uint32_t nreqs) {
+    nt_request_t *rp;
+    uint32_t      magic, value, length;
+    uint64_t      handle, offset;
+    uint16_t      flags, type;
+    char          payload[8];
+    int           error;
+
+    if ((error = nt_read_full(ntp->nt_fh, &magic, sizeof(magic))))
+        return error;
+    if (ntohl(magic) == NBD_REPLY_MAGIC) {
+        struct {
+            uint32_t error;
+            uint64_t handle;
+        } __attribute__((packed)) reply;
+
+        if ((error = nt_read_full(ntp->nt_fh, &reply, sizeof(reply))))
+            return error;
+        handle = be64toh(reply.handle) - ntp->nt_handle;
+        if ((handle >= nreqs) || reqs[handle].r_done)
+            return EPROTO;
+        rp          = &reqs[handle];
+        rp->r_error = ntohl(reply.error);
+        rp->r_done  = 1;
+        /*
+         * Without structured replies a good read is followed by its data.
+         */
+        if (((rp->r_type & NBD_CMD_MASK_COMMAND) == NBD_CMD_READ) &&
+            !rp->r_error) {
+            if (ntp->nt_structured)
+                return EPROTO;
+            if (!(error = nt_read_full(ntp->nt_fh, rp->r_data, rp->r_length)))
+                rp->r_count = rp->r_length;
+        }
+        return error;
+    }
+    if ((ntohl(magic) != NBD_STRUCTURED_REPLY_MAGIC) || !ntp->nt_structured)
+        return EPROTO;
+
+    {
+        struct {
+            uint16_t flags;
+            uint16_t type;
+            uint64_t handle;
+            uint32_t length;
+        } __attribute__((packed)) chunk;
+
+        if ((error = nt_read_full(ntp->nt_fh, &chunk, sizeof(chunk))))
+            return error;
+        flags  = ntohs(chunk.flags);
+        type   = ntohs(chunk.type);
+        length = ntohl(chunk.length);
+        handle = be64toh(chunk.handle) - ntp->nt_handle;
+    }
+    if ((handle >= nreqs) || reqs[handle].r_done)
+        return EPROTO;
+    rp = &reqs[handle];
+    switch (type) {
+    case NBD_REPLY_TYPE_OFFSET_DATA:
+        if ((length < sizeof(offset)) ||
+            (error = nt_read_full(ntp->nt_fh, &offset, sizeof(offset))))
+            return (error) ? error : EPROTO;
+        offset = be64toh(offset);
+        length -= sizeof(offset);
+        if ((offset < rp->r_offset) ||
+            (offset - rp->r_offset + length > rp->r_length))
+            return EPROTO;
+        if ((error = nt_read_full(ntp->nt_fh,
+                                  &rp->r_data[offset - rp->r_offset], length)))
+            return error;
+        rp->r_count += length;
+        break;
+    case NBD_REPLY_TYPE_BLOCK_STATUS:
+        if ((length < sizeof(value)) || ((length - sizeof(value)) % 8) ||
+            ((length - sizeof(value)) / 8 > NBD_MAX_EXTENTS - rp->r_ndesc) ||
+            (error = nt_read_full(ntp->nt_fh, &value, sizeof(value))))
+            return (error) ? error : EPROTO;
+        if (ntohl(value) != ntp->nt_context)
+            return EPROTO;
+        length -= sizeof(value);
+        if ((error = nt_read_full(ntp->nt_fh, &rp->r_desc[2 * rp->r_ndesc],
+                                  length)))
+            return error;
+        rp->r_ndesc += length / 8;
+        break;
+    case NBD_REPLY_TYPE_ERROR:
+        if ((length < 6) || (length - 6 > sizeof(payload)) ||
+            (error = nt_read_full(ntp->nt_fh, payload, length)))
+            return (error) ? error : EPROTO;
+        memcpy(&value, payload, sizeof(value));
+        rp->r_error = ntohl(value);
+        break;
+    default:
+        return EPROTO;
+    }
+    if (flags & NBD_REPLY_FLAG_DONE)
+        rp->r_done = 1;
+
+    return 0;
+}
+
+/*
+ * Send a batch of requests without waiting, then collect every reply.
+ * The replies may come back in any order.
+ */
+static int
+nt_run(nbdtest_t *ntp, nt_request_t *reqs, uint32_t nreqs) {
+    struct nbd_request request;
+    uint64_t           handle;
+    uint32_t           ri, ndone;
+    int                error = 0;
+
+    for (ri = 0; !error && (ri < nreqs); ri++) {
+        reqs[ri].r_error = 0;
+        reqs[ri].r_count = 0;
+        reqs[ri].r_ndesc = 0;
+        reqs[ri].r_done  = 0;
+        handle           = htobe64(ntp->nt_handle + ri);
+        request.magic    = htonl(NBD_REQUEST_MAGIC);
+        request.type     = htonl(reqs[ri].r_type);
+        memcpy(request.handle, &handle, sizeof(handle));
+        request.from = htobe64(reqs[ri].r_offset);
+        request.len  = htonl(reqs[ri].r_length);
+        if (!(error = nt_write_full(ntp->nt_fh, &request, sizeof(request))) &&
+            ((reqs[ri].r_type & NBD_CMD_MASK_COMMAND) == NBD_CMD_WRITE))
+            error = nt_write_full(ntp->nt_fh, reqs[ri].r_data,
+                                  reqs[ri].r_length);
+    }
+    for (ndone = 0; !error && (ndone < nreqs);) {
+        if (!(error = nt_receive(ntp, reqs, nreqs))) {
+            for (ndone = ri = 0; ri < nreqs; ri++)
+                ndone += reqs[ri].r_done;
+        }
+    }
+    ntp->nt_handle += nreqs;
+
+    return error;
+}
+
+/*
+ * Tell the server that we are done.
+ */
+static void
+nt_disconnect(nbdtest_t *ntp) {
+    struct nbd_request request;
+
+    memset(&request, 0, sizeof(request));
+    request.magic = htonl(NBD_REQUEST_MAGIC);
+    request.type  = htonl(NBD_CMD_DISC);
+    (void)nt_write_full(ntp->nt_fh, &request, sizeof(request));
+}
+
+/*
+ * Fill in a request.
+ */
+static void
+nt_request(nt_request_t *rp, uint32_t type, uint64_t offset, uint32_t length,
+           char *data) {
+    memset(rp, 0, sizeof(*rp));
+    rp->r_type   = type;
+    rp->r_offset = offset;
+    rp->r_length = length;
+    rp->r_data   = data;
+}
+
+/*
+ * Read the export at offset in pieces, all in flight at once, and compare
+ * it with what it should hold.
+ */
+static int
+nt_compare(nbdtest_t *ntp, const char *check, nt_request_t *reqs,
+           uint64_t offset, uint32_t length, const char *expect) {
+    char *   buf;
+    uint32_t piece = length / 16;
+    uint32_t ri, nreqs;
+    int      error;
+
+    if (!(buf = malloc(length)))
+        return nt_fail(check, "no memory", ENOMEM);
+    for (nreqs = 0; nreqs * piece < length; nreqs++)
+        nt_request(&reqs[nreqs], NBD_CMD_READ, offset + nreqs * piece,
+                   (length - nreqs * piece < piece) ? length - nreqs * piece
+                                                    : piece,
+                   &buf[nreqs * piece]);
+    if ((error = nt_run(ntp, reqs, nreqs))) {
+        error = nt_fail(check, "read", error);
+    } else {
+        for (ri = 0; !error && (ri < nreqs); ri++) {
+            if (reqs[ri].r_error || (reqs[ri].r_count != reqs[ri].r_length))
+                error = nt_fail(check, "read failed", reqs[ri].r_error);
+        }
+        for (ri = 0; !error && (ri < length); ri++) {
+            if (buf[ri] != expect[ri]) {
+                fprintf(stderr, "%s: %s: 0x%" PRIx64 " is 0x%02x not 0x%02x\n",
+                        progname, check, offset + ri, buf[ri] & 0xff,
+                        expect[ri] & 0xff);
+                error = nt_fail(check, "data read back differs", 0);
+            }
+        }
+    }
+    free(buf);
+
+    return error;
+}
+
+/*
+ * Check that every request of a batch succeeded.
+ */
+static int
+nt_all_ok(const char *check, nt_request_t *reqs, uint32_t nreqs) {
+    uint32_t ri;
+
+    for (ri = 0; ri < nreqs; ri++) {
+        if (reqs[ri].r_error)
+            return nt_fail(check, "request failed", reqs[ri].r_error);
+    }
+    return 0;
+}
+
+/*
+ * Overlapping writes of odd sizes and alignments, all in flight before any
+ * reply is read, then reads of the same range in the same batch.  Each
+ * must see the writes sent before it.
+ */
+static int
+check_pipeline(nbdtest_t *ntp, nt_request_t *reqs, char *shadow) {
+    const char *check   = "pipelined writes";
+    uint32_t    span    = NT_REGION / 4;
+    uint32_t    nwrites = NT_MAX_PENDING / 2;
+    char *      wbuf, *rbuf;
+    uint32_t    ri, length;
+    uint64_t    offset;
+    int         error;
+
+    if ((error = nt_compare(ntp, "initial read", reqs, 0, NT_REGION, shadow)))
+        return error;
+    if (!(wbuf = malloc(nwrites * NT_MAX_WRITE)) || !(rbuf = malloc(span))) {
+        free(wbuf);
+        return nt_fail(check, "no memory", ENOMEM);
+    }
+    for (ri = 0; ri < nwrites; ri++) {
+        offset = random() % (span - NT_MAX_WRITE);
+        length = 1 + random() % NT_MAX_WRITE;
+        /*
+         * Every other write is whole blocks, the rest are ragged.
+         */
+        if (ri & 1) {
+            offset &= ~(uint64_t)(ntp->nt_prefblock - 1);
+            length = (length + ntp->nt_prefblock - 1) &
+                     ~(ntp->nt_prefblock - 1);
+        }
+        memset(&wbuf[ri * NT_MAX_WRITE], 'A' + (ri % 26), length);
+        memcpy(&shadow[offset], &wbuf[ri * NT_MAX_WRITE], length);
+        nt_request(&reqs[ri], NBD_CMD_WRITE, offset, length,
+                   &wbuf[ri * NT_MAX_WRITE]);
+    }
+    length = span / (NT_MAX_PENDING - nwrites);
+    for (; ri < NT_MAX_PENDING; ri++)
+        nt_request(&reqs[ri], NBD_CMD_READ, (ri - nwrites) * length, length,
+                   &rbuf[(ri - nwrites) * length]);
+    if ((error = nt_run(ntp, reqs, NT_MAX_PENDING))) {
+        error = nt_fail(check, "requests", error);
+    } else if (!(error = nt_all_ok(check, reqs, NT_MAX_PENDING))) {
+        if (memcmp(rbuf, shadow, span))
+            error = nt_fail(check, "reads did not see earlier writes", 0);
+        else
+            error = nt_compare(ntp, check, reqs, 0, span, shadow);
+    }
+    free(rbuf);
+    free(wbuf);
+
+    return error;
+}
+
+/*
+ * A write with FUA and a flush behind it.
+ */
+static int
+check_flush(nbdtest_t *ntp, nt_request_t *reqs, char *shadow) {
+    const char *check  = "flush and FUA";
+    uint64_t    offset = NT_REGION / 4;
+    uint32_t    length = 3 * ntp->nt_prefblock + 17;
+    int         error;
+
+    if (!(ntp->nt_flags & NBD_FLAG_SEND_FLUSH) ||
+        !(ntp->nt_flags & NBD_FLAG_SEND_FUA))
+        return nt_fail(check, "not offered", 0);
+    memset(&shadow[offset], 'F', length);
+    nt_request(&reqs[0], NBD_CMD_WRITE | NBD_CMD_FLAG_FUA, offset, length,
+               &shadow[offset]);
+    nt_request(&reqs[1], NBD_CMD_FLUSH, 0, 0, (char *)NULL);
+    if ((error = nt_run(ntp, reqs, 2)))
+        return nt_fail(check, "requests", error);
+    if ((error = nt_all_ok(check, reqs, 2)))
+        return error;
+    nt_request(&reqs[0], NBD_CMD_FLUSH, 0, 0, (char *)NULL);
+    if ((error = nt_run(ntp, reqs, 1)) ||
+        (error = nt_all_ok(check, reqs, 1)))
+        return nt_fail(check, "second flush", error);
+
+    return nt_compare(ntp, check, reqs, offset, length, &shadow[offset]);
+}
+
+/*
+ * Trims and writes of zeroes over written data, whole blocks and ragged,
+ * read back as zeroes.  A trim within a block is free to do nothing, and
+ * imagemount does just that.
+ */
+static int
+check_zeroes(nbdtest_t *ntp, nt_request_t *reqs, char *shadow) {
+    const char *check  = "trim and write zeroes";
+    uint64_t    offset = NT_REGION / 2;
+    uint32_t    length = NT_REGION / 4;
+    uint32_t    bsize  = ntp->nt_prefblock;
+    int         error;
+
+    if (!(ntp->nt_flags & NBD_FLAG_SEND_TRIM) ||
+        !(ntp->nt_flags & NBD_FLAG_SEND_WRITE_ZEROES))
+        return nt_fail(check, "not offered", 0);
+    memset(&shadow[offset], 'Z', length);
+    nt_request(&reqs[0], NBD_CMD_WRITE, offset, length, &shadow[offset]);
+    if ((error = nt_run(ntp, reqs, 1)) || (error = nt_all_ok(check, reqs, 1)))
+        return nt_fail(check, "write", error);
+
+    nt_request(&reqs[0], NBD_CMD_WRITE_ZEROES, offset, 16 * bsize,
+               (char *)NULL);
+    nt_request(&reqs[1], NBD_CMD_WRITE_ZEROES | NBD_CMD_FLAG_FUA,
+               offset + 20 * bsize + 100, 2 * bsize + 1, (char *)NULL);
+    nt_request(&reqs[2], NBD_CMD_TRIM, offset + 32 * bsize, 16 * bsize,
+               (char *)NULL);
+    nt_request(&reqs[3], NBD_CMD_TRIM, offset + 50 * bsize + 7, 300,
+               (char *)NULL);
+    memset(&shadow[offset], 0, 16 * bsize);
+    memset(&shadow[offset + 20 * bsize + 100], 0, 2 * bsize + 1);
+    memset(&shadow[offset + 32 * bsize], 0, 16 * bsize);
+    if ((error = nt_run(ntp, reqs, 4)))
+        return nt_fail(check, "requests", error);
+    if ((error = nt_all_ok(check, reqs, 4)))
+        return error;
+
+    return nt_compare(ntp, check, reqs, offset, length, &shadow[offset]);
+}
+
+/*
+ * Check the descriptors of a block status request: they tile it from its
+ * start, all of it unless there are as many as fit in a reply, and only
+ * claim zeroes where there are zeroes.
+ */
+static int
+nt_extents(const char *check, nt_request_t *rp, const char *shadow) {
+    uint64_t offset = rp->r_offset;
+    uint64_t end    = rp->r_offset + rp->r_length;
+    uint64_t length, zi;
+    uint32_t di, flags;
+
+    if (!rp->r_ndesc)
+        return nt_fail(check, "no descriptors", 0);
+    for (di = 0; di < rp->r_ndesc; di++) {
+        length = ntohl(rp->r_desc[2 * di]);
+        flags  = ntohl(rp->r_desc[2 * di + 1]);
+        if (verbose)
+            printf("  %08" PRIx64 " %08" PRIx64 " %x\n", offset, length,
+                   flags);
+        if (!length || (offset + length > end))
+            return nt_fail(check, "descriptor out of range", 0);
+        if (flags & NBD_STATE_ZERO) {
+            for (zi = offset; zi < offset + length; zi++) {
+                if (shadow[zi])
+                    return nt_fail(check, "data reported as zeroes", 0);
+            }
+        }
+        offset += length;
+    }
+    if ((offset != end) && !(rp->r_type & NBD_CMD_FLAG_REQ_ONE) &&
+        (rp->r_ndesc < NBD_MAX_EXTENTS))
+        return nt_fail(check, "descriptors stop short", 0);
+
+    return 0;
+}
+
+/*
+ * Block status over the region, and with NBD_CMD_FLAG_REQ_ONE over part
+ * of a block, which gets one descriptor.  Images that cannot tell where
+ * their zeroes are may call everything data.
+ */
+static int
+check_status(nbdtest_t *ntp, nt_request_t *reqs, const char *shadow) {
+    const char *check = "block status";
+    int         error;
+
+    nt_request(&reqs[0], NBD_CMD_BLOCK_STATUS, 0, NT_REGION, (char *)NULL);
+    nt_request(&reqs[1], NBD_CMD_BLOCK_STATUS | NBD_CMD_FLAG_REQ_ONE,
+               NT_REGION / 2 + 100, 5000, (char *)NULL);
+    if ((error = nt_run(ntp, reqs, 2)))
+        return nt_fail(check, "requests", error);
+    if ((error = nt_all_ok(check, reqs, 2)) ||
+        (error = nt_extents(check, &reqs[0], shadow)) ||
+        (error = nt_extents(check, &reqs[1], shadow)))
+        return error;
+    if (reqs[1].r_ndesc != 1)
+        return nt_fail(check, "more than one descriptor", 0);
+
+    /*
+     * Asking without a length is refused.
+     */
+    nt_request(&reqs[0], NBD_CMD_BLOCK_STATUS, 0, 0, (char *)NULL);
+    if ((error = nt_run(ntp, reqs, 1)))
+        return nt_fail(check, "empty request", error);
+    if (!reqs[0].r_error)
+        return nt_fail(check, "empty request accepted", 0);
+
+    return 0;
+}
+
+/*
+ * A request past the end of the export is refused, and the connection
+ * carries on.
+ */
+static int
+check_bounds(nbdtest_t *ntp, nt_request_t *reqs, char *shadow) {
+    const char *check = "out of range";
+    char        buf[512];
+    int         error;
+
+    nt_request(&reqs[0], NBD_CMD_READ, ntp->nt_size - 256, sizeof(buf), buf);
+    nt_request(&reqs[1], NBD_CMD_WRITE, ntp->nt_size, sizeof(buf), buf);
+    if ((error = nt_run(ntp, reqs, 2)))
+        return nt_fail(check, "requests", error);
+    if (!reqs[0].r_error || !reqs[1].r_error)
+        return nt_fail(check, "request accepted", 0);
+
+    return nt_compare(ntp, check, reqs, 0, 64 * 1024, shadow);
+}
+
+/*
+ * What one connection wrote and flushed is seen by another, here over
+ * NBD_OPT_EXPORT_NAME and simple replies.
+ */
+static int
+check_second(const char *address, const char *export, nt_request_t *reqs,
+             const char *shadow) {
+    const char *check = "second connection";
+    nbdtest_t   nt;
+    int         error;
+
+    memset(&nt, 0, sizeof(nt));
+    nt.nt_handle = 1;
+    if ((error = nt_connect(address, &nt.nt_fh)))
+        return nt_fail(check, address, error);
+    if (!(error = nt_handshake(&nt, export, 0)) &&
+        !(error = nt_compare(&nt, check, reqs, 0, NT_REGION, shadow)))
+        nt_disconnect(&nt);
+    close(nt.nt_fh);
+
+    return error;
+}
+
+/*
+ * Copy the whole export to a file, for comparing with what another export
+ * or tool makes of the same data.
+ */
+static int
+nt_copy(nbdtest_t *ntp, nt_request_t *reqs, char *buf, const char *path) {
+    const char *check = "copy";
+    FILE *      fp;
+    uint64_t    offset;
+    uint32_t    length;
+    int         error = 0;
+
+    if (!(fp = fopen(path, "w")))
+        return nt_fail(check, path, errno);
+    for (offset = 0; !error && (offset < ntp->nt_size); offset += length) {
+        length = (ntp->nt_size - offset < NT_REGION)
+                     ? (uint32_t)(ntp->nt_size - offset)
+                     : NT_REGION;
+        nt_request(&reqs[0], NBD_CMD_READ, offset, length, buf);
+        if ((error = nt_run(ntp, reqs, 1)) || reqs[0].r_error)
+            error = nt_fail(check, "read",
+                            (error) ? error : (int)reqs[0].r_error);
+        else if (fwrite(buf, 1, length, fp) != length)
+            error = nt_fail(check, path, errno);
+    }
+    if (fclose(fp) && !error)
+        error = nt_fail(check, path, errno);
+
+    return error;
+}
+
+/*
+ * Write a file to the start of the export, and flush it, to serve data
+ * the checks can tell apart from random.
+ */
+static int
+nt_load(nbdtest_t *ntp, nt_request_t *reqs, char *buf, const char *path) {
+    const char *check  = "load";
+    uint64_t    offset = 0;
+    FILE *      fp;
+    uint32_t    length;
+    int         error = 0;
+
+    if (!(fp = fopen(path, "r")))
+        return nt_fail(check, path, errno);
+    while (!error && (offset < ntp->nt_size)) {
+        length = (ntp->nt_size - offset < NT_REGION)
+                     ? (uint32_t)(ntp->nt_size - offset)
+                     : NT_REGION;
+        if (!(length = fread(buf, 1, length, fp)))
+            break;
+        nt_request(&reqs[0], NBD_CMD_WRITE, offset, length, buf);
+        if ((error = nt_run(ntp, reqs, 1)) || reqs[0].r_error)
+            error = nt_fail(check, "write",
+                            (error) ? error : (int)reqs[0].r_error);
+        offset += length;
+    }
+    if (!error && ferror(fp))
+        error = nt_fail(check, path, EIO);
+    (void)fclose(fp);
+    if (!error) {
+        nt_request(&reqs[0], NBD_CMD_FLUSH, 0, 0, (char *)NULL);
+        if ((error = nt_run(ntp, reqs, 1)) || reqs[0].r_error)
+            error = nt_fail(check, "flush",
+                            (error) ? error : (int)reqs[0].r_error);
+    }
+
+    return error;
+}
+
+int
+main(int argc, char *argv[]) {
+    nbdtest_t     nt;
+    nt_request_t *reqs   = (nt_request_t *)NULL;
+    char *        shadow = (char *)NULL;
+    const char *  export = "";
+    const char *  copy   = (const char *)NULL;
+    const char *  load   = (const char *)NULL;
+    unsigned int  seed   = 1;
+    int           option;
+    int           error = 0;
+
+    progname = argv[0];
+    while ((option = getopt(argc, argv, "c:e:s:vw:")) != -1) {
+        switch (option) {
+        case 'c':
+            copy = optarg;
+            break;
+        case 'e':
+            export = optarg;
+            break;
+        case 's':
+            sscanf(optarg, "%u", &seed);
+            break;
+        case 'v':
+            verbose++;
+            break;
+        case 'w':
+            load = optarg;
+            break;
+        default:
+            error = 1;
+            break;
+        }
+    }
+    if (error || (optind != argc - 1)) {
+        fprintf(stderr,
+                "%s: usage %s [-c file | -w file] [-e export] [-s seed] [-v] "
+                "address\n",
+                progname, progname);
+        return 1;
+    }
+    srandom(seed);
+
+    memset(&nt, 0, sizeof(nt));
+    nt.nt_handle = 1;
+    if (!(reqs = calloc(NT_MAX_PENDING, sizeof(*reqs))) ||
+        !(shadow = calloc(1, NT_REGION))) {
+        error = nt_fail("setup", "no memory", ENOMEM);
+    } else if ((error = nt_connect(argv[optind], &nt.nt_fh))) {
+        error = nt_fail("connect", argv[optind], error);
+    } else {
+        if (!(error = nt_handshake(&nt, export, 1))) {
+            printf("handshake: ok, %" PRIu64 " bytes, blocks %u/%u\n",
+                   nt.nt_size, nt.nt_minblock, nt.nt_prefblock);
+            if (nt.nt_size < NT_REGION)
+                error = nt_fail("handshake", "export is too small", 0);
+        }
+        if (copy) {
+            if (!error)
+                error = nt_copy(&nt, reqs, shadow, copy);
+        } else if (load) {
+            if (!error)
+                error = nt_load(&nt, reqs, shadow, load);
+        } else {
+            /*
+             * The region starts out as whatever the export holds.
+             */
+            if (!error) {
+                nt_request(&reqs[0], NBD_CMD_READ, 0, NT_REGION, shadow);
+                if ((error = nt_run(&nt, reqs, 1)) || reqs[0].r_error)
+                    error = nt_fail("initial read", "read",
+                                    (error) ? error : (int)reqs[0].r_error);
+            }
+            if (!error && !(error = check_pipeline(&nt, reqs, shadow)))
+                printf("pipelined writes: ok\n");
+            if (!error && !(error = check_flush(&nt, reqs, shadow)))
+                printf("flush and FUA: ok\n");
+            if (!error && !(error = check_zeroes(&nt, reqs, shadow)))
+                printf("trim and write zeroes: ok\n");
+            if (!error && !(error = check_status(&nt, reqs, shadow)))
+                printf("block status: ok\n");
+            if (!error && !(error = check_bounds(&nt, reqs, shadow)))
+                printf("out of range: ok\n");
+            if (!error && !(error = check_second(argv[optind], export, reqs,
+                                                 shadow)))
+                printf("second connection: ok\n");
+        }
+        if (!error)
+            nt_disconnect(&nt);
+        close(nt.nt_fh);
+    }
+    free(shadow);
+    free(reqs);
+
+    return (error) ? 1 : 0;
+}
@@ -0,0 +1,438 @@
+/*
+ * nbdwbcache.c - Write-back cache of imagemount exports.
+ */
+/*
+ * Copyright (c) 2010, Ideal World, Inc.  All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ */
+#ifdef HAVE_CONFIG_H
+#    include "config.h"
+#endif /* HAVE_CONFIG_H */
+#include "imagemount.h"
+#include <errno.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Write-back caching.  Writes to an export with a cache go to memory and
+ * are written to the image later, by a thread of their own or by a flush.
+ * Jobs that touch the same blocks run in order, so while a job reads
+ * blocks, the cache only loses them to writing back, which leaves the
+ * image with the same contents.
+ */
+
+/*
+ * Hash chain of a block.
+ */
+static inline uint64_t
+nbd_wb_hash(const nbd_wbcache_t *wbp, uint64_t blockno) {
+    return ((blockno * 0x9e3779b97f4a7c15ULL) >> 32) & wbp->wb_hashmask;
+}
+
+/*
+ * Find a block in the cache.  Called with the cache lock held.
+ */
+static nbd_wbentry_t *
+nbd_wb_find(const nbd_wbcache_t *wbp, uint64_t blockno) {
+    nbd_wbentry_t *wep;
+
+    for (wep = wbp->wb_hash[nbd_wb_hash(wbp, blockno)];
+         wep && (wep->we_block != blockno); wep = wep->we_next)
+        ;
+
+    return wep;
+}
+
+/*
+ * Take a block out of the cache.  Called with the cache lock held.
+ */
+static void
+nbd_wb_remove(nbd_wbcache_t *wbp, uint64_t blockno) {
+    nbd_wbentry_t **wepp, *wep;
+
+    for (wepp = &wbp->wb_hash[nbd_wb_hash(wbp, blockno)];
+         (wep = *wepp) && (wep->we_block != blockno); wepp = &wep->we_next)
+        ;
+    if (wep) {
+        *wepp        = wep->we_next;
+        wep->we_next = wbp->wb_free;
+        wbp->wb_free = wep;
+        if (--wbp->wb_count == 0)
+            wbp->wb_since = 0;
+    }
+}
+
+/*
+ * Free a cache.  Its blocks are lost.
+ */
+void
+nbd_wb_free(nbd_wbcache_t *wbp) {
+    if (wbp->wb_pool) {
+        pthread_mutex_lock(&wbp->wb_pool->np_lock);
+        wbp->wb_pool->np_memory -= wbp->wb_memory;
+        pthread_mutex_unlock(&wbp->wb_pool->np_lock);
+    }
+    free(wbp->wb_run);
+    free(wbp->wb_seqs);
+    free(wbp->wb_blocks);
+    free(wbp->wb_hash);
+    free(wbp->wb_data);
+    free(wbp->wb_entries);
+    pthread_cond_destroy(&wbp->wb_idle);
+    pthread_mutex_destroy(&wbp->wb_lock);
+    free(wbp);
+}
+
+/*
+ * Give an export a write-back cache of megabytes, or of one run if that is
+ * more.  The cache and its run count against the pool's memory cap, and
+ * the cache is cut to what is left under the cap if that is less.
+ */
+int
+nbd_wb_new(nbd_pool_t *np, nbd_export_t *exp, int megabytes) {
+    nbd_context_t *ncp   = exp->ex_ncp;
+    uint64_t       bsize = ncp->svc_blocksize;
+    nbd_wbcache_t *wbp;
+    uint64_t       nhash, ei, room;
+
+    if (!(wbp = (nbd_wbcache_t *)calloc(1, sizeof(*wbp))))
+        return ENOMEM;
+    pthread_mutex_init(&wbp->wb_lock, NULL);
+    pthread_cond_init(&wbp->wb_idle, NULL);
+    wbp->wb_bsize    = bsize;
+    wbp->wb_nrun     = (NBD_WB_BATCH > bsize) ? NBD_WB_BATCH / bsize : 1;
+    wbp->wb_nentries = ((uint64_t)megabytes << 20) / bsize;
+    pthread_mutex_lock(&np->np_lock);
+    room = (np->np_memory < np->np_memcap)
+               ? (np->np_memcap - np->np_memory) / bsize
+               : 0;
+    if (wbp->wb_nentries + wbp->wb_nrun > room) {
+        wbp->wb_nentries = (room > wbp->wb_nrun) ? room - wbp->wb_nrun : 0;
+        logmsg(ncp, 0, "[%s] write-back cache cut to %" PRIu64 " MB by -M\n",
+               ncp->svc_progname, (wbp->wb_nentries * bsize) >> 20);
+    }
+    if (wbp->wb_nentries < wbp->wb_nrun)
+        wbp->wb_nentries = wbp->wb_nrun;
+    wbp->wb_memory = (wbp->wb_nentries + wbp->wb_nrun) * bsize;
+    np->np_memory += wbp->wb_memory;
+    wbp->wb_pool = np;
+    pthread_mutex_unlock(&np->np_lock);
+    for (nhash = 1; nhash < wbp->wb_nentries; nhash <<= 1)
+        ;
+    wbp->wb_hashmask = nhash - 1;
+    if (!(wbp->wb_entries = (nbd_wbentry_t *)calloc(wbp->wb_nentries,
+                                                     sizeof(nbd_wbentry_t))) ||
+        !(wbp->wb_data = (char *)malloc(wbp->wb_nentries * bsize)) ||
+        !(wbp->wb_hash =
+              (nbd_wbentry_t **)calloc(nhash, sizeof(nbd_wbentry_t *))) ||
+        !(wbp->wb_blocks =
+              (uint64_t *)malloc(wbp->wb_nentries * sizeof(uint64_t))) ||
+        !(wbp->wb_seqs = (uint64_t *)malloc(wbp->wb_nrun * sizeof(uint64_t))) ||
+        !(wbp->wb_run = (char *)malloc(wbp->wb_nrun * bsize))) {
+        nbd_wb_free(wbp);
+        return ENOMEM;
+    }
+    for (ei = 0; ei < wbp->wb_nentries; ei++) {
+        wbp->wb_entries[ei].we_data = &wbp->wb_data[ei * bsize];
+        wbp->wb_entries[ei].we_next = wbp->wb_free;
+        wbp->wb_free                = &wbp->wb_entries[ei];
+    }
+    exp->ex_wb = wbp;
+
+    return 0;
+}
+
+/*
+ * Find the run of blocks from blockno that are all in the cache or all
+ * not, and which.  Those in it are copied to buf if one is given.
+ */
+uint64_t
+nbd_wb_span(nbd_wbcache_t *wbp, uint64_t blockno, uint64_t nblocks,
+            int *cachedp, char *buf) {
+    nbd_wbentry_t *wep;
+    uint64_t       count = nblocks;
+
+    pthread_mutex_lock(&wbp->wb_lock);
+    *cachedp = (wbp->wb_count && nbd_wb_find(wbp, blockno));
+    if (wbp->wb_count) {
+        for (count = 0; count < nblocks; count++) {
+            if (!(wep = nbd_wb_find(wbp, blockno + count)) != !*cachedp)
+                break;
+            if (wep && buf)
+                memcpy(&buf[count * wbp->wb_bsize], wep->we_data,
+                       wbp->wb_bsize);
+        }
+    }
+    pthread_mutex_unlock(&wbp->wb_lock);
+
+    return count;
+}
+
+/*
+ * Order block numbers.
+ */
+static int
+nbd_wb_compare(const void *a, const void *b) {
+    uint64_t ablock = *(const uint64_t *)a;
+    uint64_t bblock = *(const uint64_t *)b;
+
+    return (ablock > bblock) - (ablock < bblock);
+}
+
+/*
+ * Write back the blocks in the cache, sorted into runs of blocks that
+ * follow one another.  A block written leaves the cache unless it was
+ * rewritten meanwhile.  Called by the thread that has marked the cache
+ * busy, which it is no longer on return.
+ */
+static int
+nbd_wb_flush(nbd_export_t *exp) {
+    nbd_wbcache_t *wbp   = exp->ex_wb;
+    uint64_t       bsize = wbp->wb_bsize;
+    nbd_wbentry_t *wep;
+    uint64_t       nblocks, hi, bi, start, count, ci;
+    int            error = 0;
+
+    pthread_mutex_lock(&wbp->wb_lock);
+    for (nblocks = 0, hi = 0; hi <= wbp->wb_hashmask; hi++) {
+        for (wep = wbp->wb_hash[hi]; wep; wep = wep->we_next)
+            wbp->wb_blocks[nblocks++] = wep->we_block;
+    }
+    pthread_mutex_unlock(&wbp->wb_lock);
+    qsort(wbp->wb_blocks, nblocks, sizeof(uint64_t), nbd_wb_compare);
+
+    /*
+     * Only this thread takes blocks out while the cache is busy, so the
+     * blocks listed are all still there.
+     */
+    for (bi = 0; !error && (bi < nblocks); bi += count) {
+        start = wbp->wb_blocks[bi];
+        pthread_mutex_lock(&wbp->wb_lock);
+        for (count = 0; (count < wbp->wb_nrun) && (bi + count < nblocks) &&
+                        (wbp->wb_blocks[bi + count] == start + count);
+             count++) {
+            wep = nbd_wb_find(wbp, start + count);
+            memcpy(&wbp->wb_run[count * bsize], wep->we_data, bsize);
+            wbp->wb_seqs[count] = wep->we_seq;
+        }
+        pthread_mutex_unlock(&wbp->wb_lock);
+        if ((error =
+                 image_writeblocks_at(exp->ex_pctx, start, wbp->wb_run, count)))
+            break;
+        IMAGE_STATS_ADD(exp->ex_stats.st_wbblocks, count);
+        IMAGE_STATS_ADD(exp->ex_stats.st_wbruns, 1);
+        pthread_mutex_lock(&wbp->wb_lock);
+        for (ci = 0; ci < count; ci++) {
+            if (nbd_wb_find(wbp, start + ci)->we_seq == wbp->wb_seqs[ci])
+                nbd_wb_remove(wbp, start + ci);
+        }
+        pthread_mutex_unlock(&wbp->wb_lock);
+    }
+    if (error)
+        logmsg(exp->ex_ncp, 0, "[%s] write-back failed: %s\n",
+               exp->ex_ncp->svc_progname, strerror(error));
+
+    pthread_mutex_lock(&wbp->wb_lock);
+    wbp->wb_busy = 0;
+    pthread_cond_broadcast(&wbp->wb_idle);
+    pthread_mutex_unlock(&wbp->wb_lock);
+
+    return error;
+}
+
+/*
+ * Write back an export's cache, if it has one, waiting for any writing
+ * back already under way.
+ */
+int
+nbd_wb_sync(nbd_export_t *exp) {
+    nbd_wbcache_t *wbp = exp->ex_wb;
+
+    if (!wbp)
+        return 0;
+    pthread_mutex_lock(&wbp->wb_lock);
+    while (wbp->wb_busy)
+        pthread_cond_wait(&wbp->wb_idle, &wbp->wb_lock);
+    wbp->wb_busy = 1;
+    pthread_mutex_unlock(&wbp->wb_lock);
+
+    return nbd_wb_flush(exp);
+}
+
+/*
+ * Drop blocks from an export's cache before the image is changed under
+ * them.  Writing back under way is waited for, so that it doesn't write
+ * an old copy over the change.
+ */
+void
+nbd_wb_drop(nbd_export_t *exp, uint64_t blockno, uint64_t nblocks) {
+    nbd_wbcache_t *wbp = exp->ex_wb;
+    nbd_wbentry_t *wep, *next;
+    uint64_t       hi, bi;
+
+    if (!wbp)
+        return;
+    pthread_mutex_lock(&wbp->wb_lock);
+    while (wbp->wb_busy)
+        pthread_cond_wait(&wbp->wb_idle, &wbp->wb_lock);
+    if (nblocks < wbp->wb_count) {
+        for (bi = 0; bi < nblocks; bi++)
+            nbd_wb_remove(wbp, blockno + bi);
+    } else {
+        for (hi = 0; wbp->wb_count && (hi <= wbp->wb_hashmask); hi++) {
+            for (wep = wbp->wb_hash[hi]; wep; wep = next) {
+                next = wep->we_next;
+                if (wep->we_block - blockno < nblocks)
+                    nbd_wb_remove(wbp, wep->we_block);
+            }
+        }
+    }
+    pthread_mutex_unlock(&wbp->wb_lock);
+}
+
+/*
+ * Read blocks of an export, those in its cache from there.
+ */
+int
+nbd_image_read(nbd_export_t *exp, uint64_t blockno, char *buf,
+               uint64_t nblocks) {
+    uint64_t count;
+    int      cached;
+    int      error = 0;
+
+    if (!exp->ex_wb)
+        return image_readblocks_at(exp->ex_pctx, blockno, buf, nblocks);
+    while (!error && nblocks) {
+        count = nbd_wb_span(exp->ex_wb, blockno, nblocks, &cached, buf);
+        if (!cached)
+            error = image_readblocks_at(exp->ex_pctx, blockno, buf, count);
+        else
+            IMAGE_STATS_ADD(exp->ex_stats.st_wbhits, count);
+        blockno += count;
+        buf += count * exp->ex_wb->wb_bsize;
+        nblocks -= count;
+    }
+
+    return error;
+}
+
+/*
+ * Write blocks of an export, into its cache if it has one.  Writes larger
+ * than a run go to the image.  A writer that finds the cache full writes
+ * it back itself, and the write-back thread is woken once half of it is
+ * used.
+ */
+int
+nbd_image_write(nbd_pool_t *np, nbd_export_t *exp, uint64_t blockno,
+                char *buf, uint64_t nblocks) {
+    nbd_wbcache_t *wbp = exp->ex_wb;
+    nbd_wbentry_t *wep;
+    uint64_t       nnew, bi, hi;
+    int            error = 0;
+
+    if (!wbp || (nblocks > wbp->wb_nrun)) {
+        nbd_wb_drop(exp, blockno, nblocks);
+        return image_writeblocks_at(exp->ex_pctx, blockno, buf, nblocks);
+    }
+
+    pthread_mutex_lock(&wbp->wb_lock);
+    for (;;) {
+        for (nnew = 0, bi = 0; bi < nblocks; bi++) {
+            if (!nbd_wb_find(wbp, blockno + bi))
+                nnew++;
+        }
+        if (wbp->wb_count + nnew <= wbp->wb_nentries)
+            break;
+        if (wbp->wb_busy) {
+            pthread_cond_wait(&wbp->wb_idle, &wbp->wb_lock);
+        } else {
+            wbp->wb_busy = 1;
+            pthread_mutex_unlock(&wbp->wb_lock);
+            error = nbd_wb_flush(exp);
+            pthread_mutex_lock(&wbp->wb_lock);
+            if (error)
+                break;
+        }
+    }
+    if (!error) {
+        if (!wbp->wb_since)
+            wbp->wb_since = nbd_now();
+        for (bi = 0; bi < nblocks; bi++) {
+            if (!(wep = nbd_wb_find(wbp, blockno + bi))) {
+                wep              = wbp->wb_free;
+                wbp->wb_free     = wep->we_next;
+                hi               = nbd_wb_hash(wbp, blockno + bi);
+                wep->we_block    = blockno + bi;
+                wep->we_next     = wbp->wb_hash[hi];
+                wbp->wb_hash[hi] = wep;
+                wbp->wb_count++;
+            }
+            memcpy(wep->we_data, &buf[bi * wbp->wb_bsize], wbp->wb_bsize);
+            wep->we_seq = ++wbp->wb_seq;
+        }
+        IMAGE_STATS_ADD(exp->ex_stats.st_wbmerged, nblocks - nnew);
+        if ((wbp->wb_count >= wbp->wb_nentries / 2) &&
+            (wbp->wb_count - nnew < wbp->wb_nentries / 2))
+            pthread_cond_signal(&np->np_wbwork);
+    }
+    pthread_mutex_unlock(&wbp->wb_lock);
+
+    return error;
+}
+
+/*
+ * Write-back thread.  Write back the caches that are half used or have
+ * held blocks for NBD_WB_AGE seconds, looking again every second or when
+ * woken, until told to quit.  After a failure it waits for the next look.
+ */
+void *
+nbd_wb_thread(void *arg) {
+    nbd_pool_t *    np = (nbd_pool_t *)arg;
+    nbd_export_t *  exp;
+    nbd_wbcache_t * wbp;
+    struct timespec ts;
+    uint64_t        now;
+    int             due = 0;
+    int             error;
+
+    pthread_mutex_lock(&np->np_lock);
+    while (!np->np_quit) {
+        /*
+         * Mark the cache busy before letting go of the pool lock, so that
+         * an export removed meanwhile is not freed under us.
+         */
+        now = nbd_now();
+        for (exp = np->np_exports; exp; exp = exp->ex_next) {
+            if (!(wbp = exp->ex_wb))
+                continue;
+            pthread_mutex_lock(&wbp->wb_lock);
+            if ((due = (!wbp->wb_busy && wbp->wb_count &&
+                        ((wbp->wb_count >= wbp->wb_nentries / 2) ||
+                         (wbp->wb_since + NBD_WB_AGE * 1000000000ULL <=
+                          now)))))
+                wbp->wb_busy = 1;
+            pthread_mutex_unlock(&wbp->wb_lock);
+            if (due)
+                break;
+        }
+        if (exp) {
+            pthread_mutex_unlock(&np->np_lock);
+            error = nbd_wb_flush(exp);
+            pthread_mutex_lock(&np->np_lock);
+            if (!error)
+                continue;
+        }
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec++;
+        pthread_cond_timedwait(&np->np_wbwork, &np->np_lock, &ts);
+    }
+    pthread_mutex_unlock(&np->np_lock);
+
+    return NULL;
+}
@@ -39,6 +39,7 @@ typedef struct libntfsclone_context {
     uint64_t                       nc_curblock; /* Current position */
     uint32_t                       nc_flags;    /* Handle flags */
     sysdep_open_mode_t             nc_omode;    /* Open mode */
+    uint32_t                       nc_cf_features; /* Features for new cf */
 } nc_context_t;
 
 typedef struct version_10_context {
@@ -73,4 +73,9 @@ struct image_head_v2 {
 } __attribute__((packed));
 typedef struct image_head_v2 image_head_v2;
 
+#define IMAGE_VERSION_2 "0002"
+#define ENDIAN_MAGIC    0xC0DE
+#define CSM_CRC32       0x20
+#define BM_BIT          0x01
+
 #endif /* _PARTCLONE_H_ */
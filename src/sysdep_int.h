@@ -20,7 +20,8 @@ typedef enum sysdep_open_mode {
     SYSDEP_OPEN_RO   = 1,
     SYSDEP_OPEN_RW   = 2,
     SYSDEP_OPEN_WO   = 3,
-    SYSDEP_CREATE    = 4
+    SYSDEP_CREATE    = 4,
+    SYSDEP_TEMPORARY = 5 /* unnamed, next to the path; gone when closed */
 } sysdep_open_mode_t;
 
 typedef enum sysdep_whence {
@@ -29,6 +30,11 @@ typedef enum sysdep_whence {
     SYSDEP_SEEK_END      = 2
 } sysdep_whence_t;
 
+typedef enum sysdep_lock_mode {
+    SYSDEP_LOCK_SHARED    = 0,
+    SYSDEP_LOCK_EXCLUSIVE = 1
+} sysdep_lock_mode_t;
+
 typedef struct sysdep_dispatch {
     /*
      * Open a file handle and return a pointer to it.
@@ -136,6 +142,197 @@ typedef struct sysdep_dispatch {
      *  nbytes - File size.
      */
     int (*sys_file_size)(void *rh, uint64_t *nbytes);
+    /*
+     * Preallocate storage for a range of a file without changing its size.
+     *
+     * Parameters:
+     *  rh     - Open file handle.
+     *  offset - Start of range.
+     *  len    - Length of range.
+     *
+     * Returns:
+     * - 0: Success.
+     * - EOPNOTSUPP: Preallocation not supported.
+     * - error: Otherwise.
+     */
+    int (*sys_allocate)(void *rh, uint64_t offset, uint64_t len);
+    /*
+     * Set a file's size, releasing any storage past the new end.
+     *
+     * Parameters:
+     *  rh     - Open file handle.
+     *  nbytes - New file size.
+     *
+     * Returns:
+     * - 0: Success.
+     * - EINVAL: Invalid file handle.
+     * - error: Otherwise.
+     */
+    int (*sys_truncate)(void *rh, uint64_t nbytes);
+    /*
+     * Flush a file's data and metadata to stable storage.
+     *
+     * Parameters:
+     *  rh     - Open file handle.
+     *
+     * Returns:
+     * - 0: Success.
+     * - EINVAL: Invalid file handle.
+     * - error: Otherwise.
+     */
+    int (*sys_flush)(void *rh);
+    /*
+     * Atomically replace a file with another.
+     *
+     * Parameters:
+     *  from   - Path of the new file.
+     *  to     - Path to replace.
+     *
+     * Returns:
+     * - 0: Success.
+     * - error: Otherwise.
+     */
+    int (*sys_rename)(const char *from, const char *to);
+    /*
+     * Make the entries of the directory holding a path durable, such as
+     * a rename into it.
+     *
+     * Parameters:
+     *  p      - Path in the directory.
+     *
+     * Returns:
+     * - 0: Success.
+     * - error: Otherwise.
+     */
+    int (*sys_syncdir)(const char *p);
+    /*
+     * Remove a file.
+     *
+     * Parameters:
+     *  p      - Path to remove.
+     *
+     * Returns:
+     * - 0: Success.
+     * - error: Otherwise.
+     */
+    int (*sys_unlink)(const char *p);
+    /*
+     * Read data from an offset.  The file position is not used or changed,
+     * so several threads may read one handle.
+     *
+     * Parameters:
+     * rh     - File handle.
+     * buf    - Buffer to read into.
+     * len    - Number of bytes to read.
+     * offset - Offset to read from.
+     * nr     - Number of bytes read.
+     *
+     * Returns:
+     * - 0: Success (nr may be short at the end of the file).
+     * - EINVAL: Invalid file handle.
+     * - error: Otherwise.
+     */
+    int (*sys_pread)(void *rh, void *buf, uint64_t len, uint64_t offset,
+                     uint64_t *nr);
+    /*
+     * Write data at an offset.  The file position is not used or changed.
+     *
+     * Parameters:
+     * rh     - File handle.
+     * buf    - Buffer to write from.
+     * len    - Number of bytes to write.
+     * offset - Offset to write at.
+     * nw     - Number of bytes written.
+     *
+     * Returns:
+     * - 0: Success.
+     * - EINVAL: Invalid file handle.
+     * - error: Otherwise.
+     */
+    int (*sys_pwrite)(void *rh, void *buf, uint64_t len, uint64_t offset,
+                      uint64_t *nw);
+    /*
+     * Create a reader/writer lock and return a pointer to it.
+     *
+     * Parameters:
+     * lockp  - Pointer to where to store pointer.
+     *
+     * Returns:
+     * - 0: Success.
+     * - ENOMEM: No memory for lock.
+     * - error: Otherwise.
+     */
+    int (*sys_lock_init)(void *lockp);
+    /*
+     * Destroy a lock and free pointer.
+     *
+     * Parameters:
+     * lock   - Lock.
+     *
+     * Returns:
+     * - 0: Success.
+     * - EINVAL: Invalid lock.
+     */
+    int (*sys_lock_destroy)(void *lock);
+    /*
+     * Acquire a lock, waiting for it if need be.
+     *
+     * Parameters:
+     * lock   - Lock.
+     * mode   - SYSDEP_LOCK_SHARED or SYSDEP_LOCK_EXCLUSIVE.
+     *
+     * Returns:
+     * - 0: Success.
+     * - EINVAL: Invalid lock.
+     * - error: Otherwise.
+     */
+    int (*sys_lock)(void *lock, sysdep_lock_mode_t mode);
+    /*
+     * Release a lock.
+     *
+     * Parameters:
+     * lock   - Lock.
+     *
+     * Returns:
+     * - 0: Success.
+     * - EINVAL: Invalid lock.
+     */
+    int (*sys_unlock)(void *lock);
+    /*
+     * Send a range of a file to a socket without going through the
+     * caller's memory.  The file position is not used or changed.
+     *
+     * Parameters:
+     * rh     - File handle.
+     * offset - Offset to send from.
+     * len    - Number of bytes to send.
+     * sock   - Socket to send to.
+     * nsent  - Number of bytes sent.
+     *
+     * Returns:
+     * - 0: Success.
+     * - EINVAL: Invalid file handle.
+     * - EIO: File ended early.
+     * - error: Otherwise.
+     */
+    int (*sys_send)(void *rh, uint64_t offset, uint64_t len, int sock,
+                    uint64_t *nsent);
+    /*
+     * Lock a file against other processes without waiting for them.  Any
+     * number of handles may hold it shared, or one exclusive; a handle
+     * may change the lock it holds.  Closing the handle releases it.
+     *
+     * Parameters:
+     * rh     - File handle.
+     * mode   - SYSDEP_LOCK_SHARED or SYSDEP_LOCK_EXCLUSIVE.
+     *
+     * Returns:
+     * - 0: Success.
+     * - EINVAL: Invalid file handle.
+     * - EBUSY: Another process holds a lock that conflicts.
+     * - error: Otherwise.
+     */
+    int (*sys_flock)(void *rh, sysdep_lock_mode_t mode);
 } sysdep_dispatch_t;
 
 #endif /* _SYSDEP_INT_H_ */
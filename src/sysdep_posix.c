@@ -16,14 +16,58 @@
 #include "sysdep_posix.h"
 #include <errno.h>
 #include <fcntl.h>
+#include <libgen.h>
+#ifdef HAVE_PTHREAD_H
+#    include <pthread.h>
+#endif /* HAVE_PTHREAD_H */
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#ifdef HAVE_SYS_SENDFILE_H
+#    include <sys/sendfile.h>
+#endif /* HAVE_SYS_SENDFILE_H */
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
 static const int omode2flags[] = {0, O_RDONLY | O_LARGEFILE,
                                   O_RDWR | O_LARGEFILE, O_WRONLY | O_LARGEFILE,
-                                  O_RDWR | O_CREAT | O_LARGEFILE};
+                                  O_RDWR | O_CREAT | O_LARGEFILE,
+                                  O_RDWR | O_LARGEFILE};
+
+/*
+ * Open an unnamed file in the directory of a path.  Where the system
+ * cannot make a file without a name, it is made next to the path and
+ * unlinked straight away.
+ */
+static int
+posix_open_temporary(const char *p, int flags) {
+    char *tpath;
+    int   fd = -1;
+#ifdef O_TMPFILE
+    char *sep;
+#endif /* O_TMPFILE */
+
+    if (!(tpath = (char *)malloc(strlen(p) + sizeof(".XXXXXX")))) {
+        errno = ENOMEM;
+        return -1;
+    }
+#ifdef O_TMPFILE
+    strcpy(tpath, p);
+    if ((sep = strrchr(tpath, '/')))
+        *((sep == tpath) ? sep + 1 : sep) = '\0';
+    fd = open((sep) ? tpath : ".", flags | O_TMPFILE, 0600);
+#endif /* O_TMPFILE */
+    if (fd < 0) {
+        sprintf(tpath, "%s.XXXXXX", p);
+        if ((fd = mkstemp(tpath)) >= 0)
+            (void)unlink(tpath);
+    }
+    free(tpath);
+
+    return fd;
+}
 
 /*
  * Open a file handle and return a pointer to it.
@@ -46,7 +90,8 @@ posix_open(void *rhp, const char *p, sysdep_open_mode_t omode) {
     if ((fhp = (int *)malloc(sizeof(int)))) {
         int flags = omode2flags[(int)omode];
 
-        *fhp = open(p, flags, 0640);
+        *fhp = (omode == SYSDEP_TEMPORARY) ? posix_open_temporary(p, flags)
+                                           : open(p, flags, 0640);
         if (*fhp < 0) {
             error = errno;
             *fhpp = (int *)NULL;
@@ -228,6 +273,380 @@ posix_file_size(void *rh, uint64_t *nbytes) {
     return error;
 }
 
+/*
+ * Preallocate storage for a range of a file without changing its size.
+ *
+ * Parameters:
+ *  rh     - Open file handle.
+ *  offset - Start of range.
+ *  len    - Length of range.
+ *
+ * Returns:
+ * - 0: Success.
+ * - EINVAL: Invalid file handle.
+ * - EOPNOTSUPP: Preallocation not supported.
+ * - error: Otherwise.
+ */
+static int
+posix_allocate(void *rh, uint64_t offset, uint64_t len) {
+    int *fhp = (int *)rh;
+    if (fhp) {
+#if defined(HAVE_FALLOCATE) && defined(FALLOC_FL_KEEP_SIZE)
+        return (fallocate(*fhp, FALLOC_FL_KEEP_SIZE, offset, len) == 0)
+                   ? 0
+                   : errno;
+#else  /* HAVE_FALLOCATE && FALLOC_FL_KEEP_SIZE */
+        return EOPNOTSUPP;
+#endif /* HAVE_FALLOCATE && FALLOC_FL_KEEP_SIZE */
+    } else {
+        return EINVAL;
+    }
+}
+
+/*
+ * Set a file's size, releasing any storage past the new end.
+ *
+ * Parameters:
+ *  rh     - Open file handle.
+ *  nbytes - New file size.
+ *
+ * Returns:
+ * - 0: Success.
+ * - EINVAL: Invalid file handle.
+ * - error: Otherwise (see errno values of ftruncate(2)).
+ */
+static int
+posix_truncate(void *rh, uint64_t nbytes) {
+    int *fhp = (int *)rh;
+    if (fhp) {
+        return (ftruncate(*fhp, nbytes) == 0) ? 0 : errno;
+    } else {
+        return EINVAL;
+    }
+}
+
+/*
+ * Flush a file's data and metadata to stable storage.
+ *
+ * Parameters:
+ *  rh     - Open file handle.
+ *
+ * Returns:
+ * - 0: Success.
+ * - EINVAL: Invalid file handle.
+ * - error: Otherwise (see errno values of fsync(2)).
+ */
+static int
+posix_flush(void *rh) {
+    int *fhp = (int *)rh;
+    if (fhp) {
+        return (fsync(*fhp) == 0) ? 0 : errno;
+    } else {
+        return EINVAL;
+    }
+}
+
+/*
+ * Atomically replace a file with another.
+ *
+ * Parameters:
+ *  from   - Path of the new file.
+ *  to     - Path to replace.
+ *
+ * Returns:
+ * - 0: Success.
+ * - error: Otherwise (see errno values of rename(2)).
+ */
+static int
+posix_rename(const char *from, const char *to) {
+    return (rename(from, to) == 0) ? 0 : errno;
+}
+
+/*
+ * Make the entries of the directory holding a path durable.
+ *
+ * Parameters:
+ *  p      - Path in the directory.
+ *
+ * Returns:
+ * - 0: Success.
+ * - ENOMEM: No memory for the directory name.
+ * - error: Otherwise (see errno values of open(2) and fsync(2)).
+ */
+static int
+posix_syncdir(const char *p) {
+    char *dir;
+    int   fd;
+    int   error = 0;
+
+    if (!(dir = strdup(p)))
+        return ENOMEM;
+    if ((fd = open(dirname(dir), O_RDONLY | O_DIRECTORY)) < 0) {
+        error = errno;
+    } else {
+        if (fsync(fd))
+            error = errno;
+        close(fd);
+    }
+    free(dir);
+
+    return error;
+}
+
+/*
+ * Remove a file.
+ *
+ * Parameters:
+ *  p      - Path to remove.
+ *
+ * Returns:
+ * - 0: Success.
+ * - error: Otherwise (see errno values of unlink(2)).
+ */
+static int
+posix_unlink(const char *p) {
+    return (unlink(p) == 0) ? 0 : errno;
+}
+
+/*
+ * Read data from an offset.
+ *
+ * Parameters:
+ * rh     - File handle.
+ * buf    - Buffer to read into.
+ * len    - Number of bytes to read.
+ * offset - Offset to read from.
+ * nr     - Number of bytes read.
+ *
+ * Returns:
+ * - 0: Success.
+ * - EINVAL: Invalid file handle.
+ * - error: Otherwise (see errno values of pread(2)).
+ */
+static int
+posix_pread(void *rh, void *buf, uint64_t len, uint64_t offset, uint64_t *nr) {
+    int *fhp = (int *)rh;
+    if (fhp) {
+        ssize_t n = pread(*fhp, buf, len, offset);
+        *nr       = (n < 0) ? 0 : n;
+        return (n < 0) ? errno : 0;
+    } else {
+        return EINVAL;
+    }
+}
+
+/*
+ * Write data at an offset.
+ *
+ * Parameters:
+ * rh     - File handle.
+ * buf    - Buffer to write from.
+ * len    - Number of bytes to write.
+ * offset - Offset to write at.
+ * nw     - Number of bytes written.
+ *
+ * Returns:
+ * - 0: Success.
+ * - EINVAL: Invalid file handle.
+ * - error: Otherwise (see errno values of pwrite(2)).
+ */
+static int
+posix_pwrite(void *rh, void *buf, uint64_t len, uint64_t offset,
+             uint64_t *nw) {
+    int *fhp = (int *)rh;
+    if (fhp) {
+        ssize_t n = pwrite(*fhp, buf, len, offset);
+        *nw       = (n < 0) ? 0 : n;
+        return (n < 0) ? errno : ((*nw == len) ? 0 : EIO);
+    } else {
+        return EINVAL;
+    }
+}
+
+/*
+ * Reader/writer locks.  Without threads they are never contended, so
+ * there is nothing to do.
+ *
+ * Parameters:
+ *  lockp  - Pointer to where to store pointer to the new lock.
+ *  lock   - Lock.
+ *  mode   - SYSDEP_LOCK_SHARED or SYSDEP_LOCK_EXCLUSIVE.
+ *
+ * Returns:
+ * - 0: Success.
+ * - EINVAL: Invalid lock.
+ * - ENOMEM: No memory for lock.
+ * - error: Otherwise (see errno values of pthread_rwlock_init(3)).
+ */
+static int
+posix_lock_init(void *lockp) {
+    void **xlpp = (void **)lockp;
+    if (xlpp) {
+#ifdef HAVE_PTHREAD_H
+        int error;
+        if ((*xlpp = malloc(sizeof(pthread_rwlock_t))) == NULL)
+            return ENOMEM;
+        if ((error = pthread_rwlock_init((pthread_rwlock_t *)*xlpp, NULL)) !=
+            0) {
+            free(*xlpp);
+            *xlpp = NULL;
+        }
+        return error;
+#else  /* HAVE_PTHREAD_H */
+        *xlpp = xlpp;
+        return 0;
+#endif /* HAVE_PTHREAD_H */
+    } else {
+        return EINVAL;
+    }
+}
+
+static int
+posix_lock_destroy(void *lock) {
+    if (lock) {
+#ifdef HAVE_PTHREAD_H
+        (void)pthread_rwlock_destroy((pthread_rwlock_t *)lock);
+        free(lock);
+#endif /* HAVE_PTHREAD_H */
+        return 0;
+    } else {
+        return EINVAL;
+    }
+}
+
+static int
+posix_lock(void *lock, sysdep_lock_mode_t mode) {
+    if (lock) {
+#ifdef HAVE_PTHREAD_H
+        return (mode == SYSDEP_LOCK_EXCLUSIVE)
+                   ? pthread_rwlock_wrlock((pthread_rwlock_t *)lock)
+                   : pthread_rwlock_rdlock((pthread_rwlock_t *)lock);
+#else  /* HAVE_PTHREAD_H */
+        return 0;
+#endif /* HAVE_PTHREAD_H */
+    } else {
+        return EINVAL;
+    }
+}
+
+static int
+posix_unlock(void *lock) {
+    if (lock) {
+#ifdef HAVE_PTHREAD_H
+        return pthread_rwlock_unlock((pthread_rwlock_t *)lock);
+#else  /* HAVE_PTHREAD_H */
+        return 0;
+#endif /* HAVE_PTHREAD_H */
+    } else {
+        return EINVAL;
+    }
+}
+
+/*
+ * Send a range of a file to a socket.
+ *
+ * Parameters:
+ * rh     - File handle.
+ * offset - Offset to send from.
+ * len    - Number of bytes to send.
+ * sock   - Socket to send to.
+ * nsent  - Number of bytes sent.
+ *
+ * Returns:
+ * - 0: Success.
+ * - EINVAL: Invalid file handle.
+ * - EIO: File ended early.
+ * - error: Otherwise (see errno values of sendfile(2), pread(2) and
+ *   write(2)).
+ */
+static int
+posix_send(void *rh, uint64_t offset, uint64_t len, int sock,
+           uint64_t *nsent) {
+    int *   fhp   = (int *)rh;
+    int     error = 0;
+    ssize_t n;
+
+    if (!fhp)
+        return EINVAL;
+    *nsent = 0;
+#ifdef HAVE_SENDFILE
+    while (!error && (*nsent < len)) {
+        off_t foff = offset + *nsent;
+
+        if ((n = sendfile(sock, *fhp, &foff, len - *nsent)) > 0)
+            *nsent += n;
+        else if ((n < 0) && (errno == EINTR))
+            continue;
+        else
+            error = (n == 0) ? EIO : errno;
+    }
+    /*
+     * Not from this file: fall back to copying.
+     */
+    if (error && (error != EINVAL) && (error != ENOSYS))
+        return error;
+    error = 0;
+#endif /* HAVE_SENDFILE */
+    if (*nsent < len) {
+        char buffer[65536];
+
+        while (!error && (*nsent < len)) {
+            uint64_t chunk = len - *nsent;
+            ssize_t  w;
+
+            if (chunk > sizeof(buffer))
+                chunk = sizeof(buffer);
+            if ((n = pread(*fhp, buffer, chunk, offset + *nsent)) <= 0) {
+                error = (n == 0) ? EIO : errno;
+                break;
+            }
+            for (w = 0; !error && (w < n);) {
+                ssize_t wn = write(sock, &buffer[w], n - w);
+
+                if (wn > 0)
+                    w += wn;
+                else if (wn == 0)
+                    error = EIO;
+                else if (errno != EINTR)
+                    error = errno;
+            }
+            *nsent += w;
+        }
+    }
+
+    return error;
+}
+
+/*
+ * Lock a file against other processes without waiting for them.
+ *
+ * Parameters:
+ *  rh     - Open file handle.
+ *  mode   - SYSDEP_LOCK_SHARED or SYSDEP_LOCK_EXCLUSIVE.
+ *
+ * Returns:
+ * - 0: Success.
+ * - EINVAL: Invalid file handle.
+ * - EBUSY: Another process holds a lock that conflicts.
+ * - error: Otherwise (see errno values of flock(2)).
+ */
+static int
+posix_flock(void *rh, sysdep_lock_mode_t mode) {
+    int *fhp = (int *)rh;
+    int  op  = (mode == SYSDEP_LOCK_EXCLUSIVE) ? LOCK_EX : LOCK_SH;
+    if (fhp) {
+        if (flock(*fhp, op | LOCK_NB) == 0)
+            return 0;
+        return (errno == EWOULDBLOCK) ? EBUSY : errno;
+    } else {
+        return EINVAL;
+    }
+}
+
 const sysdep_dispatch_t posix_dispatch = {
-    posix_open,  posix_closex, posix_seek, posix_read,
-    posix_write, posix_malloc, posix_free, posix_file_size};
+    posix_open,      posix_closex,       posix_seek,  posix_read,
+    posix_write,     posix_malloc,       posix_free,  posix_file_size,
+    posix_allocate,  posix_truncate,     posix_flush, posix_rename,
+    posix_syncdir,   posix_unlink,       posix_pread, posix_pwrite,
+    posix_lock_init, posix_lock_destroy, posix_lock,  posix_unlock,
+    posix_send,      posix_flock};